@@ -14,13 +14,33 @@
 #include "filtersetstate.h"
 #include "sms_queue.h"
 #include "hostresolver.h"
+#include "dns_resolver.h"
 #include "pkt_queue_filterset.h"
+#include "pkt_ring.h"
+#include "pkt_shaper.h"
+#include "ip_header.h"
+#include "pcap_file.h"
+#include "pcap_replay.h"
+#include "af_packet_capture.h"
+#include "capture_pipeline.h"
+#include "speed_history.h"
+#include "filterset_delta.h"
 #include "trafficreport_hourtick.h"
 #include "trafficreport_daytick.h"
 #include "trafficreport_filter.h"
 #include "trafficreport.h"
 #include "pktcollector_e.h"
 #include "pktcollector_ex.h"
+#include "pktcollector_shared.h"
+#include "header_arena.h"
+#include "http_scanner.h"
+#include "tls_sni.h"
+#include "host_matcher.h"
+#include "rule_classifier.h"
+#include "filterset_classifier.h"
+#include "match_cache.h"
+#include "addrgroup_index.h"
+#include "rule_kernel.h"
 
 #include <gstring.h>
 #include <ufs.h>
@@ -93,14 +113,57 @@ void filtersetstate_test(int testcase_num)
 	return;
 }
 
+// Replays the capture through the filterset and prints the accounting results
+void replay(const utm::gstring& capture, const utm::gstring& fsfile, double speed, const utm::gstring& historyfile)
+{
+	utm::filterset fs;
+	fs.xml_load(fsfile);
+	fs.prepare_rule_classifiers();
+	fs.prepare_header_usage();
+
+	utm::pcap_file file;
+	file.open(capture.getmb());
+
+	utm::speed_history history;
+	if (!historyfile.empty())
+		history.open(historyfile.getmb(), SPEEDHIST_DEFAULT_SERIES);
+
+	utm::pcap_replay rp(fs);
+	rp.set_paced(speed > 0, speed);
+	rp.set_history(history.is_open() ? &history : NULL);
+	rp.run(file);
+
+	const utm::pcap_replay_stat& st = rp.get_stat();
+	std::cout << "frames: " << st.frames << ", packets: " << st.packets << ", bytes: " << st.bytes;
+	std::cout << ", skipped: " << st.skipped << ", matched: " << st.matched << std::endl;
+
+	for (auto iter = fs.filters.items.begin(); iter != fs.filters.items.end(); ++iter)
+	{
+		std::cout << iter->get_id() << " " << iter->get_name().getmb() << ": sent " << iter->cnt_sent.get_cnt();
+		std::cout << ", recv " << iter->cnt_recv.get_cnt() << std::endl;
+	}
+
+	std::cout << "flows: " << rp.flows.size() << std::endl;
+
+	std::string xml;
+	rp.report.xml_create();
+	rp.report.xml_get_string(xml);
+	std::cout << xml << std::endl;
+}
+
 void test()
 {
 #ifdef UTM_DEBUG
 
+	utm::pkt_ring::test_all();
 	utm::pkt_queue::test_all();
+	utm::pkt_shaper::test_all();
 	utm::pkt_queue_filterset::test_all();
+	utm::ip_header::test_all();
+	utm::pcap_file::test_all();
 //	utm::hostresolver::test_all();
 	utm::hostname_ex::test_all();
+	utm::dns_resolver::test_all();
 //	utm::hosttable::test_all();
 	utm::filterset_data::test_all();
 	utm::urlfilter::test_all();
@@ -108,8 +171,13 @@ void test()
 	utm::trafficreport_daytick::test_all();
 	utm::trafficreport_filter::test_all();
 	utm::trafficreport::test_all();
+	utm::header_arena::test_all();
+	utm::http_scanner::test_all();
+	utm::tls_sni::test_all();
+	utm::host_matcher::test_all();
 	utm::pktcollector_e::test_all();
 	utm::pktcollector_ex::test_all();
+	utm::pktcollector_shared::test_all();
 
 	utm::ubase_test<utm::sms_queue> test_sms_queue;
 	test_sms_queue.test_all();
@@ -135,7 +203,19 @@ void test()
 	utm::ubase_test<utm::filterset> test_filterset;
 	test_filterset.test_all();
 
+	utm::rule_classifier::test_all();
+	utm::rule_kernel::test_all();
 	utm::filter2::test_match_filter();
+	utm::addrgroup_index::test_all();
+	utm::filterset_classifier::test_all();
+	utm::match_cache::test_all();
+	utm::pcap_replay::test_all();
+	utm::capture_pipeline::test_all();
+	utm::speed_history::test_all();
+	utm::filterset_delta::test_all();
+#ifdef UTM_LINUX
+	utm::af_packet_capture::test_all();
+#endif
 
 	filtersetstate_test(0);
 	filtersetstate_test(1);
@@ -149,6 +229,28 @@ int _tmain(int argc, _TCHAR* argv[])
 	try
 	{
 		test();
+
+#ifdef UTM_DEBUG
+		if ((argc > 1) && (_tcscmp(argv[1], _T("benchmark")) == 0))
+		{
+			utm::ip_header::benchmark();
+			utm::rule_kernel::benchmark();
+			utm::http_scanner::benchmark();
+			utm::pkt_shaper::benchmark();
+			utm::capture_pipeline::benchmark();
+			utm::filterset_delta::benchmark();
+			utm::hosttable::benchmark();
+			utm::users_connected::benchmark();
+		}
+#endif
+
+		// replay <capture> <filterset> [speed] [history], the capture is paced if the speed is not zero
+		if ((argc > 3) && (_tcscmp(argv[1], _T("replay")) == 0))
+		{
+			double speed = (argc > 4) ? _tstof(argv[4]) : 0;
+			utm::gstring historyfile((argc > 5) ? argv[5] : _T(""));
+			replay(utm::gstring(argv[2]), utm::gstring(argv[3]), speed, historyfile);
+		}
 	}
 	catch(const std::exception& ex)
 	{
@@ -0,0 +1,385 @@
+#include "StdAfx.h"
+#include "addrgroup_index.h"
+#include "filterset.h"
+
+#include <algorithm>
+
+#include <utime.h>
+#include <ubase_test.h>
+
+namespace utm {
+
+const char addrgroup_index::this_class_name[] = "addrgroup_index";
+
+addrgroup_index::addrgroup_index()
+{
+	clear();
+}
+
+addrgroup_index::~addrgroup_index()
+{
+}
+
+void addrgroup_index::clear()
+{
+	words_per_set = 1;
+	group_count = 1;
+
+	starts.assign(1, 0);
+	offsets.assign(1, 0);
+	sets.assign(1, 0);
+	atkey_bits.clear();
+}
+
+void addrgroup_index::add_group_events(const addrtable_v4& at, unsigned int bit, std::vector<group_event>& events)
+{
+	const std::map<addrip_v4, addrip_v4>& items = at.itemsref();
+
+	for (auto iter = items.begin(); iter != items.end(); ++iter)
+	{
+		unsigned int lo = iter->first.m_addr;
+		unsigned int hi = iter->second.m_addr;
+
+		// CheckAddrRange() checks only the range with the nearest start,
+		// so a range ends where the next one starts. The start of an empty
+		// next range is still checked against this one.
+		auto next = iter;
+		++next;
+		if (next != items.end())
+		{
+			unsigned int next_lo = next->first.m_addr;
+			unsigned int limit = (next->second.m_addr < next_lo) ? next_lo : next_lo - 1;
+
+			if (hi > limit)
+				hi = limit;
+		}
+
+		if (lo > hi)
+			continue;
+
+		group_event e;
+		e.bit = bit;
+
+		e.addr = lo;
+		e.is_start = true;
+		events.push_back(e);
+
+		if (hi != 0xFFFFFFFF)
+		{
+			e.addr = hi + 1;
+			e.is_start = false;
+			events.push_back(e);
+		}
+	}
+}
+
+void addrgroup_index::build(const addrtable_v4* lat, const addrtablemap_v4* mat)
+{
+	clear();
+
+	std::vector<group_event> events;
+
+	if (lat != NULL)
+		add_group_events(*lat, ADDRGROUP_BIT_LAT, events);
+
+	if (mat != NULL)
+	{
+		for (auto iter = mat->items.begin(); iter != mat->items.end(); ++iter)
+		{
+			// The first group wins as in findptr_by_id()
+			if (atkey_bits.find(iter->get_id()) != atkey_bits.end())
+				continue;
+
+			int bit = static_cast<int>(group_count++);
+			atkey_bits.insert(std::make_pair(iter->get_id(), bit));
+			add_group_events(iter->addrtable, bit, events);
+		}
+	}
+
+	words_per_set = (group_count + 31) / 32;
+
+	std::sort(events.begin(), events.end());
+
+	starts.clear();
+	offsets.clear();
+	sets.clear();
+
+	std::map<std::vector<unsigned int>, unsigned int> interned;
+	std::vector<unsigned int> current(words_per_set, 0);
+
+	unsigned int addr = 0;
+	size_t pos = 0;
+
+	for (;;)
+	{
+		for (; (pos < events.size()) && (events[pos].addr == addr); pos++)
+		{
+			const group_event& e = events[pos];
+
+			if (e.is_start)
+				current[e.bit >> 5] |= (1u << (e.bit & 31));
+			else
+				current[e.bit >> 5] &= ~(1u << (e.bit & 31));
+		}
+
+		auto found = interned.find(current);
+		if (found == interned.end())
+		{
+			found = interned.insert(std::make_pair(current, static_cast<unsigned int>(sets.size()))).first;
+			sets.insert(sets.end(), current.begin(), current.end());
+		}
+
+		// Neighbour intervals with the same groups are merged
+		if (offsets.empty() || (offsets.back() != found->second))
+		{
+			starts.push_back(addr);
+			offsets.push_back(found->second);
+		}
+
+		if (pos == events.size())
+			break;
+
+		addr = events[pos].addr;
+	}
+}
+
+const unsigned int* addrgroup_index::lookup(unsigned int addr) const
+{
+	size_t idx = std::upper_bound(starts.begin(), starts.end(), addr) - starts.begin() - 1;
+	return &sets[offsets[idx]];
+}
+
+int addrgroup_index::get_bit(unsigned int atkey) const
+{
+	auto found = atkey_bits.find(atkey);
+	return (found == atkey_bits.end()) ? -1 : found->second;
+}
+
+#ifdef UTM_DEBUG
+void addrgroup_index::test_all()
+{
+	test_report tr(this_class_name);
+	test_case::classname.assign(this_class_name);
+
+	{
+		test_case::testcase_num = 1;
+
+		addrgroup_index gi;
+		TEST_CASE_CHECK(gi.get_interval_count(), size_t(1));
+		TEST_CASE_CHECK(test_bit(gi.lookup(addrip_v4("10.0.0.1").m_addr), ADDRGROUP_BIT_LAT), false);
+
+		addrtable_v4 lat;
+		lat.AddAddrPair(addrip_v4("192.168.0.0"), addrip_v4("192.168.255.255"), false);
+		lat.AddAddrPair(addrip_v4("10.0.0.0"), addrip_v4("10.255.255.255"), false);
+
+		addrtablemap_v4 mat;
+		addrtablemaprec_v4 amr;
+		amr.set_id(11);
+		mat.add_element(amr);
+		amr.set_id(12);
+		mat.add_element(amr);
+		mat.AddAddrPair(11, addrip_v4("10.0.0.1"), addrip_v4("10.0.0.10"));
+		mat.AddAddrPair(11, addrip_v4("172.16.0.1"), addrip_v4("172.16.0.1"));
+		mat.AddAddrPair(12, addrip_v4("10.0.0.5"), addrip_v4("10.0.0.20"));
+		mat.AddAddrPair(12, addrip_v4("255.255.255.0"), addrip_v4("255.255.255.255"));
+
+		gi.build(&lat, &mat);
+
+		int bit11 = gi.get_bit(11);
+		int bit12 = gi.get_bit(12);
+		TEST_CASE_CHECK(bit11, int(1));
+		TEST_CASE_CHECK(bit12, int(2));
+		TEST_CASE_CHECK(gi.get_bit(13), int(-1));
+		TEST_CASE_CHECK(gi.get_group_count(), size_t(3));
+
+		const unsigned int* s = gi.lookup(addrip_v4("10.0.0.7").m_addr);
+		TEST_CASE_CHECK(test_bit(s, ADDRGROUP_BIT_LAT), true);
+		TEST_CASE_CHECK(test_bit(s, bit11), true);
+		TEST_CASE_CHECK(test_bit(s, bit12), true);
+
+		s = gi.lookup(addrip_v4("10.0.0.15").m_addr);
+		TEST_CASE_CHECK(test_bit(s, ADDRGROUP_BIT_LAT), true);
+		TEST_CASE_CHECK(test_bit(s, bit11), false);
+		TEST_CASE_CHECK(test_bit(s, bit12), true);
+
+		s = gi.lookup(addrip_v4("172.16.0.1").m_addr);
+		TEST_CASE_CHECK(test_bit(s, ADDRGROUP_BIT_LAT), false);
+		TEST_CASE_CHECK(test_bit(s, bit11), true);
+
+		s = gi.lookup(addrip_v4("172.16.0.2").m_addr);
+		TEST_CASE_CHECK(test_bit(s, bit11), false);
+
+		s = gi.lookup(addrip_v4("255.255.255.255").m_addr);
+		TEST_CASE_CHECK(test_bit(s, bit12), true);
+
+		s = gi.lookup(0);
+		TEST_CASE_CHECK(s[0], unsigned int(0));
+
+		// Both 10.0.0.21 and 10.1.0.0 are only in LAT
+		TEST_CASE_CHECK(gi.lookup(addrip_v4("10.0.0.21").m_addr), gi.lookup(addrip_v4("10.1.0.0").m_addr));
+	}
+
+	{
+		// Lookups must agree with CheckAddrRange(), overlapped ranges included
+
+		test_case::testcase_num = 2;
+
+		unsigned int seed = 777;
+		auto test_rand = [&seed](unsigned int n) -> unsigned int { seed = seed * 1103515245 + 12345; return (seed >> 16) % n; };
+
+		addrtablemap_v4 mat;
+		for (unsigned int key = 1; key <= 40; key++)
+		{
+			addrtablemaprec_v4 amr;
+			amr.set_id(key);
+
+			for (int i = 0; i < 30; i++)
+			{
+				unsigned int lo = 0x0A000000 + test_rand(5000);
+				amr.addrtable.AddAddrPair(addrip_v4(lo), addrip_v4(lo + test_rand(100)), false);
+			}
+
+			mat.add_element(amr);
+		}
+
+		addrgroup_index gi;
+		gi.build(NULL, &mat);
+		TEST_CASE_CHECK(gi.get_group_count(), size_t(41));
+
+		bool is_equal = true;
+		for (unsigned int addr = 0x0A000000 - 10; addr < 0x0A000000 + 5200; addr++)
+		{
+			const unsigned int* s = gi.lookup(addr);
+			if (test_bit(s, ADDRGROUP_BIT_LAT))
+				is_equal = false;
+
+			for (auto iter = mat.items.begin(); iter != mat.items.end(); ++iter)
+			{
+				if (test_bit(s, gi.get_bit(iter->get_id())) != iter->addrtable.CheckAddrRange(addrip_v4(addr)))
+					is_equal = false;
+			}
+
+			if (!is_equal)
+				break;
+		}
+
+		TEST_CASE_CHECK(is_equal, true);
+		TEST_CASE_CHECK(gi.get_set_count() < gi.get_interval_count(), true);
+	}
+
+	{
+		// Rules on address groups give the same matches with and without the index
+
+		test_case::testcase_num = 3;
+
+		tm lt = utm::utime(2010, 05, 30, 12, 59, 12).to_tm();
+
+		static const int addr_types[] = { RULE_ADDRGRP, RULE_ADDRGRP_NO, RULE_IP, RULE_LAN };
+		static const unsigned int atkeys[] = { 11, 12, 13 };
+
+		unsigned int seed = 4242;
+		auto test_rand = [&seed](unsigned int n) -> unsigned int { seed = seed * 1103515245 + 12345; return (seed >> 16) % n; };
+
+		filterset fs_plain, fs_cmp;
+
+		for (unsigned int key = 11; key <= 12; key++)
+		{
+			addrtablemaprec_v4 amr;
+			amr.set_id(key);
+
+			for (int i = 0; i < 20; i++)
+			{
+				unsigned int lo = 0x0A000000 + test_rand(1000);
+				amr.addrtable.AddAddrPair(addrip_v4(lo), addrip_v4(lo + test_rand(50)), false);
+			}
+
+			fs_plain.table_mat.add_element(amr);
+			fs_cmp.table_mat.add_element(amr);
+		}
+
+		for (unsigned int i = 1; i <= 30; i++)
+		{
+			filter2 f;
+			f.set_id(i);
+
+			unsigned int rule_count = 1 + test_rand(3);
+			for (unsigned int j = 0; j < rule_count; j++)
+			{
+				rule r;
+				r.src_type = addr_types[test_rand(4)];
+				r.dst_type = addr_types[test_rand(4)];
+				r.src_atkey = atkeys[test_rand(3)];
+				r.dst_atkey = atkeys[test_rand(3)];
+				r.src_ip = addrip_v4(0x0A000000 + test_rand(1000));
+				r.dst_ip = addrip_v4(0x0A000000 + test_rand(1000));
+				r.src_mask.from_string("255.255.255.0");
+				r.dst_mask.from_string("255.255.255.0");
+				r.mirrored = test_rand(2) ? DIRECTION_TWOWAY : DIRECTION_ONEWAY;
+				r.action = test_rand(4);
+
+				f.rule_add(r);
+			}
+
+			fs_plain.filters.add_element(f);
+			fs_cmp.filters.add_element(f);
+		}
+
+		fs_cmp.prepare_rule_classifiers();
+
+		ip_header iphdr;
+		iphdr.test_fill_packet(0);
+
+		match_filter_input in_plain, in_cmp;
+		in_plain.ip = &iphdr;
+		in_plain.mat = &fs_plain.table_mat;
+		in_plain.nModifyCounter = MODIFY_COUNTER_YES;
+		in_plain.lt = &lt;
+		in_plain.mbytes = 1048576;
+
+		in_cmp = in_plain;
+		in_cmp.mat = &fs_cmp.table_mat;
+
+		filterset_match_list ml_plain, ml_cmp;
+
+		bool is_equal = true;
+		size_t total_matches = 0;
+
+		for (int i = 0; i < 3000; i++)
+		{
+			iphdr.src_ip_addr = addrip_v4(0x0A000000 + test_rand(1100));
+			iphdr.dst_ip_addr = addrip_v4(0x0A000000 + test_rand(1100));
+			in_plain.nPreCheckAddrTables = test_rand(16);
+			in_cmp.nPreCheckAddrTables = in_plain.nPreCheckAddrTables;
+
+			fs_plain.match_filters(in_plain, ml_plain);
+			fs_cmp.match_filters(in_cmp, ml_cmp);
+
+			total_matches += ml_cmp.size();
+
+			if (ml_plain.size() != ml_cmp.size())
+			{
+				is_equal = false;
+				break;
+			}
+
+			for (size_t k = 0; k < ml_plain.size(); k++)
+			{
+				if ((ml_plain.items[k].filter_id != ml_cmp.items[k].filter_id) ||
+					(ml_plain.items[k].rule_no != ml_cmp.items[k].rule_no) ||
+					(ml_plain.items[k].direction != ml_cmp.items[k].direction))
+				{
+					is_equal = false;
+				}
+			}
+
+			if (!is_equal)
+				break;
+		}
+
+		TEST_CASE_CHECK(is_equal, true);
+		TEST_CASE_CHECK(total_matches > 0, true);
+	}
+}
+#endif
+
+}
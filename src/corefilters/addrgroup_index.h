@@ -0,0 +1,83 @@
+#ifndef _UTM_ADDRGROUP_INDEX_H
+#define _UTM_ADDRGROUP_INDEX_H
+
+#pragma once
+#include <utm.h>
+
+#include <vector>
+#include <map>
+
+#include <addrtable_v4.h>
+#include <addrtablemap_v4.h>
+
+// Bit of the local address table (LAT), MAT groups follow it
+#define ADDRGROUP_BIT_LAT 0
+
+namespace utm {
+
+//
+// Immutable classification of the IPv4 address space by the address groups.
+// Every elementary interval refers to the bitset of the groups containing it,
+// identical bitsets are stored once.
+//
+class addrgroup_index
+{
+public:
+	static const char this_class_name[];
+
+	addrgroup_index();
+	~addrgroup_index();
+
+	void clear();
+
+	// Takes a snapshot of the tables, the index must be rebuilt after they are changed
+	void build(const addrtable_v4* lat, const addrtablemap_v4* mat);
+
+	// Returns the bitset of all groups containing addr
+	const unsigned int* lookup(unsigned int addr) const;
+
+	// Returns the bit of the MAT group or -1 if the group is not indexed
+	int get_bit(unsigned int atkey) const;
+
+	size_t get_group_count() const { return group_count; };
+	size_t get_interval_count() const { return starts.size(); };
+	size_t get_set_count() const { return (words_per_set == 0) ? 0 : sets.size() / words_per_set; };
+
+	static inline bool test_bit(const unsigned int* set, int bit)
+	{
+		return (set[bit >> 5] & (1u << (bit & 31))) != 0;
+	}
+
+private:
+	struct group_event
+	{
+		unsigned int addr;
+		unsigned int bit;
+		bool is_start;
+
+		bool operator<(const group_event& rhs) const
+		{
+			if (addr != rhs.addr) return addr < rhs.addr;
+			return is_start < rhs.is_start;
+		}
+	};
+
+	static void add_group_events(const addrtable_v4& at, unsigned int bit, std::vector<group_event>& events);
+
+	std::vector<unsigned int> starts;
+	std::vector<unsigned int> offsets;
+	std::vector<unsigned int> sets;
+	size_t words_per_set;
+	size_t group_count;
+
+	std::map<unsigned int, int> atkey_bits;
+
+public:
+#ifdef UTM_DEBUG
+	static void test_all();
+#endif
+};
+
+}
+
+#endif // _UTM_ADDRGROUP_INDEX_H
@@ -0,0 +1,296 @@
+#include "stdafx.h"
+#include "af_packet_capture.h"
+
+#ifdef UTM_LINUX
+
+#include <pcap_replay.h>
+#include <ubase_test.h>
+
+#include <stdexcept>
+
+#include <arpa/inet.h>
+#include <linux/if_ether.h>
+#include <net/if.h>
+#include <netinet/in.h>
+#include <poll.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+namespace utm {
+
+const char af_packet_capture::this_class_name[] = "af_packet_capture";
+
+af_packet_capture::af_packet_capture() : running(false)
+{
+}
+
+af_packet_capture::~af_packet_capture()
+{
+	close();
+}
+
+void af_packet_capture::open(const std::string& ifname, unsigned int workers, unsigned int fanout_id, size_t ring_size)
+{
+	close();
+
+	unsigned int ifindex = if_nametoindex(ifname.c_str());
+	if (ifindex == 0)
+		throw std::runtime_error("af_packet_capture: unknown interface");
+
+	if (workers == 0)
+		workers = 1;
+
+	size_t block_count = (ring_size + AFPACKET_BLOCK_SIZE - 1) / AFPACKET_BLOCK_SIZE;
+	if (block_count < AFPACKET_MIN_BLOCKS)
+		block_count = AFPACKET_MIN_BLOCKS;
+
+	try
+	{
+		for (unsigned int i = 0; i < workers; i++)
+		{
+			rings.push_back(std::unique_ptr<ring>(new ring));
+			open_ring(*rings.back(), ifindex, workers, fanout_id, static_cast<unsigned int>(block_count));
+		}
+	}
+	catch (const std::exception&)
+	{
+		close();
+		throw;
+	}
+}
+
+void af_packet_capture::open_ring(ring& r, unsigned int ifindex, unsigned int workers, unsigned int fanout_id, unsigned int block_count)
+{
+	r.fd = socket(AF_PACKET, SOCK_RAW, htons(ETH_P_ALL));
+	if (r.fd < 0)
+		throw std::runtime_error("af_packet_capture: unable to create the socket");
+
+	int version = TPACKET_V3;
+	if (setsockopt(r.fd, SOL_PACKET, PACKET_VERSION, &version, sizeof(version)) != 0)
+		throw std::runtime_error("af_packet_capture: TPACKET_V3 is not supported");
+
+	tpacket_req3 req;
+	memset(&req, 0, sizeof(req));
+	req.tp_block_size = AFPACKET_BLOCK_SIZE;
+	req.tp_block_nr = block_count;
+	req.tp_frame_size = AFPACKET_FRAME_SIZE;
+	req.tp_frame_nr = (AFPACKET_BLOCK_SIZE / AFPACKET_FRAME_SIZE) * block_count;
+	req.tp_retire_blk_tov = AFPACKET_BLOCK_TIMEOUT;
+
+	if (setsockopt(r.fd, SOL_PACKET, PACKET_RX_RING, &req, sizeof(req)) != 0)
+		throw std::runtime_error("af_packet_capture: unable to set up the ring");
+
+	r.map_size = static_cast<size_t>(AFPACKET_BLOCK_SIZE) * block_count;
+	r.block_count = block_count;
+
+	void* area = mmap(NULL, r.map_size, PROT_READ | PROT_WRITE, MAP_SHARED, r.fd, 0);
+	if (area == MAP_FAILED)
+		throw std::runtime_error("af_packet_capture: unable to map the ring");
+
+	r.area = static_cast<unsigned char*>(area);
+
+	sockaddr_ll ll;
+	memset(&ll, 0, sizeof(ll));
+	ll.sll_family = AF_PACKET;
+	ll.sll_protocol = htons(ETH_P_ALL);
+	ll.sll_ifindex = ifindex;
+
+	if (bind(r.fd, reinterpret_cast<sockaddr*>(&ll), sizeof(ll)) != 0)
+		throw std::runtime_error("af_packet_capture: unable to bind the socket");
+
+	if (workers > 1)
+	{
+		// Fragments are joined before hashing, so they go with their flow
+		int fanout = (fanout_id & 0xFFFF) | ((PACKET_FANOUT_HASH | PACKET_FANOUT_FLAG_DEFRAG) << 16);
+		if (setsockopt(r.fd, SOL_PACKET, PACKET_FANOUT, &fanout, sizeof(fanout)) != 0)
+			throw std::runtime_error("af_packet_capture: unable to join the fanout group");
+	}
+}
+
+void af_packet_capture::close_ring(ring& r)
+{
+	if (r.area != NULL)
+		munmap(r.area, r.map_size);
+
+	if (r.fd >= 0)
+		::close(r.fd);
+
+	r.area = NULL;
+	r.fd = -1;
+}
+
+void af_packet_capture::close()
+{
+	stop();
+
+	for (auto iter = rings.begin(); iter != rings.end(); ++iter)
+		close_ring(**iter);
+
+	rings.clear();
+}
+
+void af_packet_capture::stop()
+{
+	running = false;
+	threads.join_all();
+}
+
+tpacket_block_desc* af_packet_capture::wait_block(ring& r)
+{
+	tpacket_block_desc* block = reinterpret_cast<tpacket_block_desc*>(r.area + static_cast<size_t>(r.block) * AFPACKET_BLOCK_SIZE);
+
+	if ((__atomic_load_n(&block->hdr.bh1.block_status, __ATOMIC_ACQUIRE) & TP_STATUS_USER) == 0)
+	{
+		pollfd pfd;
+		pfd.fd = r.fd;
+		pfd.events = POLLIN | POLLERR;
+		pfd.revents = 0;
+		poll(&pfd, 1, AFPACKET_POLL_TIMEOUT);
+
+		if ((__atomic_load_n(&block->hdr.bh1.block_status, __ATOMIC_ACQUIRE) & TP_STATUS_USER) == 0)
+			return NULL;
+	}
+
+	return block;
+}
+
+void af_packet_capture::release_block(ring& r, tpacket_block_desc* block)
+{
+	__atomic_store_n(&block->hdr.bh1.block_status, TP_STATUS_KERNEL, __ATOMIC_RELEASE);
+	r.block = (r.block + 1) % r.block_count;
+}
+
+void af_packet_capture::get_stat(af_packet_stat& st)
+{
+	boost::mutex::scoped_lock lock(stat_guard);
+
+	st = af_packet_stat();
+
+	for (auto iter = rings.begin(); iter != rings.end(); ++iter)
+	{
+		ring& r = **iter;
+
+		tpacket_stats_v3 kst;
+		socklen_t len = sizeof(kst);
+		if (getsockopt(r.fd, SOL_PACKET, PACKET_STATISTICS, &kst, &len) == 0)
+		{
+			r.drops += kst.tp_drops;
+			r.freezes += kst.tp_freeze_q_cnt;
+		}
+
+		st.packets += r.packets.load(std::memory_order_relaxed);
+		st.bytes += r.bytes.load(std::memory_order_relaxed);
+		st.drops += r.drops;
+		st.freezes += r.freezes;
+	}
+}
+
+void af_packet_capture::update_state(svcstate_base& state)
+{
+	af_packet_stat st;
+	get_stat(st);
+
+	state.total_packets_dropped = st.drops;
+	state.total_ring_freezes = st.freezes;
+}
+
+bool af_packet_capture::parse_frame(const pcap_frame& frame, ip_header& ip, unsigned int& direction, unsigned int need)
+{
+	size_t offset = 0;
+
+	if (!pcap_replay::get_ip_packet(frame, offset, ip, direction))
+		return false;
+
+	// parse_raw_buffer() reads by the lengths in the headers, not past tp_snaplen of a short frame
+	size_t len = frame.caplen - offset;
+	if (len >= AFPACKET_PARSE_SPAN)
+		return ip.parse_raw_buffer(frame.data + offset, need);
+
+	unsigned char buf[AFPACKET_PARSE_SPAN];
+	memcpy(buf, frame.data + offset, len);
+	memset(buf + len, 0, AFPACKET_PARSE_SPAN - len);
+
+	return ip.parse_raw_buffer(buf, need);
+}
+
+#ifdef UTM_DEBUG
+void af_packet_capture::test_all()
+{
+	test_report tr(this_class_name);
+	test_case::classname.assign(this_class_name);
+
+	af_packet_capture cap;
+
+	try
+	{
+		cap.open("lo", 2, static_cast<unsigned int>(getpid()), 4 * AFPACKET_BLOCK_SIZE);
+	}
+	catch (const std::exception&)
+	{
+		// Capture needs CAP_NET_RAW
+		return;
+	}
+
+	test_case::testcase_num = 1;
+	TEST_CASE_CHECK(size_t(2), cap.get_worker_count());
+
+	const unsigned short test_port = 39999;
+	std::atomic<unsigned int> received(0);
+	std::atomic<unsigned int> workers_mask(0);
+
+	cap.start([&](unsigned int worker, const pcap_frame& frame)
+	{
+		ip_header ip;
+		unsigned int direction = PACKET_DIRECTION_PASSIVE;
+
+		if (parse_frame(frame, ip, direction) && (ip.proto == 17) && (ip.dst_port == test_port) && (direction == PACKET_DIRECTION_INCOMING))
+		{
+			received++;
+			workers_mask |= (1u << worker);
+		}
+	});
+
+	// Flows from different source ports are spread over the workers
+	const unsigned int flows = 16, packets = 20;
+	int s[flows];
+
+	sockaddr_in dst;
+	memset(&dst, 0, sizeof(dst));
+	dst.sin_family = AF_INET;
+	dst.sin_port = htons(test_port);
+	dst.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+
+	for (unsigned int i = 0; i < flows; i++)
+		s[i] = socket(AF_INET, SOCK_DGRAM, 0);
+
+	for (unsigned int n = 0; n < packets; n++)
+	{
+		for (unsigned int i = 0; i < flows; i++)
+			sendto(s[i], "utm", 3, 0, reinterpret_cast<sockaddr*>(&dst), sizeof(dst));
+	}
+
+	for (int i = 0; (i < 200) && (received.load() < flows * packets); i++)
+		boost::this_thread::sleep_for(boost::chrono::milliseconds(10));
+
+	for (unsigned int i = 0; i < flows; i++)
+		::close(s[i]);
+
+	cap.stop();
+
+	TEST_CASE_CHECK(flows * packets, received.load());
+	TEST_CASE_CHECK(3u, workers_mask.load());
+
+	af_packet_stat st;
+	cap.get_stat(st);
+
+	TEST_CASE_CHECK(true, st.packets >= flows * packets);
+	TEST_CASE_CHECK(uint64_t(0), st.drops);
+
+	return;
+}
+#endif
+
+}
+
+#endif // UTM_LINUX
@@ -0,0 +1,177 @@
+#ifndef _UTM_AF_PACKET_CAPTURE_H
+#define _UTM_AF_PACKET_CAPTURE_H
+
+#pragma once
+#include <utm.h>
+
+#ifdef UTM_LINUX
+
+#include <pcap_file.h>
+#include <ip_header.h>
+#include <svcstate_base.h>
+
+#include <atomic>
+#include <memory>
+#include <string>
+#include <vector>
+
+#include <boost/thread.hpp>
+
+#include <linux/if_packet.h>
+
+#define AFPACKET_BLOCK_SIZE (1 << 20)		// power of two, a multiple of the page size
+#define AFPACKET_RING_SIZE (16 << 20)		// bytes of the ring of a worker by default
+#define AFPACKET_MIN_BLOCKS 2
+#define AFPACKET_FRAME_SIZE 2048
+#define AFPACKET_BLOCK_TIMEOUT 10			// milliseconds the kernel keeps a block which is not full
+#define AFPACKET_POLL_TIMEOUT 100			// milliseconds, the workers check for stop
+#define AFPACKET_PARSE_SPAN 256				// bytes parse_raw_buffer() may read, FTP commands past the headers
+
+namespace utm {
+
+struct af_packet_stat
+{
+	af_packet_stat() : packets(0), bytes(0), drops(0), freezes(0) { };
+
+	uint64_t packets;
+	uint64_t bytes;
+	uint64_t drops;				// by the kernel, the ring was full
+	uint64_t freezes;			// times the queue was frozen
+};
+
+//
+// Linux capture on AF_PACKET TPACKET_V3 rings. Every worker has its socket and the ring of
+// blocks mapped into memory, the sockets are joined in a fanout group which puts all packets
+// of a flow to the same worker. Frames are given to the worker callback in place, they are
+// valid until the callback returns.
+//
+class af_packet_capture
+{
+	struct ring
+	{
+		ring() : fd(-1), area(NULL), map_size(0), block_count(0), block(0), packets(0), bytes(0), drops(0), freezes(0) { };
+
+		int fd;
+		unsigned char* area;
+		size_t map_size;
+		unsigned int block_count;
+		unsigned int block;			// the next block of the worker
+
+		std::atomic<uint64_t> packets;
+		std::atomic<uint64_t> bytes;
+		uint64_t drops;
+		uint64_t freezes;
+	};
+
+public:
+	static const char this_class_name[];
+
+	af_packet_capture();
+	~af_packet_capture();
+
+	// The fanout group id must be unique among the captures of the host. The ring size of a worker
+	// is rounded up to AFPACKET_BLOCK_SIZE.
+	void open(const std::string& ifname, unsigned int workers, unsigned int fanout_id, size_t ring_size = AFPACKET_RING_SIZE);
+	void close();
+
+	bool is_open() const { return !rings.empty(); };
+	size_t get_worker_count() const { return rings.size(); };
+
+	// Runs the workers, f(worker, frame) is called from the thread of the worker
+	template<class F>
+	void start(F f)
+	{
+		running = true;
+
+		for (unsigned int i = 0; i < rings.size(); i++)
+			threads.create_thread([this, i, f]() { worker(i, f); });
+	}
+
+	void stop();
+
+	// Reads the kernel counters, they are reset by the kernel on each read
+	void get_stat(af_packet_stat& st);
+	void update_state(svcstate_base& state);
+
+	// Parses the IP packet in the ring memory, a frame shorter than AFPACKET_PARSE_SPAN is copied.
+	// The direction is one of PACKET_DIRECTION_*, it is not changed if the kernel did not give it.
+	static bool parse_frame(const pcap_frame& frame, ip_header& ip, unsigned int& direction, unsigned int need = IPHDR_NEED_ALL);
+
+private:
+	af_packet_capture(const af_packet_capture&);
+	af_packet_capture& operator=(const af_packet_capture&);
+
+	void open_ring(ring& r, unsigned int ifindex, unsigned int workers, unsigned int fanout_id, unsigned int block_count);
+	void close_ring(ring& r);
+
+	tpacket_block_desc* wait_block(ring& r);
+	void release_block(ring& r, tpacket_block_desc* block);
+
+	static void get_frame(const tpacket3_hdr* h, pcap_frame& frame)
+	{
+		const unsigned char* p = reinterpret_cast<const unsigned char*>(h);
+		const sockaddr_ll* sll = reinterpret_cast<const sockaddr_ll*>(p + TPACKET_ALIGN(sizeof(tpacket3_hdr)));
+
+		frame.ts = static_cast<uint64_t>(h->tp_sec) * 1000000000ULL + h->tp_nsec;
+		frame.linktype = PCAP_LINKTYPE_ETHERNET;
+		frame.data = p + h->tp_mac;
+		frame.caplen = h->tp_snaplen;
+		frame.len = h->tp_len;
+
+		if (sll->sll_pkttype == PACKET_OUTGOING)
+			frame.direction = PCAP_DIRECTION_OUTBOUND;
+		else if (sll->sll_pkttype == PACKET_HOST)
+			frame.direction = PCAP_DIRECTION_INBOUND;
+		else
+			frame.direction = PCAP_DIRECTION_UNKNOWN;
+	}
+
+	template<class F>
+	void worker(unsigned int index, F f)
+	{
+		ring& r = *rings[index];
+		pcap_frame frame;
+
+		while (running.load(std::memory_order_relaxed))
+		{
+			tpacket_block_desc* block = wait_block(r);
+			if (block == NULL)
+				continue;
+
+			const unsigned char* p = reinterpret_cast<const unsigned char*>(block) + block->hdr.bh1.offset_to_first_pkt;
+			uint32_t count = block->hdr.bh1.num_pkts;
+			uint64_t bytes = 0;
+
+			for (uint32_t n = 0; n < count; n++)
+			{
+				const tpacket3_hdr* h = reinterpret_cast<const tpacket3_hdr*>(p);
+				get_frame(h, frame);
+				bytes += frame.len;
+
+				f(index, frame);
+				p += h->tp_next_offset;
+			}
+
+			release_block(r, block);
+
+			r.packets.fetch_add(count, std::memory_order_relaxed);
+			r.bytes.fetch_add(bytes, std::memory_order_relaxed);
+		}
+	}
+
+	std::vector<std::unique_ptr<ring> > rings;
+	std::atomic<bool> running;
+	boost::thread_group threads;
+	boost::mutex stat_guard;
+
+#ifdef UTM_DEBUG
+public:
+	static void test_all();
+#endif
+};
+
+}
+
+#endif // UTM_LINUX
+
+#endif // _UTM_AF_PACKET_CAPTURE_H
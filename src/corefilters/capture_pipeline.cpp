@@ -0,0 +1,701 @@
+#include "stdafx.h"
+#include "capture_pipeline.h"
+
+#include <cstring>
+#include <iostream>
+#include <sstream>
+
+#include <utime.h>
+#include <ubase_test.h>
+
+#ifdef UTM_LINUX
+#include <pthread.h>
+#include <sched.h>
+#endif
+
+namespace utm {
+
+const char capture_pipeline::this_class_name[] = "capture_pipeline";
+
+static bool is_packet_counted(const filterset_match& m)
+{
+	// The rule action counts, the filter may still deny the packet
+	return (m.filter_ptr != NULL) && (m.rule_ptr != NULL) && ((m.rule_ptr->action == ACTION_COUNT) || (m.rule_ptr->action == ACTION_COUNTPASS));
+}
+
+static void pin_thread(boost::thread& t, unsigned int cpu)
+{
+#ifdef UTM_WIN
+	SetThreadAffinityMask(t.native_handle(), static_cast<DWORD_PTR>(1) << (cpu % (sizeof(DWORD_PTR) * 8)));
+#endif
+
+#ifdef UTM_LINUX
+	cpu_set_t set;
+	CPU_ZERO(&set);
+	CPU_SET(cpu % CPU_SETSIZE, &set);
+	pthread_setaffinity_np(t.native_handle(), sizeof(set), &set);
+#endif
+}
+
+capture_pipeline::capture_pipeline(filterset& _fs) : fs(_fs), header_need(IPHDR_NEED_ALL), host2ip(NULL), resolver(NULL), running(false)
+{
+}
+
+capture_pipeline::~capture_pipeline()
+{
+	stop();
+}
+
+unsigned int capture_pipeline::get_flow_hash(const unsigned char* ippkt, size_t len)
+{
+	if (len < 20)
+		return 0;
+
+	uint32_t addr_a = (ippkt[12] << 24) | (ippkt[13] << 16) | (ippkt[14] << 8) | ippkt[15];
+	uint32_t addr_b = (ippkt[16] << 24) | (ippkt[17] << 16) | (ippkt[18] << 8) | ippkt[19];
+	uint32_t port_a = 0, port_b = 0;
+	unsigned int proto = ippkt[9];
+	size_t ipd = (ippkt[0] & 0x0F) * 4;
+
+	// Fragments have no ports but one, a fragmented packet goes by its addresses
+	bool fragmented = (((ippkt[6] << 8) | ippkt[7]) & 0x3FFF) != 0;
+
+	if (((proto == 6) || (proto == 17)) && !fragmented && (len >= ipd + 4))
+	{
+		port_a = (ippkt[ipd] << 8) | ippkt[ipd + 1];
+		port_b = (ippkt[ipd + 2] << 8) | ippkt[ipd + 3];
+	}
+
+	// Both directions give the same hash
+	if ((addr_a > addr_b) || ((addr_a == addr_b) && (port_a > port_b)))
+	{
+		std::swap(addr_a, addr_b);
+		std::swap(port_a, port_b);
+	}
+
+	uint64_t h = (static_cast<uint64_t>(addr_a) << 32) | addr_b;
+	h ^= ((static_cast<uint64_t>(port_a) << 24) | (port_b << 8) | proto) * 0x9E3779B97F4A7C15ULL;
+
+	h ^= h >> 33;
+	h *= 0xFF51AFD7ED558CCDULL;
+	h ^= h >> 33;
+	h *= 0xC4CEB9FE1A85EC53ULL;
+	h ^= h >> 33;
+
+	return static_cast<unsigned int>(h);
+}
+
+void capture_pipeline::set_hosttable(hosttable* ht, dns_resolver* _resolver)
+{
+	host2ip = ht;
+	resolver = _resolver;
+
+	if (resolver != NULL)
+		fs.prepare_resolver(*resolver);
+
+	if (host2ip != NULL)
+		fs.prepare_host_ids(*host2ip);
+}
+
+void capture_pipeline::start(unsigned int count, bool pin, unsigned int first_cpu)
+{
+	stop();
+
+	if (count == 0)
+		count = 1;
+
+	if (count > PIPELINE_MAX_WORKERS)
+		count = PIPELINE_MAX_WORKERS;
+
+	header_need = fs.get_header_usage();
+
+	// The payload of the flow is found by the TCP header length
+	if (host2ip != NULL)
+		header_need |= IPHDR_NEED_FLAGS;
+
+	filters.clear();
+	for (auto iter = fs.filters.items.begin(); iter != fs.filters.items.end(); ++iter)
+		filters.push_back(&(*iter));
+
+	workers.clear();
+	for (unsigned int i = 0; i < count; i++)
+	{
+		std::unique_ptr<worker> w(new worker);
+
+		w->queue.init(PIPELINE_QUEUE_PACKETS, PIPELINE_QUEUE_BYTES);
+		w->collector.set_memory_budget(fs.pcollector.get_memory_budget() / count);
+		if (host2ip != NULL)
+		{
+			w->hosts.set_memory_budget(fs.pcollector.get_memory_budget() / count);
+			w->hosts.set_host_matcher(&host2ip->get_matcher());
+		}
+
+		w->counters.assign(filters.size(), std::make_pair(__int64(0), __int64(0)));
+
+		w->input.ip = &w->ip;
+		w->input.mat = &fs.table_mat;
+		w->input.nModifyCounter = MODIFY_COUNTER_NO;
+		w->input.lt = &w->lt;
+		w->input.mbytes = fs.get_megabytes();
+		w->input.host2ip = host2ip;
+		memset(&w->lt, 0, sizeof(w->lt));
+
+		workers.push_back(std::move(w));
+	}
+
+	running = true;
+
+	unsigned int cpus = boost::thread::hardware_concurrency();
+	for (unsigned int i = 0; i < count; i++)
+	{
+		boost::thread* t = threads.create_thread([this, i]() { run(i); });
+
+		if (pin && (cpus > 0))
+			pin_thread(*t, (first_cpu + i) % cpus);
+	}
+}
+
+void capture_pipeline::stop()
+{
+	running = false;
+	threads.join_all();
+}
+
+bool capture_pipeline::put_packet(const unsigned char* ippkt, size_t len, unsigned int direction, unsigned int nic_alias, unsigned int now)
+{
+	if (!running.load(std::memory_order_relaxed) || (len > 0xFFFF))
+		return false;
+
+	worker& w = *workers[get_worker_index(get_flow_hash(ippkt, len), workers.size())];
+
+	size_t size = sizeof(packet_header) + len + PIPELINE_PACKET_PAD;
+	pkt_ring_slot slot;
+
+	unsigned char* p = w.queue.reserve(size, slot);
+	if (p == NULL)
+		return false;
+
+	packet_header h;
+	h.now = now;
+	h.direction = direction;
+
+	memcpy(p, &h, sizeof(h));
+	memcpy(p + sizeof(h), ippkt, len);
+	memset(p + sizeof(h) + len, 0, PIPELINE_PACKET_PAD);
+
+	pkt_additional_data pkt_data;
+	pkt_data.hAdapterHandle = NULL;
+	pkt_data.nic_alias = nic_alias;
+
+	w.queue.commit(slot, size, &pkt_data);
+	return true;
+}
+
+void capture_pipeline::run(unsigned int index)
+{
+	worker& w = *workers[index];
+	w.last_merge = std::chrono::steady_clock::now();
+
+	for (;;)
+	{
+		// Producers are stopped before the pipeline, the queue is drained
+		bool stopping = !running.load();
+
+		uint64_t bytes = 0;
+		size_t n = w.queue.get_batch(PIPELINE_BATCH, [this, &w, &bytes](const unsigned char* pkt, size_t len, const pkt_additional_data& pkt_data)
+		{
+			process_packet(w, pkt, len, pkt_data);
+			bytes += w.ip.length;
+		});
+
+		if (n > 0)
+		{
+			w.packets.fetch_add(n, std::memory_order_relaxed);
+			w.bytes.fetch_add(bytes, std::memory_order_relaxed);
+			w.batches.fetch_add(1, std::memory_order_relaxed);
+		}
+
+		std::chrono::steady_clock::time_point now = std::chrono::steady_clock::now();
+		if (now - w.last_merge >= std::chrono::milliseconds(PIPELINE_MERGE_INTERVAL))
+		{
+			merge(w);
+			w.last_merge = now;
+		}
+
+		if (n == 0)
+		{
+			if (stopping)
+				break;
+
+			boost::this_thread::sleep_for(boost::chrono::microseconds(PIPELINE_IDLE_WAIT));
+		}
+	}
+
+	merge(w);
+}
+
+void capture_pipeline::process_packet(worker& w, const unsigned char* pkt, size_t len, const pkt_additional_data& pkt_data)
+{
+	const packet_header* h = reinterpret_cast<const packet_header*>(pkt);
+
+	if (!w.ip.parse_raw_buffer(pkt + sizeof(packet_header), header_need))
+	{
+		w.ip.length = 0;
+		return;
+	}
+
+	if (h->now != w.lt_time)
+	{
+		utime t;
+		t.from_time_t(h->now);
+		w.lt = t.to_tm();
+		w.lt_time = h->now;
+	}
+
+	w.input.nPacketDirection = h->direction;
+	w.input.nNicAlias = pkt_data.nic_alias;
+
+	if (host2ip != NULL)
+		classify_flow(w, pkt + sizeof(packet_header), len - sizeof(packet_header) - PIPELINE_PACKET_PAD, h->now);
+
+	// Counters are not touched by matching, they are kept by the worker
+	w.cache.match(fs, w.input, w.matches);
+
+	for (auto iter = w.matches.items.begin(); iter != w.matches.items.end(); ++iter)
+	{
+		if (!is_packet_counted(*iter) || (iter->filter_idx >= w.counters.size()))
+			continue;
+
+		__int64 length = iter->filter_ptr->m_bRevers ? -static_cast<__int64>(w.ip.length) : static_cast<__int64>(w.ip.length);
+
+		if (iter->direction == DIRECTION_FORWARD)
+			w.counters[iter->filter_idx].first += length;
+		else
+			w.counters[iter->filter_idx].second += length;
+	}
+
+	fs.collect_packet(w.collector, w.ip, w.matches, h->now);
+}
+
+void capture_pipeline::classify_flow(worker& w, const unsigned char* ippkt, size_t len, unsigned int now)
+{
+	w.input.flow_host_id = 0;
+
+	if (w.ip.proto != 6)
+		return;
+
+	// The client sends from an unprivileged port to the privileged port of the server
+	int direction;
+	if ((w.ip.src_port > MAX_PRIVELEGED_PORT) && (w.ip.dst_port <= MAX_PRIVELEGED_PORT))
+		direction = 0;
+	else if ((w.ip.src_port <= MAX_PRIVELEGED_PORT) && (w.ip.dst_port > MAX_PRIVELEGED_PORT))
+		direction = 1;
+	else
+		return;
+
+	size_t offset = (w.ip.ip_hl + w.ip.tcp_hl) * 4;
+	size_t end = std::min(len, static_cast<size_t>(w.ip.length));
+	size_t payload_len = (end > offset) ? end - offset : 0;
+
+	w.input.flow_host_id = w.hosts.put_packet(w.ip, direction, now, ippkt + offset, payload_len);
+	w.input.flow_server = (direction == 0) ? w.ip.dst_ip_addr : w.ip.src_ip_addr;
+}
+
+void capture_pipeline::merge(worker& w)
+{
+	for (size_t i = 0; i < w.counters.size(); i++)
+	{
+		std::pair<__int64, __int64>& c = w.counters[i];
+
+		if (c.first != 0)
+			filters[i]->cnt_sent.add_cnt(c.first);
+
+		if (c.second != 0)
+			filters[i]->cnt_recv.add_cnt(c.second);
+
+		c.first = 0;
+		c.second = 0;
+	}
+
+	if (host2ip != NULL)
+	{
+		flush_container_ex fc;
+		w.hosts.flush(fc, w.lt_time);
+
+		if (resolver != NULL)
+			w.hosts.add_seen_hosts(fc, *host2ip, *resolver);
+	}
+
+	w.merges.fetch_add(1, std::memory_order_relaxed);
+}
+
+void capture_pipeline::flush(flush_container_shared& fc, unsigned int now)
+{
+	for (auto iter = workers.begin(); iter != workers.end(); ++iter)
+	{
+		flush_container_shared part;
+		(*iter)->collector.flush(part, now);
+		fc.splice(fc.end(), part);
+	}
+}
+
+void capture_pipeline::get_worker_stat(unsigned int index, capture_pipeline_stat& st) const
+{
+	const worker& w = *workers[index];
+
+	pkt_ring_stat qs;
+	w.queue.get_stat(qs);
+
+	st.packets = w.packets.load(std::memory_order_relaxed);
+	st.bytes = w.bytes.load(std::memory_order_relaxed);
+	st.drops = qs.drop_counter;
+	st.batches = w.batches.load(std::memory_order_relaxed);
+	st.merges = w.merges.load(std::memory_order_relaxed);
+	st.queue_watermark = qs.packets_watermark;
+}
+
+void capture_pipeline::get_stat(capture_pipeline_stat& st) const
+{
+	st = capture_pipeline_stat();
+
+	for (unsigned int i = 0; i < workers.size(); i++)
+	{
+		capture_pipeline_stat ws;
+		get_worker_stat(i, ws);
+
+		st.packets += ws.packets;
+		st.bytes += ws.bytes;
+		st.drops += ws.drops;
+		st.batches += ws.batches;
+		st.merges += ws.merges;
+		st.queue_watermark = std::max(st.queue_watermark, ws.queue_watermark);
+	}
+}
+
+double capture_pipeline::get_imbalance() const
+{
+	uint64_t total = 0, busiest = 0;
+
+	for (auto iter = workers.begin(); iter != workers.end(); ++iter)
+	{
+		uint64_t packets = (*iter)->packets.load(std::memory_order_relaxed);
+		total += packets;
+		busiest = std::max(busiest, packets);
+	}
+
+	if (total == 0)
+		return 1.0;
+
+	return static_cast<double>(busiest) * workers.size() / static_cast<double>(total);
+}
+
+#ifdef UTM_DEBUG
+static void pipeline_test_packet(std::vector<unsigned char>& pkt, uint32_t src, uint32_t dst, unsigned short sport, unsigned short dport, unsigned int length)
+{
+	pkt.assign(40, 0);
+	pkt[0] = 0x45;
+	pkt[2] = static_cast<unsigned char>(length >> 8);
+	pkt[3] = static_cast<unsigned char>(length);
+	pkt[8] = 64;
+	pkt[9] = 6;
+
+	for (int i = 0; i < 4; i++)
+	{
+		pkt[12 + i] = static_cast<unsigned char>(src >> (24 - i * 8));
+		pkt[16 + i] = static_cast<unsigned char>(dst >> (24 - i * 8));
+	}
+
+	pkt[20] = static_cast<unsigned char>(sport >> 8);
+	pkt[21] = static_cast<unsigned char>(sport);
+	pkt[22] = static_cast<unsigned char>(dport >> 8);
+	pkt[23] = static_cast<unsigned char>(dport);
+	pkt[32] = 0x50;
+}
+
+static void pipeline_test_segment(std::vector<unsigned char>& pkt, uint32_t src, uint32_t dst, unsigned short sport, unsigned short dport, unsigned char flags, const char* payload)
+{
+	size_t len = strlen(payload);
+	pipeline_test_packet(pkt, src, dst, sport, dport, static_cast<unsigned int>(40 + len));
+	pkt[33] = flags;
+	pkt.insert(pkt.end(), payload, payload + len);
+}
+
+static void pipeline_test_filters(filterset& fs, unsigned int count)
+{
+	for (unsigned int i = 1; i <= count; i++)
+	{
+		filter2 f;
+		f.set_id(i);
+		f.m_bRevers = (i == 3);
+		f.m_nPktLogDest = (i == 1) ? LOGPKT_INTOFILE : LOGPKT_DISABLED;
+
+		std::ostringstream dst;
+		dst << "10." << (i % 8) << ".0.0";
+
+		rule r(RULE_IP, "10.0.0.0", "255.255.255.0", RULE_IP, dst.str().c_str(), "255.255.0.0");
+		r.action = (i == 2) ? ACTION_PASS : ACTION_COUNT;
+		f.rule_add(r);
+
+		fs.filters.add_element(f);
+	}
+
+	fs.prepare_rule_classifiers();
+	fs.prepare_header_usage();
+}
+
+void capture_pipeline::test_all()
+{
+	test_report tr(this_class_name);
+	test_case::classname.assign(this_class_name);
+
+	const unsigned int now = static_cast<unsigned int>(utime(2014, 5, 14, 12, 0, 0).to_time_t());
+	const unsigned int flows = 256, rounds = 20;
+
+	std::vector<std::vector<unsigned char> > packets;
+	std::vector<unsigned char> pkt;
+
+	for (unsigned int i = 0; i < flows; i++)
+	{
+		uint32_t src = addrip_v4("10.0.0.0").m_addr + (i % 16);
+		uint32_t dst = addrip_v4("10.0.0.1").m_addr + ((i % 8) << 16);
+		unsigned short sport = static_cast<unsigned short>(1000 + i);
+
+		pipeline_test_packet(pkt, src, dst, sport, 80, 100 + i);
+		packets.push_back(pkt);
+		pipeline_test_packet(pkt, dst, src, 80, sport, 40);
+		packets.push_back(pkt);
+	}
+
+	{
+		// Both directions of a flow go to the same worker
+		test_case::testcase_num = 1;
+
+		bool is_symmetric = true;
+		for (size_t i = 0; i < packets.size(); i += 2)
+		{
+			if (get_flow_hash(&packets[i][0], packets[i].size()) != get_flow_hash(&packets[i + 1][0], packets[i + 1].size()))
+				is_symmetric = false;
+		}
+
+		TEST_CASE_CHECK(true, is_symmetric);
+		TEST_CASE_NOTCHECK(get_flow_hash(&packets[0][0], packets[0].size()), get_flow_hash(&packets[2][0], packets[2].size()));
+	}
+
+	{
+		// The same counters and flows as the filterset counts itself
+		test_case::testcase_num = 2;
+
+		filterset fs, fs_ref;
+		pipeline_test_filters(fs, 8);
+		pipeline_test_filters(fs_ref, 8);
+
+		// The first filter logs flows, the collector needs the TCP flags
+		TEST_CASE_CHECK((unsigned int)IPHDR_NEED_FLAGS, fs.get_header_usage());
+
+		tm lt = utime(2014, 5, 14, 12, 0, 0).to_tm();
+		ip_header ip;
+		match_filter_input input;
+		input.ip = &ip;
+		input.mat = &fs_ref.table_mat;
+		input.nModifyCounter = MODIFY_COUNTER_YES;
+		input.lt = &lt;
+		input.mbytes = fs_ref.get_megabytes();
+		filterset_match_list matches;
+
+		for (unsigned int n = 0; n < rounds; n++)
+		{
+			for (size_t i = 0; i < packets.size(); i++)
+			{
+				ip.parse_raw_buffer(&packets[i][0]);
+				fs_ref.match_filters(input, matches);
+				fs_ref.collect_packet(ip, matches, now);
+			}
+		}
+
+		capture_pipeline cp(fs);
+		cp.start(4, false);
+
+		// Two producers, each puts its half of the flows
+		boost::thread_group producers;
+		for (unsigned int t = 0; t < 2; t++)
+		{
+			producers.create_thread([&cp, &packets, t, now]()
+			{
+				for (unsigned int n = 0; n < rounds; n++)
+				{
+					for (size_t i = t * 2; i < packets.size(); i += 4)
+					{
+						for (size_t k = i; k < i + 2; k++)
+						{
+							while (!cp.put_packet(&packets[k][0], packets[k].size(), PACKET_DIRECTION_PASSIVE, 0, now))
+								boost::this_thread::yield();
+						}
+					}
+				}
+			});
+		}
+
+		producers.join_all();
+		cp.stop();
+
+		capture_pipeline_stat st;
+		cp.get_stat(st);
+		TEST_CASE_CHECK(uint64_t(packets.size() * rounds), st.packets);
+
+		bool is_equal = true;
+		auto iter_ref = fs_ref.filters.items.begin();
+		for (auto iter = fs.filters.items.begin(); iter != fs.filters.items.end(); ++iter, ++iter_ref)
+		{
+			if ((iter->cnt_sent.get_cnt() != iter_ref->cnt_sent.get_cnt()) || (iter->cnt_recv.get_cnt() != iter_ref->cnt_recv.get_cnt()))
+				is_equal = false;
+		}
+
+		TEST_CASE_CHECK(true, is_equal);
+		TEST_CASE_NOTCHECK(__int64(0), fs.filters.items.front().cnt_sent.get_cnt());
+
+		flush_container_shared fc, fc_ref;
+		cp.flush(fc, now + 1);
+		fs_ref.pcollector.flush(fc_ref, now + 1);
+
+		std::uint64_t bytes = 0, bytes_ref = 0;
+		for (auto iter = fc.begin(); iter != fc.end(); ++iter)
+			bytes += iter->value.sent_flush + iter->value.recv_flush;
+		for (auto iter = fc_ref.begin(); iter != fc_ref.end(); ++iter)
+			bytes_ref += iter->value.sent_flush + iter->value.recv_flush;
+
+		TEST_CASE_CHECK(fc_ref.size(), fc.size());
+		TEST_CASE_CHECK(bytes_ref, bytes);
+
+		// Every worker got flows
+		bool all_busy = true;
+		for (unsigned int i = 0; i < cp.get_worker_count(); i++)
+		{
+			capture_pipeline_stat ws;
+			cp.get_worker_stat(i, ws);
+			if (ws.packets == 0)
+				all_busy = false;
+		}
+
+		TEST_CASE_CHECK(true, all_busy);
+		TEST_CASE_CHECK(true, cp.get_imbalance() < 2.0);
+	}
+
+	{
+		// The host rule counts the flow by its name, with a resolver the server is also
+		// added to the host. The answer is taken from the resolver cache.
+		test_case::testcase_num = 3;
+
+		dns_resolver resolver;
+		dns_result result;
+		resolver.resolve_host("localhost", result);
+
+		uint32_t client = addrip_v4("10.0.0.1").m_addr;
+		uint32_t server = addrip_v4("127.0.0.1").m_addr;
+
+		std::vector<std::vector<unsigned char> > flow(6);
+		pipeline_test_segment(flow[0], client, server, 40000, 80, 0x02, "");
+		pipeline_test_segment(flow[1], server, client, 80, 40000, 0x12, "");
+		pipeline_test_segment(flow[2], client, server, 40000, 80, 0x10, "");
+		pipeline_test_segment(flow[3], client, server, 40000, 80, 0x18, "GET / HTTP/1.1\r\nHost: localhost\r\n\r\n");
+		pipeline_test_segment(flow[4], server, client, 80, 40000, 0x18, "HTTP/1.1 200 OK\r\n\r\n");
+		pipeline_test_segment(flow[5], server, client, 80, 40000, 0x11, "");
+
+		for (int with_resolver = 0; with_resolver < 2; with_resolver++)
+		{
+			hosttable ht;
+
+			filterset fs;
+			filter2 f;
+			f.set_id(1);
+			rule r(RULE_IP, "0.0.0.0", "0.0.0.0", RULE_HOST, "0.0.0.0", "0.0.0.0");
+			r.dst_host.set_host("localhost");
+			f.rule_add(r);
+			fs.filters.add_element(f);
+
+			capture_pipeline cp(fs);
+			cp.set_hosttable(&ht, with_resolver ? &resolver : NULL);
+			fs.prepare_rule_classifiers();
+			fs.prepare_header_usage();
+
+			cp.start(2, false);
+			for (size_t i = 0; i < flow.size(); i++)
+			{
+				while (!cp.put_packet(&flow[i][0], flow[i].size(), PACKET_DIRECTION_PASSIVE, 0, now))
+					boost::this_thread::yield();
+			}
+			cp.stop();
+
+			capture_pipeline_stat st;
+			cp.get_stat(st);
+			TEST_CASE_CHECK(uint64_t(flow.size()), st.packets);
+			TEST_CASE_NOTCHECK(__int64(0), fs.filters.items.front().cnt_sent.get_cnt());
+
+			hostname hl;
+			hl.set_host("localhost");
+			TEST_CASE_CHECK(with_resolver != 0, ht.checkaddr(hl, addrip_v4(server)));
+		}
+	}
+
+	return;
+}
+
+void capture_pipeline::benchmark()
+{
+	const unsigned int now = static_cast<unsigned int>(utime(2014, 5, 14, 12, 0, 0).to_time_t());
+	const unsigned int flows = 4096, rounds = 200;
+
+	std::vector<std::vector<unsigned char> > packets;
+	std::vector<unsigned char> pkt;
+
+	for (unsigned int i = 0; i < flows; i++)
+	{
+		uint32_t src = addrip_v4("10.0.0.0").m_addr + (i % 200);
+		uint32_t dst = addrip_v4("10.0.0.1").m_addr + ((i % 8) << 16) + (i % 251);
+
+		pipeline_test_packet(pkt, src, dst, static_cast<unsigned short>(1024 + i), 443, 1000);
+		packets.push_back(pkt);
+	}
+
+	unsigned int cpus = boost::thread::hardware_concurrency();
+
+	for (unsigned int count = 1; count <= std::max(cpus / 2, 1u); count *= 2)
+	{
+		filterset fs;
+		pipeline_test_filters(fs, 60);
+
+		capture_pipeline cp(fs);
+		cp.start(count, true, count);
+
+		std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+
+		// One producer a worker, as with the fanout of the capture
+		boost::thread_group producers;
+		for (unsigned int t = 0; t < count; t++)
+		{
+			producers.create_thread([&cp, &packets, t, count, now]()
+			{
+				for (unsigned int n = 0; n < rounds; n++)
+				{
+					for (size_t i = t; i < packets.size(); i += count)
+					{
+						while (!cp.put_packet(&packets[i][0], packets[i].size(), PACKET_DIRECTION_PASSIVE, 0, now))
+							boost::this_thread::yield();
+					}
+				}
+			});
+		}
+
+		producers.join_all();
+		cp.stop();
+
+		double elapsed = std::chrono::duration<double, std::micro>(std::chrono::steady_clock::now() - start).count();
+
+		capture_pipeline_stat st;
+		cp.get_stat(st);
+
+		std::cout << this_class_name << ": workers " << count << ", " << (st.packets / elapsed) << " Mpps, imbalance " << cp.get_imbalance() << std::endl;
+	}
+}
+#endif
+
+}
@@ -0,0 +1,150 @@
+#ifndef _UTM_CAPTURE_PIPELINE_H
+#define _UTM_CAPTURE_PIPELINE_H
+
+#pragma once
+#include <utm.h>
+
+#include <filterset.h>
+#include <match_cache.h>
+#include <pkt_ring.h>
+#include <pktcollector_ex.h>
+#include <pktcollector_shared.h>
+
+#include <atomic>
+#include <chrono>
+#include <memory>
+#include <vector>
+
+#include <boost/thread.hpp>
+
+#define PIPELINE_MAX_WORKERS 64
+#define PIPELINE_QUEUE_PACKETS 8192
+#define PIPELINE_QUEUE_BYTES (1 << 22)
+#define PIPELINE_PACKET_PAD 256			// zeros after the packet, parse_raw_buffer() reads past it
+#define PIPELINE_BATCH 64
+#define PIPELINE_MERGE_INTERVAL 100		// milliseconds between merges of the worker counters
+#define PIPELINE_IDLE_WAIT 50			// microseconds a worker sleeps if its queue is empty
+
+namespace utm {
+
+struct capture_pipeline_stat
+{
+	capture_pipeline_stat() : packets(0), bytes(0), drops(0), batches(0), merges(0), queue_watermark(0) { };
+
+	uint64_t packets;
+	uint64_t bytes;
+	uint64_t drops;				// the queue of the worker was full
+	uint64_t batches;
+	uint64_t merges;
+	uint32_t queue_watermark;
+};
+
+//
+// Packets of a flow are steered to one worker by the symmetric hash of the addresses, ports and
+// protocol, so both directions meet in the same worker. A worker has its queue, match cache,
+// flow collector and counters of the filters; the counters are added to the filterset
+// counters every PIPELINE_MERGE_INTERVAL and when the worker stops. Workers are pinned to
+// consecutive processors.
+//
+// With a host table the worker takes the host names of the TCP flows to privileged ports,
+// the host rules match the server of a flow by its name. The servers are added to the hosts
+// on the merge if the DNS confirms them.
+//
+// The filterset must not change while the pipeline runs, flows of the logging filters are
+// taken with flush() instead of the filterset collector.
+//
+class capture_pipeline
+{
+	struct packet_header
+	{
+		uint32_t now;
+		uint32_t direction;
+	};
+
+	struct worker
+	{
+		worker() : packets(0), bytes(0), batches(0), merges(0), lt_time(0) { };
+
+		pkt_ring queue;
+		match_cache cache;
+		pktcollector_shared collector;
+		pktcollector_ex hosts;
+
+		// Counter deltas by the filter index, not merged yet
+		std::vector<std::pair<__int64, __int64> > counters;
+
+		std::atomic<uint64_t> packets;
+		std::atomic<uint64_t> bytes;
+		std::atomic<uint64_t> batches;
+		std::atomic<uint64_t> merges;
+
+		ip_header ip;
+		match_filter_input input;
+		filterset_match_list matches;
+		struct tm lt;
+		unsigned int lt_time;
+		std::chrono::steady_clock::time_point last_merge;
+
+		char pad[PKTRING_CACHELINE];
+	};
+
+public:
+	static const char this_class_name[];
+
+	capture_pipeline(filterset& fs);
+	~capture_pipeline();
+
+	// Binds the host rules of the filterset to the table and the resolver to its DNS server,
+	// called before start(). Without a resolver the servers of the flows are not confirmed.
+	void set_hosttable(hosttable* ht, dns_resolver* resolver);
+
+	void start(unsigned int workers, bool pin = true, unsigned int first_cpu = 0);
+	void stop();
+
+	bool is_running() const { return running.load(); };
+	size_t get_worker_count() const { return workers.size(); };
+
+	// Any thread. Returns false if the worker queue is full and the packet is dropped.
+	bool put_packet(const unsigned char* ippkt, size_t len, unsigned int direction, unsigned int nic_alias, unsigned int now);
+
+	// Flows of the logging filters from all workers
+	void flush(flush_container_shared& fc, unsigned int now);
+
+	void get_worker_stat(unsigned int index, capture_pipeline_stat& st) const;
+	void get_stat(capture_pipeline_stat& st) const;
+
+	// The busiest worker against the mean by packets, 1.0 is even
+	double get_imbalance() const;
+
+	static unsigned int get_flow_hash(const unsigned char* ippkt, size_t len);
+	static unsigned int get_worker_index(unsigned int hash, size_t workers) { return static_cast<unsigned int>((static_cast<uint64_t>(hash) * workers) >> 32); };
+
+private:
+	capture_pipeline(const capture_pipeline&);
+	capture_pipeline& operator=(const capture_pipeline&);
+
+	void run(unsigned int index);
+	void process_packet(worker& w, const unsigned char* pkt, size_t len, const pkt_additional_data& pkt_data);
+	void classify_flow(worker& w, const unsigned char* ippkt, size_t len, unsigned int now);
+	void merge(worker& w);
+
+	filterset& fs;
+	std::vector<filter2*> filters;
+	unsigned int header_need;
+	hosttable* host2ip;
+	dns_resolver* resolver;
+
+	std::vector<std::unique_ptr<worker> > workers;
+	std::atomic<bool> running;
+	boost::thread_group threads;
+
+#ifdef UTM_DEBUG
+public:
+	static void test_all();
+	static void benchmark();
+#endif
+};
+
+}
+
+#endif // _UTM_CAPTURE_PIPELINE_H
@@ -0,0 +1,981 @@
+#include "stdafx.h"
+#include "dns_resolver.h"
+
+#include <algorithm>
+#include <atomic>
+#include <cctype>
+#include <chrono>
+#include <sstream>
+
+#include <boost/bind.hpp>
+#include <boost/thread/once.hpp>
+
+#include <ubase_test.h>
+
+#define DNSRESOLVER_MAX_MESSAGE 1500
+#define DNSRESOLVER_MAX_JUMPS 16
+
+namespace utm {
+
+const char dns_resolver::this_class_name[] = "dns_resolver";
+
+struct dns_resolver::udp_query
+{
+	udp_query(boost::asio::io_service& ios) : strand(ios), socket(ios), timer(ios), id(0), is_finished(false) { };
+
+	request req;
+	boost::asio::io_service::strand strand;
+	boost::asio::ip::udp::socket socket;
+	boost::asio::deadline_timer timer;
+	boost::asio::ip::udp::endpoint sender;
+	unsigned short id;
+	std::string query;
+	unsigned char buffer[DNSRESOLVER_MAX_MESSAGE];
+	bool is_finished;
+};
+
+// Reads a name with the compression pointers, pos moves past the name in the record
+static bool dns_read_name(const unsigned char* data, size_t size, size_t& pos, std::string* name)
+{
+	size_t p = pos;
+	bool is_jumped = false;
+	unsigned int jumps = 0;
+
+	for (;;)
+	{
+		if (p >= size)
+			return false;
+
+		unsigned int len = data[p];
+		if ((len & 0xC0) == 0xC0)
+		{
+			if ((p + 1 >= size) || (++jumps > DNSRESOLVER_MAX_JUMPS))
+				return false;
+
+			if (!is_jumped)
+				pos = p + 2;
+
+			is_jumped = true;
+			p = ((len & 0x3F) << 8) | data[p + 1];
+			continue;
+		}
+
+		if ((len & 0xC0) != 0)
+			return false;
+
+		p++;
+		if (len == 0)
+			break;
+
+		if (p + len > size)
+			return false;
+
+		if (name != NULL)
+		{
+			if (!name->empty())
+				name->push_back('.');
+			name->append(reinterpret_cast<const char*>(data + p), len);
+		}
+		p += len;
+	}
+
+	if (!is_jumped)
+		pos = p;
+
+	return true;
+}
+
+static unsigned int dns_get16(const unsigned char* p)
+{
+	return (p[0] << 8) | p[1];
+}
+
+static unsigned int dns_get32(const unsigned char* p)
+{
+	return (static_cast<unsigned int>(p[0]) << 24) | (p[1] << 16) | (p[2] << 8) | p[3];
+}
+
+static dns_resolver* shared_resolver = NULL;
+static boost::once_flag shared_resolver_once = BOOST_ONCE_INIT;
+
+static void create_shared_resolver()
+{
+	// Lives until the process exits
+	shared_resolver = new dns_resolver();
+}
+
+static std::int64_t dns_resolver_steady_tick()
+{
+	return std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+dns_resolver::dns_resolver(unsigned int _max_parallel) :
+	work(new boost::asio::io_service::work(ios)),
+	max_parallel(_max_parallel == 0 ? 1 : _max_parallel), active(0), timeout_ms(DNSRESOLVER_DEFAULT_TIMEOUT),
+	min_ttl(DNSRESOLVER_MIN_TTL), max_ttl(DNSRESOLVER_MAX_TTL), server_port(DNSRESOLVER_PORT)
+{
+	get_current_tick = dns_resolver_steady_tick;
+
+	// The system lookups block their thread, one more thread serves the UDP queries
+	for (unsigned int i = 0; i <= max_parallel; i++)
+		threads.create_thread(boost::bind(&boost::asio::io_service::run, &ios));
+}
+
+dns_resolver::~dns_resolver()
+{
+	work.reset();
+	ios.stop();
+	threads.join_all();
+}
+
+dns_resolver& dns_resolver::shared()
+{
+	boost::call_once(shared_resolver_once, create_shared_resolver);
+	return *shared_resolver;
+}
+
+void dns_resolver::set_server(const addrip_v4& _server, unsigned short port)
+{
+	boost::mutex::scoped_lock lock(guard);
+	server = _server;
+	server_port = port;
+}
+
+void dns_resolver::set_ttl_limits(unsigned int min_seconds, unsigned int max_seconds)
+{
+	boost::mutex::scoped_lock lock(guard);
+	min_ttl = min_seconds;
+	max_ttl = (max_seconds < min_seconds) ? min_seconds : max_seconds;
+}
+
+std::string dns_resolver::make_reverse_name(const addrip_v4& addr)
+{
+	std::ostringstream s;
+	s << addr.get_octet4() << "." << addr.get_octet3() << "." << addr.get_octet2() << "." << addr.get_octet1() << ".in-addr.arpa";
+	return s.str();
+}
+
+bool dns_resolver::make_query(unsigned short id, unsigned int type, const std::string& name, std::string& query)
+{
+	static const unsigned char header[10] = { 0x01, 0x00, 0, 1, 0, 0, 0, 0, 0, 0 };
+
+	query.clear();
+	query.push_back(static_cast<char>(id >> 8));
+	query.push_back(static_cast<char>(id & 0xFF));
+	query.append(reinterpret_cast<const char*>(header), sizeof(header));
+
+	size_t start = 0;
+	while (start < name.size())
+	{
+		size_t end = name.find('.', start);
+		if (end == std::string::npos)
+			end = name.size();
+
+		size_t len = end - start;
+		if ((len == 0) || (len > 63))
+			return false;
+
+		query.push_back(static_cast<char>(len));
+		query.append(name, start, len);
+		start = end + 1;
+	}
+
+	if ((start == 0) || (query.size() > 12 + 254))
+		return false;
+
+	query.push_back(0);
+	query.push_back(static_cast<char>(type >> 8));
+	query.push_back(static_cast<char>(type & 0xFF));
+	query.push_back(0);
+	query.push_back(1);
+	return true;
+}
+
+bool dns_resolver::parse_response(const unsigned char* data, size_t size, unsigned short id, unsigned int type, const std::string& name, dns_result& result)
+{
+	if ((size < 12) || (dns_get16(data) != id) || ((data[2] & 0x80) == 0))
+		return false;
+
+	unsigned int rcode = data[3] & 0x0F;
+	unsigned int qdcount = dns_get16(data + 4);
+	unsigned int ancount = dns_get16(data + 6);
+	unsigned int nscount = dns_get16(data + 8);
+
+	// The question of the query comes back, the names are not case sensitive
+	if (qdcount != 1)
+		return false;
+
+	size_t pos = 12;
+	std::string qname;
+	if (!dns_read_name(data, size, pos, &qname) || (pos + 4 > size))
+		return false;
+
+	std::transform(qname.begin(), qname.end(), qname.begin(), ::tolower);
+	if ((qname != name) || (dns_get16(data + pos) != type) || (dns_get16(data + pos + 2) != 1))
+		return false;
+
+	pos += 4;
+
+	result = dns_result();
+	unsigned int answer_ttl = 0xFFFFFFFF;
+	unsigned int negative_ttl = DNSRESOLVER_NEGATIVE_TTL;
+
+	for (unsigned int i = 0; i < ancount + nscount; i++)
+	{
+		if (!dns_read_name(data, size, pos, NULL) || (pos + 10 > size))
+			return false;
+
+		unsigned int rtype = dns_get16(data + pos);
+		unsigned int rttl = dns_get32(data + pos + 4);
+		size_t rdlength = dns_get16(data + pos + 8);
+		size_t rdata = pos + 10;
+		pos = rdata + rdlength;
+		if (pos > size)
+			return false;
+
+		if (i >= ancount)
+		{
+			// The negative answer lives for the SOA minimum
+			size_t p = rdata;
+			if ((rtype == DNSRESOLVER_TYPE_SOA) && dns_read_name(data, size, p, NULL) && dns_read_name(data, size, p, NULL) && (p + 20 <= pos))
+				negative_ttl = std::min(rttl, dns_get32(data + p + 16));
+
+			continue;
+		}
+
+		if ((rtype == DNSRESOLVER_TYPE_A) && (type == DNSRESOLVER_TYPE_A) && (rdlength == 4))
+		{
+			result.addrs.insert(addrip_v4(static_cast<unsigned long>(dns_get32(data + rdata))));
+			answer_ttl = std::min(answer_ttl, rttl);
+		}
+		else if ((rtype == DNSRESOLVER_TYPE_PTR) && (type == DNSRESOLVER_TYPE_PTR) && result.hostname.empty())
+		{
+			size_t p = rdata;
+			if (dns_read_name(data, size, p, &result.hostname))
+				answer_ttl = std::min(answer_ttl, rttl);
+		}
+		else if (rtype == DNSRESOLVER_TYPE_CNAME)
+		{
+			answer_ttl = std::min(answer_ttl, rttl);
+		}
+	}
+
+	result.found = (rcode == 0) && (!result.addrs.empty() || !result.hostname.empty());
+	if (result.found)
+		result.ttl = answer_ttl;
+	else if ((rcode == 0) || (rcode == 3))
+		result.ttl = negative_ttl;
+
+	return true;
+}
+
+unsigned int dns_resolver::get_cache_ttl(const dns_result& result) const
+{
+	if (result.is_timeout)
+		return DNSRESOLVER_TIMEOUT_TTL;
+
+	return std::max(min_ttl, std::min(max_ttl, result.ttl));
+}
+
+void dns_resolver::async_resolve_host(const char* hostname, const dns_handler& handler)
+{
+	request req;
+	req.type = DNSRESOLVER_TYPE_A;
+	req.name.assign(hostname);
+	std::transform(req.name.begin(), req.name.end(), req.name.begin(), ::tolower);
+
+	// The answer has the name without the root
+	if (!req.name.empty() && (*req.name.rbegin() == '.'))
+		req.name.erase(req.name.size() - 1);
+
+	{
+		boost::mutex::scoped_lock lock(guard);
+		req.server = server;
+		req.port = server_port;
+	}
+
+	req.key = "A " + req.name + " " + req.server.to_string();
+	start_request(req, handler);
+}
+
+void dns_resolver::async_resolve_addr(const addrip_v4& addr, const addrip_v4& _server, const dns_handler& handler)
+{
+	request req;
+	req.type = DNSRESOLVER_TYPE_PTR;
+	req.name = make_reverse_name(addr);
+	req.addr = addr;
+	req.server = _server;
+	req.port = DNSRESOLVER_PORT;
+
+	// The server of the forward lookups if none is given
+	if (req.server.is_zero())
+	{
+		boost::mutex::scoped_lock lock(guard);
+		req.server = server;
+		req.port = server_port;
+	}
+
+	req.key = "PTR " + req.name + " " + req.server.to_string();
+	start_request(req, handler);
+}
+
+struct dns_resolver_wait
+{
+	dns_resolver_wait() : is_done(false) { };
+
+	void on_result(const dns_result& _result)
+	{
+		boost::mutex::scoped_lock lock(guard);
+		result = _result;
+		is_done = true;
+		cond.notify_all();
+	}
+
+	bool is_done;
+	dns_result result;
+	boost::mutex guard;
+	boost::condition_variable cond;
+};
+
+void dns_resolver::resolve_host(const char* hostname, dns_result& result)
+{
+	std::shared_ptr<dns_resolver_wait> w(new dns_resolver_wait());
+	async_resolve_host(hostname, boost::bind(&dns_resolver_wait::on_result, w, _1));
+
+	boost::mutex::scoped_lock lock(w->guard);
+	while (!w->is_done)
+		w->cond.wait(lock);
+
+	result = w->result;
+}
+
+size_t dns_resolver::cache_size() const
+{
+	boost::mutex::scoped_lock lock(guard);
+	return cache.size();
+}
+
+void dns_resolver::clear_cache()
+{
+	boost::mutex::scoped_lock lock(guard);
+
+	for (auto iter = cache.begin(); iter != cache.end(); )
+	{
+		if (iter->second.is_pending)
+			++iter;
+		else
+			iter = cache.erase(iter);
+	}
+}
+
+void dns_resolver::purge_expired()
+{
+	std::int64_t now = get_current_tick();
+
+	for (auto iter = cache.begin(); iter != cache.end(); )
+	{
+		if (!iter->second.is_pending && (iter->second.expires <= now))
+			iter = cache.erase(iter);
+		else
+			++iter;
+	}
+}
+
+void dns_resolver::start_request(const request& req, const dns_handler& handler)
+{
+	dns_result cached;
+	bool is_cached = false;
+
+	{
+		boost::mutex::scoped_lock lock(guard);
+
+		auto iter = cache.find(req.key);
+		if (iter != cache.end())
+		{
+			if (iter->second.is_pending)
+			{
+				iter->second.waiters.push_back(handler);
+				return;
+			}
+
+			if (iter->second.expires > get_current_tick())
+			{
+				cached = iter->second.result;
+				is_cached = true;
+			}
+		}
+
+		if (!is_cached)
+		{
+			cache_entry& entry = cache[req.key];
+			entry.is_pending = true;
+			entry.waiters.push_back(handler);
+			pending.push_back(req);
+		}
+	}
+
+	if (is_cached)
+	{
+		handler(cached);
+		return;
+	}
+
+	start_next();
+}
+
+void dns_resolver::start_next()
+{
+	std::vector<request> started;
+
+	{
+		boost::mutex::scoped_lock lock(guard);
+		while ((active < max_parallel) && !pending.empty())
+		{
+			started.push_back(pending.front());
+			pending.pop_front();
+			active++;
+		}
+	}
+
+	for (auto iter = started.begin(); iter != started.end(); ++iter)
+	{
+		if (iter->server.is_zero())
+			ios.post(boost::bind(&dns_resolver::system_lookup, this, *iter));
+		else
+			udp_lookup(*iter);
+	}
+}
+
+void dns_resolver::complete(const request& req, const dns_result& result)
+{
+	std::vector<dns_handler> waiters;
+
+	{
+		boost::mutex::scoped_lock lock(guard);
+
+		cache_entry& entry = cache[req.key];
+		entry.is_pending = false;
+		entry.result = result;
+		entry.expires = get_current_tick() + static_cast<std::int64_t>(get_cache_ttl(result)) * 1000;
+		waiters.swap(entry.waiters);
+		active--;
+
+		if (cache.size() > DNSRESOLVER_MAX_CACHE)
+			purge_expired();
+	}
+
+	start_next();
+
+	for (auto iter = waiters.begin(); iter != waiters.end(); ++iter)
+		(*iter)(result);
+}
+
+void dns_resolver::system_lookup(const request& req)
+{
+	dns_result result;
+	boost::system::error_code err;
+	boost::asio::ip::tcp::resolver resolver(ios);
+
+	if (req.type == DNSRESOLVER_TYPE_A)
+	{
+		boost::asio::ip::tcp::resolver::query query(req.name, "http");
+		boost::asio::ip::tcp::resolver::iterator iter = resolver.resolve(query, err);
+		for (; !err && (iter != boost::asio::ip::tcp::resolver::iterator()); ++iter)
+		{
+			boost::asio::ip::tcp::endpoint endpoint = *iter;
+			if (endpoint.address().is_v4())
+				result.addrs.insert(addrip_v4(endpoint.address().to_v4().to_ulong()));
+		}
+
+		result.found = !result.addrs.empty();
+	}
+	else
+	{
+		boost::asio::ip::tcp::endpoint endpoint(boost::asio::ip::address_v4(req.addr.m_addr), 0);
+		boost::asio::ip::tcp::resolver::iterator iter = resolver.resolve(endpoint, err);
+		if (!err && (iter != boost::asio::ip::tcp::resolver::iterator()))
+		{
+			// The system gives the address back if there is no name
+			std::string name = iter->host_name();
+			if (!name.empty() && (name != req.addr.to_string()))
+			{
+				result.hostname = name;
+				result.found = true;
+			}
+		}
+	}
+
+	result.ttl = result.found ? DNSRESOLVER_SYSTEM_TTL : DNSRESOLVER_NEGATIVE_TTL;
+	complete(req, result);
+}
+
+void dns_resolver::udp_lookup(const request& req)
+{
+	std::shared_ptr<udp_query> q(new udp_query(ios));
+	q->req = req;
+
+	{
+		boost::mutex::scoped_lock lock(guard);
+		q->id = static_cast<unsigned short>(id_source());
+	}
+
+	boost::system::error_code err;
+	if (!make_query(q->id, req.type, req.name, q->query) || q->socket.open(boost::asio::ip::udp::v4(), err))
+	{
+		complete(req, dns_result());
+		return;
+	}
+
+	boost::asio::ip::udp::endpoint endpoint(boost::asio::ip::address_v4(req.server.m_addr), req.port);
+
+	q->timer.expires_from_now(boost::posix_time::milliseconds(timeout_ms));
+	q->timer.async_wait(q->strand.wrap(boost::bind(&dns_resolver::on_udp_timeout, this, q, boost::asio::placeholders::error)));
+
+	q->socket.async_send_to(boost::asio::buffer(q->query), endpoint,
+		q->strand.wrap(boost::bind(&dns_resolver::on_udp_sent, this, q, boost::asio::placeholders::error)));
+}
+
+void dns_resolver::on_udp_sent(std::shared_ptr<udp_query> q, const boost::system::error_code& err)
+{
+	if (q->is_finished)
+		return;
+
+	if (err)
+	{
+		finish_udp(q, dns_result());
+		return;
+	}
+
+	q->socket.async_receive_from(boost::asio::buffer(q->buffer), q->sender,
+		q->strand.wrap(boost::bind(&dns_resolver::on_udp_received, this, q, boost::asio::placeholders::error, boost::asio::placeholders::bytes_transferred)));
+}
+
+void dns_resolver::on_udp_received(std::shared_ptr<udp_query> q, const boost::system::error_code& err, size_t size)
+{
+	if (q->is_finished)
+		return;
+
+	if (err)
+	{
+		finish_udp(q, dns_result());
+		return;
+	}
+
+	// Answers from other addresses, for other ids and questions are dropped
+	dns_result result;
+	if ((q->sender.address() == boost::asio::ip::address_v4(q->req.server.m_addr)) && parse_response(q->buffer, size, q->id, q->req.type, q->req.name, result))
+	{
+		finish_udp(q, result);
+		return;
+	}
+
+	q->socket.async_receive_from(boost::asio::buffer(q->buffer), q->sender,
+		q->strand.wrap(boost::bind(&dns_resolver::on_udp_received, this, q, boost::asio::placeholders::error, boost::asio::placeholders::bytes_transferred)));
+}
+
+void dns_resolver::on_udp_timeout(std::shared_ptr<udp_query> q, const boost::system::error_code& err)
+{
+	if (q->is_finished || (err == boost::asio::error::operation_aborted))
+		return;
+
+	dns_result result;
+	result.is_timeout = true;
+	finish_udp(q, result);
+}
+
+void dns_resolver::finish_udp(std::shared_ptr<udp_query> q, const dns_result& result)
+{
+	q->is_finished = true;
+
+	boost::system::error_code err;
+	q->timer.cancel(err);
+	q->socket.close(err);
+
+	complete(q->req, result);
+}
+
+dns_handler dns_batch::wrap(const dns_handler& handler)
+{
+	boost::mutex::scoped_lock lock(guard);
+	count++;
+	return boost::bind(&dns_batch::on_result, this, handler, _1);
+}
+
+void dns_batch::on_result(const dns_handler& handler, const dns_result& result)
+{
+	handler(result);
+
+	boost::mutex::scoped_lock lock(guard);
+	count--;
+	if (count == 0)
+		cond.notify_all();
+}
+
+void dns_batch::wait()
+{
+	boost::mutex::scoped_lock lock(guard);
+	while (count != 0)
+		cond.wait(lock);
+}
+
+#ifdef UTM_DEBUG
+//
+// DNS server on the loopback for the tests. It answers after a delay, so the requests overlap.
+//
+class dns_stub_server
+{
+	struct answer
+	{
+		unsigned int rcode;
+		unsigned int ttl;
+		std::vector<unsigned int> addrs;
+		std::string ptr;
+	};
+
+public:
+	dns_stub_server() : socket(ios, boost::asio::ip::udp::endpoint(boost::asio::ip::address_v4::loopback(), 0)),
+		queries(0), outstanding(0), max_outstanding(0)
+	{
+		receive();
+		thread = boost::thread(boost::bind(&boost::asio::io_service::run, &ios));
+	}
+
+	~dns_stub_server()
+	{
+		ios.stop();
+		thread.join();
+	}
+
+	unsigned short get_port() const { return socket.local_endpoint().port(); };
+
+	void add_host(const std::string& name, unsigned int addr, unsigned int ttl)
+	{
+		boost::mutex::scoped_lock lock(guard);
+		answer& a = answers[name];
+		a.rcode = 0;
+		a.ttl = ttl;
+		a.addrs.push_back(addr);
+	}
+
+	void add_ptr(const std::string& name, const std::string& ptr, unsigned int ttl)
+	{
+		boost::mutex::scoped_lock lock(guard);
+		answer& a = answers[name];
+		a.rcode = 0;
+		a.ttl = ttl;
+		a.ptr = ptr;
+	}
+
+	std::atomic<unsigned int> queries;
+	std::atomic<unsigned int> outstanding;
+	std::atomic<unsigned int> max_outstanding;
+
+private:
+	void receive()
+	{
+		socket.async_receive_from(boost::asio::buffer(buffer), sender,
+			boost::bind(&dns_stub_server::on_received, this, boost::asio::placeholders::error, boost::asio::placeholders::bytes_transferred));
+	}
+
+	void on_received(const boost::system::error_code& err, size_t size)
+	{
+		if (err)
+			return;
+
+		std::string name;
+		size_t pos = 12;
+		if ((size > 12) && dns_read_name(buffer, size, pos, &name) && (pos + 4 <= size) && (name != "timeout.test"))
+		{
+			queries++;
+			unsigned int n = ++outstanding;
+			if (n > max_outstanding)
+				max_outstanding = n;
+
+			std::shared_ptr<std::string> response(new std::string());
+			make_response(name, dns_get16(buffer + pos), pos + 4, *response);
+
+			std::shared_ptr<boost::asio::deadline_timer> timer(new boost::asio::deadline_timer(ios));
+			timer->expires_from_now(boost::posix_time::milliseconds(50));
+			timer->async_wait(boost::bind(&dns_stub_server::on_delay, this, timer, response, sender));
+		}
+
+		receive();
+	}
+
+	void on_delay(std::shared_ptr<boost::asio::deadline_timer>, std::shared_ptr<std::string> response, boost::asio::ip::udp::endpoint to)
+	{
+		outstanding--;
+
+		boost::system::error_code err;
+		socket.send_to(boost::asio::buffer(*response), to, 0, err);
+	}
+
+	static void put16(std::string& s, unsigned int value)
+	{
+		s.push_back(static_cast<char>(value >> 8));
+		s.push_back(static_cast<char>(value & 0xFF));
+	}
+
+	static void put32(std::string& s, unsigned int value)
+	{
+		put16(s, value >> 16);
+		put16(s, value & 0xFFFF);
+	}
+
+	void make_response(const std::string& name, unsigned int type, size_t question_size, std::string& response)
+	{
+		boost::mutex::scoped_lock lock(guard);
+
+		response.assign(reinterpret_cast<const char*>(buffer), question_size);
+		response[2] = static_cast<char>(0x81);
+
+		auto found = answers.find(name);
+		unsigned int ancount = 0;
+		if (found != answers.end())
+		{
+			if (type == DNSRESOLVER_TYPE_A)
+				ancount = static_cast<unsigned int>(found->second.addrs.size());
+			else if (!found->second.ptr.empty())
+				ancount = 1;
+		}
+
+		if (ancount == 0)
+		{
+			// NXDOMAIN with the SOA, the negative answer is cached for 30 seconds
+			response[3] = static_cast<char>(0x83);
+			response[9] = 1;
+			put16(response, 0xC00C);
+			put16(response, DNSRESOLVER_TYPE_SOA);
+			put16(response, 1);
+			put32(response, 3600);
+			put16(response, 22);
+			response.push_back(0);
+			response.push_back(0);
+			put32(response, 1);
+			put32(response, 3600);
+			put32(response, 600);
+			put32(response, 86400);
+			put32(response, 30);
+			return;
+		}
+
+		response[3] = static_cast<char>(0x80);
+		response[7] = static_cast<char>(ancount);
+		for (unsigned int i = 0; i < ancount; i++)
+		{
+			put16(response, 0xC00C);
+			put16(response, type);
+			put16(response, 1);
+			put32(response, found->second.ttl);
+
+			if (type == DNSRESOLVER_TYPE_A)
+			{
+				put16(response, 4);
+				put32(response, found->second.addrs[i]);
+				continue;
+			}
+
+			std::string rdata;
+			dns_resolver::make_query(0, 0, found->second.ptr, rdata);
+			rdata = rdata.substr(12, rdata.size() - 12 - 4);
+			put16(response, static_cast<unsigned int>(rdata.size()));
+			response.append(rdata);
+		}
+	}
+
+	boost::asio::io_service ios;
+	boost::asio::ip::udp::socket socket;
+	boost::asio::ip::udp::endpoint sender;
+	unsigned char buffer[DNSRESOLVER_MAX_MESSAGE];
+	boost::thread thread;
+
+	std::map<std::string, answer> answers;
+	boost::mutex guard;
+};
+
+void dns_resolver::test_all()
+{
+	test_report tr(this_class_name);
+
+	dns_stub_server stub;
+	stub.add_host("a.test", addrip_v4("10.0.0.1").m_addr, 120);
+	stub.add_host("a.test", addrip_v4("10.0.0.2").m_addr, 120);
+	stub.add_host("b.test", addrip_v4("10.0.0.3").m_addr, 600);
+	stub.add_ptr("1.0.0.10.in-addr.arpa", "host1.test", 300);
+
+	std::atomic<std::int64_t> fake_tick(1000);
+
+	dns_resolver resolver(4);
+	resolver.get_current_tick = [&fake_tick]() { return fake_tick.load(); };
+	resolver.set_server(addrip_v4("127.0.0.1"), stub.get_port());
+	resolver.set_timeout(200);
+
+	{
+		// Forward lookup with the TTL of the answer
+		test_case::classname.assign(this_class_name);
+		test_case::testcase_num = 1;
+
+		dns_result result;
+		resolver.resolve_host("A.test", result);
+		TEST_CASE_CHECK(true, result.found);
+		TEST_CASE_CHECK(size_t(2), result.addrs.size());
+		TEST_CASE_CHECK(std::string("10.0.0.1"), result.addrs.begin()->to_string());
+		TEST_CASE_CHECK(120u, result.ttl);
+		TEST_CASE_CHECK(1u, stub.queries.load());
+	}
+
+	{
+		// The answer is cached until the TTL is over
+		test_case::testcase_num = 2;
+
+		dns_result result;
+		resolver.resolve_host("a.test", result);
+		TEST_CASE_CHECK(true, result.found);
+		TEST_CASE_CHECK(1u, stub.queries.load());
+
+		fake_tick += 121 * 1000;
+		resolver.resolve_host("a.test", result);
+		TEST_CASE_CHECK(true, result.found);
+		TEST_CASE_CHECK(2u, stub.queries.load());
+	}
+
+	{
+		// Requests for the same name share the query
+		test_case::testcase_num = 3;
+
+		std::atomic<unsigned int> found(0);
+		dns_batch batch;
+		for (int i = 0; i < 5; i++)
+			resolver.async_resolve_host("b.test", batch.wrap([&found](const dns_result& result) { if (result.found) found++; }));
+		batch.wait();
+
+		TEST_CASE_CHECK(5u, found.load());
+		TEST_CASE_CHECK(3u, stub.queries.load());
+	}
+
+	{
+		// Negative answers live for the SOA minimum
+		test_case::testcase_num = 4;
+
+		dns_result result;
+		resolver.resolve_host("nx.test", result);
+		TEST_CASE_CHECK(false, result.found);
+		TEST_CASE_CHECK(false, result.is_timeout);
+		TEST_CASE_CHECK(30u, result.ttl);
+		TEST_CASE_CHECK(4u, stub.queries.load());
+
+		resolver.resolve_host("nx.test", result);
+		TEST_CASE_CHECK(4u, stub.queries.load());
+
+		fake_tick += 31 * 1000;
+		resolver.resolve_host("nx.test", result);
+		TEST_CASE_CHECK(5u, stub.queries.load());
+	}
+
+	{
+		// Reverse lookups through the default server
+		test_case::testcase_num = 5;
+
+		dns_result result;
+		bool is_called = false;
+		dns_batch batch;
+		resolver.async_resolve_addr(addrip_v4("10.0.0.1"), addrip_v4(), batch.wrap([&result, &is_called](const dns_result& r) { result = r; is_called = true; }));
+		batch.wait();
+
+		TEST_CASE_CHECK(true, is_called);
+		TEST_CASE_CHECK(true, result.found);
+		TEST_CASE_CHECK(std::string("host1.test"), result.hostname);
+		TEST_CASE_CHECK(300u, result.ttl);
+	}
+
+	{
+		// No answer
+		test_case::testcase_num = 6;
+
+		dns_result result;
+		resolver.resolve_host("timeout.test", result);
+		TEST_CASE_CHECK(false, result.found);
+		TEST_CASE_CHECK(true, result.is_timeout);
+	}
+
+	{
+		// No more queries than max_parallel at once
+		test_case::testcase_num = 7;
+
+		stub.max_outstanding = 0;
+
+		dns_resolver resolver2(2);
+		resolver2.set_server(addrip_v4("127.0.0.1"), stub.get_port());
+
+		std::atomic<unsigned int> found(0);
+		dns_batch batch;
+		for (int i = 0; i < 8; i++)
+		{
+			std::ostringstream name;
+			name << "p" << i << ".test";
+			stub.add_host(name.str(), 0x0A000100 + i, 60);
+			resolver2.async_resolve_host(name.str().c_str(), batch.wrap([&found](const dns_result& result) { if (result.found) found++; }));
+		}
+		batch.wait();
+
+		TEST_CASE_CHECK(8u, found.load());
+		TEST_CASE_CHECK(true, stub.max_outstanding.load() <= 2);
+		TEST_CASE_CHECK(size_t(8), resolver2.cache_size());
+	}
+
+	{
+		// The system resolver without a server
+		test_case::testcase_num = 8;
+
+		dns_resolver resolver3(2);
+		dns_result result;
+		resolver3.resolve_host("localhost", result);
+		TEST_CASE_CHECK(true, result.found);
+		TEST_CASE_CHECK(true, result.addrs.find(addrip_v4("127.0.0.1")) != result.addrs.end());
+		TEST_CASE_CHECK((unsigned int)DNSRESOLVER_SYSTEM_TTL, result.ttl);
+	}
+
+	{
+		// Bad names and replies
+		test_case::testcase_num = 9;
+
+		std::string query;
+		TEST_CASE_CHECK(false, make_query(1, DNSRESOLVER_TYPE_A, "", query));
+		TEST_CASE_CHECK(false, make_query(1, DNSRESOLVER_TYPE_A, "a..test", query));
+		TEST_CASE_CHECK(true, make_query(0x1234, DNSRESOLVER_TYPE_A, "a.test", query));
+
+		dns_result result;
+		const unsigned char* data = reinterpret_cast<const unsigned char*>(query.data());
+		TEST_CASE_CHECK(false, parse_response(data, query.size(), 0x1234, DNSRESOLVER_TYPE_A, "a.test", result));
+
+		// The answer is taken for the question of the query only
+		std::string answer;
+		TEST_CASE_CHECK(true, make_query(0x1234, DNSRESOLVER_TYPE_A, "A.Test", answer));
+		answer[2] = static_cast<char>(0x81);
+		answer[3] = static_cast<char>(0x80);
+		answer[7] = 1;
+		answer.append("\xC0\x0C\x00\x01\x00\x01\x00\x00\x00\x3C\x00\x04\x0A\x00\x00\x01", 16);
+		data = reinterpret_cast<const unsigned char*>(answer.data());
+		TEST_CASE_CHECK(true, parse_response(data, answer.size(), 0x1234, DNSRESOLVER_TYPE_A, "a.test", result));
+		TEST_CASE_CHECK(true, result.found);
+		TEST_CASE_CHECK(60u, result.ttl);
+		TEST_CASE_CHECK(false, parse_response(data, answer.size(), 0x1234, DNSRESOLVER_TYPE_A, "b.test", result));
+		TEST_CASE_CHECK(false, parse_response(data, answer.size(), 0x1234, DNSRESOLVER_TYPE_PTR, "a.test", result));
+		TEST_CASE_CHECK(false, parse_response(data, answer.size(), 0x4321, DNSRESOLVER_TYPE_A, "a.test", result));
+
+		// A pointer loop
+		std::string reply(query);
+		reply[2] = static_cast<char>(0x81);
+		reply[7] = 1;
+		reply.append("\xC0\x0C\x00\x01", 4);
+		reply[12] = static_cast<char>(0xC0);
+		reply[13] = 12;
+		data = reinterpret_cast<const unsigned char*>(reply.data());
+		TEST_CASE_CHECK(false, parse_response(data, reply.size(), 0x1234, DNSRESOLVER_TYPE_A, "a.test", result));
+	}
+
+	return;
+}
+#endif
+
+}
@@ -0,0 +1,183 @@
+#ifndef _UTM_DNS_RESOLVER_H
+#define _UTM_DNS_RESOLVER_H
+
+#pragma once
+#include <utm.h>
+
+#include <addrip_v4.h>
+
+#include <deque>
+#include <map>
+#include <memory>
+#include <random>
+#include <string>
+#include <vector>
+
+#include <boost/asio.hpp>
+#include <boost/function.hpp>
+#include <boost/thread.hpp>
+#include <boost/thread/condition_variable.hpp>
+#include <boost/thread/mutex.hpp>
+
+#include "hostresolver.h"
+
+#define DNSRESOLVER_PORT 53
+#define DNSRESOLVER_DEFAULT_PARALLEL 16
+#define DNSRESOLVER_DEFAULT_TIMEOUT 1000		// milliseconds
+
+#define DNSRESOLVER_MIN_TTL 5					// seconds
+#define DNSRESOLVER_MAX_TTL 86400
+#define DNSRESOLVER_SYSTEM_TTL 300				// the system resolver gives no TTL
+#define DNSRESOLVER_NEGATIVE_TTL 60				// no SOA in a negative answer
+#define DNSRESOLVER_TIMEOUT_TTL 5
+
+#define DNSRESOLVER_MAX_CACHE 65536
+
+#define DNSRESOLVER_TYPE_A 1
+#define DNSRESOLVER_TYPE_CNAME 5
+#define DNSRESOLVER_TYPE_SOA 6
+#define DNSRESOLVER_TYPE_PTR 12
+
+namespace utm {
+
+struct dns_result
+{
+	dns_result() : found(false), is_timeout(false), ttl(0) { };
+
+	bool found;
+	bool is_timeout;
+	unsigned int ttl;							// seconds, as given by the server
+	hostresolver_result_container addrs;		// forward lookup
+	std::string hostname;						// reverse lookup
+};
+
+typedef boost::function<void (const dns_result& result)> dns_handler;
+
+//
+// Shared asynchronous resolver for the host rules and the monitor. Answers are cached for
+// their TTL, negative answers for the SOA minimum, and requests for a name which is being
+// resolved wait for the same query.
+//
+// Queries go to the DNS server over UDP, or to the system resolver if no server is given.
+// At most max_parallel queries are sent at once, the others wait in the queue. Handlers are
+// called on the resolver threads, or at once by the caller if the answer is in the cache.
+//
+class dns_resolver
+{
+	struct cache_entry
+	{
+		cache_entry() : is_pending(false), expires(0) { };
+
+		bool is_pending;
+		std::int64_t expires;					// get_current_tick() milliseconds
+		dns_result result;
+		std::vector<dns_handler> waiters;
+	};
+
+	struct request
+	{
+		std::string key;
+		unsigned int type;
+		std::string name;						// the name or the in-addr.arpa name
+		addrip_v4 addr;
+		addrip_v4 server;
+		unsigned short port;
+	};
+
+	struct udp_query;
+
+public:
+	static const char this_class_name[];
+
+	dns_resolver(unsigned int max_parallel = DNSRESOLVER_DEFAULT_PARALLEL);
+	~dns_resolver();
+
+	// The resolver for all users of the process
+	static dns_resolver& shared();
+
+	// The server for the forward lookups, zero means the system resolver
+	void set_server(const addrip_v4& server, unsigned short port = DNSRESOLVER_PORT);
+	void set_timeout(unsigned int milliseconds) { timeout_ms = milliseconds; };
+	void set_ttl_limits(unsigned int min_seconds, unsigned int max_seconds);
+
+	void async_resolve_host(const char* hostname, const dns_handler& handler);
+	void async_resolve_addr(const addrip_v4& addr, const addrip_v4& server, const dns_handler& handler);
+
+	// Waits for the answer
+	void resolve_host(const char* hostname, dns_result& result);
+
+	size_t cache_size() const;
+	void clear_cache();
+
+	// Milliseconds of a monotonic clock, replaced by the tests
+	boost::function<std::int64_t ()> get_current_tick;
+
+	static bool make_query(unsigned short id, unsigned int type, const std::string& name, std::string& query);
+	// The answer must have the id and the question of the query
+	static bool parse_response(const unsigned char* data, size_t size, unsigned short id, unsigned int type, const std::string& name, dns_result& result);
+	static std::string make_reverse_name(const addrip_v4& addr);
+
+private:
+	dns_resolver(const dns_resolver&);
+	dns_resolver& operator=(const dns_resolver&);
+
+	void start_request(const request& req, const dns_handler& handler);
+	void start_next();
+	void system_lookup(const request& req);
+	void udp_lookup(const request& req);
+	void on_udp_sent(std::shared_ptr<udp_query> q, const boost::system::error_code& err);
+	void on_udp_received(std::shared_ptr<udp_query> q, const boost::system::error_code& err, size_t size);
+	void on_udp_timeout(std::shared_ptr<udp_query> q, const boost::system::error_code& err);
+	void finish_udp(std::shared_ptr<udp_query> q, const dns_result& result);
+	void complete(const request& req, const dns_result& result);
+	void purge_expired();
+
+	unsigned int get_cache_ttl(const dns_result& result) const;
+
+	boost::asio::io_service ios;
+	std::unique_ptr<boost::asio::io_service::work> work;
+	boost::thread_group threads;
+
+	unsigned int max_parallel;
+	unsigned int active;
+	unsigned int timeout_ms;
+	unsigned int min_ttl;
+	unsigned int max_ttl;
+	std::random_device id_source;				// the ids of the queries are not guessed by the others on the path
+
+	addrip_v4 server;
+	unsigned short server_port;
+
+	std::map<std::string, cache_entry> cache;
+	std::deque<request> pending;
+
+	mutable boost::mutex guard;
+
+#ifdef UTM_DEBUG
+public:
+	static void test_all();
+#endif
+};
+
+//
+// Waits for a group of requests, the handlers given by wrap() must all be called
+//
+class dns_batch
+{
+public:
+	dns_batch() : count(0) { };
+
+	dns_handler wrap(const dns_handler& handler);
+	void wait();
+
+private:
+	void on_result(const dns_handler& handler, const dns_result& result);
+
+	unsigned int count;
+	boost::mutex guard;
+	boost::condition_variable cond;
+};
+
+}
+
+#endif // _UTM_DNS_RESOLVER_H
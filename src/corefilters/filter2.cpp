@@ -37,6 +37,25 @@ void filter2::reset_filter_counters(bool reset_history)
 	cnt_recv.reset(reset_history);
 }
 
+void filter2::rule_add(const rule& r)
+{
+	filter::rule_add(r);
+	classifier.reset();
+}
+
+void filter2::rules_clear()
+{
+	filter::rules_clear();
+	classifier.reset();
+}
+
+void filter2::compile_rules(addrtablemap_v4* mat, std::shared_ptr<const addrgroup_index> groups)
+{
+	std::shared_ptr<rule_classifier> rc(new rule_classifier());
+	rc->compile(rules.items, mat, groups);
+	classifier = rc;
+}
+
 bool filter2::reset_on_schedule(const standard_timeset& stimeset, bool reset_history)
 {
 	utimestamp tss(unsigned int(0));
@@ -193,33 +212,170 @@ void filter2::match_filter(const match_filter_input& data, match_filter_result&
 	match_filter(data, result);
 }
 
+bool filter2::is_enabled_at(const tm* lt) const
+{
+	if (m_bDisable)
+		return false;
+
+	// Check for Work Hours for the filter
+	unsigned int bit = 1;
+	bit = bit << lt->tm_hour;
+
+	int week_day = (lt->tm_wday <= 0) ? 6 : (lt->tm_wday - 1);
+	if ((m_nWorkHours[week_day] & bit) == 0)
+		return false;
+
+	// Check for Work Days for the filter
+
+	unsigned int current_day = (lt->tm_year + 1900)*10000 + (lt->tm_mon + 1)*100 + lt->tm_mday;
+	if ((m_nStartDay > current_day) || (m_nEndDay < current_day))
+		return false;
+
+	return true;
+}
+
 void filter2::match_filter(const match_filter_input& data, match_filter_result& result)
 {
-    if (m_bDisable)
+	if (!is_enabled_at(data.lt))
 		return;
 
+	int res;
+	const rule_classifier* rc = classifier.get();
+
+	if (rc != NULL)
+	{
+		rule_candidates cand;
+		rc->lookup(*data.ip, cand);
+		res = match_rules_compiled(*rc, cand, NULL, data, result);
+	}
+	else
 	{
-		// Check for Work Hours for the filter
-		unsigned int bit = 1;
-		bit = bit << data.lt->tm_hour;
+		res = match_rules(data, result);
+	}
 
-		int week_day = (data.lt->tm_wday <= 0) ? 6 : (data.lt->tm_wday - 1);
-		if ((m_nWorkHours[week_day] & bit) == 0)
-			return;
+	if ((res == FILTER_RULE_MATCHED) && m_bBlocked)
+	{
+		result.action = ACTION_DENY;
+	}
+}
+
+void filter2::apply_match(const rule& r, int rule_no, int curdir, const match_filter_input& data, match_filter_result& result)
+{
+	if ((apply_rule_match(r, rule_no, curdir, data, result) == FILTER_RULE_MATCHED) && m_bBlocked)
+	{
+		result.action = ACTION_DENY;
+	}
+}
 
-		// Check for Work Days for the filter
+void filter2::match_filter_compiled(const match_filter_input& data, match_filter_result& result, const rule_classifier& rc, rule_candidates& cand, const unsigned char* rule_enabled)
+{
+	if ((rule_enabled == NULL) && !is_enabled_at(data.lt))
+		return;
 
-		unsigned int current_day = (data.lt->tm_year + 1900)*10000 + (data.lt->tm_mon + 1)*100 + data.lt->tm_mday;
-		if ((m_nStartDay > current_day) || (m_nEndDay < current_day))
-			return;
+	if ((match_rules_compiled(rc, cand, rule_enabled, data, result) == FILTER_RULE_MATCHED) && m_bBlocked)
+	{
+		result.action = ACTION_DENY;
 	}
+}
 
-	bool filter_match = false;
+int filter2::match_rules(const match_filter_input& data, match_filter_result& result)
+{
 	int rule_number = 1;
+	utm::addrtablemaprec<utm::addrtable_v4> *src_at, *dst_at;
 
-//	addrtablemaprec_v4 *src_at, *dst_at;
+	for (auto iter = rules.items.begin(); iter != rules.items.end(); ++iter)
+	{
+		const rule& r = *iter;
+
+		if (!rule_classifier::is_gate_passed(r, data.bWithNat, data.nNicAlias))
+			continue;
+
+		if (rule_classifier::is_volatile_rule(r))
+			result.is_volatile = true;
+
+		resolve_addrtables(r, data.mat, src_at, dst_at);
+
+		int curdir = match_rule(r, src_at, dst_at, -1, -1, data);
+		if (curdir >= 0)
+			return apply_rule_match(r, rule_number, curdir, data, result);
+
+		rule_number++;
+	};
+
+	return FILTER_RULE_NOTMATCHED;
+}
+
+int filter2::match_rules_compiled(const rule_classifier& rc, rule_candidates& cand, const unsigned char* rule_enabled, const match_filter_input& data, match_filter_result& result)
+{
 	utm::addrtablemaprec<utm::addrtable_v4> *src_at, *dst_at;
+	utm::ip_header* ip = data.ip;
+
+	int gate = rule_classifier::get_gate_class(data.bWithNat, data.nNicAlias);
+	bool same_mat = (data.mat == rc.get_mat());
+	bool same_groups = same_mat && (data.addrgroups != NULL) && (data.addrgroups == rc.get_addrgroups());
+
+	// Candidates come in the rule order, so the first match is the same as in match_rules()
+	unsigned int idx;
+	while (cand.next(idx))
+	{
+		const compiled_rule& cr = rc.at(idx);
+
+		if (cr.rule_no[gate] == 0)
+			continue;
+
+		if (!cr.is_port_possible(ip->src_port, ip->dst_port))
+			continue;
+
+		if ((rule_enabled != NULL) && !rule_enabled[idx])
+			continue;
 
+		if (cr.is_volatile)
+			result.is_volatile = true;
+
+		int curdir;
+		if (cr.kernel != NULL)
+		{
+			curdir = cr.kernel(cr, data);
+		}
+		else
+		{
+			if (same_mat && cr.at_resolved)
+			{
+				src_at = cr.src_at;
+				dst_at = cr.dst_at;
+			}
+			else
+			{
+				resolve_addrtables(cr.r, data.mat, src_at, dst_at);
+			}
+
+			curdir = match_rule(cr.r, src_at, dst_at, same_groups ? cr.src_grp_bit : -1, same_groups ? cr.dst_grp_bit : -1, data);
+		}
+
+		if (curdir >= 0)
+			return apply_rule_match(cr.r, cr.rule_no[gate], curdir, data, result);
+	};
+
+	return FILTER_RULE_NOTMATCHED;
+}
+
+void filter2::resolve_addrtables(const rule& r, addrtablemap_v4* mat, addrtablemaprec<addrtable_v4>*& src_at, addrtablemaprec<addrtable_v4>*& dst_at)
+{
+	src_at = NULL;
+	dst_at = NULL;
+
+	if (mat == NULL)
+		return;
+
+	if ((r.src_type == RULE_ADDRGRP) || (r.src_type == RULE_ADDRGRP_NO))
+		src_at = mat->findptr_by_id(r.src_atkey);
+
+	if ((r.dst_type == RULE_ADDRGRP) || (r.dst_type == RULE_ADDRGRP_NO))
+		dst_at = mat->findptr_by_id(r.dst_atkey);
+}
+
+int filter2::match_rule(const rule& r, addrtablemaprec<addrtable_v4>* src_at, addrtablemaprec<addrtable_v4>* dst_at, int src_grp_bit, int dst_grp_bit, const match_filter_input& data) const
+{
 	unsigned char *psrc_mac, *pdst_mac;
 	unsigned int src_ip, dst_ip;
 	utm::addrip_v4 addr_src_ip, addr_dst_ip;
@@ -231,817 +387,788 @@ void filter2::match_filter(const match_filter_input& data, match_filter_result&
 	__int64 lim;
 
 	utm::ip_header* ip = data.ip;
-	utm::addrip_v4 a;
 
 	const unsigned char* cond_mac_data;
-	unsigned int isrc_ip, isrc_mask, idst_ip, idst_mask;
-	utm::rule* prule;
+	const utm::rule* prule = &r;
 
-	rule_container::iterator iter;
-	for (iter = rules.items.begin(); iter != rules.items.end(); ++iter)
-	{
-        prule = &(*iter);
+	unsigned int isrc_ip = prule->src_ip.m_addr;
+	unsigned int isrc_mask = prule->src_mask.m_addr;
+	unsigned int idst_ip = prule->dst_ip.m_addr;
+	unsigned int idst_mask = prule->dst_mask.m_addr;
 
-		isrc_ip = prule->src_ip.m_addr;
-		isrc_mask = prule->src_mask.m_addr;
-		idst_ip = prule->dst_ip.m_addr;
-		idst_mask = prule->dst_mask.m_addr;
+	is_ftp_data_match = false;
+	is_spi_match = false;
 
-		if ((prule->natuse == NATUSE_YES) && (data.bWithNat == false))
-			continue;
+	for (curdir = 0; curdir < 2; curdir++)
+	{
+		//  is_match -      
+		//   is_match  false,       .
 
-		if ((prule->natuse == NATUSE_NO) && (data.bWithNat == true))
-			continue;
+		is_match = true;
 
-		if ((prule->nicalias == NICALIAS_PUBLIC) || (prule->nicalias == NICALIAS_PRIVATE) || (prule->nicalias == NICALIAS_NETFLOW))
+		if (curdir == DIRECTION_FORWARD)
 		{
-			if (prule->nicalias != data.nNicAlias)
-				continue;
+			psrc_mac = &ip->src_mac[0];
+			pdst_mac = &ip->dst_mac[0];
+			src_ip = ip->src_ip_addr.m_addr;
+			dst_ip = ip->dst_ip_addr.m_addr;
+			src_port = ip->src_port;
+			dst_port = ip->dst_port;
 		};
 
-		src_at = NULL;
-		dst_at = NULL;
-
-		if (data.mat != NULL)
+		if (curdir == DIRECTION_BACKWARD)
 		{
-
-			if ((prule->src_type == RULE_ADDRGRP) || (prule->src_type == RULE_ADDRGRP_NO))
-			{
-				src_at = data.mat->findptr_by_id(prule->src_atkey);
-//				src_at_prule = data.mat->addrtables.find(prule->src_atkey);
-//				if (src_at_prule != data.mat->addrtables.end())
-//					src_at_found = true;
-			};
-
-			if ((prule->dst_type == RULE_ADDRGRP) || (prule->dst_type == RULE_ADDRGRP_NO))
+			if ((prule->mirrored == DIRECTION_ONEWAY) || (prule->pkt_options & PKTOPT_TCPSYN) || (prule->pkt_options & PKTOPT_ICMPECHOREQUEST))
 			{
-				dst_at = data.mat->findptr_by_id(prule->dst_atkey);
-//				dst_at_prule = data.mat->addrtables.find(prule->dst_atkey);
-//				if (dst_at_prule != data.mat->addrtables.end())
-//					dst_at_found = true;
+				curdir++;
+				break;
 			};
-		}
 
-		is_ftp_data_match = false;
-		is_spi_match = false;
+			psrc_mac = &ip->dst_mac[0];
+			pdst_mac = &ip->src_mac[0];
+			src_ip = ip->dst_ip_addr.m_addr;
+			dst_ip = ip->src_ip_addr.m_addr;
+			src_port = ip->dst_port;
+			dst_port = ip->src_port;
+		};
 
-		for (curdir = 0; curdir < 2; curdir++)
-		{
-			//  is_match -      
-			//   is_match  false,       .
+		addr_src_ip.m_addr = src_ip;
+		addr_dst_ip.m_addr = dst_ip;
 
-			is_match = true;
+		// Check for data channel in FTP protocol
 
-			if (curdir == DIRECTION_FORWARD)
+		if ((prule->proto == 6) && (prule->dst_port == 21) && (prule->pkt_options & PKTOPT_FTP))
+		{
+			if ((src_port != 21) && (dst_port != 21))
 			{
-				psrc_mac = &ip->src_mac[0];
-				pdst_mac = &ip->dst_mac[0];
-				src_ip = ip->src_ip_addr.m_addr;
-				dst_ip = ip->dst_ip_addr.m_addr;
-				src_port = ip->src_port;
-				dst_port = ip->dst_port;
-			};
+/*
+				StateStor sis;
 
-			if (curdir == DIRECTION_BACKWARD)
-			{
-				if ((prule->mirrored == DIRECTION_ONEWAY) || (prule->pkt_options & PKTOPT_TCPSYN) || (prule->pkt_options & PKTOPT_ICMPECHOREQUEST))
+				sis.src_ip = src_ip;
+				sis.src_port = src_port;
+				sis.dst_ip = dst_ip;
+				sis.dst_port = dst_port;
+				sis.proto = 6;
+				sis.type = STATE_STOR_TYPE_FTP;
+
+				if ((*prule).SsFindPkt(&sis, data.nUptime, tcp_flags))
 				{
-					curdir++;
+					is_ftp_data_match = true;
 					break;
 				};
-
-				psrc_mac = &ip->dst_mac[0];
-				pdst_mac = &ip->src_mac[0];
-				src_ip = ip->dst_ip_addr.m_addr;
-				dst_ip = ip->src_ip_addr.m_addr;
-				src_port = ip->dst_port;
-				dst_port = ip->src_port;
-			};
-
-			addr_src_ip.m_addr = src_ip;
-			addr_dst_ip.m_addr = dst_ip;
-
-			// Check for data channel in FTP protocol
-
-			if ((prule->proto == 6) && (prule->dst_port == 21) && (prule->pkt_options & PKTOPT_FTP))
-			{
-				if ((src_port != 21) && (dst_port != 21))
-				{
-/*
-					StateStor sis;
-
-					sis.src_ip = src_ip;
-					sis.src_port = src_port;
-					sis.dst_ip = dst_ip;
-					sis.dst_port = dst_port;
-					sis.proto = 6;
-					sis.type = STATE_STOR_TYPE_FTP;
-
-					if ((*prule).SsFindPkt(&sis, data.nUptime, tcp_flags))
-					{
-						is_ftp_data_match = true;
-						break;
-					};
 */
-				};
 			};
+		};
 
-			if ((prule->proto == 6) && (prule->src_port == 21) && (prule->pkt_options & PKTOPT_FTP))
+		if ((prule->proto == 6) && (prule->src_port == 21) && (prule->pkt_options & PKTOPT_FTP))
+		{
+			if ((src_port != 21) && (dst_port != 21))
 			{
-				if ((src_port != 21) && (dst_port != 21))
-				{
 /*
-					StateStor sis;
+				StateStor sis;
 
-					sis.src_ip = src_ip;
-					sis.src_port = src_port;
-					sis.dst_ip = dst_ip;
-					sis.dst_port = dst_port;
-					sis.proto = 6;
-					sis.type = STATE_STOR_TYPE_FTP;
+				sis.src_ip = src_ip;
+				sis.src_port = src_port;
+				sis.dst_ip = dst_ip;
+				sis.dst_port = dst_port;
+				sis.proto = 6;
+				sis.type = STATE_STOR_TYPE_FTP;
 
-					if ((*prule).SsFindPkt(&sis, data.nUptime, tcp_flags))
-					{
-						is_ftp_data_match = true;
-						break;
-					};
-*/
+				if ((*prule).SsFindPkt(&sis, data.nUptime, tcp_flags))
+				{
+					is_ftp_data_match = true;
+					break;
 				};
+*/
 			};
+		};
 
-			if (curdir == DIRECTION_BACKWARD)
+		if (curdir == DIRECTION_BACKWARD)
+		{
+			if (prule->mirrored & DIRECTION_STATEFUL)
 			{
-				if (prule->mirrored & DIRECTION_STATEFUL)
-				{
 /*
-					StateStor sis;
+				StateStor sis;
 
-					sis.src_ip = src_ip;
-					sis.src_port = src_port;
-					sis.dst_ip = dst_ip;
-					sis.dst_port = dst_port;
+				sis.src_ip = src_ip;
+				sis.src_port = src_port;
+				sis.dst_ip = dst_ip;
+				sis.dst_port = dst_port;
 
-					sis.proto = ip->proto;
-					sis.type = STATE_STOR_TYPE_NORMAL;
+				sis.proto = ip->proto;
+				sis.type = STATE_STOR_TYPE_NORMAL;
 
-					if ((*prule).SsFindPkt(&sis, data.nUptime, tcp_flags))
-					{
-						is_spi_match = true;
-					}
-					else
-					{
-						// Packet is not matched in the current rule
+				if ((*prule).SsFindPkt(&sis, data.nUptime, tcp_flags))
+				{
+					is_spi_match = true;
+				}
+				else
+				{
+					// Packet is not matched in the current rule
 
-						curdir++;
-					};
+					curdir++;
+				};
 
-					break;
+				break;
 */
-				};
 			};
+		};
 
-			//   
-
-			switch (prule->src_type)
-			{
-				case RULE_MYIP:
-					is_match = (curdir == DIRECTION_FORWARD) ? (data.nPreCheckAddrTables & CHECKADDR_MYPC_SRC) != 0 : (data.nPreCheckAddrTables & CHECKADDR_MYPC_DST) != 0;
-					break;
-
-				case RULE_IP:
-					is_match = (src_ip & isrc_mask) == (isrc_ip & isrc_mask);
-					break;
-
-				case RULE_RANGE:
-					is_match = (src_ip >= isrc_ip) && (src_ip <= isrc_mask);
-					break;
-
-				case RULE_LAN:
-					is_match = (curdir == DIRECTION_FORWARD) ? (data.nPreCheckAddrTables & CHECKADDR_LAT_SRC) != 0 : (data.nPreCheckAddrTables & CHECKADDR_LAT_DST) != 0;
-					break;
-
-				case RULE_WAN:
-					is_match = (curdir == DIRECTION_FORWARD) ? (data.nPreCheckAddrTables & CHECKADDR_LAT_SRC) == 0 : (data.nPreCheckAddrTables & CHECKADDR_LAT_DST) == 0;
-					break;
-
-				case RULE_MAC:
-					is_match = prule->src_mac.is_equal(psrc_mac);
-					break;
-
-				case RULE_HOST:
-					is_match = (data.host2ip == NULL) ? false : data.host2ip->checkaddr(prule->src_host, addr_src_ip);
-					break;
+		//   
 
-				case RULE_ADDRGRP:
+		switch (prule->src_type)
+		{
+			case RULE_MYIP:
+				is_match = (curdir == DIRECTION_FORWARD) ? (data.nPreCheckAddrTables & CHECKADDR_MYPC_SRC) != 0 : (data.nPreCheckAddrTables & CHECKADDR_MYPC_DST) != 0;
+				break;
+
+			case RULE_IP:
+				is_match = (src_ip & isrc_mask) == (isrc_ip & isrc_mask);
+				break;
+
+			case RULE_RANGE:
+				is_match = (src_ip >= isrc_ip) && (src_ip <= isrc_mask);
+				break;
+
+			case RULE_LAN:
+				is_match = (curdir == DIRECTION_FORWARD) ? (data.nPreCheckAddrTables & CHECKADDR_LAT_SRC) != 0 : (data.nPreCheckAddrTables & CHECKADDR_LAT_DST) != 0;
+				break;
+
+			case RULE_WAN:
+				is_match = (curdir == DIRECTION_FORWARD) ? (data.nPreCheckAddrTables & CHECKADDR_LAT_SRC) == 0 : (data.nPreCheckAddrTables & CHECKADDR_LAT_DST) == 0;
+				break;
+
+			case RULE_MAC:
+				is_match = prule->src_mac.is_equal(psrc_mac);
+				break;
+
+			case RULE_HOST:
+				is_match = (data.host2ip == NULL) ? false : (data.host2ip->checkflow(prule->src_host, data.flow_host_id, data.flow_server, addr_src_ip) || data.host2ip->checkaddr(prule->src_host, addr_src_ip));
+				break;
+
+			case RULE_ADDRGRP:
+				if (src_grp_bit >= 0)
+					is_match = addrgroup_index::test_bit((curdir == DIRECTION_FORWARD) ? data.pSrcAddrGroups : data.pDstAddrGroups, src_grp_bit);
+				else
 					is_match = (src_at == NULL) ? false : src_at->addrtable.CheckAddrRange(addr_src_ip);
-					break;
+				break;
 
-				case RULE_ADDRGRP_NO:
+			case RULE_ADDRGRP_NO:
+				if (src_grp_bit >= 0)
+					is_match = !addrgroup_index::test_bit((curdir == DIRECTION_FORWARD) ? data.pSrcAddrGroups : data.pDstAddrGroups, src_grp_bit);
+				else
 					is_match = (src_at == NULL) ? false : !(src_at->addrtable.CheckAddrRange(addr_src_ip));
-					break;
+				break;
 
-				case RULE_INCOMING:
-					is_match = data.nPacketDirection == PACKET_DIRECTION_INCOMING;
-					break;
+			case RULE_INCOMING:
+				is_match = data.nPacketDirection == PACKET_DIRECTION_INCOMING;
+				break;
 
-				case RULE_OUTGOING:
-					is_match = data.nPacketDirection != PACKET_DIRECTION_OUTGOING;
-					break;
+			case RULE_OUTGOING:
+				is_match = data.nPacketDirection != PACKET_DIRECTION_OUTGOING;
+				break;
 
-				case RULE_USER:
-					is_match = data.user_conn->check_user_and_ip(prule->src_uid, addr_src_ip, data.uptime);
+			case RULE_USER:
+				is_match = data.user_conn->check_user_and_ip(prule->src_uid, addr_src_ip, data.uptime);
                     break;
 
-				case RULE_USER_ANY:
-					is_match = data.user_conn->check_for_any_ip(addr_src_ip, data.uptime);
-					break;
+			case RULE_USER_ANY:
+				is_match = data.user_conn->check_for_any_ip(addr_src_ip, data.uptime);
+				break;
 
-				case RULE_PROCNAME:
+			case RULE_PROCNAME:
 
-					if (curdir == DIRECTION_FORWARD)
-					{
-						if (data.dwProcNickIdSrc == 0)
-							is_match = false;
-						else
-							is_match = !(data.dwProcNickIdSrc != prule->src_procnick);
-					}
+				if (curdir == DIRECTION_FORWARD)
+				{
+					if (data.dwProcNickIdSrc == 0)
+						is_match = false;
 					else
-					{
-						if (data.dwProcNickIdDst == 0)
-							is_match = false;
-						else
-							is_match = !(data.dwProcNickIdDst != prule->src_procnick);
-					}
-					break;
+						is_match = !(data.dwProcNickIdSrc != prule->src_procnick);
+				}
+				else
+				{
+					if (data.dwProcNickIdDst == 0)
+						is_match = false;
+					else
+						is_match = !(data.dwProcNickIdDst != prule->src_procnick);
+				}
+				break;
 
-				case RULE_PROCUSER:
+			case RULE_PROCUSER:
 
-					if (curdir == DIRECTION_FORWARD)
+				if (curdir == DIRECTION_FORWARD)
+				{
+					if (data.uidSrc == 0)
+						is_match = false;
+					else
 					{
-						if (data.uidSrc == 0)
-							is_match = false;
-						else
-						{
-							is_match = !(data.uidSrc != prule->src_uid);
-						}
+						is_match = !(data.uidSrc != prule->src_uid);
 					}
+				}
+				else
+				{
+					if (data.uidDst == 0)
+						is_match = false;
 					else
 					{
-						if (data.uidDst == 0)
-							is_match = false;
-						else
-						{
-							is_match = !(data.uidDst != prule->src_uid);
-						}
+						is_match = !(data.uidDst != prule->src_uid);
 					}
-					break;
+				}
+				break;
 
-				default:
-					is_match = false;
-					break;
-			};
-
-			if (!is_match)
-				continue;			// check backward direction or exit
-
-			//   
-
-			switch (prule->dst_type)
-			{
-				case RULE_MYIP:
-					is_match = (curdir == DIRECTION_FORWARD) ? (data.nPreCheckAddrTables & CHECKADDR_MYPC_DST) != 0 : (data.nPreCheckAddrTables & CHECKADDR_MYPC_SRC) != 0;
-					break;
-
-				case RULE_IP:
-					is_match = (dst_ip & idst_mask) == (idst_ip & idst_mask);
-					break;
-
-				case RULE_RANGE:
-					is_match = (dst_ip >= idst_ip) && (dst_ip <= idst_mask);
-					break;
-
-				case RULE_LAN:
-					is_match = (curdir == DIRECTION_FORWARD) ? (data.nPreCheckAddrTables & CHECKADDR_LAT_DST) != 0 : (data.nPreCheckAddrTables & CHECKADDR_LAT_SRC) != 0;
-					break;
+			default:
+				is_match = false;
+				break;
+		};
 
-				case RULE_WAN:
-					is_match = (curdir == DIRECTION_FORWARD) ? (data.nPreCheckAddrTables & CHECKADDR_LAT_DST) == 0 : (data.nPreCheckAddrTables & CHECKADDR_LAT_SRC) == 0;
-					break;
+		if (!is_match)
+			continue;			// check backward direction or exit
 
-				case RULE_MAC:
-					is_match = prule->dst_mac.is_equal(pdst_mac);
-					break;
+		//   
 
-				case RULE_HOST:
-					is_match = (data.host2ip == NULL) ? false : data.host2ip->checkaddr(prule->dst_host, addr_dst_ip);
-					break;
-
-				case RULE_ADDRGRP:
+		switch (prule->dst_type)
+		{
+			case RULE_MYIP:
+				is_match = (curdir == DIRECTION_FORWARD) ? (data.nPreCheckAddrTables & CHECKADDR_MYPC_DST) != 0 : (data.nPreCheckAddrTables & CHECKADDR_MYPC_SRC) != 0;
+				break;
+
+			case RULE_IP:
+				is_match = (dst_ip & idst_mask) == (idst_ip & idst_mask);
+				break;
+
+			case RULE_RANGE:
+				is_match = (dst_ip >= idst_ip) && (dst_ip <= idst_mask);
+				break;
+
+			case RULE_LAN:
+				is_match = (curdir == DIRECTION_FORWARD) ? (data.nPreCheckAddrTables & CHECKADDR_LAT_DST) != 0 : (data.nPreCheckAddrTables & CHECKADDR_LAT_SRC) != 0;
+				break;
+
+			case RULE_WAN:
+				is_match = (curdir == DIRECTION_FORWARD) ? (data.nPreCheckAddrTables & CHECKADDR_LAT_DST) == 0 : (data.nPreCheckAddrTables & CHECKADDR_LAT_SRC) == 0;
+				break;
+
+			case RULE_MAC:
+				is_match = prule->dst_mac.is_equal(pdst_mac);
+				break;
+
+			case RULE_HOST:
+				is_match = (data.host2ip == NULL) ? false : (data.host2ip->checkflow(prule->dst_host, data.flow_host_id, data.flow_server, addr_dst_ip) || data.host2ip->checkaddr(prule->dst_host, addr_dst_ip));
+				break;
+
+			case RULE_ADDRGRP:
+				if (dst_grp_bit >= 0)
+					is_match = addrgroup_index::test_bit((curdir == DIRECTION_FORWARD) ? data.pDstAddrGroups : data.pSrcAddrGroups, dst_grp_bit);
+				else
 					is_match = (dst_at == NULL) ? false : dst_at->addrtable.CheckAddrRange(addr_dst_ip);
-					break;
+				break;
 
-				case RULE_ADDRGRP_NO:
+			case RULE_ADDRGRP_NO:
+				if (dst_grp_bit >= 0)
+					is_match = !addrgroup_index::test_bit((curdir == DIRECTION_FORWARD) ? data.pDstAddrGroups : data.pSrcAddrGroups, dst_grp_bit);
+				else
 					is_match = (dst_at == NULL) ? false : !(dst_at->addrtable.CheckAddrRange(addr_dst_ip));
-					break;
+				break;
 
-				case RULE_INCOMING:
-					is_match = !(data.nPacketDirection != PACKET_DIRECTION_INCOMING);
-					break;
+			case RULE_INCOMING:
+				is_match = !(data.nPacketDirection != PACKET_DIRECTION_INCOMING);
+				break;
 
-				case RULE_OUTGOING:
-					is_match = !(data.nPacketDirection != PACKET_DIRECTION_OUTGOING);
-					break;
+			case RULE_OUTGOING:
+				is_match = !(data.nPacketDirection != PACKET_DIRECTION_OUTGOING);
+				break;
 
                 case RULE_USER:
-					is_match = data.user_conn->check_user_and_ip(prule->dst_uid, addr_dst_ip, data.uptime);
+				is_match = data.user_conn->check_user_and_ip(prule->dst_uid, addr_dst_ip, data.uptime);
                     break;
 
-				case RULE_USER_ANY:
-					is_match = data.user_conn->check_for_any_ip(addr_dst_ip, data.uptime);
-					break;
+			case RULE_USER_ANY:
+				is_match = data.user_conn->check_for_any_ip(addr_dst_ip, data.uptime);
+				break;
 
-				case RULE_PROCNAME:
-					if (curdir == DIRECTION_FORWARD)
-					{
-						if (data.dwProcNickIdDst == 0)
-							is_match = false;
-						else
-							is_match = !(data.dwProcNickIdDst != prule->dst_procnick);
-					}
+			case RULE_PROCNAME:
+				if (curdir == DIRECTION_FORWARD)
+				{
+					if (data.dwProcNickIdDst == 0)
+						is_match = false;
 					else
-					{
-						if (data.dwProcNickIdSrc == 0)
-							is_match = false;
-						else
-							is_match = !(data.dwProcNickIdSrc != prule->dst_procnick);
-					}
-					break;
+						is_match = !(data.dwProcNickIdDst != prule->dst_procnick);
+				}
+				else
+				{
+					if (data.dwProcNickIdSrc == 0)
+						is_match = false;
+					else
+						is_match = !(data.dwProcNickIdSrc != prule->dst_procnick);
+				}
+				break;
 
-				case RULE_PROCUSER:
-					if (curdir == DIRECTION_FORWARD)
-					{
-						if (data.uidDst == 0)
-							is_match = false;
-						else
-							is_match = !(data.uidDst != prule->dst_uid);
-					}
+			case RULE_PROCUSER:
+				if (curdir == DIRECTION_FORWARD)
+				{
+					if (data.uidDst == 0)
+						is_match = false;
 					else
-					{
-						if (data.uidSrc == 0)
-							is_match = false;
-						else
-							is_match = !(data.uidSrc != prule->dst_uid);
-					}
-					break;
+						is_match = !(data.uidDst != prule->dst_uid);
+				}
+				else
+				{
+					if (data.uidSrc == 0)
+						is_match = false;
+					else
+						is_match = !(data.uidSrc != prule->dst_uid);
+				}
+				break;
+
+			
+			default:
+				is_match = false;
+				break;
+		};
 
-				
-				default:
-					is_match = false;
-					break;
-			};
+		if (!is_match)
+			continue;			// check backward direction or exit
 
-			if (!is_match)
-				continue;			// check backward direction or exit
+		// IP-   ,     
+		if ((prule->proto > 0))
+		{
+			// ,      
+			//      
+			
+			if (prule->proto != ip->proto)
+				continue;
 
-			// IP-   ,     
-			if ((prule->proto > 0))
+			if ((ip->proto == 6) || (ip->proto == 17))
 			{
-				// ,      
-				//      
-				
-				if (prule->proto != ip->proto)
-					continue;
+				// We will check ports for TCP and UDP protocol types
 
-				if ((ip->proto == 6) || (ip->proto == 17))
+				switch(prule->src_port_type)
 				{
-					// We will check ports for TCP and UDP protocol types
-
-					switch(prule->src_port_type)
-					{
-						case PORT_ANY:	
-									break;
+					case PORT_ANY:	
+								break;
 
-						case PORT_EQUAL:
-									is_match = (prule->src_port) == src_port;
-									break;
+					case PORT_EQUAL:
+								is_match = (prule->src_port) == src_port;
+								break;
 
-						case PORT_GREATER:
-									is_match = src_port > (prule->src_port);
-									break;
+					case PORT_GREATER:
+								is_match = src_port > (prule->src_port);
+								break;
 
-						case PORT_LESS:
-									is_match = src_port < (prule->src_port);
-									break;
+					case PORT_LESS:
+								is_match = src_port < (prule->src_port);
+								break;
 
-						case PORT_NOTEQUAL:
-									is_match = src_port != (prule->src_port);
-									break;
+					case PORT_NOTEQUAL:
+								is_match = src_port != (prule->src_port);
+								break;
 
-						case PORT_BETWEEN:
-									is_match = (src_port >= (prule->src_port)) && (src_port <= (prule->src_port_to));
-									break;
+					case PORT_BETWEEN:
+								is_match = (src_port >= (prule->src_port)) && (src_port <= (prule->src_port_to));
+								break;
 
-						case PORT_NOTBETWEEN:
-									is_match = (src_port <= (prule->src_port)) || (src_port >= (prule->src_port_to));
-									break;
+					case PORT_NOTBETWEEN:
+								is_match = (src_port <= (prule->src_port)) || (src_port >= (prule->src_port_to));
+								break;
 
-						case PORT_EQUAL_OR:
-									is_match = (src_port == (prule->src_port)) || (src_port == (prule->src_port_to));
-									break;
-					};
+					case PORT_EQUAL_OR:
+								is_match = (src_port == (prule->src_port)) || (src_port == (prule->src_port_to));
+								break;
+				};
 
-					switch(prule->dst_port_type)
-					{
-						case PORT_ANY:	
-									break;
+				switch(prule->dst_port_type)
+				{
+					case PORT_ANY:	
+								break;
 
-						case PORT_EQUAL:
-									is_match = (prule->dst_port) == dst_port;
-									break;
+					case PORT_EQUAL:
+								is_match = (prule->dst_port) == dst_port;
+								break;
 
-						case PORT_GREATER:
-									is_match = dst_port > (prule->dst_port);
-									break;
+					case PORT_GREATER:
+								is_match = dst_port > (prule->dst_port);
+								break;
 
-						case PORT_LESS:
-									is_match = dst_port < (prule->dst_port);
-									break;
+					case PORT_LESS:
+								is_match = dst_port < (prule->dst_port);
+								break;
 
-						case PORT_NOTEQUAL:
-									is_match = dst_port != (prule->dst_port);
-									break;
+					case PORT_NOTEQUAL:
+								is_match = dst_port != (prule->dst_port);
+								break;
 
-						case PORT_BETWEEN:
-									is_match = (dst_port >= (prule->dst_port)) && (dst_port<=(prule->dst_port_to));
-									break;
+					case PORT_BETWEEN:
+								is_match = (dst_port >= (prule->dst_port)) && (dst_port<=(prule->dst_port_to));
+								break;
 
-						case PORT_NOTBETWEEN:
-									is_match = (dst_port <= (prule->dst_port)) || (dst_port >= (prule->dst_port_to));
-									break;
+					case PORT_NOTBETWEEN:
+								is_match = (dst_port <= (prule->dst_port)) || (dst_port >= (prule->dst_port_to));
+								break;
 
-						case PORT_EQUAL_OR:
-									is_match = (dst_port == (prule->dst_port)) || (dst_port == (prule->dst_port_to));
-									break;
-					};
+					case PORT_EQUAL_OR:
+								is_match = (dst_port == (prule->dst_port)) || (dst_port == (prule->dst_port_to));
+								break;
 				};
 			};
+		};
 
-			if (!is_match)
-				continue;
+		if (!is_match)
+			continue;
 
-			// Pkt options (ICMP)
+		// Pkt options (ICMP)
 
-			if (ip->proto == 1)
+		if (ip->proto == 1)
+		{
+			if ((prule->pkt_options & PKTOPT_ICMPECHOREQUEST) && (curdir == DIRECTION_FORWARD))
 			{
-				if ((prule->pkt_options & PKTOPT_ICMPECHOREQUEST) && (curdir == DIRECTION_FORWARD))
-				{
-					is_match = ((ip->flags & 0x0800) == 0x0800);
-				};
-
-				if ((prule->pkt_options & PKTOPT_ICMPTTLEXCEEDED) && (curdir == DIRECTION_FORWARD))
-				{
-					is_match = ((ip->flags & 0x0b00) == 0x0b00);
-				};
+				is_match = ((ip->flags & 0x0800) == 0x0800);
 			};
 
-			// Pkt options (TCP)
-
-			if ((prule->pkt_options & PKTOPT_TCPSYN) && (ip->proto == 6))
+			if ((prule->pkt_options & PKTOPT_ICMPTTLEXCEEDED) && (curdir == DIRECTION_FORWARD))
 			{
-				if (curdir == DIRECTION_FORWARD)
-				{
-					is_match = (0x0002 & ip->flags) && ((0x0010 & ip->flags) == 0);
-				};
+				is_match = ((ip->flags & 0x0b00) == 0x0b00);
 			};
+		};
 
-			if (!is_match)
-				continue;
-
-			// Condition
+		// Pkt options (TCP)
 
-			rule_lim = prule->condition_limit;
-			lim = (data.mbytes)*rule_lim;
-	
-			switch (prule->condition_type)
+		if ((prule->pkt_options & PKTOPT_TCPSYN) && (ip->proto == 6))
+		{
+			if (curdir == DIRECTION_FORWARD)
 			{
-				case COND_SENT_LESS:
-								is_match = cnt_sent.get_cnt() < lim;
-								break;
-
-				case COND_SENT_GREATER:
-								is_match = cnt_sent.get_cnt() > lim;
-								break;
-
-				case COND_RECV_LESS:
-								is_match = cnt_recv.get_cnt() < lim;
-								break;
-
-				case COND_RECV_GREATER:
-								is_match = cnt_recv.get_cnt() > lim;
-								break;
-
-				case COND_SENT_OR_RECV_LESS:
-								is_match = (cnt_sent.get_cnt() < lim) || (cnt_recv.get_cnt() < lim);
-								break;
-
-				case COND_SENT_OR_RECV_GREATER:
-								is_match = (cnt_sent.get_cnt() > lim) || (cnt_recv.get_cnt() > lim);
-								break;
+				is_match = (0x0002 & ip->flags) && ((0x0010 & ip->flags) == 0);
+			};
+		};
 
-				case COND_SENT_AND_RECV_LESS:
-								is_match = (cnt_sent.get_cnt() < lim) && (cnt_recv.get_cnt() < lim);
-								break;
+		if (!is_match)
+			continue;
 
-				case COND_SENT_AND_RECV_GREATER:
-								is_match = (cnt_sent.get_cnt() > lim) && (cnt_recv.get_cnt() > lim);
-								break;
+		// Condition
 
-				case COND_SENT_PLUS_RECV_LESS:
-								is_match = (cnt_sent.get_cnt() + cnt_recv.get_cnt()) < lim;
-								break;
+		rule_lim = prule->condition_limit;
+		lim = (data.mbytes)*rule_lim;
 
-				case COND_SENT_PLUS_RECV_GREATER:
-								is_match = (cnt_sent.get_cnt() + cnt_recv.get_cnt()) > lim;
-								break;
-			};
+		switch (prule->condition_type)
+		{
+			case COND_SENT_LESS:
+							is_match = cnt_sent.get_cnt() < lim;
+							break;
 
-			if (!is_match)
-				continue;
+			case COND_SENT_GREATER:
+							is_match = cnt_sent.get_cnt() > lim;
+							break;
 
-			// Check day of week
+			case COND_RECV_LESS:
+							is_match = cnt_recv.get_cnt() < lim;
+							break;
 
-			switch(data.lt->tm_wday)
-			{
-				case 1:		is_match = (prule->wday & WDAY_MON) != 0;
+			case COND_RECV_GREATER:
+							is_match = cnt_recv.get_cnt() > lim;
 							break;
 
-				case 2:		is_match = (prule->wday & WDAY_TUE) != 0;
+			case COND_SENT_OR_RECV_LESS:
+							is_match = (cnt_sent.get_cnt() < lim) || (cnt_recv.get_cnt() < lim);
 							break;
 
-				case 3:		is_match = (prule->wday & WDAY_WED) != 0;
+			case COND_SENT_OR_RECV_GREATER:
+							is_match = (cnt_sent.get_cnt() > lim) || (cnt_recv.get_cnt() > lim);
 							break;
 
-				case 4:		is_match = (prule->wday & WDAY_THU) != 0;
+			case COND_SENT_AND_RECV_LESS:
+							is_match = (cnt_sent.get_cnt() < lim) && (cnt_recv.get_cnt() < lim);
 							break;
 
-				case 5:		is_match = (prule->wday & WDAY_FRI) != 0;
+			case COND_SENT_AND_RECV_GREATER:
+							is_match = (cnt_sent.get_cnt() > lim) && (cnt_recv.get_cnt() > lim);
 							break;
 
-				case 6:		is_match = (prule->wday & WDAY_SAT) != 0;
+			case COND_SENT_PLUS_RECV_LESS:
+							is_match = (cnt_sent.get_cnt() + cnt_recv.get_cnt()) < lim;
 							break;
 
-				case 0:		is_match = (prule->wday & WDAY_SUN) != 0;
+			case COND_SENT_PLUS_RECV_GREATER:
+							is_match = (cnt_sent.get_cnt() + cnt_recv.get_cnt()) > lim;
 							break;
-			};
+		};
 
-			if (!is_match)
-				continue;
+		if (!is_match)
+			continue;
 
-			if ((data.lt->tm_hour) < prule->time_from)
-				continue;
+		// Check day of week
 
-			if ((data.lt->tm_hour) > prule->time_to)
-				continue;
+		switch(data.lt->tm_wday)
+		{
+			case 1:		is_match = (prule->wday & WDAY_MON) != 0;
+						break;
+
+			case 2:		is_match = (prule->wday & WDAY_TUE) != 0;
+						break;
 
-			// Condition MAC
+			case 3:		is_match = (prule->wday & WDAY_WED) != 0;
+						break;
 
-			cond_mac_data = prule->cond_mac_data.get();
-			switch (prule->cond_mac_type)
-			{
-				case COND_MAC_SRC_EQUAL:
-							if (data.nNicAlias == NICALIAS_NETFLOW)
-							{
-								is_match = memcmp(psrc_mac + 2, &cond_mac_data[2], 4) == 0;
-							}
-							else
-							{
-								is_match = memcmp(psrc_mac, &cond_mac_data[0], 6) == 0;
-							}
-							break;
+			case 4:		is_match = (prule->wday & WDAY_THU) != 0;
+						break;
 
-				case COND_MAC_SRC_NOTEQUAL:
-							is_match = !(memcmp(psrc_mac, &cond_mac_data[0], 6) == 0);
-							break;
+			case 5:		is_match = (prule->wday & WDAY_FRI) != 0;
+						break;
 
-				case COND_MAC_DST_EQUAL:
-							if (data.nNicAlias == NICALIAS_NETFLOW)
-							{
-								is_match = memcmp(pdst_mac + 2, &cond_mac_data[2], 4) == 0;
-							}
-							else
-							{
-								is_match = memcmp(pdst_mac, &cond_mac_data[0], 6) == 0;
-							}
-							break;
+			case 6:		is_match = (prule->wday & WDAY_SAT) != 0;
+						break;
 
-				case COND_MAC_DST_NOTEQUAL:
-							is_match = !(memcmp(pdst_mac, &cond_mac_data[0], 6) == 0);
-							break;
+			case 0:		is_match = (prule->wday & WDAY_SUN) != 0;
+						break;
+		};
 
-				default:
-							break;
-			};
+		if (!is_match)
+			continue;
 
-			if (!is_match)
-				continue;
+		if ((data.lt->tm_hour) < prule->time_from)
+			continue;
 
-			switch (prule->prevfilter_type)
-			{
-				case PREVFILTER_NOTMATCHED:
-							is_match = (data.nPrevFilter == 0);
-							break;
+		if ((data.lt->tm_hour) > prule->time_to)
+			continue;
 
-				case PREVFILTER_MATCHED:
-							is_match = (data.nPrevFilter == 1);
-							break;
+		// Condition MAC
 
-				default:
-							break;
-			};
+		cond_mac_data = prule->cond_mac_data.get();
+		switch (prule->cond_mac_type)
+		{
+			case COND_MAC_SRC_EQUAL:
+						if (data.nNicAlias == NICALIAS_NETFLOW)
+						{
+							is_match = memcmp(psrc_mac + 2, &cond_mac_data[2], 4) == 0;
+						}
+						else
+						{
+							is_match = memcmp(psrc_mac, &cond_mac_data[0], 6) == 0;
+						}
+						break;
 
-			if (!is_match)
-				continue;
+			case COND_MAC_SRC_NOTEQUAL:
+						is_match = !(memcmp(psrc_mac, &cond_mac_data[0], 6) == 0);
+						break;
+
+			case COND_MAC_DST_EQUAL:
+						if (data.nNicAlias == NICALIAS_NETFLOW)
+						{
+							is_match = memcmp(pdst_mac + 2, &cond_mac_data[2], 4) == 0;
+						}
+						else
+						{
+							is_match = memcmp(pdst_mac, &cond_mac_data[0], 6) == 0;
+						}
+						break;
 
-			break;				// This will be a match
+			case COND_MAC_DST_NOTEQUAL:
+						is_match = !(memcmp(pdst_mac, &cond_mac_data[0], 6) == 0);
+						break;
+
+			default:
+						break;
 		};
 
-		//
-		// Match !!!!!
-		//
+		if (!is_match)
+			continue;
 
-		if ((curdir == DIRECTION_FORWARD) || (curdir == DIRECTION_BACKWARD))
+		switch (prule->prevfilter_type)
+		{
+			case PREVFILTER_NOTMATCHED:
+						is_match = (data.nPrevFilter == 0);
+						break;
+
+			case PREVFILTER_MATCHED:
+						is_match = (data.nPrevFilter == 1);
+						break;
+
+			default:
+						break;
+		};
+
+		if (!is_match)
+			continue;
+
+		break;				// This will be a match
+	};
+
+	if ((curdir == DIRECTION_FORWARD) || (curdir == DIRECTION_BACKWARD))
+		return curdir;
+
+	return -1;
+}
+
+int filter2::apply_rule_match(const rule& r, int rule_number, int curdir, const match_filter_input& data, match_filter_result& result)
+{
+	//
+	// Match !!!!!
+	//
+
+	utm::ip_header* ip = data.ip;
+	const utm::rule* prule = &r;
+	bool is_ftp_data_match = false;
+
+	if (!is_ftp_data_match)
+	{
+		if ((prule->mirrored & DIRECTION_STATEFUL) && (curdir == DIRECTION_FORWARD))
 		{
-			if (!is_ftp_data_match)
-			{
-				if ((prule->mirrored & DIRECTION_STATEFUL) && (curdir == DIRECTION_FORWARD))
-				{
 /*
-					StateStor sis;
+			StateStor sis;
 
-					sis.src_ip = ip->src_ip;
-					sis.dst_ip = ip->dst_ip;
-					sis.src_port = ip->src_port;
-					sis.dst_port = ip->dst_port;
+			sis.src_ip = ip->src_ip;
+			sis.dst_ip = ip->dst_ip;
+			sis.src_port = ip->src_port;
+			sis.dst_port = ip->dst_port;
 
-					sis.proto = ip->proto;
-					sis.type = STATE_STOR_TYPE_NORMAL;
+			sis.proto = ip->proto;
+			sis.type = STATE_STOR_TYPE_NORMAL;
 
-					(*prule).SsPutPkt(&sis, data.nUptime, tcp_flags);
+			(*prule).SsPutPkt(&sis, data.nUptime, tcp_flags);
 */
-				};
+		};
+	};
+
+	result.filter_match_result = true;
+	result.direction = curdir;
+	result.action = prule->action;
+	result.rule_no = rule_number;
+	result.filter_id = m_id;
+	result.filter_ptr = this;
+	result.rule_ptr = prule;
+	result.is_rwrfwd = (prule->rwr_fwd > 0);
+		
+	// match - update corresponding counter
+
+	if (data.nModifyCounter == MODIFY_COUNTER_NO)
+	{
+		if ((prule->action == ACTION_COUNT) || (prule->action == ACTION_COUNTPASS))
+		{
+			// Modify counters
+
+			if ((m_nTrafficLimitAction == TRAFFICLIMIT_BLOCK) && (is_traffic_limit_exceeded(data.mbytes)))
+			{
+				result.action = ACTION_DENY;
+				result.is_limit_exceeded = true;
+				return FILTER_RULE_LIMIT;
 			};
+		};
+	};
 
-			filter_match = true;
-			result.filter_match_result = true;
-			result.direction = curdir;
-			result.action = prule->action;
-			result.rule_no = rule_number;
-			result.filter_id = m_id;
-			result.filter_ptr = this;
-			result.is_rwrfwd = (prule->rwr_fwd > 0);
-				
-			// match - update corresponding counter
-
-			if (data.nModifyCounter == MODIFY_COUNTER_NO)
+	if (data.nModifyCounter == MODIFY_COUNTER_YES)
+	{
+		// If rule action is about to change counters...
+
+		if ((prule->action == ACTION_COUNT) || (prule->action == ACTION_COUNTPASS))
+		{
+			// Modify counters
+
+			if (curdir == DIRECTION_FORWARD)
 			{
-				if ((prule->action == ACTION_COUNT) || (prule->action == ACTION_COUNTPASS))
+				if (!m_bRevers)
 				{
-					// Modify counters
-
-					if ((m_nTrafficLimitAction == TRAFFICLIMIT_BLOCK) && (is_traffic_limit_exceeded(data.mbytes)))
-					{
-						result.action = ACTION_DENY;
-						result.is_limit_exceeded = true;
-						return;
-					};
+					cnt_sent.add_cnt(ip->length);
+				}
+				else
+				{
+					__int64 ip_length = ip->length;
+					cnt_sent.add_cnt(-ip_length);
 				};
-			};
-
-			if (data.nModifyCounter == MODIFY_COUNTER_YES)
+			}
+			else
 			{
-				// If rule action is about to change counters...
-
-				if ((prule->action == ACTION_COUNT) || (prule->action == ACTION_COUNTPASS))
+				if (!m_bRevers)
 				{
-					// Modify counters
-
-					if (curdir == DIRECTION_FORWARD)
-					{
-						if (!m_bRevers)
-						{
-							cnt_sent.add_cnt(ip->length);
-						}
-						else
-						{
-							__int64 ip_length = ip->length;
-							cnt_sent.add_cnt(-ip_length);
-						};
-					}
-					else
-					{
-						if (!m_bRevers)
-						{
-							cnt_recv.add_cnt(ip->length);
-						}
-						else
-						{
-							__int64 ip_length = ip->length;
-							cnt_recv.add_cnt(-ip_length);
-						}
-					};
+					cnt_recv.add_cnt(ip->length);
+				}
+				else
+				{
+					__int64 ip_length = ip->length;
+					cnt_recv.add_cnt(-ip_length);
+				}
+			};
 
-					// Put packet into Packet collector
+			// Put packet into Packet collector
 
 /* TODO
-					if (m_nPktLogDest != LOGPKT_DISABLED)
-					{
-						if (m_bInitDone == false)
-							InitCollector();
+			if (m_nPktLogDest != LOGPKT_DISABLED)
+			{
+				if (m_bInitDone == false)
+					InitCollector();
 
-						PutPacket(ip, curdir);
-					};
+				PutPacket(ip, curdir);
+			};
 */
-					if (m_nTrafficLimitAction == TRAFFICLIMIT_BLOCK)
-					{
-						if (is_traffic_limit_exceeded(data.mbytes))
-						{
-							result.action = ACTION_DENY;
-							result.is_limit_exceeded = true;
-							result.filter_match_result = true;
-							return;
-						};
-					}
+			if (m_nTrafficLimitAction == TRAFFICLIMIT_BLOCK)
+			{
+				if (is_traffic_limit_exceeded(data.mbytes))
+				{
+					result.action = ACTION_DENY;
+					result.is_limit_exceeded = true;
+					result.filter_match_result = true;
+					return FILTER_RULE_LIMIT;
 				};
+			}
+		};
 /* TODO
-				if ((!is_ftp_data_match) && (ip->ftpdata_mode != FTPMODE_NONE) && (prule->pkt_options & PKTOPT_FTP))
+		if ((!is_ftp_data_match) && (ip->ftpdata_mode != FTPMODE_NONE) && (prule->pkt_options & PKTOPT_FTP))
+		{
+			StateStor sis;
+
+			if (ip->ftpdata_mode == FTPMODE_ACTIVE)
+			{
+				// Construct temp rule for ftp active data connection
+
+				if (prule->dst_port == 21)
 				{
-					StateStor sis;
+					sis.src_ip = ip->ftpdata_ip;
+					sis.src_port = ip->ftpdata_port;
+					sis.dst_ip = ip->dst_ip;
+					sis.dst_port = 20;
+					sis.proto = 6;
+					sis.type = STATE_STOR_TYPE_FTP;
+				};
 
-					if (ip->ftpdata_mode == FTPMODE_ACTIVE)
-					{
-						// Construct temp rule for ftp active data connection
+				if (prule->src_port == 21)
+				{
+					sis.src_ip = ip->dst_ip;
+					sis.src_port = 20;
+					sis.dst_ip = ip->ftpdata_ip;
+					sis.dst_port = ip->ftpdata_port;
+					sis.proto = 6;
+					sis.type = STATE_STOR_TYPE_FTP;
+				};
+			};
 
-						if (prule->dst_port == 21)
-						{
-							sis.src_ip = ip->ftpdata_ip;
-							sis.src_port = ip->ftpdata_port;
-							sis.dst_ip = ip->dst_ip;
-							sis.dst_port = 20;
-							sis.proto = 6;
-							sis.type = STATE_STOR_TYPE_FTP;
-						};
-
-						if (prule->src_port == 21)
-						{
-							sis.src_ip = ip->dst_ip;
-							sis.src_port = 20;
-							sis.dst_ip = ip->ftpdata_ip;
-							sis.dst_port = ip->ftpdata_port;
-							sis.proto = 6;
-							sis.type = STATE_STOR_TYPE_FTP;
-						};
-					};
-
-					if (ip->ftpdata_mode == FTPMODE_PASSIVE)
-					{
-						// Construct temp rule for ftp passive data connection
+			if (ip->ftpdata_mode == FTPMODE_PASSIVE)
+			{
+				// Construct temp rule for ftp passive data connection
 
-						if (prule->dst_port == 21)
-						{
-							sis.src_ip = ip->dst_ip;
-							sis.src_port = 0;
-							sis.dst_ip = ip->ftpdata_ip;
-							sis.dst_port = ip->ftpdata_port;
-							sis.proto = 6;
-							sis.type = STATE_STOR_TYPE_FTP;
-						};
-
-						if (prule->src_port == 21)
-						{
-							sis.src_ip = ip->ftpdata_ip;
-							sis.src_port = ip->ftpdata_port;
-							sis.dst_ip = ip->dst_ip;
-							sis.dst_port = 0;
-							sis.proto = 6;
-							sis.type = STATE_STOR_TYPE_FTP;
-						};
-					};
-
-					(*prule).SsPutPkt(&sis, data.nUptime, tcp_flags);
+				if (prule->dst_port == 21)
+				{
+					sis.src_ip = ip->dst_ip;
+					sis.src_port = 0;
+					sis.dst_ip = ip->ftpdata_ip;
+					sis.dst_port = ip->ftpdata_port;
+					sis.proto = 6;
+					sis.type = STATE_STOR_TYPE_FTP;
+				};
+
+				if (prule->src_port == 21)
+				{
+					sis.src_ip = ip->ftpdata_ip;
+					sis.src_port = ip->ftpdata_port;
+					sis.dst_ip = ip->dst_ip;
+					sis.dst_port = 0;
+					sis.proto = 6;
+					sis.type = STATE_STOR_TYPE_FTP;
 				};
-*/
 			};
 
-			break;
+			(*prule).SsPutPkt(&sis, data.nUptime, tcp_flags);
 		};
-
-		rule_number++;
+*/
 	};
 
-	if (filter_match && m_bBlocked)
-	{
-		result.action = ACTION_DENY;
-	}
+	return FILTER_RULE_MATCHED;
 }
 
 void filter2::test_match_filter()
@@ -1267,6 +1394,116 @@ void filter2::test_match_filter()
 		TEST_CASE_CHECK(f1.cnt_sent.get_cnt(), __int64(420));
 		TEST_CASE_CHECK(f1.cnt_recv.get_cnt(), __int64(120));
 
+		// The rule bound to the host id, an address seen in a flow matches at once
+		f1.rules_clear();
+		ht.bind_host(r11.dst_host);
+		f1.rule_add(r11);
+		TEST_CASE_CHECK(ht.add_seen_addr(ht.add_host("localhost"), utm::addrip_v4("127.0.0.2")), true);
+
+		f1.match_filter(input, result, true);
+		TEST_CASE_CHECK(result.filter_match_result, true);
+		TEST_CASE_CHECK(f1.cnt_sent.get_cnt(), __int64(480));
+
+		// The binding is not used after the table is cleared
+		ht.clear();
+		f1.match_filter(input, result, true);
+		TEST_CASE_CHECK(result.filter_match_result, false);
+		TEST_CASE_CHECK(f1.cnt_sent.get_cnt(), __int64(480));
+
+	}
+
+	{
+		// Compiled rules must give the same result as the plain rule walk
+
+		test_case::testcase_num = 2;
+
+		static const int addr_types[] = { RULE_MYIP, RULE_IP, RULE_IP, RULE_RANGE, RULE_LAN, RULE_WAN, RULE_ADDRGRP, RULE_ADDRGRP_NO };
+		static const char* addrs[] = { "10.0.0.1", "10.0.0.2", "10.0.0.130", "192.168.1.2", "172.30.1.1", "0.0.0.0" };
+		static const char* masks[] = { "255.255.255.255", "255.255.255.0", "255.255.255.128", "255.255.0.0", "0.0.0.0" };
+		static const int protos[] = { 0, 6, 17, 1 };
+		static const unsigned short ports[] = { 21, 80, 443, 1024, 5000 };
+		static const unsigned int nicaliases[] = { NICALIAS_DEFAULT, NICALIAS_PUBLIC, NICALIAS_PRIVATE, NICALIAS_NETFLOW };
+
+		unsigned int seed = 12345;
+		auto test_rand = [&seed](unsigned int n) -> unsigned int { seed = seed * 1103515245 + 12345; return (seed >> 16) % n; };
+
+		filter2 f_int, f_cmp;
+
+		for (int i = 0; i < 300; i++)
+		{
+			rule r;
+			r.src_type = addr_types[test_rand(8)];
+			r.dst_type = addr_types[test_rand(8)];
+			r.src_ip.from_string(addrs[test_rand(6)]);
+			r.dst_ip.from_string(addrs[test_rand(6)]);
+			r.src_mask.from_string(masks[test_rand(5)]);
+			r.dst_mask.from_string(masks[test_rand(5)]);
+
+			if (r.src_type == RULE_RANGE) r.src_mask = r.src_ip.m_addr + test_rand(200);
+			if (r.dst_type == RULE_RANGE) r.dst_mask = r.dst_ip.m_addr + test_rand(200);
+
+			r.src_atkey = test_rand(2) ? 0 : 11;
+			r.dst_atkey = test_rand(2) ? 0 : 11;
+			r.proto = protos[test_rand(4)];
+			r.src_port_type = test_rand(8);
+			r.dst_port_type = test_rand(8);
+			r.src_port = ports[test_rand(5)];
+			r.src_port_to = ports[test_rand(5)];
+			r.dst_port = ports[test_rand(5)];
+			r.dst_port_to = ports[test_rand(5)];
+			r.mirrored = test_rand(2) ? DIRECTION_TWOWAY : DIRECTION_ONEWAY;
+			r.natuse = test_rand(3);
+			r.nicalias = nicaliases[test_rand(4)];
+			r.action = test_rand(4);
+
+			f_int.rule_add(r);
+			f_cmp.rule_add(r);
+		}
+
+		f_cmp.compile_rules(&addrmap);
+		TEST_CASE_CHECK(f_cmp.is_compiled(), true);
+		TEST_CASE_CHECK(f_int.is_compiled(), false);
+
+		ip_header iphdr;
+		iphdr.test_fill_packet(0);
+
+		match_filter_input input;
+		input.ip = &iphdr;
+		input.mat = &addrmap;
+		input.nModifyCounter = MODIFY_COUNTER_YES;
+		input.lt = &lt;
+		input.mbytes = 1048576;
+
+		match_filter_result res_int, res_cmp;
+
+		bool is_equal = true;
+		for (int i = 0; i < 5000; i++)
+		{
+			iphdr.src_ip_addr = addrip_v4(addrs[test_rand(5)]).m_addr + test_rand(3);
+			iphdr.dst_ip_addr = addrip_v4(addrs[test_rand(5)]).m_addr + test_rand(3);
+			iphdr.proto = protos[1 + test_rand(3)];
+			iphdr.src_port = ports[test_rand(5)];
+			iphdr.dst_port = ports[test_rand(5)];
+			input.nPreCheckAddrTables = test_rand(16);
+			input.bWithNat = test_rand(2) != 0;
+			input.nNicAlias = nicaliases[test_rand(4)];
+
+			f_int.match_filter(input, res_int, true);
+			f_cmp.match_filter(input, res_cmp, true);
+
+			if ((res_int.filter_match_result != res_cmp.filter_match_result) ||
+				(res_int.rule_no != res_cmp.rule_no) ||
+				(res_int.direction != res_cmp.direction) ||
+				(res_int.action != res_cmp.action))
+			{
+				is_equal = false;
+				break;
+			}
+		}
+
+		TEST_CASE_CHECK(is_equal, true);
+		TEST_CASE_CHECK(f_cmp.cnt_sent.get_cnt(), f_int.cnt_sent.get_cnt());
+		TEST_CASE_CHECK(f_cmp.cnt_recv.get_cnt(), f_int.cnt_recv.get_cnt());
 	}
 }
 
@@ -9,15 +9,22 @@
 #include "filter_extra.h"
 #include "pktcollector_e.h"
 #include "pktcollector_ex.h"
+#include "rule_classifier.h"
 #include <addrtablemap_v4.h>
 #include <utime.h>
 #include <utimestamp.h>
 
+#include <memory>
+
 #define LOGPKT_PRIVILEGED 1
 #define LOGPKT_WRITEMAC 2
 #define LOGPKT_WRITETOS 4
 #define LOGPKT_WRITEFILTERNAME 8
 
+#define FILTER_RULE_NOTMATCHED 0
+#define FILTER_RULE_MATCHED 1
+#define FILTER_RULE_LIMIT 2
+
 //
 //    
 // m_nMasterOptions:
@@ -47,7 +54,6 @@ public:
 	void reset_filter_counters(bool reset_history);
 	bool reset_on_schedule(const standard_timeset& stimeset, bool reset_history);
 	utimestamp last_reset_ts;
-	pktcollector_e pcollector;
 	pktcollector_ex hcollector;
 
 	void set_id(unsigned int id) { m_id = id; };
@@ -58,10 +64,37 @@ public:
 	bool is_traffic_limitwarn_exceeded(int mbytes = 1048576) const;
 	int get_actual_speed() const;
 
+	void rule_add(const rule& r);
+	void rules_clear();
+
+	// Builds the rule classifier, it must be rebuilt after rules or MAT are changed
+	void compile_rules(addrtablemap_v4* mat, std::shared_ptr<const addrgroup_index> groups = std::shared_ptr<const addrgroup_index>());
+	bool is_compiled() const { return classifier.get() != NULL; };
+	std::shared_ptr<const rule_classifier> get_classifier() const { return classifier; };
+
+	bool is_enabled_at(const tm* lt) const;
+
 	void match_filter(const match_filter_input& data, match_filter_result& result, bool clear_result_before);
 	void match_filter(const match_filter_input& data, match_filter_result& result);
 
+	// Checks only the candidate rules selected from the classifier rc.
+	// If rule_enabled is given, it marks the rules passing the time checks and the filter is already checked by the caller.
+	void match_filter_compiled(const match_filter_input& data, match_filter_result& result, const rule_classifier& rc, rule_candidates& cand, const unsigned char* rule_enabled = NULL);
+
+	// Applies an already known match of the rule r: counters, traffic limit and blocking
+	void apply_match(const rule& r, int rule_no, int curdir, const match_filter_input& data, match_filter_result& result);
+
 	static void test_match_filter();
+
+private:
+	std::shared_ptr<const rule_classifier> classifier;
+
+	int match_rules(const match_filter_input& data, match_filter_result& result);
+	int match_rules_compiled(const rule_classifier& rc, rule_candidates& cand, const unsigned char* rule_enabled, const match_filter_input& data, match_filter_result& result);
+	int match_rule(const rule& r, addrtablemaprec<addrtable_v4>* src_at, addrtablemaprec<addrtable_v4>* dst_at, int src_grp_bit, int dst_grp_bit, const match_filter_input& data) const;
+	int apply_rule_match(const rule& r, int rule_number, int curdir, const match_filter_input& data, match_filter_result& result);
+
+	static void resolve_addrtables(const rule& r, addrtablemap_v4* mat, addrtablemaprec<addrtable_v4>*& src_at, addrtablemaprec<addrtable_v4>*& dst_at);
 };
 
 }
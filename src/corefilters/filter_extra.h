@@ -37,6 +37,8 @@
 namespace utm {
 
 class filter2;
+class rule;
+class addrgroup_index;
 
 struct match_filter_result
 {
@@ -61,6 +63,10 @@ struct match_filter_result
 
 	// filter-level result
 	filter2* filter_ptr;
+	const rule* rule_ptr;
+
+	// The result depends on more than the packet headers (counters, users, hosts and etc.)
+	bool is_volatile;
 
 	void clear()
 	{
@@ -97,6 +103,15 @@ struct match_filter_input
 	int mbytes;
 	HANDLE adapter_handle;
 
+	// Address groups of the packet addresses (see addrgroup_index::lookup)
+	const utm::addrgroup_index* addrgroups;
+	const unsigned int* pSrcAddrGroups;
+	const unsigned int* pDstAddrGroups;
+
+	// The host id of the flow by its server name and the server of the flow (see hosttable::checkflow)
+	unsigned int flow_host_id;
+	utm::addrip_v4 flow_server;
+
 	void clear()
 	{
 		memset(this, 0, sizeof(match_filter_input));
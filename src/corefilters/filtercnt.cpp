@@ -5,7 +5,7 @@
 
 namespace utm {
 
-filtercnt::filtercnt(void)
+filtercnt::filtercnt(void) : cnt_sets(0)
 {
 	reset(true);
 }
@@ -51,6 +51,7 @@ void filtercnt::copy(const filtercnt& fc)
 	cnt_xml.store(fc.cnt_xml.load());
 	cnt_xml2.store(fc.cnt_xml2.load());
 	cnt_logdb.store(fc.cnt_logdb.load());
+	cnt_sets.store(fc.cnt_sets.load());
 
 	memcpy(cnt_set, fc.cnt_set, sizeof(unsigned short) * MAXVALUES);
 	cnt_momspeed1 = fc.cnt_momspeed1;
@@ -65,12 +66,19 @@ __int64 filtercnt::get_cnt() const
 void filtercnt::set_cnt(__int64 value)
 {
 	cnt.store(value);
+	cnt_sets++;
 }
 
 void filtercnt::set_cnt_with_prev(__int64 value)
 {
 	cnt.store(value);
 	cnt_prev = value;
+	cnt_sets++;
+}
+
+unsigned int filtercnt::get_sets() const
+{
+	return cnt_sets.load();
 }
 
 void filtercnt::add_cnt(__int64 value)
@@ -10,6 +10,7 @@
 
 #include <base64.h>
 #include <gstring.h>
+#include <sharded_counter.h>
 
 namespace utm {
 
@@ -27,10 +28,11 @@ public:
 
 private:
 	__int64			cnt_prev;
-	std::atomic<int_fast64_t>	cnt;
+	sharded_counter<int_fast64_t>	cnt;	// added by every packet, one slot per thread
 	std::atomic<int_fast64_t>	cnt_xml;
 	std::atomic<int_fast64_t>	cnt_xml2;
 	std::atomic<int_fast64_t>	cnt_logdb;
+	std::atomic<unsigned int>	cnt_sets;
 
 public:
 	__int64 get_cnt() const;
@@ -39,6 +41,9 @@ public:
 	void add_cnt(__int64 value);
 	void add_cnt_with_prev(__int64 value);
 
+	// Changed by set_cnt(), the counter was given a value instead of counting the bytes
+	unsigned int get_sets() const;
+
 	__int64 get_xml() const;
 	void set_xml(__int64 value);
 	void add_xml(__int64 value);
@@ -51,6 +56,8 @@ public:
 	void set_logdb(__int64 value);
 	void add_logdb(__int64 value);
 
+	// The speed window of the GUI protocol, MAXVALUES points of REFRESH_INTERVAL: 2800 bytes
+	// of every counter are kept in memory, the longer history is in speed_history
 	unsigned short	cnt_set[MAXVALUES];
 	unsigned int	cnt_momspeed1;
 	unsigned int	cnt_speed;
@@ -1,16 +1,19 @@
 #include "StdAfx.h"
 #include "filterset.h"
+#include "filterset_delta.h"
+#include "dns_resolver.h"
 
 #include <ubase_test.h>
 #include <addrtablemap_v4.h>
 #include <ufs.h>
 #include <utime.h>
+#include <algorithm>
 
 #include <filteragent.h>
 
 namespace utm {
 
-filterset::filterset(void)
+filterset::filterset(void) : header_need(IPHDR_NEED_ALL)
 {
 }
 
@@ -40,6 +43,21 @@ void filterset::reset_all_counters()
 	}
 }
 
+void filterset::refresh_points(time_t now, filterset_delta* delta)
+{
+	unsigned int next_point = fdata.get_next_point();
+	for (auto iter = filters.items.begin(); iter != filters.items.end(); ++iter)
+	{
+		iter->cnt_sent.do_refresh(fdata.get_total_points(), next_point);
+		iter->cnt_recv.do_refresh(fdata.get_total_points(), next_point);
+	}
+
+	fdata.goto_next_point(now);
+
+	if (delta != NULL)
+		delta->update(*this);
+}
+
 void filterset::reset_on_schedule(bool reset_history, std::string& filterids)
 {
 	utime now(true);
@@ -89,6 +107,137 @@ void filterset::prepare_shaper_usage()
 	}
 }
 
+void filterset::prepare_header_usage()
+{
+	header_need = IPHDR_NEED_NONE;
+	for (auto iter = filters.items.begin(); iter != filters.items.end(); ++iter)
+	{
+		// The flow collector looks for TCP SYN
+		if (iter->m_nPktLogDest != LOGPKT_DISABLED)
+			header_need |= IPHDR_NEED_FLAGS;
+
+		for (auto riter = iter->rules.items.begin(); riter != iter->rules.items.end(); ++riter)
+		{
+			if (riter->pkt_options & (PKTOPT_TCPSYN | PKTOPT_ICMPECHOREQUEST | PKTOPT_ICMPTTLEXCEEDED))
+				header_need |= IPHDR_NEED_FLAGS;
+
+			if (riter->pkt_options & PKTOPT_FTP)
+				header_need |= IPHDR_NEED_FTP;
+		}
+	}
+}
+
+void filterset::prepare_host_ids(hosttable& ht)
+{
+	for (auto iter = filters.items.begin(); iter != filters.items.end(); ++iter)
+	{
+		for (auto riter = iter->rules.items.begin(); riter != iter->rules.items.end(); ++riter)
+		{
+			if (riter->src_type == RULE_HOST)
+				ht.bind_host(riter->src_host);
+
+			if (riter->dst_type == RULE_HOST)
+				ht.bind_host(riter->dst_host);
+		}
+	}
+}
+
+void filterset::prepare_resolver(dns_resolver& resolver) const
+{
+	resolver.set_server(dns_server);
+}
+
+void filterset::prepare_rule_classifiers()
+{
+	std::shared_ptr<filterset_classifier> fc(new filterset_classifier());
+	fc->compile(filters.items, &table_lat, &table_mat, this);
+	fclassifier = fc;
+}
+
+void filterset::match_filters(const match_filter_input& data, filterset_match_list& matches)
+{
+	const filterset_classifier* fc = fclassifier.get();
+
+	if ((fc != NULL) && fc->is_valid_for(this, filters.size()))
+	{
+		fc->match(data, matches);
+		return;
+	}
+
+	matches.reset(filters.size());
+
+	match_filter_input input(data);
+	match_filter_result result;
+	unsigned int idx = 0;
+
+	for (auto iter = filters.items.begin(); iter != filters.items.end(); ++iter, ++idx)
+	{
+		if (idx > 0)
+			input.nPrevFilter = result.filter_match_result ? 1 : 0;
+
+		result.clear();
+		iter->match_filter(input, result);
+
+		if (result.is_volatile)
+			matches.is_volatile = true;
+
+		if (result.filter_match_result)
+			matches.add(idx, result);
+	}
+}
+
+void filterset::match_filters_batch(const match_filter_input& data, const match_batch_packet* packets, size_t count, filterset_match_list* matches, match_batch_state& state)
+{
+	const filterset_classifier* fc = fclassifier.get();
+
+	if ((fc != NULL) && fc->is_valid_for(this, filters.size()))
+	{
+		fc->match_batch(data, packets, count, matches, state);
+		return;
+	}
+
+	match_filter_input input(data);
+
+	for (size_t i = 0; i < count; i++)
+	{
+		const match_batch_packet& p = packets[i];
+
+		input.ip = p.ip;
+		input.nPacketDirection = p.nPacketDirection;
+		input.nPreCheckAddrTables = p.nPreCheckAddrTables;
+		input.dwProcNickIdSrc = p.dwProcNickIdSrc;
+		input.dwProcNickIdDst = p.dwProcNickIdDst;
+		input.uidSrc = p.uidSrc;
+		input.uidDst = p.uidDst;
+
+		match_filters(input, matches[i]);
+	}
+}
+
+static bool is_packet_collected(const filterset_match& m)
+{
+	if ((m.filter_ptr == NULL) || (m.filter_ptr->m_nPktLogDest == LOGPKT_DISABLED))
+		return false;
+
+	return (m.action == ACTION_COUNT) || (m.action == ACTION_COUNTPASS);
+}
+
+void filterset::collect_packet(pktcollector_shared& pc, const ip_header& ip, const filterset_match_list& matches, unsigned int now) const
+{
+	auto first = std::find_if(matches.items.begin(), matches.items.end(), is_packet_collected);
+	if (first == matches.items.end())
+		return;
+
+	// Flow keys are built once for all filters
+	pktcollector_packet pkt(ip, NULL, 0);
+
+	for (auto iter = first; iter != matches.items.end(); ++iter)
+	{
+		if (is_packet_collected(*iter))
+			pc.put_packet(pkt, iter->filter_id, iter->direction, now);
+	}
+}
+
 bool filterset::is_addrtable_used(unsigned int atkey) const
 {
 	for (auto iter = filters.items.begin(); iter != filters.items.end(); ++iter)
@@ -287,6 +436,17 @@ void filterset::parse_lat_string(const char *lat_string)
 	table_lat.AddAddrPair(addr_begin, addr_end, false);
 }
 
+void filterset::xml_parse_started()
+{
+	// One LAT node per pair, the readers get the table at the end of the load
+	table_lat.BeginUpdate();
+}
+
+void filterset::xml_parse_finished()
+{
+	table_lat.CommitUpdate();
+}
+
 ubase* filterset::xml_catch_subnode(const char *keyname)
 {
 	ubase *u = NULL;
@@ -5,11 +5,18 @@
 
 #include <filterset_data.h>
 #include <filterset_base.h>
+#include <filterset_classifier.h>
+#include <pktcollector_shared.h>
+
+#include <memory>
 
 #define START_SEQUENCE_NUMBER_FILTERID 0
 
 namespace utm {
 
+class dns_resolver;
+class filterset_delta;
+
 class filterset : public filterset_base
 {
 public:
@@ -18,13 +25,21 @@ public:
 
 	filterset_data fdata;
 
+	// Flows of the filters which log packets, shared by all filters
+	pktcollector_shared pcollector;
+
 	lat_as_string_container get_lat() const;
 	void parse_lat_string(const char *lat_string);
+	void xml_parse_started();
+	void xml_parse_finished();
 
 	void copy_counters(const filterset& fs);
 	void reset_all_counters();
 	void reset_on_schedule(bool reset_history, std::string& filterids);
 
+	// Every REFRESH_INTERVAL: the speed point of the counters, then the delta of the point for the clients
+	void refresh_points(time_t now, filterset_delta* delta = NULL);
+
 	void process_traffic_limit_flags(const gstring& flagfolder);
 	void select_users_by_filter_id(unsigned int filter_id, std::map<unsigned int, gstring>& selected_users) const;
 	void make_user_agentinfo_as_xml(const utime& cutime, const fsuser& user, std::ostringstream& res) const;
@@ -40,11 +55,35 @@ public:
 	void prepare_shaper_usage();
 	bool get_shaper_usage() const { return is_shaper_used; };
 
+	// IPHDR_NEED_* mask of the packet fields the rules and the flow collector look at
+	void prepare_header_usage();
+	unsigned int get_header_usage() const { return header_need; };
+
+	// Binds the RULE_HOST rules to the host ids of the table, before prepare_rule_classifiers()
+	void prepare_host_ids(hosttable& ht);
+
+	// The DNS server of the host rules, the system resolver if none is given
+	void prepare_resolver(dns_resolver& resolver) const;
+
+	void prepare_rule_classifiers();
+
+	// Checks the packet against all filters, matched filters are returned in the filter order
+	void match_filters(const match_filter_input& data, filterset_match_list& matches);
+	void match_filters_batch(const match_filter_input& data, const match_batch_packet* packets, size_t count, filterset_match_list* matches, match_batch_state& state);
+	std::shared_ptr<const filterset_classifier> get_classifier() const { return fclassifier; };
+
+	// Puts the packet into the shared collector for the matched filters which log packets
+	void collect_packet(const ip_header& ip, const filterset_match_list& matches, unsigned int now) { collect_packet(pcollector, ip, matches, now); };
+	void collect_packet(pktcollector_shared& pc, const ip_header& ip, const filterset_match_list& matches, unsigned int now) const;
+
 	bool is_addrtable_used(unsigned int atkey) const;
 
 private:
 	bool is_proc_used;
 	bool is_shaper_used;
+	unsigned int header_need;
+
+	std::shared_ptr<const filterset_classifier> fclassifier;
 
 public:
 	ubase* xml_catch_subnode(const char *name);
@@ -50,6 +50,7 @@ filterset_base& filterset_base::operator=(const filterset_base& rhs)
     descr = rhs.descr;
     adodb_conn_string = rhs.adodb_conn_string;
     m_bKeepCounters = rhs.m_bKeepCounters;
+    dns_server = rhs.dns_server;
     m_nLogCntFlushPeriod = rhs.m_nLogCntFlushPeriod;
     m_szLogCntFolder1 = rhs.m_szLogCntFolder1;
     m_szLogCntFolder2 = rhs.m_szLogCntFolder2;
@@ -81,6 +82,7 @@ bool filterset_base::operator==(const filterset_base& rhs) const
     if (!(descr == rhs.descr)) return false;
     if (!(adodb_conn_string == rhs.adodb_conn_string)) return false;
     if (!(m_bKeepCounters == rhs.m_bKeepCounters)) return false;
+    if (!(dns_server == rhs.dns_server)) return false;
     if (!(m_nLogCntFlushPeriod == rhs.m_nLogCntFlushPeriod)) return false;
     if (!(m_szLogCntFolder1 == rhs.m_szLogCntFolder1)) return false;
     if (!(m_szLogCntFolder2 == rhs.m_szLogCntFolder2)) return false;
@@ -113,6 +115,7 @@ void filterset_base::clear()
     descr.clear();
     adodb_conn_string.clear();
     m_bKeepCounters = true;
+    dns_server.clear();
     m_nLogCntFlushPeriod = 10;
     m_szLogCntFolder1.clear();
     m_szLogCntFolder2.clear();
@@ -156,6 +159,7 @@ void filterset_base::xml_create()
     xml_append_node("FiltersetDescription", descr, orig.descr);
     xml_append_node("DbConnString", adodb_conn_string, orig.adodb_conn_string);
     xml_append_node("RestoreCounters", m_bKeepCounters, orig.m_bKeepCounters);
+    xml_append_node("DnsServer", dns_server, orig.dns_server);
     xml_append_node("LogCntXmlReportsFlushPeriod", m_nLogCntFlushPeriod, orig.m_nLogCntFlushPeriod);
     xml_append_node("LogCntXmlReportsFolder", m_szLogCntFolder1, orig.m_szLogCntFolder1);
     xml_append_node("LogCntBackupReportsFolder", m_szLogCntFolder2, orig.m_szLogCntFolder2);
@@ -186,6 +190,7 @@ void filterset_base::xml_catch_value(const char *keyname, const char *keyvalue)
     if (xml_check_value(keyname, "FiltersetDescription", keyvalue, descr)) return;
     if (xml_check_value(keyname, "DbConnString", keyvalue, adodb_conn_string)) return;
     if (xml_check_value(keyname, "RestoreCounters", keyvalue, m_bKeepCounters)) return;
+    if (xml_check_value(keyname, "DnsServer", keyvalue, dns_server)) return;
     if (xml_check_value(keyname, "LogCntXmlReportsFlushPeriod", keyvalue, m_nLogCntFlushPeriod)) return;
     if (xml_check_value(keyname, "LogCntXmlReportsFolder", keyvalue, m_szLogCntFolder1)) return;
     if (xml_check_value(keyname, "LogCntBackupReportsFolder", keyvalue, m_szLogCntFolder2)) return;
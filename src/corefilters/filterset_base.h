@@ -78,6 +78,7 @@ public:
     gstring descr;
     gstring adodb_conn_string;
     bool m_bKeepCounters;
+    addrip_v4 dns_server;
     unsigned int m_nLogCntFlushPeriod;
     gstring m_szLogCntFolder1;
     gstring m_szLogCntFolder2;
@@ -0,0 +1,547 @@
+#include "StdAfx.h"
+#include "filterset_classifier.h"
+#include "filterset.h"
+
+#include <atomic>
+
+#include <utime.h>
+#include <ubase_test.h>
+
+namespace utm {
+
+const char filterset_classifier::this_class_name[] = "filterset_classifier";
+
+filterset_match_list::filterset_match_list() : is_volatile(false)
+{
+}
+
+filterset_match_list::~filterset_match_list()
+{
+}
+
+void filterset_match_list::reset(size_t filter_count)
+{
+	size_t words = (filter_count + 31) / 32;
+
+	if (bitmap.size() != words)
+	{
+		bitmap.assign(words, 0);
+	}
+	else
+	{
+		// Only the bits of the previous packet are cleared
+		for (auto iter = items.begin(); iter != items.end(); ++iter)
+		{
+			bitmap[iter->filter_idx >> 5] = 0;
+		}
+	}
+
+	items.clear();
+	is_volatile = false;
+}
+
+void filterset_match_list::add(unsigned int filter_idx, const match_filter_result& result)
+{
+	filterset_match m;
+	m.filter_idx = filter_idx;
+
+	items.push_back(m);
+	update(items.size() - 1, result);
+}
+
+void filterset_match_list::update(size_t pos, const match_filter_result& result)
+{
+	filterset_match& m = items[pos];
+
+	m.filter_id = result.filter_id;
+	m.filter_ptr = result.filter_ptr;
+	m.rule_ptr = result.rule_ptr;
+	m.rule_no = result.rule_no;
+	m.direction = result.direction;
+	m.action = result.action;
+	m.is_limit_exceeded = result.is_limit_exceeded;
+	m.is_rwrfwd = result.is_rwrfwd;
+
+	if ((m.filter_idx >> 5) < bitmap.size())
+		bitmap[m.filter_idx >> 5] |= (1u << (m.filter_idx & 31));
+}
+
+static std::atomic_uint_fast32_t filterset_classifier_generation(0);
+
+filterset_classifier::filterset_classifier() : owner(NULL), generation(0)
+{
+}
+
+filterset_classifier::~filterset_classifier()
+{
+}
+
+void filterset_classifier::compile(std::list<filter2>& filters, const addrtable_v4* lat, addrtablemap_v4* mat, const filterset* owner)
+{
+	this->owner = owner;
+	generation = ++filterset_classifier_generation;
+
+	std::shared_ptr<addrgroup_index> gi(new addrgroup_index());
+	gi->build(lat, mat);
+	groups = gi;
+
+	fentries.clear();
+	id_filter.clear();
+
+	rule_index_entries entries;
+	unsigned int id_base = 0;
+
+	for (auto iter = filters.begin(); iter != filters.end(); ++iter)
+	{
+		iter->compile_rules(mat, groups);
+
+		filter_entry fe;
+		fe.filter_ptr = &(*iter);
+		fe.rc = iter->get_classifier();
+		fe.id_base = id_base;
+		fe.id_limit = id_base + static_cast<unsigned int>(fe.rc->size());
+
+		// Global ids go in the filter order, then in the rule order
+		fe.rc->collect_index_entries(id_base, entries);
+		id_filter.insert(id_filter.end(), fe.rc->size(), static_cast<unsigned int>(fentries.size()));
+
+		id_base = fe.id_limit;
+		fentries.push_back(fe);
+	}
+
+	index.build(entries);
+}
+
+void filterset_classifier::match(const match_filter_input& data, filterset_match_list& matches) const
+{
+	match_filter_input input(data);
+
+	if (input.addrgroups != groups.get())
+	{
+		input.addrgroups = groups.get();
+		input.pSrcAddrGroups = groups->lookup(data.ip->src_ip_addr.m_addr);
+		input.pDstAddrGroups = groups->lookup(data.ip->dst_ip_addr.m_addr);
+	}
+
+	rule_candidates cand;
+	index.lookup(*data.ip, cand);
+
+	match_packet(input, cand, matches, NULL);
+}
+
+void filterset_classifier::match_batch(const match_filter_input& data, const match_batch_packet* packets, size_t count, filterset_match_list* matches, match_batch_state& state) const
+{
+	prepare_batch(*data.lt, state);
+
+	match_filter_input input(data);
+	input.addrgroups = groups.get();
+
+	rule_candidates cand;
+	bool has_prev = false;
+	unsigned int prev_src = 0;
+	unsigned int prev_dst = 0;
+	unsigned short prev_proto = 0;
+
+	for (size_t i = 0; i < count; i++)
+	{
+		const match_batch_packet& p = packets[i];
+
+		input.ip = p.ip;
+		input.nPacketDirection = p.nPacketDirection;
+		input.nPreCheckAddrTables = p.nPreCheckAddrTables;
+		input.dwProcNickIdSrc = p.dwProcNickIdSrc;
+		input.dwProcNickIdDst = p.dwProcNickIdDst;
+		input.uidSrc = p.uidSrc;
+		input.uidDst = p.uidDst;
+
+		// Packets of one flow come together, so the lookups of the previous packet are often valid
+		if (!has_prev || (prev_src != p.ip->src_ip_addr.m_addr) || (prev_dst != p.ip->dst_ip_addr.m_addr) || (prev_proto != p.ip->proto))
+		{
+			input.pSrcAddrGroups = groups->lookup(p.ip->src_ip_addr.m_addr);
+			input.pDstAddrGroups = groups->lookup(p.ip->dst_ip_addr.m_addr);
+			index.lookup(*p.ip, cand);
+
+			has_prev = true;
+			prev_src = p.ip->src_ip_addr.m_addr;
+			prev_dst = p.ip->dst_ip_addr.m_addr;
+			prev_proto = p.ip->proto;
+		}
+
+		match_packet(input, cand, matches[i], &state);
+	}
+}
+
+void filterset_classifier::prepare_batch(const tm& lt, match_batch_state& state) const
+{
+	unsigned int epoch = get_time_epoch(lt);
+
+	if ((state.generation == generation) && (state.epoch == epoch))
+		return;
+
+	state.generation = generation;
+	state.epoch = epoch;
+	state.filter_enabled.resize(fentries.size());
+	state.rule_enabled.resize(id_filter.size());
+
+	for (size_t idx = 0; idx < fentries.size(); idx++)
+	{
+		const filter_entry& fe = fentries[idx];
+		state.filter_enabled[idx] = fe.filter_ptr->is_enabled_at(&lt) ? 1 : 0;
+
+		for (unsigned int id = fe.id_base; id < fe.id_limit; id++)
+		{
+			state.rule_enabled[id] = rule_classifier::is_time_passed(fe.rc->at(id - fe.id_base).r, &lt) ? 1 : 0;
+		}
+	}
+}
+
+unsigned int filterset_classifier::get_time_epoch(const tm& lt)
+{
+	return ((lt.tm_year * 12 + lt.tm_mon) * 31 + lt.tm_mday) * 24 + lt.tm_hour;
+}
+
+void filterset_classifier::match_packet(match_filter_input& input, rule_candidates cand, filterset_match_list& matches, const match_batch_state* state) const
+{
+	matches.reset(fentries.size());
+
+	match_filter_result result;
+	int first_prev_filter = input.nPrevFilter;
+
+	unsigned int prev_idx = 0;
+	bool prev_matched = false;
+	unsigned int id;
+
+	while (cand.peek(id))
+	{
+		unsigned int idx = id_filter[id];
+		const filter_entry& fe = fentries[idx];
+
+		// A filter without candidates is not matched, so the previous filter
+		// is matched only if it was checked just before
+		if (idx == 0)
+			input.nPrevFilter = first_prev_filter;
+		else
+			input.nPrevFilter = (prev_matched && (prev_idx == idx - 1)) ? 1 : 0;
+
+		cand.base = fe.id_base;
+		cand.limit = fe.id_limit;
+
+		result.clear();
+
+		if (state == NULL)
+			fe.filter_ptr->match_filter_compiled(input, result, *fe.rc, cand);
+		else if (state->filter_enabled[idx])
+			fe.filter_ptr->match_filter_compiled(input, result, *fe.rc, cand, &state->rule_enabled[fe.id_base]);
+
+		// Skip the candidates left after the first matched rule
+		while (cand.next(id));
+
+		cand.base = 0;
+		cand.limit = 0xFFFFFFFF;
+
+		prev_idx = idx;
+		prev_matched = result.filter_match_result;
+
+		if (result.is_volatile)
+			matches.is_volatile = true;
+
+		if (prev_matched)
+			matches.add(idx, result);
+	}
+
+	input.nPrevFilter = first_prev_filter;
+}
+
+void filterset_classifier::classify_addresses(match_filter_input& data) const
+{
+	data.addrgroups = groups.get();
+	data.pSrcAddrGroups = groups->lookup(data.ip->src_ip_addr.m_addr);
+	data.pDstAddrGroups = groups->lookup(data.ip->dst_ip_addr.m_addr);
+
+	data.nPreCheckAddrTables &= ~(CHECKADDR_LAT_SRC | CHECKADDR_LAT_DST);
+
+	if (addrgroup_index::test_bit(data.pSrcAddrGroups, ADDRGROUP_BIT_LAT))
+		data.nPreCheckAddrTables |= CHECKADDR_LAT_SRC;
+
+	if (addrgroup_index::test_bit(data.pDstAddrGroups, ADDRGROUP_BIT_LAT))
+		data.nPreCheckAddrTables |= CHECKADDR_LAT_DST;
+}
+
+#ifdef UTM_DEBUG
+void filterset_classifier::test_all()
+{
+	test_report tr(this_class_name);
+	test_case::classname.assign(this_class_name);
+
+	tm lt = utm::utime(2010, 05, 30, 12, 59, 12).to_tm();
+
+	{
+		test_case::testcase_num = 1;
+
+		filterset_match_list ml;
+		match_filter_result result;
+
+		ml.reset(40);
+		result.filter_id = 7;
+		ml.add(33, result);
+
+		TEST_CASE_CHECK(ml.size(), size_t(1));
+		TEST_CASE_CHECK(ml.is_matched(33), true);
+		TEST_CASE_CHECK(ml.is_matched(1), false);
+		TEST_CASE_CHECK(ml.items[0].filter_id, unsigned int(7));
+
+		ml.reset(40);
+		TEST_CASE_CHECK(ml.size(), size_t(0));
+		TEST_CASE_CHECK(ml.is_matched(33), false);
+	}
+
+	{
+		// The compiled filterset must give the same matches as the plain walk over filters
+
+		test_case::testcase_num = 2;
+
+		static const int addr_types[] = { RULE_MYIP, RULE_IP, RULE_IP, RULE_RANGE, RULE_LAN, RULE_WAN };
+		static const char* addrs[] = { "10.0.0.1", "10.0.0.2", "10.0.0.130", "192.168.1.2", "172.30.1.1", "0.0.0.0" };
+		static const char* masks[] = { "255.255.255.255", "255.255.255.0", "255.255.255.128", "0.0.0.0" };
+		static const int prevfilters[] = { PREVFILTER_ANY, PREVFILTER_ANY, PREVFILTER_MATCHED, PREVFILTER_NOTMATCHED };
+
+		unsigned int seed = 54321;
+		auto test_rand = [&seed](unsigned int n) -> unsigned int { seed = seed * 1103515245 + 12345; return (seed >> 16) % n; };
+
+		filterset fs_plain, fs_cmp;
+
+		for (unsigned int i = 1; i <= 60; i++)
+		{
+			filter2 f;
+			f.set_id(i);
+			f.m_bBlocked = (test_rand(10) == 0);
+
+			unsigned int rule_count = 1 + test_rand(5);
+			for (unsigned int j = 0; j < rule_count; j++)
+			{
+				rule r;
+				r.src_type = addr_types[test_rand(6)];
+				r.dst_type = addr_types[test_rand(6)];
+				r.src_ip.from_string(addrs[test_rand(6)]);
+				r.dst_ip.from_string(addrs[test_rand(6)]);
+				r.src_mask.from_string(masks[test_rand(4)]);
+				r.dst_mask.from_string(masks[test_rand(4)]);
+
+				if (r.src_type == RULE_RANGE) r.src_mask = r.src_ip.m_addr + test_rand(200);
+				if (r.dst_type == RULE_RANGE) r.dst_mask = r.dst_ip.m_addr + test_rand(200);
+
+				r.mirrored = test_rand(2) ? DIRECTION_TWOWAY : DIRECTION_ONEWAY;
+				r.prevfilter_type = prevfilters[test_rand(4)];
+				r.action = test_rand(4);
+
+				f.rule_add(r);
+			}
+
+			fs_plain.filters.add_element(f);
+			fs_cmp.filters.add_element(f);
+		}
+
+		fs_cmp.prepare_rule_classifiers();
+
+		ip_header iphdr;
+		iphdr.test_fill_packet(0);
+
+		match_filter_input input;
+		input.ip = &iphdr;
+		input.mat = &fs_cmp.table_mat;
+		input.nModifyCounter = MODIFY_COUNTER_YES;
+		input.lt = &lt;
+		input.mbytes = 1048576;
+
+		filterset_match_list ml_plain, ml_cmp;
+
+		bool is_equal = true;
+		size_t total_matches = 0;
+
+		for (int i = 0; i < 3000; i++)
+		{
+			iphdr.src_ip_addr = addrip_v4(addrs[test_rand(5)]).m_addr + test_rand(3);
+			iphdr.dst_ip_addr = addrip_v4(addrs[test_rand(5)]).m_addr + test_rand(3);
+			input.nPreCheckAddrTables = test_rand(16);
+			input.nPrevFilter = test_rand(2);
+
+			fs_plain.match_filters(input, ml_plain);
+			fs_cmp.match_filters(input, ml_cmp);
+
+			total_matches += ml_cmp.size();
+
+			if (ml_plain.size() != ml_cmp.size())
+			{
+				is_equal = false;
+				break;
+			}
+
+			for (size_t k = 0; k < ml_plain.size(); k++)
+			{
+				const filterset_match& m1 = ml_plain.items[k];
+				const filterset_match& m2 = ml_cmp.items[k];
+
+				if ((m1.filter_idx != m2.filter_idx) || (m1.filter_id != m2.filter_id) || (m1.rule_no != m2.rule_no) ||
+					(m1.direction != m2.direction) || (m1.action != m2.action) || !ml_cmp.is_matched(m2.filter_idx))
+				{
+					is_equal = false;
+				}
+			}
+
+			if (!is_equal)
+				break;
+		}
+
+		TEST_CASE_CHECK(is_equal, true);
+		TEST_CASE_CHECK(total_matches > 0, true);
+
+		auto iter_cmp = fs_cmp.filters.items.begin();
+		for (auto iter = fs_plain.filters.items.begin(); iter != fs_plain.filters.items.end(); ++iter, ++iter_cmp)
+		{
+			TEST_CASE_CHECK(iter_cmp->cnt_sent.get_cnt(), iter->cnt_sent.get_cnt());
+			TEST_CASE_CHECK(iter_cmp->cnt_recv.get_cnt(), iter->cnt_recv.get_cnt());
+		}
+	}
+
+	{
+		// Batches must give the same matches as the packets one by one, time windows included
+
+		test_case::testcase_num = 3;
+
+		static const char* addrs[] = { "10.0.0.1", "10.0.0.2", "10.0.0.130", "192.168.1.2", "172.30.1.1" };
+		static const char* masks[] = { "255.255.255.255", "255.255.255.0", "0.0.0.0" };
+
+		unsigned int seed = 9876;
+		auto test_rand = [&seed](unsigned int n) -> unsigned int { seed = seed * 1103515245 + 12345; return (seed >> 16) % n; };
+
+		filterset fs_plain, fs_batch;
+
+		for (unsigned int i = 1; i <= 40; i++)
+		{
+			filter2 f;
+			f.set_id(i);
+
+			if (test_rand(4) == 0)
+			{
+				for (int d = 0; d < 7; d++)
+					f.m_nWorkHours[d] = 0x00FFF000;
+			}
+
+			unsigned int rule_count = 1 + test_rand(4);
+			for (unsigned int j = 0; j < rule_count; j++)
+			{
+				rule r;
+				r.src_type = RULE_IP;
+				r.dst_type = RULE_IP;
+				r.src_ip.from_string(addrs[test_rand(5)]);
+				r.dst_ip.from_string(addrs[test_rand(5)]);
+				r.src_mask.from_string(masks[test_rand(3)]);
+				r.dst_mask.from_string(masks[test_rand(3)]);
+				r.mirrored = test_rand(2) ? DIRECTION_TWOWAY : DIRECTION_ONEWAY;
+				r.prevfilter_type = test_rand(3) ? PREVFILTER_ANY : PREVFILTER_MATCHED;
+
+				if (test_rand(3) == 0)
+				{
+					r.wday = WDAY_MON | WDAY_WED | WDAY_SUN;
+					r.time_from = static_cast<unsigned short>(8 + test_rand(4));
+					r.time_to = static_cast<unsigned short>(12 + test_rand(8));
+				}
+
+				f.rule_add(r);
+			}
+
+			fs_plain.filters.add_element(f);
+			fs_batch.filters.add_element(f);
+		}
+
+		fs_batch.prepare_rule_classifiers();
+
+		static const size_t batch_size = 16;
+		ip_header packets[batch_size];
+		match_batch_packet bpackets[batch_size];
+		filterset_match_list ml_batch[batch_size];
+		filterset_match_list ml_plain;
+		match_batch_state state;
+
+		match_filter_input input;
+		input.mat = &fs_plain.table_mat;
+		input.nModifyCounter = MODIFY_COUNTER_YES;
+		input.mbytes = 1048576;
+
+		match_filter_input binput(input);
+		binput.mat = &fs_batch.table_mat;
+
+		bool is_equal = true;
+		size_t total_matches = 0;
+
+		for (int b = 0; b < 300; b++)
+		{
+			// Every 10 batches the time goes 5 hours forward
+			tm blt = utm::utime(2010, 06, 1 + (b / 10) * 5 / 24, (b / 10) * 5 % 24, 15, 0).to_tm();
+			input.lt = &blt;
+			binput.lt = &blt;
+			input.nPrevFilter = test_rand(2);
+			binput.nPrevFilter = input.nPrevFilter;
+
+			for (size_t i = 0; i < batch_size; i++)
+			{
+				if ((i > 0) && test_rand(2))
+				{
+					packets[i] = packets[i - 1];
+				}
+				else
+				{
+					packets[i].test_fill_packet(0);
+					packets[i].src_ip_addr = addrip_v4(addrs[test_rand(5)]).m_addr + test_rand(2);
+					packets[i].dst_ip_addr = addrip_v4(addrs[test_rand(5)]).m_addr + test_rand(2);
+				}
+
+				bpackets[i].ip = &packets[i];
+				bpackets[i].nPreCheckAddrTables = test_rand(16);
+			}
+
+			fs_batch.match_filters_batch(binput, bpackets, batch_size, ml_batch, state);
+
+			for (size_t i = 0; i < batch_size; i++)
+			{
+				input.ip = &packets[i];
+				input.nPreCheckAddrTables = bpackets[i].nPreCheckAddrTables;
+				fs_plain.match_filters(input, ml_plain);
+
+				total_matches += ml_plain.size();
+
+				if (ml_plain.size() != ml_batch[i].size())
+				{
+					is_equal = false;
+					break;
+				}
+
+				for (size_t k = 0; k < ml_plain.size(); k++)
+				{
+					if ((ml_plain.items[k].filter_id != ml_batch[i].items[k].filter_id) ||
+						(ml_plain.items[k].rule_no != ml_batch[i].items[k].rule_no) ||
+						(ml_plain.items[k].direction != ml_batch[i].items[k].direction))
+					{
+						is_equal = false;
+					}
+				}
+			}
+
+			if (!is_equal)
+				break;
+		}
+
+		TEST_CASE_CHECK(is_equal, true);
+		TEST_CASE_CHECK(total_matches > 0, true);
+
+		auto iter_batch = fs_batch.filters.items.begin();
+		for (auto iter = fs_plain.filters.items.begin(); iter != fs_plain.filters.items.end(); ++iter, ++iter_batch)
+		{
+			TEST_CASE_CHECK(iter_batch->cnt_sent.get_cnt(), iter->cnt_sent.get_cnt());
+			TEST_CASE_CHECK(iter_batch->cnt_recv.get_cnt(), iter->cnt_recv.get_cnt());
+		}
+	}
+}
+#endif
+
+}
@@ -0,0 +1,148 @@
+#ifndef _UTM_FILTERSET_CLASSIFIER_H
+#define _UTM_FILTERSET_CLASSIFIER_H
+
+#pragma once
+#include <utm.h>
+
+#include <list>
+#include <vector>
+#include <memory>
+
+#include "filter2.h"
+#include "rule_classifier.h"
+#include "addrgroup_index.h"
+
+namespace utm {
+
+class filterset;
+
+struct filterset_match
+{
+	unsigned int filter_idx;
+	unsigned int filter_id;
+	filter2* filter_ptr;
+	const rule* rule_ptr;
+	int rule_no;
+	int direction;
+	int action;
+	bool is_limit_exceeded;
+	bool is_rwrfwd;
+};
+
+//
+// Matched filters of a packet: list in the filter order and a bitmap by filter index.
+//
+class filterset_match_list
+{
+public:
+	filterset_match_list();
+	~filterset_match_list();
+
+	std::vector<filterset_match> items;
+
+	// Some checked rule depends on more than the packet headers
+	bool is_volatile;
+
+	void reset(size_t filter_count);
+	void add(unsigned int filter_idx, const match_filter_result& result);
+	void update(size_t pos, const match_filter_result& result);
+
+	size_t size() const { return items.size(); };
+	bool is_matched(unsigned int filter_idx) const { return (filter_idx < bitmap.size() * 32) && ((bitmap[filter_idx >> 5] & (1u << (filter_idx & 31))) != 0); };
+
+private:
+	std::vector<unsigned int> bitmap;
+};
+
+// Per-packet fields of a batch, other fields of match_filter_input are common for the batch
+struct match_batch_packet
+{
+	match_batch_packet() : ip(NULL), nPacketDirection(0), nPreCheckAddrTables(0), dwProcNickIdSrc(0), dwProcNickIdDst(0), uidSrc(0), uidDst(0) { };
+
+	ip_header* ip;
+	unsigned int nPacketDirection;
+	unsigned int nPreCheckAddrTables;
+	unsigned int dwProcNickIdSrc;
+	unsigned int dwProcNickIdDst;
+	int uidSrc;
+	int uidDst;
+};
+
+//
+// Results of the time checks of filters and rules, they are kept while the hour is the same
+//
+class match_batch_state
+{
+public:
+	match_batch_state() : generation(0), epoch(0xFFFFFFFF) { };
+
+	std::vector<unsigned char> filter_enabled;
+	std::vector<unsigned char> rule_enabled;
+
+	unsigned int generation;
+	unsigned int epoch;
+};
+
+//
+// Rules of all filters in one index, so a packet is checked only against the filters
+// which have candidate rules for it.
+//
+class filterset_classifier
+{
+public:
+	static const char this_class_name[];
+
+	filterset_classifier();
+	~filterset_classifier();
+
+	// Compiles rules of every filter, pointers to the filters are kept.
+	// LAT and MAT groups are indexed, so a packet address is classified by one lookup.
+	void compile(std::list<filter2>& filters, const addrtable_v4* lat, addrtablemap_v4* mat, const filterset* owner);
+	bool is_valid_for(const filterset* fs, size_t filter_count) const { return (owner == fs) && (fentries.size() == filter_count); };
+
+	// nPrevFilter of the input is used for the first filter only, other filters get the result of the previous filter
+	void match(const match_filter_input& data, filterset_match_list& matches) const;
+
+	// Sets address groups of the packet addresses and LAT flags of nPreCheckAddrTables
+	void classify_addresses(match_filter_input& data) const;
+
+	// Matches a batch of packets, the common fields are taken from data. The time checks
+	// are done once per hour, the address lookups are shared by neighbour packets of a flow.
+	void match_batch(const match_filter_input& data, const match_batch_packet* packets, size_t count, filterset_match_list* matches, match_batch_state& state) const;
+	void prepare_batch(const tm& lt, match_batch_state& state) const;
+
+	// Time checks of filters and rules give the same result within one hour of one day
+	static unsigned int get_time_epoch(const tm& lt);
+
+	size_t get_filter_count() const { return fentries.size(); };
+	unsigned int get_generation() const { return generation; };
+
+private:
+	struct filter_entry
+	{
+		filter2* filter_ptr;
+		std::shared_ptr<const rule_classifier> rc;
+		unsigned int id_base;
+		unsigned int id_limit;
+	};
+
+	void match_packet(match_filter_input& input, rule_candidates cand, filterset_match_list& matches, const match_batch_state* state) const;
+
+	std::vector<filter_entry> fentries;
+	std::vector<unsigned int> id_filter;
+	rule_index index;
+	std::shared_ptr<const addrgroup_index> groups;
+	const filterset* owner;
+
+	// Unique number of the compiled configuration
+	unsigned int generation;
+
+public:
+#ifdef UTM_DEBUG
+	static void test_all();
+#endif
+};
+
+}
+
+#endif // _UTM_FILTERSET_CLASSIFIER_H
@@ -0,0 +1,776 @@
+#include "stdafx.h"
+#include "filterset_delta.h"
+
+#include <map>
+#include <chrono>
+#include <iostream>
+
+#include <ubase_test.h>
+
+#ifdef UTM_DEBUG
+#include <filtersetcons.h>
+#endif
+
+// The longest encoded number
+#define FSDELTA_MAX_VARINT 10
+
+namespace utm {
+
+const char filterset_delta::this_class_name[] = "filterset_delta";
+
+filterset_delta::filterset_delta() : layout_id(0), layout_seqnum(0), seqnum(0), snapshot_seqnum(0), has_snapshot(false), client_layout_id(0), client_seqnum(FSDELTA_NO_SEQNUM)
+{
+}
+
+filterset_delta::~filterset_delta()
+{
+}
+
+void filterset_delta::put_uint(std::string& s, uint64_t value)
+{
+	while (value >= 0x80)
+	{
+		s.push_back(static_cast<char>(value | 0x80));
+		value >>= 7;
+	}
+
+	s.push_back(static_cast<char>(value));
+}
+
+void filterset_delta::put_int(std::string& s, int64_t value)
+{
+	put_uint(s, (static_cast<uint64_t>(value) << 1) ^ static_cast<uint64_t>(value >> 63));
+}
+
+uint64_t filterset_delta::get_uint(const unsigned char*& p, const unsigned char* end)
+{
+	uint64_t value = 0;
+	for (unsigned int n = 0; (n < FSDELTA_MAX_VARINT) && (p < end); n++)
+	{
+		unsigned char c = *p++;
+		value |= static_cast<uint64_t>(c & 0x7F) << (7 * n);
+		if ((c & 0x80) == 0)
+			return value;
+	}
+
+	throw std::exception("filterset_delta: truncated data");
+}
+
+int64_t filterset_delta::get_int(const unsigned char*& p, const unsigned char* end)
+{
+	uint64_t value = get_uint(p, end);
+	return static_cast<int64_t>(value >> 1) ^ -static_cast<int64_t>(value & 1);
+}
+
+void filterset_delta::put_header(std::string& result, unsigned int type, unsigned int from_seqnum) const
+{
+	unsigned int magic = FSDELTA_MAGIC;
+	for (unsigned int i = 0; i < 4; i++, magic >>= 8)
+		result.push_back(static_cast<char>(magic & 0xFF));
+
+	put_uint(result, FSDELTA_VERSION);
+	put_uint(result, type);
+	put_uint(result, layout_id);
+	put_uint(result, from_seqnum);
+	put_uint(result, seqnum);
+}
+
+bool filterset_delta::is_same_layout(const filterset& fs) const
+{
+	if (layout.size() != fs.filters.items.size())
+		return false;
+
+	unsigned int n = 0;
+	for (auto iter = fs.filters.items.begin(); iter != fs.filters.items.end(); ++iter, n++)
+	{
+		if (layout[n] != iter->get_id())
+			return false;
+	}
+
+	return true;
+}
+
+void filterset_delta::reset_layout(const filterset& fs, unsigned int tick_seqnum)
+{
+	layout.clear();
+	counters.clear();
+	for (auto iter = fs.filters.items.begin(); iter != fs.filters.items.end(); ++iter)
+	{
+		layout.push_back(iter->get_id());
+		counters.push_back(std::make_pair(iter->cnt_sent.get_cnt(), iter->cnt_recv.get_cnt()));
+	}
+
+	layout_id++;
+	layout_seqnum = tick_seqnum;
+	seqnum = tick_seqnum;
+	ticks.clear();
+	has_snapshot = false;
+}
+
+void filterset_delta::update(const filterset& fs)
+{
+	boost::mutex::scoped_lock lock(guard);
+
+	if (fs.fdata.get_total_points() == 0)
+		return;
+
+	unsigned int point = fs.fdata.get_current_point();
+	unsigned int tick_seqnum = fs.fdata.seqnum_array[point];
+
+	if ((layout_id != 0) && (tick_seqnum == seqnum))
+		return;
+
+	// The filters are changed, the clients need the snapshot
+	if ((layout_id == 0) || !is_same_layout(fs))
+	{
+		reset_layout(fs, tick_seqnum);
+		return;
+	}
+
+	std::string changed;
+	unsigned int changed_count = 0;
+	unsigned int prev_index = 0;
+
+	unsigned int n = 0;
+	for (auto iter = fs.filters.items.begin(); iter != fs.filters.items.end(); ++iter, n++)
+	{
+		__int64 sent = iter->cnt_sent.get_cnt();
+		__int64 recv = iter->cnt_recv.get_cnt();
+		unsigned short sent_speed = iter->cnt_sent.cnt_set[point];
+		unsigned short recv_speed = iter->cnt_recv.cnt_set[point];
+
+		if ((sent == counters[n].first) && (recv == counters[n].second) && (sent_speed == 0) && (recv_speed == 0))
+			continue;
+
+		put_uint(changed, n - prev_index);
+		put_int(changed, sent - counters[n].first);
+		put_int(changed, recv - counters[n].second);
+		put_uint(changed, sent_speed);
+		put_uint(changed, recv_speed);
+
+		counters[n].first = sent;
+		counters[n].second = recv;
+		prev_index = n;
+		changed_count++;
+	}
+
+	ticks.push_back(tick());
+	tick& t = ticks.back();
+	t.seqnum = tick_seqnum;
+	put_uint(t.data, tick_seqnum);
+	put_uint(t.data, fs.fdata.time_array[point]);
+	put_uint(t.data, changed_count);
+	t.data.append(changed);
+
+	// The snapshot has the same window
+	if (ticks.size() > MAXVALUES)
+		ticks.pop_front();
+
+	seqnum = tick_seqnum;
+	has_snapshot = false;
+}
+
+void filterset_delta::build(const filterset& fs, unsigned int client_layout, unsigned int client_seq, std::string& result)
+{
+	boost::mutex::scoped_lock lock(guard);
+
+	result.clear();
+
+	// The filters are changed after the last update, the ticks do not fit them any more
+	if ((layout_id != 0) && !is_same_layout(fs))
+		reset_layout(fs, seqnum);
+
+	unsigned int first_seqnum = layout_seqnum;
+	if (!ticks.empty() && (ticks.front().seqnum > first_seqnum + 1))
+		first_seqnum = ticks.front().seqnum - 1;
+
+	if ((layout_id != 0) && (client_layout == layout_id) && (client_seq != FSDELTA_NO_SEQNUM) && (client_seq >= first_seqnum) && (client_seq <= seqnum))
+	{
+		put_header(result, FSDELTA_TYPE_DELTA, client_seq);
+
+		auto iter = ticks.end();
+		unsigned int count = 0;
+		while ((iter != ticks.begin()) && ((iter - 1)->seqnum > client_seq))
+		{
+			--iter;
+			count++;
+		}
+
+		put_uint(result, count);
+		for (; iter != ticks.end(); ++iter)
+			result.append(iter->data);
+
+		return;
+	}
+
+	if (!has_snapshot || (snapshot_seqnum != seqnum))
+		make_snapshot(fs);
+
+	result = snapshot;
+}
+
+void filterset_delta::make_snapshot(const filterset& fs)
+{
+	snapshot.clear();
+	put_header(snapshot, FSDELTA_TYPE_SNAPSHOT, seqnum);
+
+	put_uint(snapshot, layout.size());
+	unsigned int prev_id = 0;
+	for (size_t n = 0; n < layout.size(); n++)
+	{
+		put_int(snapshot, static_cast<int64_t>(layout[n]) - prev_id);
+		put_int(snapshot, counters[n].first);
+		put_int(snapshot, counters[n].second);
+		prev_id = layout[n];
+	}
+
+	// The points up to the last encoded tick
+	const filterset_data& fd = fs.fdata;
+	unsigned int start_index = 0;
+	unsigned int last_index = 0;
+	filterset_data::calc_start_last_index(fd.get_total_points(), fd.get_next_point(), start_index, last_index);
+
+	std::vector<unsigned int> points;
+	for (unsigned int i = start_index; i < last_index; i++)
+	{
+		unsigned int index = i % MAXVALUES;
+		if ((layout_id == 0) || (fd.seqnum_array[index] > seqnum))
+			continue;
+
+		points.push_back(index);
+	}
+
+	put_uint(snapshot, points.size());
+	unsigned int prev_seqnum = 0;
+	fdata_time prev_time = 0;
+	for (size_t i = 0; i < points.size(); i++)
+	{
+		put_uint(snapshot, fd.seqnum_array[points[i]] - prev_seqnum);
+		put_int(snapshot, static_cast<int64_t>(fd.time_array[points[i]]) - prev_time);
+		prev_seqnum = fd.seqnum_array[points[i]];
+		prev_time = fd.time_array[points[i]];
+	}
+
+	// Speed points of the filters, most of them are zero: a token is the value shifted left
+	// or the number of zeros shifted left with the low bit set
+	std::vector<unsigned short> values(points.size() * 2);
+	auto iter = fs.filters.items.begin();
+	for (size_t n = 0; n < layout.size(); n++)
+	{
+		for (size_t i = 0; i < points.size(); i++)
+		{
+			values[i] = iter->cnt_sent.cnt_set[points[i]];
+			values[points.size() + i] = iter->cnt_recv.cnt_set[points[i]];
+		}
+
+		++iter;
+
+		unsigned int zeros = 0;
+		for (size_t i = 0; i < values.size(); i++)
+		{
+			if (values[i] == 0)
+			{
+				zeros++;
+				continue;
+			}
+
+			if (zeros != 0)
+			{
+				put_uint(snapshot, (zeros << 1) | 1);
+				zeros = 0;
+			}
+
+			put_uint(snapshot, static_cast<uint64_t>(values[i]) << 1);
+		}
+
+		if (zeros != 0)
+			put_uint(snapshot, (zeros << 1) | 1);
+	}
+
+	snapshot_seqnum = seqnum;
+	has_snapshot = true;
+}
+
+void filterset_delta::apply(const std::string& data, filterset& fs)
+{
+	const unsigned char* p = reinterpret_cast<const unsigned char*>(data.data());
+	const unsigned char* end = p + data.size();
+
+	if (data.size() < 4)
+		throw std::exception("filterset_delta: truncated data");
+
+	unsigned int magic = p[0] | (p[1] << 8) | (p[2] << 16) | (static_cast<unsigned int>(p[3]) << 24);
+	p += 4;
+
+	if (magic != FSDELTA_MAGIC)
+		throw std::exception("filterset_delta: bad magic");
+
+	if (get_uint(p, end) != FSDELTA_VERSION)
+		throw std::exception("filterset_delta: unknown version");
+
+	unsigned int type = static_cast<unsigned int>(get_uint(p, end));
+	unsigned int data_layout_id = static_cast<unsigned int>(get_uint(p, end));
+	unsigned int from_seqnum = static_cast<unsigned int>(get_uint(p, end));
+	unsigned int to_seqnum = static_cast<unsigned int>(get_uint(p, end));
+
+	std::map<unsigned int, filter2*> filter_by_id;
+	for (auto iter = fs.filters.items.begin(); iter != fs.filters.items.end(); ++iter)
+		filter_by_id[iter->get_id()] = &(*iter);
+
+	if (type == FSDELTA_TYPE_SNAPSHOT)
+	{
+		size_t count = static_cast<size_t>(get_uint(p, end));
+		if (count > static_cast<size_t>(end - p))
+			throw std::exception("filterset_delta: truncated data");
+
+		std::vector<unsigned int> new_layout(count);
+		std::vector<filter2*> ptrs(count);
+		unsigned int prev_id = 0;
+		for (size_t n = 0; n < count; n++)
+		{
+			new_layout[n] = static_cast<unsigned int>(prev_id + get_int(p, end));
+			prev_id = new_layout[n];
+
+			__int64 sent = get_int(p, end);
+			__int64 recv = get_int(p, end);
+
+			auto found = filter_by_id.find(new_layout[n]);
+			if (found == filter_by_id.end())
+				continue;
+
+			ptrs[n] = found->second;
+			ptrs[n]->cnt_sent.reset(true);
+			ptrs[n]->cnt_recv.reset(true);
+			ptrs[n]->cnt_sent.set_cnt(sent);
+			ptrs[n]->cnt_recv.set_cnt(recv);
+		}
+
+		unsigned int points = static_cast<unsigned int>(get_uint(p, end));
+		if (points > MAXVALUES)
+			throw std::exception("filterset_delta: too many points");
+
+		fs.fdata.clear();
+		unsigned int point_seqnum = 0;
+		__int64 point_time = 0;
+		for (unsigned int i = 0; i < points; i++)
+		{
+			point_seqnum += static_cast<unsigned int>(get_uint(p, end));
+			point_time += get_int(p, end);
+			fs.fdata.set_next_seqnum(point_seqnum);
+			fs.fdata.goto_next_point(static_cast<time_t>(point_time));
+		}
+
+		std::vector<unsigned short> values(points * 2);
+		for (size_t n = 0; n < count; n++)
+		{
+			for (size_t i = 0; i < values.size(); )
+			{
+				uint64_t token = get_uint(p, end);
+				if ((token & 1) == 0)
+				{
+					values[i++] = static_cast<unsigned short>(token >> 1);
+					continue;
+				}
+
+				uint64_t zeros = token >> 1;
+				if (zeros > values.size() - i)
+					throw std::exception("filterset_delta: bad speed points");
+
+				for (; zeros != 0; zeros--)
+					values[i++] = 0;
+			}
+
+			if ((ptrs[n] != NULL) && (points != 0))
+				ptrs[n]->apply_diffspeed(points, 0, &values[0], &values[points]);
+		}
+
+		client_layout.swap(new_layout);
+	}
+	else if (type == FSDELTA_TYPE_DELTA)
+	{
+		if ((data_layout_id != client_layout_id) || (from_seqnum != client_seqnum))
+			throw std::exception("filterset_delta: the delta is for another state");
+
+		std::vector<filter2*> ptrs(client_layout.size());
+		for (size_t n = 0; n < client_layout.size(); n++)
+		{
+			auto found = filter_by_id.find(client_layout[n]);
+			if (found != filter_by_id.end())
+				ptrs[n] = found->second;
+		}
+
+		unsigned int tick_count = static_cast<unsigned int>(get_uint(p, end));
+		for (unsigned int t = 0; t < tick_count; t++)
+		{
+			unsigned int tick_seqnum = static_cast<unsigned int>(get_uint(p, end));
+			fdata_time tick_time = static_cast<fdata_time>(get_uint(p, end));
+			unsigned int changed_count = static_cast<unsigned int>(get_uint(p, end));
+
+			unsigned int point = fs.fdata.get_next_point();
+			for (size_t n = 0; n < ptrs.size(); n++)
+			{
+				if (ptrs[n] == NULL)
+					continue;
+
+				ptrs[n]->cnt_sent.cnt_set[point] = 0;
+				ptrs[n]->cnt_recv.cnt_set[point] = 0;
+				ptrs[n]->cnt_sent.cnt_speed = 0;
+				ptrs[n]->cnt_recv.cnt_speed = 0;
+			}
+
+			size_t index = 0;
+			for (unsigned int c = 0; c < changed_count; c++)
+			{
+				index += static_cast<size_t>(get_uint(p, end));
+				if (index >= ptrs.size())
+					throw std::exception("filterset_delta: bad filter index");
+
+				__int64 sent_delta = get_int(p, end);
+				__int64 recv_delta = get_int(p, end);
+				unsigned short sent_speed = static_cast<unsigned short>(get_uint(p, end));
+				unsigned short recv_speed = static_cast<unsigned short>(get_uint(p, end));
+
+				filter2* pf = ptrs[index];
+				if (pf == NULL)
+					continue;
+
+				pf->cnt_sent.add_cnt(sent_delta);
+				pf->cnt_recv.add_cnt(recv_delta);
+				pf->cnt_sent.cnt_set[point] = sent_speed;
+				pf->cnt_recv.cnt_set[point] = recv_speed;
+				pf->cnt_sent.cnt_speed = filtercnt::unpack_speed(sent_speed);
+				pf->cnt_recv.cnt_speed = filtercnt::unpack_speed(recv_speed);
+			}
+
+			fs.fdata.set_next_seqnum(tick_seqnum);
+			fs.fdata.goto_next_point(tick_time);
+		}
+	}
+	else
+	{
+		throw std::exception("filterset_delta: unknown type");
+	}
+
+	client_layout_id = data_layout_id;
+	client_seqnum = to_seqnum;
+}
+
+#ifdef UTM_DEBUG
+static void filterset_delta_tick(filterset& fs, filterset_delta& server, fdata_time time)
+{
+	fs.refresh_points(time, &server);
+}
+
+static bool filterset_delta_equal(const filterset& fs1, const filterset& fs2)
+{
+	if (fs1.fdata.get_total_points() != fs2.fdata.get_total_points())
+		return false;
+
+	if (fs1.fdata.get_next_seqnum() != fs2.fdata.get_next_seqnum())
+		return false;
+
+	unsigned int start_index1 = 0, last_index1 = 0;
+	unsigned int start_index2 = 0, last_index2 = 0;
+	filterset_data::calc_start_last_index(fs1.fdata.get_total_points(), fs1.fdata.get_next_point(), start_index1, last_index1);
+	filterset_data::calc_start_last_index(fs2.fdata.get_total_points(), fs2.fdata.get_next_point(), start_index2, last_index2);
+
+	auto iter2 = fs2.filters.items.begin();
+	for (auto iter1 = fs1.filters.items.begin(); iter1 != fs1.filters.items.end(); ++iter1, ++iter2)
+	{
+		if (iter2 == fs2.filters.items.end())
+			return false;
+
+		if ((iter1->cnt_sent.get_cnt() != iter2->cnt_sent.get_cnt()) || (iter1->cnt_recv.get_cnt() != iter2->cnt_recv.get_cnt()))
+			return false;
+
+		for (unsigned int i = 0; i < last_index1 - start_index1; i++)
+		{
+			unsigned int n1 = (start_index1 + i) % MAXVALUES;
+			unsigned int n2 = (start_index2 + i) % MAXVALUES;
+
+			if ((fs1.fdata.seqnum_array[n1] != fs2.fdata.seqnum_array[n2]) || (fs1.fdata.time_array[n1] != fs2.fdata.time_array[n2]))
+				return false;
+
+			if ((iter1->cnt_sent.cnt_set[n1] != iter2->cnt_sent.cnt_set[n2]) || (iter1->cnt_recv.cnt_set[n1] != iter2->cnt_recv.cnt_set[n2]))
+				return false;
+		}
+	}
+
+	return true;
+}
+
+void filterset_delta::test_all()
+{
+	test_report tr(this_class_name);
+
+	filterset server_fs;
+	filterset client_fs;
+	for (unsigned int i = 1; i <= 4; i++)
+	{
+		filter2 f;
+		f.set_id(i * 10);
+		server_fs.filters.add_element(f);
+		client_fs.filters.add_element(f);
+	}
+
+	filterset_delta server;
+	filterset_delta client;
+	std::string data;
+	fdata_time t0 = 1500000000;
+
+	{
+		// A new client gets the snapshot
+		test_case::classname.assign(this_class_name);
+		test_case::testcase_num = 1;
+
+		server_fs.filters.items.front().cnt_sent.add_cnt(100);
+		filterset_delta_tick(server_fs, server, t0);
+		server_fs.filters.items.back().cnt_recv.add_cnt(3000);
+		filterset_delta_tick(server_fs, server, t0 + 2);
+
+		server.build(server_fs, client.get_layout_id(), client.get_seqnum(), data);
+		client.apply(data, client_fs);
+
+		TEST_CASE_CHECK(server_fs.fdata.get_current_seqnum(), client.get_seqnum());
+		TEST_CASE_CHECK(true, filterset_delta_equal(server_fs, client_fs));
+	}
+
+	{
+		// The ticks after the client seqnum
+		test_case::testcase_num = 2;
+
+		for (unsigned int t = 0; t < 10; t++)
+		{
+			auto iter = server_fs.filters.items.begin();
+			std::advance(iter, t % 4);
+			iter->cnt_sent.add_cnt(1000 * (t + 1));
+			iter->cnt_recv.add_cnt(-50);
+			filterset_delta_tick(server_fs, server, t0 + 4 + t * 2);
+
+			if ((t % 3) == 0)
+			{
+				server.build(server_fs, client.get_layout_id(), client.get_seqnum(), data);
+				TEST_CASE_CHECK(FSDELTA_TYPE_DELTA, static_cast<int>(data[5]));
+				client.apply(data, client_fs);
+			}
+		}
+
+		server.build(server_fs, client.get_layout_id(), client.get_seqnum(), data);
+		client.apply(data, client_fs);
+
+		TEST_CASE_CHECK(server_fs.fdata.get_current_seqnum(), client.get_seqnum());
+		TEST_CASE_CHECK(true, filterset_delta_equal(server_fs, client_fs));
+
+		// Nothing new
+		server.build(server_fs, client.get_layout_id(), client.get_seqnum(), data);
+		client.apply(data, client_fs);
+		TEST_CASE_CHECK(true, filterset_delta_equal(server_fs, client_fs));
+	}
+
+	{
+		// The delta does not fit the state of another client
+		test_case::testcase_num = 3;
+
+		filterset_delta other;
+		server.build(server_fs, client.get_layout_id(), server_fs.fdata.get_current_seqnum() - 1, data);
+
+		bool is_failed = false;
+		try
+		{
+			other.apply(data, client_fs);
+		}
+		catch (const std::exception&)
+		{
+			is_failed = true;
+		}
+
+		TEST_CASE_CHECK(true, is_failed);
+
+		data.assign("UTFX");
+		is_failed = false;
+		try
+		{
+			client.apply(data, client_fs);
+		}
+		catch (const std::exception&)
+		{
+			is_failed = true;
+		}
+
+		TEST_CASE_CHECK(true, is_failed);
+	}
+
+	{
+		// A new filter makes the snapshot
+		test_case::testcase_num = 4;
+
+		filter2 f;
+		f.set_id(50);
+		server_fs.filters.add_element(f);
+		client_fs.filters.add_element(f);
+
+		server_fs.filters.items.back().cnt_sent.add_cnt(777);
+		filterset_delta_tick(server_fs, server, t0 + 40);
+		server_fs.filters.items.front().cnt_recv.add_cnt(5);
+		filterset_delta_tick(server_fs, server, t0 + 42);
+
+		server.build(server_fs, client.get_layout_id(), client.get_seqnum(), data);
+		TEST_CASE_CHECK(FSDELTA_TYPE_SNAPSHOT, static_cast<int>(data[5]));
+		client.apply(data, client_fs);
+
+		TEST_CASE_CHECK(server_fs.fdata.get_current_seqnum(), client.get_seqnum());
+		TEST_CASE_CHECK(true, filterset_delta_equal(server_fs, client_fs));
+
+		server_fs.filters.items.back().cnt_recv.add_cnt(9000);
+		filterset_delta_tick(server_fs, server, t0 + 44);
+
+		server.build(server_fs, client.get_layout_id(), client.get_seqnum(), data);
+		TEST_CASE_CHECK(FSDELTA_TYPE_DELTA, static_cast<int>(data[5]));
+		client.apply(data, client_fs);
+		TEST_CASE_CHECK(true, filterset_delta_equal(server_fs, client_fs));
+	}
+
+	{
+		// A client behind the ring gets the snapshot
+		test_case::testcase_num = 5;
+
+		unsigned int old_seqnum = client.get_seqnum();
+		for (unsigned int t = 0; t < MAXVALUES + 10; t++)
+		{
+			server_fs.filters.items.front().cnt_sent.add_cnt(t);
+			filterset_delta_tick(server_fs, server, t0 + 46 + t * 2);
+		}
+
+		server.build(server_fs, client.get_layout_id(), old_seqnum, data);
+		TEST_CASE_CHECK(FSDELTA_TYPE_SNAPSHOT, static_cast<int>(data[5]));
+		client.apply(data, client_fs);
+
+		TEST_CASE_CHECK(server_fs.fdata.get_current_seqnum(), client.get_seqnum());
+		TEST_CASE_CHECK(true, filterset_delta_equal(server_fs, client_fs));
+	}
+
+	{
+		// The filters are changed between the refreshes, the snapshot has the new layout
+		test_case::testcase_num = 6;
+
+		server_fs.filters.items.erase(server_fs.filters.items.begin());
+		client_fs.filters.items.erase(client_fs.filters.items.begin());
+		server_fs.filters.items.back().cnt_sent.add_cnt(12);
+
+		server.build(server_fs, client.get_layout_id(), client.get_seqnum(), data);
+		TEST_CASE_CHECK(FSDELTA_TYPE_SNAPSHOT, static_cast<int>(data[5]));
+		client.apply(data, client_fs);
+		TEST_CASE_CHECK(true, filterset_delta_equal(server_fs, client_fs));
+
+		filterset_delta_tick(server_fs, server, t0 + 400);
+		server.build(server_fs, client.get_layout_id(), client.get_seqnum(), data);
+		TEST_CASE_CHECK(FSDELTA_TYPE_DELTA, static_cast<int>(data[5]));
+		client.apply(data, client_fs);
+		TEST_CASE_CHECK(true, filterset_delta_equal(server_fs, client_fs));
+	}
+
+	{
+		// The request and the answer in the console XML
+		test_case::testcase_num = 7;
+
+		server_fs.filters.items.front().cnt_recv.add_cnt(4321);
+		filterset_delta_tick(server_fs, server, t0 + 402);
+
+		filtersetcons request;
+		request.make_delta_request(client);
+
+		std::string xml;
+		request.xml_get_string(xml);
+
+		filtersetcons answer;
+		answer.xml_parse(xml.c_str());
+		TEST_CASE_CHECK(true, answer.delta_request);
+		answer.fill_from_delta(server_fs, server);
+		answer.xml_get_string(xml);
+
+		filtersetcons received;
+		received.xml_parse(xml.c_str());
+		received.apply_delta(client, client_fs);
+
+		TEST_CASE_CHECK(server_fs.fdata.get_current_seqnum(), client.get_seqnum());
+		TEST_CASE_CHECK(true, filterset_delta_equal(server_fs, client_fs));
+	}
+
+	return;
+}
+
+void filterset_delta::benchmark()
+{
+	const unsigned int filters = 5000;
+	const unsigned int polls = 20;
+
+	filterset fs;
+	for (unsigned int i = 1; i <= filters; i++)
+	{
+		filter2 f;
+		f.set_id(i);
+		fs.filters.add_element(f);
+	}
+
+	filterset_delta server;
+	fdata_time t0 = 1500000000;
+
+	// A tenth of the filters have traffic in a tick
+	unsigned int tick_num = 0;
+	auto make_tick = [&]()
+	{
+		unsigned int n = 0;
+		for (auto iter = fs.filters.items.begin(); iter != fs.filters.items.end(); ++iter, n++)
+		{
+			if (((n + tick_num) % 10) == 0)
+			{
+				iter->cnt_sent.add_cnt(1500 + n);
+				iter->cnt_recv.add_cnt(40000 + n * 3);
+			}
+		}
+
+		filterset_delta_tick(fs, server, t0 + tick_num * REFRESH_INTERVAL);
+		tick_num++;
+	};
+
+	for (unsigned int i = 0; i < MAXVALUES; i++)
+		make_tick();
+
+	std::string data;
+	size_t delta_bytes = 0;
+	size_t xml_bytes = 0;
+	std::chrono::nanoseconds delta_ns(0);
+	std::chrono::nanoseconds xml_ns(0);
+
+	// A poll after every tick, the old way and the new one
+	for (unsigned int i = 0; i < polls; i++)
+	{
+		unsigned int seqnum = fs.fdata.get_current_seqnum();
+		make_tick();
+
+		std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+		server.build(fs, 1, seqnum, data);
+		delta_ns += std::chrono::steady_clock::now() - start;
+		delta_bytes += data.size();
+
+		start = std::chrono::steady_clock::now();
+		filtersetcons fsc;
+		fsc.fill_from_filterset(fs, seqnum);
+
+		std::string xml;
+		fsc.xml_get_string(xml, false);
+		xml_ns += std::chrono::steady_clock::now() - start;
+		xml_bytes += xml.size();
+	}
+
+	std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+	server.build(fs, 0, FSDELTA_NO_SEQNUM, data);
+	std::chrono::nanoseconds snapshot_ns = std::chrono::steady_clock::now() - start;
+
+	std::cout << this_class_name << ": delta: " << delta_bytes / polls << " bytes, " << delta_ns.count() / polls << " ns/poll" << std::endl;
+	std::cout << this_class_name << ": xml diff: " << xml_bytes / polls << " bytes, " << xml_ns.count() / polls << " ns/poll" << std::endl;
+	std::cout << this_class_name << ": snapshot: " << data.size() << " bytes, " << snapshot_ns.count() << " ns" << std::endl;
+}
+#endif
+
+}
@@ -0,0 +1,104 @@
+#ifndef _UTM_FILTERSET_DELTA_H
+#define _UTM_FILTERSET_DELTA_H
+
+#pragma once
+#include <utm.h>
+
+#include <filterset.h>
+
+#include <deque>
+#include <string>
+#include <utility>
+#include <vector>
+
+#include <boost/thread/mutex.hpp>
+
+#define FSDELTA_MAGIC 0x44465455			// "UTFD"
+#define FSDELTA_VERSION 1
+
+#define FSDELTA_TYPE_SNAPSHOT 0
+#define FSDELTA_TYPE_DELTA 1
+
+#define FSDELTA_NO_SEQNUM 0xFFFFFFFF		// the client has no data yet
+
+namespace utm {
+
+//
+// Binary replacement of the filtersetcons diffs. The server encodes every refresh tick once:
+// the point sequence number and time, then the filters which changed in the tick with their
+// counter differences and speed points. A client sends the layout and the sequence number it
+// has and gets the ticks after it, or the snapshot of the counters and the whole point window
+// if the ticks are gone or the filters changed. The snapshot is also made once per tick.
+// The delta travels in the filtersetcons blob, see filtersetcons::fill_from_delta().
+//
+// All numbers are varints, signed ones are zigzag coded. Filters of a tick are given by their
+// index in the filter layout of the snapshot.
+//
+class filterset_delta
+{
+	struct tick
+	{
+		unsigned int seqnum;
+		std::string data;
+	};
+
+public:
+	static const char this_class_name[];
+
+	filterset_delta();
+	~filterset_delta();
+
+	// Server: encodes the last point of the filterset, called by filterset::refresh_points()
+	void update(const filterset& fs);
+
+	// Server: the ticks after the seqnum of the client layout or the snapshot
+	void build(const filterset& fs, unsigned int layout, unsigned int seqnum, std::string& result);
+
+	// Client: applies the result of build() to its copy of the filterset
+	void apply(const std::string& data, filterset& fs);
+
+	// Client: the layout and the sequence number to send
+	unsigned int get_layout_id() const { return client_layout_id; };
+	unsigned int get_seqnum() const { return client_seqnum; };
+
+private:
+	filterset_delta(const filterset_delta&);
+	filterset_delta& operator=(const filterset_delta&);
+
+	bool is_same_layout(const filterset& fs) const;
+	void reset_layout(const filterset& fs, unsigned int tick_seqnum);
+	void make_snapshot(const filterset& fs);
+	void put_header(std::string& result, unsigned int type, unsigned int from_seqnum) const;
+
+	static void put_uint(std::string& s, uint64_t value);
+	static void put_int(std::string& s, int64_t value);
+	static uint64_t get_uint(const unsigned char*& p, const unsigned char* end);
+	static int64_t get_int(const unsigned char*& p, const unsigned char* end);
+
+	// Server
+	std::vector<unsigned int> layout;
+	unsigned int layout_id;
+	unsigned int layout_seqnum;					// ticks after it have the layout
+	std::vector<std::pair<__int64, __int64> > counters;
+	unsigned int seqnum;
+	std::deque<tick> ticks;
+	std::string snapshot;
+	unsigned int snapshot_seqnum;
+	bool has_snapshot;
+	boost::mutex guard;
+
+	// Client
+	std::vector<unsigned int> client_layout;
+	unsigned int client_layout_id;
+	unsigned int client_seqnum;
+
+#ifdef UTM_DEBUG
+public:
+	static void test_all();
+	static void benchmark();
+#endif
+};
+
+}
+
+#endif // _UTM_FILTERSET_DELTA_H
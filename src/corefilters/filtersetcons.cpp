@@ -90,6 +90,33 @@ void filtersetcons::apply_to_filterset(filterset& fs)
 	}
 }
 
+void filtersetcons::make_delta_request(const filterset_delta& client)
+{
+	delta_request = true;
+	delta_layout = client.get_layout_id();
+	delta_seqnum = client.get_seqnum();
+}
+
+void filtersetcons::fill_from_delta(const filterset& fs, filterset_delta& server)
+{
+	std::string data;
+	server.build(fs, delta_layout, delta_seqnum, data);
+
+	total_points = fs.fdata.get_total_points();
+	next_seqnum = fs.fdata.get_next_seqnum();
+
+	delta.set(reinterpret_cast<unsigned char*>(&data[0]), data.size());
+}
+
+void filtersetcons::apply_delta(filterset_delta& client, filterset& fs) const
+{
+	std::string data;
+	if (delta.size() != 0)
+		data.assign(reinterpret_cast<const char*>(delta.get()), delta.size());
+
+	client.apply(data, fs);
+}
+
 ubase* filtersetcons::xml_catch_subnode(const char *keyname)
 {
 	ubase *u = NULL;
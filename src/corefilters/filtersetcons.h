@@ -6,6 +6,7 @@
 
 #include <filtersetcons_base.h>
 #include <filterset.h>
+#include <filterset_delta.h>
 
 namespace utm {
 
@@ -18,6 +19,15 @@ public:
 	void fill_from_filterset(const filterset& fs, unsigned int seqnum);
 	void apply_to_filterset(filterset& fs);
 
+	// Client: asks for the delta of the layout and the seqnum it has instead of the diffs
+	void make_delta_request(const filterset_delta& client);
+
+	// Server: answers the delta request, the points are encoded by filterset::refresh_points()
+	void fill_from_delta(const filterset& fs, filterset_delta& server);
+
+	// Client: applies the answer, the seqnum for the next request is kept by the client
+	void apply_delta(filterset_delta& client, filterset& fs) const;
+
 	ubase* xml_catch_subnode(const char *keyname);
 	void xml_catch_subnode_finished(const char *keyname);
 
@@ -43,6 +43,10 @@ filtersetcons_base& filtersetcons_base::operator=(const filtersetcons_base& rhs)
     start_diffindex = rhs.start_diffindex;
     diff_seqnum = rhs.diff_seqnum;
     diff_time = rhs.diff_time;
+    delta_request = rhs.delta_request;
+    delta_layout = rhs.delta_layout;
+    delta_seqnum = rhs.delta_seqnum;
+    delta = rhs.delta;
     filtercons_s = rhs.filtercons_s;
     return *this;
 }
@@ -60,6 +64,10 @@ bool filtersetcons_base::operator==(const filtersetcons_base& rhs) const
     if (!(start_diffindex == rhs.start_diffindex)) return false;
     if (!(diff_seqnum == rhs.diff_seqnum)) return false;
     if (!(diff_time == rhs.diff_time)) return false;
+    if (!(delta_request == rhs.delta_request)) return false;
+    if (!(delta_layout == rhs.delta_layout)) return false;
+    if (!(delta_seqnum == rhs.delta_seqnum)) return false;
+    if (!(delta == rhs.delta)) return false;
     if (!(filtercons_s == rhs.filtercons_s)) return false;
 
     return true;
@@ -78,6 +86,10 @@ void filtersetcons_base::clear()
     start_diffindex = 0;
     diff_seqnum.clear();
     diff_time.clear();
+    delta_request = false;
+    delta_layout = 0;
+    delta_seqnum = 0;
+    delta.clear();
     filtercons_s.clear();
 }
 
@@ -107,6 +119,10 @@ void filtersetcons_base::xml_create()
     xml_append_node("dindex", start_diffindex, orig.start_diffindex);
     xml_append_node("SN", diff_seqnum, orig.diff_seqnum);
     xml_append_node("TM", diff_time, orig.diff_time);
+    xml_append_node("DR", delta_request, orig.delta_request);
+    xml_append_node("DL", delta_layout, orig.delta_layout);
+    xml_append_node("DS", delta_seqnum, orig.delta_seqnum);
+    xml_append_node("DT", delta, orig.delta);
     xml_append_node("F", get_filtercons());
 }
 
@@ -123,6 +139,10 @@ void filtersetcons_base::xml_catch_value(const char *keyname, const char *keyval
     if (xml_check_value(keyname, "dindex", keyvalue, start_diffindex)) return;
     if (xml_check_value(keyname, "SN", keyvalue, diff_seqnum)) return;
     if (xml_check_value(keyname, "TM", keyvalue, diff_time)) return;
+    if (xml_check_value(keyname, "DR", keyvalue, delta_request)) return;
+    if (xml_check_value(keyname, "DL", keyvalue, delta_layout)) return;
+    if (xml_check_value(keyname, "DS", keyvalue, delta_seqnum)) return;
+    if (xml_check_value(keyname, "DT", keyvalue, delta)) return;
     if (xml_check_value(keyname, "F", keyvalue, boost::bind(&filtersetcons_base::parse_filtercons_string,this,_1))) return;
 }
 
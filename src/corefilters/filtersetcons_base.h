@@ -48,6 +48,10 @@ public:
     unsigned int start_diffindex;
     blob diff_seqnum;
     blob diff_time;
+    bool delta_request;
+    unsigned int delta_layout;
+    unsigned int delta_seqnum;
+    blob delta;
     filterconslist filtercons_s;
 
 
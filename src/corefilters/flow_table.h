@@ -0,0 +1,180 @@
+#ifndef _FLOW_TABLE_H
+#define _FLOW_TABLE_H
+
+#pragma once
+
+#include <vector>
+
+namespace utm {
+
+//
+// Open addressing hash table with linear probing. Keys and values are kept inline in one
+// array, the key hash is computed by the caller once and stored in the slot. Deletion
+// shifts the following entries back, so there are no tombstones.
+// K must have operator==, K and V must be default constructible. Not thread safe.
+//
+template<class K, class V>
+class flow_table
+{
+	struct slot
+	{
+		slot() : used(false), hash(0) { };
+
+		bool used;
+		unsigned int hash;
+		K key;
+		V value;
+	};
+
+public:
+	flow_table() : count(0), mask(0) { };
+
+	size_t size() const { return count; };
+	bool empty() const { return count == 0; };
+	size_t capacity() const { return slots.size(); };
+
+	void clear()
+	{
+		slots.clear();
+		count = 0;
+		mask = 0;
+	}
+
+	V* find(const K& key, unsigned int hash)
+	{
+		if (count == 0)
+			return NULL;
+
+		for (size_t idx = hash & mask; slots[idx].used; idx = (idx + 1) & mask)
+		{
+			if ((slots[idx].hash == hash) && (slots[idx].key == key))
+				return &slots[idx].value;
+		}
+
+		return NULL;
+	}
+
+	// Returns the value of the new entry, the key must not be in the table
+	V* insert(const K& key, unsigned int hash, const V& value)
+	{
+		if ((count + 1) * 8 > slots.size() * 7)
+			grow();
+
+		size_t idx = hash & mask;
+		while (slots[idx].used)
+			idx = (idx + 1) & mask;
+
+		slot& s = slots[idx];
+		s.used = true;
+		s.hash = hash;
+		s.key = key;
+		s.value = value;
+		count++;
+
+		return &s.value;
+	}
+
+	bool erase(const K& key, unsigned int hash)
+	{
+		if (count == 0)
+			return false;
+
+		for (size_t idx = hash & mask; slots[idx].used; idx = (idx + 1) & mask)
+		{
+			if ((slots[idx].hash == hash) && (slots[idx].key == key))
+			{
+				erase_at(idx);
+				return true;
+			}
+		}
+
+		return false;
+	}
+
+	// Calls f(key, value) for every entry and erases the entries for which it returns true.
+	// Every entry is visited once.
+	template<class F>
+	void erase_if(F f)
+	{
+		if (count == 0)
+			return;
+
+		// Start after an empty slot, so no probe sequence wraps over the starting point
+		size_t start = 0;
+		while (slots[start].used)
+			start++;
+
+		size_t idx = (start + 1) & mask;
+		for (size_t n = 0; n < slots.size(); n++)
+		{
+			while (slots[idx].used && f(static_cast<const K&>(slots[idx].key), slots[idx].value))
+			{
+				// The next entry of the cluster is moved here, check it in place
+				erase_at(idx);
+			}
+
+			idx = (idx + 1) & mask;
+		}
+	}
+
+	template<class F>
+	void for_each(F f) const
+	{
+		for (size_t idx = 0; idx < slots.size(); idx++)
+		{
+			if (slots[idx].used)
+				f(slots[idx].key, slots[idx].value);
+		}
+	}
+
+private:
+	void erase_at(size_t idx)
+	{
+		size_t next = (idx + 1) & mask;
+
+		while (slots[next].used)
+		{
+			// The entry can fill the hole if the hole lies on its probe sequence
+			size_t home = slots[next].hash & mask;
+			if (((next - home) & mask) >= ((next - idx) & mask))
+			{
+				slots[idx] = slots[next];
+				idx = next;
+			}
+
+			next = (next + 1) & mask;
+		}
+
+		slots[idx] = slot();
+		count--;
+	}
+
+	void grow()
+	{
+		std::vector<slot> old;
+		old.swap(slots);
+
+		slots.resize(old.empty() ? 64 : old.size() * 2);
+		mask = slots.size() - 1;
+
+		for (size_t i = 0; i < old.size(); i++)
+		{
+			if (!old[i].used)
+				continue;
+
+			size_t idx = old[i].hash & mask;
+			while (slots[idx].used)
+				idx = (idx + 1) & mask;
+
+			slots[idx] = old[i];
+		}
+	}
+
+	std::vector<slot> slots;
+	size_t count;
+	size_t mask;
+};
+
+}
+
+#endif // _FLOW_TABLE_H
@@ -0,0 +1,165 @@
+#ifndef _FLOW_WHEEL_H
+#define _FLOW_WHEEL_H
+
+#pragma once
+
+#include <vector>
+
+#define FLOWWHEEL_SIZE 256		// power of two, FLOWWHEEL_SIZE*FLOWWHEEL_TICK must exceed the flow timeout
+#define FLOWWHEEL_TICK 4
+
+// Results of the timer check callback
+#define FLOWWHEEL_STALE 0		// the flow is gone or has a newer timer, the timer is dropped
+#define FLOWWHEEL_MOVED 1		// the flow was updated, the timer is moved to new_due
+#define FLOWWHEEL_DUE 2			// the flow is removed by the callback, the timer is dropped
+
+namespace utm {
+
+template<class K>
+struct flow_timer
+{
+	flow_timer() : hash(0), due(0) { };
+	flow_timer(const K& _key, unsigned int _hash, unsigned int _due) : key(_key), hash(_hash), due(_due) { };
+
+	K key;
+	unsigned int hash;
+	unsigned int due;
+};
+
+//
+// Timing wheel of flow expiry times. Timers are not moved when a flow is updated: the owner
+// keeps the due time of the valid timer in the flow and checks every timer which comes up.
+// The check callback is int check(const K& key, unsigned int hash, unsigned int due, unsigned int& new_due).
+// Not thread safe.
+//
+template<class K>
+class flow_wheel
+{
+public:
+	flow_wheel() : tick(0) { };
+
+	void clear()
+	{
+		buckets.clear();
+		tick = 0;
+	}
+
+	void set_timer(const K& key, unsigned int hash, unsigned int due)
+	{
+		if (buckets.empty())
+			buckets.resize(FLOWWHEEL_SIZE);
+
+		buckets[get_bucket(due)].push_back(flow_timer<K>(key, hash, due));
+	}
+
+	// Checks the timers due before now in the ticks passed since the last call
+	template<class F>
+	void expire(unsigned int now, F check)
+	{
+		if (now == 0)
+			return;
+
+		unsigned int last_tick = (now - 1) / FLOWWHEEL_TICK;
+
+		if (buckets.empty() || (last_tick < tick))
+			return;
+
+		unsigned int ticks = last_tick - tick + 1;
+		if (ticks > FLOWWHEEL_SIZE)
+			ticks = FLOWWHEEL_SIZE;
+
+		for (unsigned int n = 0; n < ticks; n++)
+		{
+			size_t b = (tick + n) & (FLOWWHEEL_SIZE - 1);
+			std::vector<flow_timer<K> >& bucket = buckets[b];
+
+			size_t i = 0;
+			while (i < bucket.size())
+			{
+				// A later round of the wheel
+				if (bucket[i].due >= now)
+				{
+					i++;
+					continue;
+				}
+
+				check_timer(b, i, check);
+			}
+		}
+
+		// The last tick may get more due timers before the next call
+		tick = last_tick;
+	}
+
+	// Checks the timers from the current tick on until the callback removes a flow.
+	// Returns false if there is no valid timer.
+	template<class F>
+	bool evict(F check)
+	{
+		if (buckets.empty())
+			return false;
+
+		for (size_t n = 0; n < FLOWWHEEL_SIZE; n++)
+		{
+			size_t b = (tick + n) & (FLOWWHEEL_SIZE - 1);
+
+			size_t i = 0;
+			while (i < buckets[b].size())
+			{
+				if (check_timer(b, i, check) == FLOWWHEEL_DUE)
+					return true;
+			}
+		}
+
+		return false;
+	}
+
+private:
+	static size_t get_bucket(unsigned int due)
+	{
+		return (due / FLOWWHEEL_TICK) & (FLOWWHEEL_SIZE - 1);
+	}
+
+	static void remove_timer(std::vector<flow_timer<K> >& bucket, size_t i)
+	{
+		bucket[i] = bucket.back();
+		bucket.pop_back();
+	}
+
+	template<class F>
+	int check_timer(size_t b, size_t& i, F& check)
+	{
+		std::vector<flow_timer<K> >& bucket = buckets[b];
+		flow_timer<K> t = bucket[i];
+
+		unsigned int new_due = t.due;
+		int res = check(static_cast<const K&>(t.key), t.hash, t.due, new_due);
+
+		if (res != FLOWWHEEL_MOVED)
+		{
+			remove_timer(bucket, i);
+			return res;
+		}
+
+		size_t nb = get_bucket(new_due);
+		if (nb == b)
+		{
+			bucket[i].due = new_due;
+			i++;
+		}
+		else
+		{
+			remove_timer(bucket, i);
+			buckets[nb].push_back(flow_timer<K>(t.key, t.hash, new_due));
+		}
+
+		return res;
+	}
+
+	std::vector<std::vector<flow_timer<K> > > buckets;
+	unsigned int tick;		// ticks before this one are processed
+};
+
+}
+
+#endif // _FLOW_WHEEL_H
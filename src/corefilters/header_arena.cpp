@@ -0,0 +1,225 @@
+#include "stdafx.h"
+#include "header_arena.h"
+
+#include <cstring>
+#include <ubase_test.h>
+
+namespace utm {
+
+const char header_arena::this_class_name[] = "header_arena";
+
+header_arena::header_arena() : used(0)
+{
+}
+
+header_arena::header_arena(const header_arena& rhs) : used(0)
+{
+	copy(rhs);
+}
+
+header_arena::~header_arena()
+{
+}
+
+header_arena& header_arena::operator=(const header_arena& rhs)
+{
+	if (this != &rhs)
+		copy(rhs);
+
+	return *this;
+}
+
+void header_arena::copy(const header_arena& rhs)
+{
+	for (unsigned int cls = 0; cls < HEADER_ARENA_CLASSES; cls++)
+	{
+		// The slab list must not be reallocated, readers index it without a lock
+		if (!rhs.slabs[cls].empty())
+			slabs[cls].reserve(HEADER_ARENA_MAX_SLABS);
+
+		slabs[cls] = rhs.slabs[cls];
+		free_blocks[cls] = rhs.free_blocks[cls];
+	}
+
+	retired = rhs.retired;
+	released = rhs.released;
+	used = rhs.used;
+}
+
+unsigned int header_arena::get_class(size_t size)
+{
+	unsigned int cls = 0;
+	while ((cls < HEADER_ARENA_CLASSES - 1) && (get_block_size(cls) < size))
+		cls++;
+
+	return cls;
+}
+
+char* header_arena::get(const header_ref& ref)
+{
+	return const_cast<char*>(static_cast<const header_arena*>(this)->get(ref));
+}
+
+const char* header_arena::get(const header_ref& ref) const
+{
+	if (ref.empty())
+		return NULL;
+
+	unsigned int cls = ref.block >> 24;
+	unsigned int num = ref.block & 0x00FFFFFF;
+	size_t per_slab = HEADER_ARENA_SLAB_SIZE / get_block_size(cls);
+
+	return &slabs[cls][num / per_slab][(num % per_slab) * get_block_size(cls)];
+}
+
+size_t header_arena::get_capacity(const header_ref& ref) const
+{
+	if (ref.empty())
+		return 0;
+
+	return get_block_size(ref.block >> 24);
+}
+
+bool header_arena::add_slab(unsigned int cls)
+{
+	std::vector<std::vector<char> >& sl = slabs[cls];
+	if (sl.size() >= HEADER_ARENA_MAX_SLABS)
+		return false;
+
+	if (sl.empty())
+		sl.reserve(HEADER_ARENA_MAX_SLABS);
+
+	sl.push_back(std::vector<char>(HEADER_ARENA_SLAB_SIZE));
+
+	// Blocks of the slab are taken in order
+	size_t per_slab = HEADER_ARENA_SLAB_SIZE / get_block_size(cls);
+	unsigned int first = static_cast<unsigned int>((sl.size() - 1) * per_slab);
+	for (size_t i = per_slab; i > 0; i--)
+		free_blocks[cls].push_back((cls << 24) | (first + static_cast<unsigned int>(i - 1)));
+
+	return true;
+}
+
+unsigned int header_arena::alloc_block(unsigned int cls)
+{
+	if (free_blocks[cls].empty() && !add_slab(cls))
+		return HEADER_NO_BLOCK;
+
+	unsigned int block = free_blocks[cls].back();
+	free_blocks[cls].pop_back();
+	used++;
+
+	return block;
+}
+
+void header_arena::free_block(unsigned int block)
+{
+	free_blocks[block >> 24].push_back(block);
+	used--;
+}
+
+size_t header_arena::reserve(header_ref& ref, size_t size)
+{
+	size_t cap = get_capacity(ref);
+	if ((cap >= size) || (cap == HEADER_ARENA_MAX_BLOCK))
+		return cap;
+
+	unsigned int block = alloc_block(get_class(size));
+	if (block == HEADER_NO_BLOCK)
+		return cap;
+
+	header_ref newref;
+	newref.block = block;
+	newref.length = ref.length;
+
+	if (!ref.empty())
+	{
+		memcpy(get(newref), get(ref), ref.length);
+		retire(ref);
+	}
+
+	ref = newref;
+	return get_capacity(ref);
+}
+
+void header_arena::retire(header_ref& ref)
+{
+	if (ref.empty())
+		return;
+
+	retired.push_back(ref.block);
+	ref = header_ref();
+}
+
+void header_arena::recycle()
+{
+	for (size_t i = 0; i < released.size(); i++)
+		free_block(released[i]);
+
+	released.clear();
+	released.swap(retired);
+}
+
+size_t header_arena::get_memory_usage() const
+{
+	size_t n = 0;
+	for (unsigned int cls = 0; cls < HEADER_ARENA_CLASSES; cls++)
+		n += slabs[cls].size() * HEADER_ARENA_SLAB_SIZE;
+
+	return n;
+}
+
+#ifdef UTM_DEBUG
+void header_arena::test_all()
+{
+	test_report tr(this_class_name);
+
+	header_arena ha;
+	header_ref ref;
+
+	TEST_CASE_CHECK(true, ha.get(ref) == NULL);
+	TEST_CASE_CHECK(size_t(256), ha.reserve(ref, 10));
+	TEST_CASE_CHECK(size_t(1), ha.get_block_count());
+
+	memcpy(ha.get(ref), "GET / HTTP/1.1", 14);
+	ref.length = 14;
+
+	// The data is moved to a larger block, the old one is reused after two recycles
+	header_ref copied = ref;
+	TEST_CASE_CHECK(size_t(2048), ha.reserve(ref, 1500));
+	TEST_CASE_CHECK(size_t(2), ha.get_block_count());
+	TEST_CASE_CHECK(0, memcmp(ha.get(ref), "GET / HTTP/1.1", 14));
+	TEST_CASE_CHECK(size_t(14), size_t(ref.length));
+
+	ha.recycle();
+	TEST_CASE_CHECK(size_t(2), ha.get_block_count());
+	TEST_CASE_CHECK(0, memcmp(ha.get(copied), "GET / HTTP/1.1", 14));
+
+	ha.recycle();
+	TEST_CASE_CHECK(size_t(1), ha.get_block_count());
+
+	// The freed block is taken again
+	header_ref ref2;
+	ha.reserve(ref2, 100);
+	TEST_CASE_CHECK(copied.block, ref2.block);
+
+	TEST_CASE_CHECK(size_t(HEADER_ARENA_MAX_BLOCK), ha.reserve(ref, 100000));
+	TEST_CASE_CHECK(0, memcmp(ha.get(ref), "GET / HTTP/1.1", 14));
+
+	header_arena ha2(ha);
+	TEST_CASE_CHECK(ha.get_block_count(), ha2.get_block_count());
+	TEST_CASE_CHECK(0, memcmp(ha2.get(ref), "GET / HTTP/1.1", 14));
+	TEST_CASE_CHECK(true, ha2.get(ref) != ha.get(ref));
+
+	ha.retire(ref);
+	ha.retire(ref2);
+	TEST_CASE_CHECK(true, ref.empty());
+	ha.recycle();
+	ha.recycle();
+	TEST_CASE_CHECK(size_t(0), ha.get_block_count());
+
+	return;
+}
+#endif
+
+}
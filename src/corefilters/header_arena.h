@@ -0,0 +1,87 @@
+#ifndef _HEADER_ARENA_H
+#define _HEADER_ARENA_H
+
+#pragma once
+
+#include <vector>
+
+#define HEADER_ARENA_CLASSES 7
+#define HEADER_ARENA_MIN_BLOCK 256
+#define HEADER_ARENA_MAX_BLOCK (HEADER_ARENA_MIN_BLOCK << (HEADER_ARENA_CLASSES - 1))
+#define HEADER_ARENA_SLAB_SIZE 65536
+#define HEADER_ARENA_MAX_SLABS 64
+#define HEADER_NO_BLOCK 0xFFFFFFFF
+
+namespace utm {
+
+// Handle of the bytes kept in a header_arena
+struct header_ref
+{
+	header_ref() : block(HEADER_NO_BLOCK), length(0) { };
+
+	bool empty() const { return block == HEADER_NO_BLOCK; };
+
+	unsigned int block;			// size class in the high byte, block number in the class below
+	unsigned int length;
+};
+
+//
+// Slab storage of captured header bytes. Blocks of power of two sizes are carved from
+// fixed slabs and reused through free lists, so a steady flow of captures allocates nothing.
+// A retired block is reused only after two recycle() calls: copies of its handle taken
+// before the next recycle() stay valid until the one after it.
+// Not thread safe, but slabs never move, so get() may be called by a reader which got
+// the handle under the lock of the writer.
+//
+class header_arena
+{
+public:
+	static const char this_class_name[];
+
+public:
+	header_arena();
+	header_arena(const header_arena& rhs);
+	~header_arena();
+
+	header_arena& operator=(const header_arena& rhs);
+
+	char* get(const header_ref& ref);
+	const char* get(const header_ref& ref) const;
+
+	size_t get_capacity(const header_ref& ref) const;
+
+	// Makes the block of the handle hold at least size bytes (up to HEADER_ARENA_MAX_BLOCK),
+	// the data is moved to a larger block if needed. Returns the capacity of the block.
+	size_t reserve(header_ref& ref, size_t size);
+
+	// The block is reused after two recycle() calls
+	void retire(header_ref& ref);
+	void recycle();
+
+	size_t get_block_count() const { return used; };
+	size_t get_memory_usage() const;
+
+private:
+	static unsigned int get_class(size_t size);
+	static size_t get_block_size(unsigned int cls) { return static_cast<size_t>(HEADER_ARENA_MIN_BLOCK) << cls; };
+
+	void copy(const header_arena& rhs);
+	bool add_slab(unsigned int cls);
+	unsigned int alloc_block(unsigned int cls);
+	void free_block(unsigned int block);
+
+	std::vector<std::vector<char> > slabs[HEADER_ARENA_CLASSES];
+	std::vector<unsigned int> free_blocks[HEADER_ARENA_CLASSES];
+	std::vector<unsigned int> retired;		// retired after the last recycle()
+	std::vector<unsigned int> released;		// retired before the last recycle()
+	size_t used;
+
+#ifdef UTM_DEBUG
+public:
+	static void test_all();
+#endif
+};
+
+}
+
+#endif // _HEADER_ARENA_H
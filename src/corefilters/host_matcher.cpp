@@ -0,0 +1,155 @@
+#include "stdafx.h"
+#include "host_matcher.h"
+
+#include <algorithm>
+#include <cstring>
+
+#include <ubase_test.h>
+
+namespace utm {
+
+const char host_matcher::this_class_name[] = "host_matcher";
+
+static inline char host_lower(char c)
+{
+	return ((c >= 'A') && (c <= 'Z')) ? static_cast<char>(c + ('a' - 'A')) : c;
+}
+
+host_matcher::host_matcher()
+{
+}
+
+host_matcher::~host_matcher()
+{
+}
+
+unsigned int host_matcher::get_hash(const char* name, size_t len)
+{
+	// FNV-1a of the lower case name
+	unsigned int h = 2166136261U;
+	for (size_t i = 0; i < len; i++)
+	{
+		h ^= static_cast<unsigned char>(host_lower(name[i]));
+		h *= 16777619U;
+	}
+
+	return h;
+}
+
+void host_matcher::add_host(const char* name, unsigned int host_id)
+{
+	if ((name == NULL) || (host_id == 0))
+		throw std::exception("host_matcher: bad host");
+
+	entry e;
+	e.wildcard = (name[0] == '*') && (name[1] == '.');
+	e.host_id = host_id;
+	e.name.assign(e.wildcard ? name + 1 : name);
+
+	// A trailing dot is the same name
+	if (!e.name.empty() && (e.name[e.name.size() - 1] == '.'))
+		e.name.erase(e.name.size() - 1);
+
+	for (size_t i = 0; i < e.name.size(); i++)
+		e.name[i] = host_lower(e.name[i]);
+
+	if (e.name.empty() || (e.name == "."))
+		throw std::exception("host_matcher: bad host");
+
+	e.hash = get_hash(e.name.c_str(), e.name.size());
+
+	// The first added name wins
+	if (find(e.name.c_str(), e.name.size(), e.wildcard) != 0)
+		return;
+
+	entries.insert(std::upper_bound(entries.begin(), entries.end(), e), e);
+}
+
+unsigned int host_matcher::find(const char* name, size_t len, bool wildcard) const
+{
+	entry key;
+	key.hash = get_hash(name, len);
+
+	std::vector<entry>::const_iterator iter = std::lower_bound(entries.begin(), entries.end(), key);
+	for (; (iter != entries.end()) && (iter->hash == key.hash); ++iter)
+	{
+		if ((iter->wildcard != wildcard) || (iter->name.size() != len))
+			continue;
+
+		size_t i = 0;
+		while ((i < len) && (iter->name[i] == host_lower(name[i])))
+			i++;
+
+		if (i == len)
+			return iter->host_id;
+	}
+
+	return 0;
+}
+
+unsigned int host_matcher::lookup(const char* name, size_t len) const
+{
+	if ((name == NULL) || entries.empty())
+		return 0;
+
+	const char* colon = static_cast<const char*>(memchr(name, ':', len));
+	if (colon != NULL)
+		len = colon - name;
+
+	if ((len > 0) && (name[len - 1] == '.'))
+		len--;
+
+	if (len == 0)
+		return 0;
+
+	unsigned int id = find(name, len, false);
+	if (id != 0)
+		return id;
+
+	// The longest wildcard suffix
+	for (size_t i = 1; i < len; i++)
+	{
+		if (name[i] != '.')
+			continue;
+
+		id = find(name + i, len - i, true);
+		if (id != 0)
+			return id;
+	}
+
+	return 0;
+}
+
+#ifdef UTM_DEBUG
+void host_matcher::test_all()
+{
+	test_report tr(this_class_name);
+
+	host_matcher hm;
+	hm.add_host("www.example.com", 1);
+	hm.add_host("*.example.com", 2);
+	hm.add_host("*.cdn.example.com", 3);
+	hm.add_host("Mail.Example.Org.", 4);
+	hm.add_host("www.example.com", 5);
+
+	TEST_CASE_CHECK(size_t(4), hm.size());
+
+	TEST_CASE_CHECK(1U, hm.lookup("www.example.com", 15));
+	TEST_CASE_CHECK(1U, hm.lookup("WWW.EXAMPLE.COM", 15));
+	TEST_CASE_CHECK(1U, hm.lookup("www.example.com:443", 19));
+	TEST_CASE_CHECK(2U, hm.lookup("img.example.com", 15));
+	TEST_CASE_CHECK(3U, hm.lookup("a.b.cdn.example.com", 19));
+	TEST_CASE_CHECK(0U, hm.lookup("example.com", 11));
+	TEST_CASE_CHECK(0U, hm.lookup("badexample.com", 14));
+	TEST_CASE_CHECK(4U, hm.lookup("mail.example.org", 16));
+	TEST_CASE_CHECK(4U, hm.lookup("mail.example.org.", 17));
+	TEST_CASE_CHECK(0U, hm.lookup("", 0));
+
+	// Only the given length is taken
+	TEST_CASE_CHECK(1U, hm.lookup("www.example.com.evil.net", 15));
+
+	return;
+}
+#endif
+
+}
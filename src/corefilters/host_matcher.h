@@ -0,0 +1,59 @@
+#ifndef _HOST_MATCHER_H
+#define _HOST_MATCHER_H
+
+#pragma once
+
+#include <string>
+#include <vector>
+
+namespace utm {
+
+//
+// Host names by the name seen in a flow (TLS server name or HTTP Host). Names are compared
+// without case, a name "*.example.com" matches all subdomains of example.com. Entries are
+// kept sorted by the name hash, lookups do not lock and do not allocate.
+//
+class host_matcher
+{
+	struct entry
+	{
+		unsigned int hash;
+		bool wildcard;
+		unsigned int host_id;
+		std::string name;		// lower case, ".example.com" for the wildcard
+
+		bool operator<(const entry& rhs) const { return hash < rhs.hash; };
+	};
+
+public:
+	static const char this_class_name[];
+
+public:
+	host_matcher();
+	~host_matcher();
+
+	void clear() { entries.clear(); };
+	size_t size() const { return entries.size(); };
+
+	// The host id must not be zero
+	void add_host(const char* name, unsigned int host_id);
+
+	// Returns the id of the exact name or of the nearest wildcard, zero if there is none.
+	// A port after the name (Host: example.com:8080) is ignored.
+	unsigned int lookup(const char* name, size_t len) const;
+
+private:
+	static unsigned int get_hash(const char* name, size_t len);
+	unsigned int find(const char* name, size_t len, bool wildcard) const;
+
+	std::vector<entry> entries;
+
+#ifdef UTM_DEBUG
+public:
+	static void test_all();
+#endif
+};
+
+}
+
+#endif // _HOST_MATCHER_H
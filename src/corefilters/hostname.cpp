@@ -5,10 +5,13 @@
 #include <boost/asio.hpp>
 
 #include "hostresolver.h"
+#include "dns_resolver.h"
+
+#include <algorithm>
 
 namespace utm {
 
-hostname::hostname(void)
+hostname::hostname(void) : hash(0), host_id(0), host_table(0)
 {
 }
 
@@ -25,6 +28,8 @@ void hostname::clear()
 {
 	host.clear();
 	hash = 0;
+	host_id = 0;
+	host_table = 0;
 }
 
 void hostname::set_host(const char *hostname)
@@ -37,9 +42,11 @@ void hostname::set_host(const char *hostname)
 
 	host.assign(hostname);
 	hash = utm::crc32::calc(hostname);
+	host_id = 0;
+	host_table = 0;
 }
 
-hostname_ex::hostname_ex(void)
+hostname_ex::hostname_ex(void) : seen_next(0)
 {
 }
 
@@ -47,6 +54,8 @@ hostname_ex::hostname_ex(const hostname_ex& hse)
 	: hostname((hostname)hse)
 {
 	addrs_v4 = hse.addrs_v4;
+	seen_addrs_v4 = hse.seen_addrs_v4;
+	seen_next = hse.seen_next;
 	last_update = hse.last_update;
 }
 
@@ -57,39 +66,56 @@ hostname_ex::~hostname_ex(void)
 bool hostname_ex::check_addr(unsigned int addr)
 {
 	addrip_v4 a(addr);
-	boost::mutex::scoped_lock lock(guard);
-	bool retval = addrs_v4.find(a) != addrs_v4.end();
-	return retval;
+	return check_addr(a);
 }
 
 bool hostname_ex::check_addr(const utm::addrip_v4& a)
 {
 	boost::mutex::scoped_lock lock(guard);
 	bool retval = addrs_v4.find(a) != addrs_v4.end();
+	if (!retval)
+		retval = std::find(seen_addrs_v4.begin(), seen_addrs_v4.end(), a) != seen_addrs_v4.end();
+
 	return retval;
 }
 
-void hostname_ex::update_addr()
+bool hostname_ex::add_seen_addr(const utm::addrip_v4& a)
 {
-	std::set<addrip_v4> res_addrs_v4;
-	bool is_timeout = false;
+	boost::mutex::scoped_lock lock(guard);
 
-	try
-	{
-		hostresolver::resolve(get_host(), 1, res_addrs_v4, is_timeout);
-		{
-			boost::mutex::scoped_lock lock(guard);
-			if (addrs_v4 != res_addrs_v4)
-				addrs_v4 = res_addrs_v4;
-		}
-	}
-	catch(const boost::system::error_code&)
+	if (std::find(seen_addrs_v4.begin(), seen_addrs_v4.end(), a) != seen_addrs_v4.end())
+		return false;
+
+	if (seen_addrs_v4.size() < HOSTNAME_MAX_SEEN_ADDRS)
 	{
+		seen_addrs_v4.push_back(a);
+		return true;
 	}
 
+	// The oldest address is replaced
+	seen_addrs_v4[seen_next] = a;
+	seen_next = (seen_next + 1) % HOSTNAME_MAX_SEEN_ADDRS;
+	return true;
+}
+
+void hostname_ex::update_addr()
+{
+	dns_result result;
+	dns_resolver::shared().resolve_host(get_host(), result);
+
+	if (!result.is_timeout)
+		set_addrs(result.addrs);
+
 	return;
 }
 
+void hostname_ex::set_addrs(const std::set<utm::addrip_v4>& addrs)
+{
+	boost::mutex::scoped_lock lock(guard);
+	if (addrs_v4 != addrs)
+		addrs_v4 = addrs;
+}
+
 void hostname_ex::test_all()
 {
 	{
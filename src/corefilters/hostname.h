@@ -5,11 +5,14 @@
 
 #include <string>
 #include <set>
+#include <vector>
 #include <addrip_v4.h>
 #include <utime.h>
 
 #include <boost/thread/mutex.hpp>
 
+#define HOSTNAME_MAX_SEEN_ADDRS 32
+
 namespace utm {
 
 class hostname
@@ -25,9 +28,16 @@ public:
 	const char* get_host() const { return host.c_str(); };
 	unsigned int get_hash() const { return hash; }
 
+	// The id of the name in a host table, given by hosttable::bind_host()
+	unsigned int get_host_id() const { return host_id; };
+	unsigned int get_host_table() const { return host_table; };
+	void bind(unsigned int table_serial, unsigned int id) { host_table = table_serial; host_id = id; };
+
 protected:
 	std::string host;
 	unsigned int hash;
+	unsigned int host_id;
+	unsigned int host_table;
 };
 
 class hostname_ex : public hostname
@@ -39,10 +49,18 @@ public:
 
 
 	void update_addr();
+	void set_addrs(const std::set<utm::addrip_v4>& addrs);
 	bool check_addr(unsigned int addr);
 	bool check_addr(const utm::addrip_v4& addr);
 
+	// Server address seen with this name in a flow (TLS server name or HTTP Host).
+	// The last HOSTNAME_MAX_SEEN_ADDRS addresses are kept, the DNS refresh does not drop them.
+	// Returns false if the address is already known.
+	bool add_seen_addr(const utm::addrip_v4& addr);
+
 	std::set<utm::addrip_v4> addrs_v4;
+	std::vector<utm::addrip_v4> seen_addrs_v4;
+	size_t seen_next;
 	utm::utime last_update;
 
 	boost::mutex guard;
@@ -3,72 +3,250 @@
 
 #include "hostresolver.h"
 
+#include <algorithm>
 #include <ubase_test.h>
 
+#ifdef UTM_DEBUG
+#include <chrono>
+#include <iostream>
+#include <sstream>
+#endif
+
 namespace utm {
 
 const char hosttable::this_class_name[] = "hosttable";
 
-hosttable::hosttable(void)
+std::atomic<unsigned int> hosttable::next_serial(0);
+
+hosttable::hosttable(void) : current(NULL), has_seen_addrs(false)
 {
+	serial = ++next_serial;
 }
 
 hosttable::~hosttable(void)
 {
+	confirms.wait();
+
+	delete current.load();
 }
 
-void hosttable::add_host(const char* hostname)
+unsigned int hosttable::add_host(const char* hostname)
 {
 	hostname_ex hse;
 	hse.set_host(hostname);
 
+	boost::mutex::scoped_lock lock(guard);
+
 	maphost::iterator iter = hosts.find(hse.get_hash());
-	bool found = false;
-	while (iter != hosts.end())
+	while ((iter != hosts.end()) && (iter->first == hse.get_hash()))
 	{
 		if (strcmp(iter->second.get_host(), hostname) == 0)
-		{
-			found = true;
-			break;
-		}
+			return iter->second.get_host_id();
+
 		++iter;
 	}
 
-	if (!found)
-	{
-		hosts.insert(std::pair<unsigned int, utm::hostname_ex>(hse.get_hash(), hse));
-	}
+	unsigned int host_id = static_cast<unsigned int>(host_index.size() + 1);
+	hse.bind(serial, host_id);
+
+	maphost::iterator added = hosts.insert(std::pair<unsigned int, utm::hostname_ex>(hse.get_hash(), hse));
+	host_index.push_back(&added->second);
+
+	if (hostname[0] != 0)
+		matcher.add_host(hostname, host_id);
+
+	return host_id;
+}
+
+void hosttable::bind_host(hostname& hs)
+{
+	unsigned int host_id = add_host(hs.get_host());
+	hs.bind(serial, host_id);
 }
 
 void hosttable::clear()
 {
+	boost::mutex::scoped_lock lock(guard);
+
 	hosts.clear();
+	matcher.clear();
+	host_index.clear();
+
+	serial = ++next_serial;
+	has_seen_addrs = false;
+	retire_table(NULL);
+}
+
+bool hosttable::add_seen_addr(unsigned int host_id, const utm::addrip_v4& addr4, bool publish)
+{
+	// add_host() may grow the index meanwhile
+	boost::mutex::scoped_lock lock(guard);
+
+	if ((host_id == 0) || (host_id > host_index.size()))
+		return false;
+
+	if (!host_index[host_id - 1]->add_seen_addr(addr4))
+		return false;
+
+	if (publish)
+		publish_table();
+	else
+		has_seen_addrs = true;
+
+	return true;
+}
+
+void hosttable::confirm_seen_addr(unsigned int host_id, const char* name, const utm::addrip_v4& addr4, dns_resolver& resolver)
+{
+	if ((host_id == 0) || check_host_id(host_id, addr4))
+		return;
+
+	unsigned int table_serial = serial;
+	resolver.async_resolve_host(name, confirms.wrap([this, table_serial, host_id, addr4](const dns_result& result)
+	{
+		if (result.found && (result.addrs.count(addr4) > 0))
+			add_confirmed_addr(table_serial, host_id, addr4);
+	}));
+}
+
+void hosttable::add_confirmed_addr(unsigned int table_serial, unsigned int host_id, const utm::addrip_v4& addr4)
+{
+	boost::mutex::scoped_lock lock(guard);
+
+	// The table was cleared after the request, the host id may be given to another host
+	if ((table_serial != serial) || (host_id == 0) || (host_id > host_index.size()))
+		return;
+
+	if (host_index[host_id - 1]->add_seen_addr(addr4))
+		has_seen_addrs = true;
 }
 
 bool hosttable::checkaddr(unsigned int hostname_crc32, const char *hostname, const utm::addrip_v4& addr4)
 {
-	maphost::iterator iter = hosts.find(hostname_crc32);
+	rcu_domain<addr_table>::reader section(tables);
 
-	bool retval = false;
-	while (iter != hosts.end())
+	const addr_table* t = current.load();
+	if (t == NULL)
+		return false;
+
+	// The map of the hosts is changed under the guard, the names are taken from the published table
+	std::vector<std::pair<unsigned int, unsigned int> >::const_iterator iter = std::lower_bound(t->names.begin(), t->names.end(), std::make_pair(hostname_crc32, 0U));
+	for (; (iter != t->names.end()) && (iter->first == hostname_crc32); ++iter)
 	{
-		if (strcmp(iter->second.get_host(), hostname) == 0)
-		{
-			retval = iter->second.check_addr(addr4);
-			break;
-		}
-		++iter;
+		if (t->host_names[iter->second - 1] == hostname)
+			return has_key(t, make_key(iter->second, addr4));
+	}
+
+	return false;
+}
+
+bool hosttable::check_host_id(unsigned int host_id, const utm::addrip_v4& addr4) const
+{
+	rcu_domain<addr_table>::reader section(tables);
+
+	const addr_table* t = current.load();
+	return (t != NULL) && has_key(t, make_key(host_id, addr4));
+}
+
+bool hosttable::has_key(const addr_table* t, uint64_t key)
+{
+	for (size_t n = get_slot(key, t->mask); t->slots[n] != 0; n = (n + 1) & t->mask)
+	{
+		if (t->slots[n] == key)
+			return true;
+	}
+
+	return false;
+}
+
+void hosttable::publish_addrs()
+{
+	boost::mutex::scoped_lock lock(guard);
+	publish_table();
+}
+
+void hosttable::publish_seen_addrs()
+{
+	boost::mutex::scoped_lock lock(guard);
+	if (has_seen_addrs)
+		publish_table();
+}
+
+// Guard must be locked
+void hosttable::publish_table()
+{
+	has_seen_addrs = false;
+
+	addr_table* t = new addr_table();
+	t->names.reserve(host_index.size());
+	t->host_names.reserve(host_index.size());
+
+	std::vector<uint64_t> keys;
+	for (size_t i = 0; i < host_index.size(); i++)
+	{
+		hostname_ex* hse = host_index[i];
+		unsigned int host_id = static_cast<unsigned int>(i + 1);
+
+		t->names.push_back(std::make_pair(hse->get_hash(), host_id));
+		t->host_names.push_back(hse->get_host());
+
+		boost::mutex::scoped_lock hlock(hse->guard);
+		for (auto iter = hse->addrs_v4.begin(); iter != hse->addrs_v4.end(); ++iter)
+			keys.push_back(make_key(host_id, *iter));
+
+		for (auto iter = hse->seen_addrs_v4.begin(); iter != hse->seen_addrs_v4.end(); ++iter)
+			keys.push_back(make_key(host_id, *iter));
 	}
 
-	return retval;
+	// At most half of the slots are used, so the probes are short
+	size_t size = 16;
+	while (size < keys.size() * 2)
+		size <<= 1;
+
+	std::sort(t->names.begin(), t->names.end());
+
+	t->slots.assign(size, 0);
+	t->mask = size - 1;
+
+	for (size_t i = 0; i < keys.size(); i++)
+	{
+		size_t n = get_slot(keys[i], t->mask);
+		while ((t->slots[n] != 0) && (t->slots[n] != keys[i]))
+			n = (n + 1) & t->mask;
+
+		t->slots[n] = keys[i];
+	}
+
+	retire_table(t);
+}
+
+// Guard must be locked
+void hosttable::retire_table(const addr_table* t)
+{
+	tables.retire(current.exchange(t));
 }
 
 void hosttable::refresh_hosttable()
 {
+	refresh_hosttable(dns_resolver::shared());
+}
+
+void hosttable::refresh_hosttable(dns_resolver& resolver)
+{
+	dns_batch batch;
 	for (maphost::iterator iter = hosts.begin(); iter != hosts.end(); ++iter)
 	{
-		iter->second.update_addr();
+		hostname_ex* hse = &iter->second;
+		resolver.async_resolve_host(hse->get_host(), batch.wrap([hse](const dns_result& result)
+		{
+			// The addresses of the previous refresh stay until the server answers
+			if (!result.is_timeout)
+				hse->set_addrs(result.addrs);
+		}));
 	}
+
+	batch.wait();
+	publish_addrs();
 }
 
 void hosttable::test_all()
@@ -104,7 +282,110 @@ void hosttable::test_all()
 		TEST_CASE_CHECK(r2, bool(true));
 	}
 
+	{
+		// A bound name is checked by its id, the seen addresses are visible after the publish
+		hosttable ht2;
+		hostname b1, b2;
+		b1.set_host("bound.example.com");
+		b2.set_host("bound.example.com");
+		ht2.bind_host(b1);
+		ht2.bind_host(b2);
+		TEST_CASE_CHECK(b1.get_host_id(), b2.get_host_id());
+
+		addrip_v4 a1("10.1.2.3");
+		TEST_CASE_CHECK(ht2.add_seen_addr(b1.get_host_id(), a1, false), true);
+		TEST_CASE_CHECK(ht2.check_host_id(b1.get_host_id(), a1), false);
+		ht2.publish_seen_addrs();
+		TEST_CASE_CHECK(ht2.check_host_id(b1.get_host_id(), a1), true);
+		TEST_CASE_CHECK(ht2.check_host_id(b1.get_host_id(), addrip_v4("10.1.2.4")), false);
+		TEST_CASE_CHECK(ht2.checkaddr(b1, a1), true);
+
+		// An unbound name is found in the published table
+		hostname u1;
+		u1.set_host("bound.example.com");
+		TEST_CASE_CHECK(ht2.checkaddr(u1, a1), true);
+
+		// The bindings and the addresses from before clear() are not used
+		ht2.clear();
+		TEST_CASE_CHECK(ht2.size(), size_t(0));
+		TEST_CASE_CHECK(ht2.checkaddr(b1, a1), false);
+		TEST_CASE_CHECK(ht2.check_host_id(b1.get_host_id(), a1), false);
+		ht2.bind_host(b1);
+		TEST_CASE_CHECK(ht2.checkaddr(b1, a1), false);
+	}
+
 	return;
 }
 
+#ifdef UTM_DEBUG
+void hosttable::benchmark()
+{
+	const unsigned int host_count = 2000;
+	const unsigned int checks = 1000000;
+
+	hosttable ht;
+	std::vector<hostname> names(host_count);
+	std::vector<hostname> bound(host_count);
+
+	for (unsigned int i = 0; i < host_count; i++)
+	{
+		std::ostringstream s;
+		s << "host" << i << ".example.com";
+		names[i].set_host(s.str().c_str());
+		bound[i] = names[i];
+		ht.bind_host(bound[i]);
+
+		std::set<addrip_v4> addrs;
+		for (unsigned int n = 0; n < 4; n++)
+			addrs.insert(addrip_v4(0x0A000000 + i * 4 + n));
+		ht.host_index[i]->set_addrs(addrs);
+	}
+	ht.publish_addrs();
+
+	// Every second check is a hit
+	unsigned int matched[3] = { 0, 0, 0 };
+	double elapsed[3];
+	for (int kind = 0; kind < 3; kind++)
+	{
+		unsigned int seed = 12345;
+		std::chrono::steady_clock::time_point t0 = std::chrono::steady_clock::now();
+
+		for (unsigned int c = 0; c < checks; c++)
+		{
+			seed = seed * 1103515245 + 12345;
+			unsigned int i = (seed >> 8) % host_count;
+			addrip_v4 addr(0x0A000000 + ((c & 1) ? i * 4 + (c & 3) : (i + 1) * 4 % (host_count * 4)));
+
+			bool r;
+			if (kind == 0)
+			{
+				// The name lookup and the lock of the host as before
+				r = false;
+				for (maphost::iterator iter = ht.hosts.find(names[i].get_hash()); iter != ht.hosts.end(); ++iter)
+				{
+					if (strcmp(iter->second.get_host(), names[i].get_host()) == 0)
+					{
+						r = iter->second.check_addr(addr);
+						break;
+					}
+				}
+			}
+			else
+			{
+				r = ht.checkaddr((kind == 1) ? names[i] : bound[i], addr);
+			}
+
+			if (r)
+				matched[kind]++;
+		}
+
+		elapsed[kind] = std::chrono::duration<double, std::nano>(std::chrono::steady_clock::now() - t0).count() / checks;
+	}
+
+	std::cout << this_class_name << ": name and lock: " << elapsed[0] << " ns/check, " << matched[0] << " matched" << std::endl;
+	std::cout << this_class_name << ": name and probe: " << elapsed[1] << " ns/check, " << matched[1] << " matched" << std::endl;
+	std::cout << this_class_name << ": bound probe: " << elapsed[2] << " ns/check, " << matched[2] << " matched" << std::endl;
+}
+#endif
+
 }
@@ -4,9 +4,18 @@
 #pragma once
 
 #include <addrip_v4.h>
+#include <rcu_domain.h>
+#include <atomic>
+#include <cstdint>
 #include <map>
+#include <string>
+#include <vector>
+
+#include <boost/thread/mutex.hpp>
 
 #include "hostname.h"
+#include "dns_resolver.h"
+#include "host_matcher.h"
 
 typedef std::multimap<unsigned int, utm::hostname_ex> maphost;
 
@@ -14,26 +23,105 @@ namespace utm {
 
 class hosttable
 {
+	// Open addressing set of (host id, address), an empty slot is zero. The host ids by the
+	// name hash are for the checks of unbound names.
+	struct addr_table
+	{
+		std::vector<uint64_t> slots;
+		size_t mask;
+		std::vector<std::pair<unsigned int, unsigned int> > names;		// (name hash, host id), sorted
+		std::vector<std::string> host_names;							// by host id - 1
+	};
+
 public:
 	static const char this_class_name[];
 
 	hosttable(void);
 	~hosttable(void);
 
-	void add_host(const char* hostname);
+	// Returns the host id, the same name gets the same id
+	unsigned int add_host(const char* hostname);
 	void clear();
 	size_t size() const { return hosts.size(); };
 
-	inline bool checkaddr(const utm::hostname& hs, const utm::addrip_v4& addr4) { return checkaddr(hs.get_hash(), hs.get_host(), addr4); };
+	// Adds the host of a rule and binds the name to its id, so checkaddr() needs no name lookup
+	void bind_host(hostname& hs);
+
+	inline bool checkaddr(const utm::hostname& hs, const utm::addrip_v4& addr4)
+	{
+		if ((hs.get_host_id() != 0) && (hs.get_host_table() == serial))
+			return check_host_id(hs.get_host_id(), addr4);
+
+		return checkaddr(hs.get_hash(), hs.get_host(), addr4);
+	};
 	bool checkaddr(unsigned int hostname_crc32, const char *hostname, const utm::addrip_v4& addr4);
+	bool check_host_id(unsigned int host_id, const utm::addrip_v4& addr4) const;
+
+	// The flow of the packet is classified by its own server name (see pktcollector::put_packet),
+	// the host matches the server of this flow only
+	inline bool checkflow(const utm::hostname& hs, unsigned int flow_host_id, const utm::addrip_v4& flow_server, const utm::addrip_v4& addr4) const
+	{
+		return (flow_host_id != 0) && (hs.get_host_id() == flow_host_id) && (hs.get_host_table() == serial) && (addr4 == flow_server);
+	};
+
 	void refresh_hosttable();
 
+	// Resolves all hosts at once, returns when all of them are answered
+	void refresh_hosttable(dns_resolver& resolver);
+
+	// Host ids by the name seen in a flow, for pktcollector_ex::set_host_matcher
+	const host_matcher& get_matcher() const { return matcher; };
+
+	// The server of a flow was seen with the name of the host, so the host rules match
+	// its address before the next DNS refresh. Returns true if the address is new,
+	// without publish the caller calls publish_seen_addrs() after a batch.
+	bool add_seen_addr(unsigned int host_id, const utm::addrip_v4& addr4, bool publish = true);
+
+	// The name of a flow is given by the client, the server is added to the host only if
+	// the name resolves to it. The answer comes later unless it is in the resolver cache,
+	// it is published by the next publish_seen_addrs().
+	void confirm_seen_addr(unsigned int host_id, const char* name, const utm::addrip_v4& addr4, dns_resolver& resolver);
+
+	// Makes the current addresses of all hosts visible to checkaddr()
+	void publish_addrs();
+
+	// Publishes the seen addresses added since the last call, once per flush of the flows
+	void publish_seen_addrs();
+
 private:
 	maphost hosts;
+	host_matcher matcher;
+	std::vector<hostname_ex*> host_index;		// by host id - 1
+	dns_batch confirms;							// waited for by the destructor
+
+	// Bindings of other tables and of the table before clear() are not used
+	unsigned int serial;
+	static std::atomic<unsigned int> next_serial;
+
+	// The addresses are read without locks, the old tables are freed by the epochs of the readers
+	std::atomic<const addr_table*> current;
+	rcu_domain<addr_table> tables;
+	boost::mutex guard;
+	bool has_seen_addrs;						// not published yet, guard is locked
+
+	void publish_table();
+	void retire_table(const addr_table* t);
+	void add_confirmed_addr(unsigned int table_serial, unsigned int host_id, const utm::addrip_v4& addr4);
+
+	static bool has_key(const addr_table* t, uint64_t key);
+
+	static uint64_t make_key(unsigned int host_id, const utm::addrip_v4& addr4) { return (static_cast<uint64_t>(host_id) << 32) | static_cast<uint32_t>(addr4.m_addr); };
+	static size_t get_slot(uint64_t key, size_t mask) { return static_cast<size_t>((key * 0x9E3779B97F4A7C15ULL) >> 32) & mask; };
+
+	hosttable(const hosttable&);
+	hosttable& operator=(const hosttable&);
 
 public:
 	static void test_all();
 
+#ifdef UTM_DEBUG
+	static void benchmark();
+#endif
 };
 
 }
@@ -0,0 +1,406 @@
+#include "stdafx.h"
+#include "http_scanner.h"
+
+#include <cstring>
+#include <string>
+#include <vector>
+#include <chrono>
+#include <iostream>
+
+#ifdef HTTP_SCANNER_SSE2
+#include <emmintrin.h>
+#endif
+
+#ifdef _MSC_VER
+#include <intrin.h>
+#endif
+
+#include <ubase_test.h>
+
+namespace utm {
+
+const char http_scanner::this_class_name[] = "http_scanner";
+
+static inline unsigned int get_lowest_bit(unsigned int mask)
+{
+#ifdef _MSC_VER
+	unsigned long idx;
+	_BitScanForward(&idx, mask);
+	return idx;
+#else
+	return __builtin_ctz(mask);
+#endif
+}
+
+int http_scanner::get_method(const unsigned char* data, size_t len)
+{
+	if ((data == NULL) || (len < 8))
+		return HTTP_METHOD_UNKNOWN;
+
+	if (memcmp(data, "GET ", 4) == 0)
+		return HTTP_METHOD_GET;
+
+	if (memcmp(data, "POST ", 5) == 0)
+		return HTTP_METHOD_POST;
+
+	if (memcmp(data, "PUT ", 4) == 0)
+		return HTTP_METHOD_PUT;
+
+	if (memcmp(data, "HEAD ", 5) == 0)
+		return HTTP_METHOD_HEAD;
+
+	return HTTP_METHOD_UNKNOWN;
+}
+
+bool http_scanner::line_end(const char* header, size_t pos, http_scan_state& st)
+{
+	if ((pos > 0) && (header[pos - 1] == '\r'))
+	{
+		// An empty line ends the header
+		if ((pos >= 3) && (header[pos - 2] == '\n') && (header[pos - 3] == '\r'))
+		{
+			st.finished = true;
+			return true;
+		}
+
+		// The first Host field after "\r\n", the request line is skipped
+		size_t start = st.line_start;
+		if ((st.host_length == 0) && (start >= 2) && (header[start - 2] == '\r') &&
+			(pos - 1 > start + 6) && (memcmp(header + start, "Host: ", 6) == 0))
+		{
+			st.host_offset = static_cast<unsigned short>(start + 6);
+			st.host_length = static_cast<unsigned short>(pos - 1 - start - 6);
+		}
+	}
+
+	st.line_start = static_cast<unsigned short>(pos + 1);
+	return false;
+}
+
+size_t http_scanner::scan(char* header, size_t length, size_t capacity, const unsigned char* data, size_t data_len, http_scan_state& st)
+{
+	if (st.finished || (length >= capacity))
+		return length;
+
+	size_t n = capacity - length;
+	if (data_len < n)
+		n = data_len;
+
+	size_t i = 0;
+
+#ifdef HTTP_SCANNER_SSE2
+	const __m128i lf = _mm_set1_epi8('\n');
+	char *out = header + length;
+
+	for (; i + 16 <= n; i += 16)
+	{
+		__m128i v = _mm_loadu_si128(reinterpret_cast<const __m128i*>(data + i));
+		_mm_storeu_si128(reinterpret_cast<__m128i*>(out + i), v);
+
+		unsigned int mask = static_cast<unsigned int>(_mm_movemask_epi8(_mm_cmpeq_epi8(v, lf)));
+		while (mask != 0)
+		{
+			size_t pos = length + i + get_lowest_bit(mask);
+			mask &= mask - 1;
+
+			if (line_end(header, pos, st))
+				return pos + 1;
+		}
+	}
+#endif
+
+	return scan_bytes(header, length + i, capacity, data + i, n - i, st);
+}
+
+size_t http_scanner::scan_bytes(char* header, size_t length, size_t capacity, const unsigned char* data, size_t data_len, http_scan_state& st)
+{
+	if (st.finished || (length >= capacity))
+		return length;
+
+	size_t n = capacity - length;
+	if (data_len < n)
+		n = data_len;
+
+	for (size_t i = 0; i < n; i++)
+	{
+		char c = static_cast<char>(data[i]);
+		header[length + i] = c;
+
+		if ((c == '\n') && line_end(header, length + i, st))
+			return length + i + 1;
+	}
+
+	return length + n;
+}
+
+#ifdef UTM_DEBUG
+// Typical requests of browsers and clients
+static const char* http_samples[] = {
+	"GET / HTTP/1.1\r\nHost: www.example.com\r\nUser-Agent: curl/7.35.0\r\nAccept: */*\r\n\r\n",
+
+	"GET /images/branding/googlelogo/2x/googlelogo_color_272x92dp.png HTTP/1.1\r\n"
+	"Host: www.google.com\r\n"
+	"Connection: keep-alive\r\n"
+	"User-Agent: Mozilla/5.0 (Windows NT 6.1; WOW64) AppleWebKit/537.36 (KHTML, like Gecko) Chrome/45.0.2454.101 Safari/537.36\r\n"
+	"Accept: image/webp,image/*,*/*;q=0.8\r\n"
+	"Referer: https://www.google.com/\r\n"
+	"Accept-Encoding: gzip, deflate, sdch\r\n"
+	"Accept-Language: ru-RU,ru;q=0.8,en-US;q=0.6,en;q=0.4\r\n"
+	"Cookie: NID=72=eXaMpLeCoOkIeVaLuE0123456789abcdefghijklmnopqrstuvwxyzABCDEFGHIJKLMNOPQRSTUVWXYZ0123456789abcdefghijklmnopqrstuv; PREF=ID=1111111111111111:FF=0:TM=1440000000:LM=1440000000:V=1:S=abcdefghijklmnop\r\n"
+	"\r\n",
+
+	"POST /api/v1/events?source=agent&version=3 HTTP/1.1\r\n"
+	"Host: collector.internal.local:8080\r\n"
+	"Content-Type: application/json; charset=utf-8\r\n"
+	"Content-Length: 27\r\n"
+	"Expect: 100-continue\r\n"
+	"\r\n"
+	"{\"event\":\"start\",\"id\":1234}",
+
+	"GET /update/win32/version.xml?os=6.1.7601&lang=ru HTTP/1.1\r\n"
+	"Accept: */*\r\n"
+	"User-Agent: Microsoft-CryptoAPI/6.1\r\n"
+	"Host: update.vendor.com\r\n"
+	"Cache-Control: no-cache\r\n"
+	"Pragma: no-cache\r\n"
+	"\r\n",
+
+	"HEAD /files/setup.exe HTTP/1.0\r\nHost: download.example.org\r\n\r\n"
+};
+
+static const size_t http_sample_count = sizeof(http_samples) / sizeof(http_samples[0]);
+
+// The former capture of pktcollector_value_ex: the payload is appended to a string and rescanned
+struct http_legacy_capture
+{
+	http_legacy_capture() : finished(false) { };
+
+	static size_t lookup_end(const char* p, size_t len)
+	{
+		for (size_t r = 0; (r + 3) < len; r++, p++)
+		{
+			if ((*p == '\r') && (*(p + 1) == '\n') && (*(p + 2) == '\r') && (*(p + 3) == '\n'))
+				return r + 3;
+		}
+
+		return std::string::npos;
+	}
+
+	void lookup_hostname()
+	{
+		const char *p = raw.c_str();
+		const char *host = NULL;
+		size_t hostlen = 0;
+
+		for (size_t r = 0; (r + 8) < raw.size(); r++, p++)
+		{
+			if (*p != '\r')
+				continue;
+
+			if (host == NULL)
+			{
+				if (strncmp(p + 1, "\nHost: ", 7) == 0)
+					host = p + 8;
+			}
+			else if (*(p + 1) == '\n')
+			{
+				hostlen = p - host;
+				break;
+			}
+		}
+
+		if ((host != NULL) && (hostlen > 0))
+			hostname.assign(host, hostlen);
+	}
+
+	void first_packet(const char* data, size_t len)
+	{
+		size_t endpos = lookup_end(data, len);
+		raw.assign(data, (endpos == std::string::npos) ? len : endpos);
+
+		if (endpos != std::string::npos)
+		{
+			finished = true;
+			lookup_hostname();
+		}
+	}
+
+	void next_packet(const char* data, size_t len)
+	{
+		if (finished || (raw.size() >= 8192))
+			return;
+
+		raw.reserve(raw.size() + len);
+		for (size_t t = 0; t < len; t++)
+		{
+			char c = data[t];
+			raw.push_back(c);
+			size_t sz = raw.size();
+			if (((c == '\r') || (c == '\n')) && (sz >= 4) && (raw.compare(sz - 4, 4, "\r\n\r\n") == 0))
+			{
+				finished = true;
+				lookup_hostname();
+				break;
+			}
+		}
+	}
+
+	std::string raw;
+	std::string hostname;
+	bool finished;
+};
+
+static size_t http_test_scan(const std::string& s, size_t split, bool simd, std::vector<char>& buf, http_scan_state& st)
+{
+	st = http_scan_state();
+	const unsigned char* data = reinterpret_cast<const unsigned char*>(s.c_str());
+
+	size_t length = 0;
+	if (simd)
+	{
+		length = http_scanner::scan(&buf[0], length, buf.size(), data, split, st);
+		length = http_scanner::scan(&buf[0], length, buf.size(), data + split, s.size() - split, st);
+	}
+	else
+	{
+		length = http_scanner::scan_bytes(&buf[0], length, buf.size(), data, split, st);
+		length = http_scanner::scan_bytes(&buf[0], length, buf.size(), data + split, s.size() - split, st);
+	}
+
+	return length;
+}
+
+void http_scanner::test_all()
+{
+	test_report tr(this_class_name);
+
+	test_case::classname.assign("get_method");
+	{
+		test_case::testcase_num = 1;
+		TEST_CASE_CHECK(HTTP_METHOD_GET, get_method(reinterpret_cast<const unsigned char*>("GET / HTTP/1.1"), 14));
+		TEST_CASE_CHECK(HTTP_METHOD_POST, get_method(reinterpret_cast<const unsigned char*>("POST / HTTP/1.1"), 15));
+		TEST_CASE_CHECK(HTTP_METHOD_HEAD, get_method(reinterpret_cast<const unsigned char*>("HEAD / HTTP/1.1"), 15));
+		TEST_CASE_CHECK(HTTP_METHOD_UNKNOWN, get_method(reinterpret_cast<const unsigned char*>("GET /"), 5));
+		TEST_CASE_CHECK(HTTP_METHOD_UNKNOWN, get_method(reinterpret_cast<const unsigned char*>("\x16\x03\x01\x02\x00\x01\x00\x01"), 8));
+	}
+
+	test_case::classname.assign("scan");
+	{
+		// Every split of every sample gives the same header and host as one packet
+		test_case::testcase_num = 1;
+		std::vector<char> buf(16384);
+		size_t mismatched = 0;
+
+		for (size_t n = 0; n < http_sample_count; n++)
+		{
+			std::string s(http_samples[n]);
+			size_t hdrlen = s.find("\r\n\r\n") + 4;
+
+			size_t hostpos = s.find("\r\nHost: ") + 8;
+			std::string expected = s.substr(hostpos, s.find("\r\n", hostpos) - hostpos);
+
+			for (size_t split = 0; split <= s.size(); split++)
+			{
+				for (int simd = 0; simd < 2; simd++)
+				{
+					http_scan_state st;
+					size_t length = http_test_scan(s, split, simd != 0, buf, st);
+					std::string host(&buf[st.host_offset], st.host_length);
+
+					if (!st.finished || (length != hdrlen) || (host != expected) || (s.compare(0, hdrlen, &buf[0], length) != 0))
+						mismatched++;
+				}
+			}
+		}
+
+		TEST_CASE_CHECK(size_t(0), mismatched);
+
+		// The body after the header is not taken
+		test_case::testcase_num = 2;
+		http_scan_state st;
+		std::string s(http_samples[2]);
+		TEST_CASE_CHECK(s.find("\r\n\r\n") + 4, http_test_scan(s, 30, true, buf, st));
+		TEST_CASE_CHECK(std::string("collector.internal.local:8080"), std::string(&buf[st.host_offset], st.host_length));
+
+		// Host in the request line or without CR is not taken
+		test_case::testcase_num = 3;
+		s.assign("GET /Host: a HTTP/1.1\r\nX: 1\nHost: b\r\nHost: www.example.com\r\n\r\n");
+		http_test_scan(s, 0, true, buf, st);
+		TEST_CASE_CHECK(true, st.finished);
+		TEST_CASE_CHECK(std::string("www.example.com"), std::string(&buf[st.host_offset], st.host_length));
+
+		// The header is cut at the capacity
+		test_case::testcase_num = 4;
+		st = http_scan_state();
+		s.assign(http_samples[1]);
+		size_t length = scan(&buf[0], 0, 100, reinterpret_cast<const unsigned char*>(s.c_str()), s.size(), st);
+		TEST_CASE_CHECK(size_t(100), length);
+		TEST_CASE_CHECK(false, st.finished);
+		TEST_CASE_CHECK(size_t(100), scan(&buf[0], length, 100, reinterpret_cast<const unsigned char*>(s.c_str()), s.size(), st));
+	}
+
+	return;
+}
+
+void http_scanner::benchmark()
+{
+	// Requests come in segments of the usual MSS, each flow ends with the header
+	static const size_t mss = 536;
+	static const int rounds = 20000;
+
+	double elapsed[3];
+	size_t hosts[3] = { 0, 0, 0 };
+	std::vector<char> buf(16384);
+
+	for (int kind = 0; kind < 3; kind++)
+	{
+		std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+
+		for (int r = 0; r < rounds; r++)
+		{
+			for (size_t n = 0; n < http_sample_count; n++)
+			{
+				const char* s = http_samples[n];
+				size_t len = strlen(s);
+
+				if (kind == 0)
+				{
+					http_legacy_capture lc;
+					lc.first_packet(s, (len < mss) ? len : mss);
+					for (size_t off = mss; off < len; off += mss)
+						lc.next_packet(s + off, (len - off < mss) ? len - off : mss);
+
+					hosts[kind] += lc.hostname.size();
+					continue;
+				}
+
+				http_scan_state st;
+				size_t length = 0;
+				for (size_t off = 0; (off < len) && !st.finished; off += mss)
+				{
+					const unsigned char* data = reinterpret_cast<const unsigned char*>(s + off);
+					size_t data_len = (len - off < mss) ? len - off : mss;
+
+					if (kind == 1)
+						length = scan_bytes(&buf[0], length, buf.size(), data, data_len, st);
+					else
+						length = scan(&buf[0], length, buf.size(), data, data_len, st);
+				}
+
+				hosts[kind] += st.host_length;
+			}
+		}
+
+		elapsed[kind] = std::chrono::duration<double, std::micro>(std::chrono::steady_clock::now() - start).count();
+	}
+
+	static const char* names[3] = { "string, rescan", "single pass, bytes", "single pass, sse2" };
+	for (int kind = 0; kind < 3; kind++)
+	{
+		std::cout << this_class_name << ": " << names[kind] << ": " << (elapsed[kind] * 1000.0 / (rounds * http_sample_count)) << " ns/request, "
+			<< hosts[kind] << " host bytes" << std::endl;
+	}
+}
+#endif
+
+}
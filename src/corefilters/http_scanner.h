@@ -0,0 +1,65 @@
+#ifndef _HTTP_SCANNER_H
+#define _HTTP_SCANNER_H
+
+#pragma once
+
+#define HTTP_METHOD_UNKNOWN 0
+#define HTTP_METHOD_GET 1
+#define HTTP_METHOD_POST 2
+#define HTTP_METHOD_HEAD 3
+#define HTTP_METHOD_PUT 4
+#define HTTP_METHOD_OPTIONS 5
+
+#if defined(_M_X64) || (defined(_M_IX86_FP) && (_M_IX86_FP >= 2)) || defined(__SSE2__)
+#define HTTP_SCANNER_SSE2
+#endif
+
+namespace utm {
+
+// Scan position of a request header which comes in several packets
+struct http_scan_state
+{
+	http_scan_state() : line_start(0), host_offset(0), host_length(0), finished(false) { };
+
+	unsigned short line_start;		// offset of the current header line
+	unsigned short host_offset;		// Host value in the header
+	unsigned short host_length;
+	bool finished;					// "\r\n\r\n" is found
+};
+
+//
+// Single pass scanner of HTTP request headers. The payload is copied to the header buffer
+// and searched for line feeds 16 bytes at a time; at every line end the line is checked for
+// the end of the header and for the Host field. Only the bytes of the new payload are scanned,
+// the state of the previous packets is in http_scan_state.
+//
+class http_scanner
+{
+public:
+	static const char this_class_name[];
+
+public:
+	// Request method by the start of the payload
+	static int get_method(const unsigned char* data, size_t len);
+
+	// Appends the payload to the header of the given length and scans it. The header is not
+	// extended over the capacity or over the end of the header. Returns the new header length.
+	static size_t scan(char* header, size_t length, size_t capacity, const unsigned char* data, size_t data_len, http_scan_state& st);
+
+	// The same byte by byte
+	static size_t scan_bytes(char* header, size_t length, size_t capacity, const unsigned char* data, size_t data_len, http_scan_state& st);
+
+private:
+	// Handles the line feed at pos, returns true at the end of the header
+	static bool line_end(const char* header, size_t pos, http_scan_state& st);
+
+#ifdef UTM_DEBUG
+public:
+	static void test_all();
+	static void benchmark();
+#endif
+};
+
+}
+
+#endif // _HTTP_SCANNER_H
@@ -4,10 +4,18 @@
 #include <string.h>
 #include <addrip_v4.h>
 
+#include <chrono>
+#include <iostream>
+#include <vector>
+
+#include <ubase_test.h>
+
 #include <boost/lexical_cast.hpp>
 
 namespace utm {
 
+const char ip_header::this_class_name[] = "ip_header";
+
 ip_header::ip_header(void)
 {
 }
@@ -16,7 +24,7 @@ ip_header::~ip_header(void)
 {
 }
 
-bool ip_header::parse_raw_buffer(const unsigned char *ippkt)
+bool ip_header::parse_raw_buffer(const unsigned char *ippkt, unsigned int need)
 {
 	// "Version" field. It must be 4.
 	version = (ippkt[0] >> 4); if (version != 4) return false;
@@ -24,29 +32,32 @@ bool ip_header::parse_raw_buffer(const unsigned char *ippkt)
 	// IP Header Lenght (in 32-bits words)
 	ip_hl = (ippkt[0] & 0x0F);
 
-	// TOS
-	tos = ippkt[1];
-
 	// Total packet lenght
 	length = (ippkt[2]<<8)+ippkt[3];
 
-	// Identification
-	identification = (ippkt[4]<<8)+ippkt[5];
+	if (need & IPHDR_NEED_DETAILS)
+	{
+		// TOS
+		tos = ippkt[1];
+
+		// Identification
+		identification = (ippkt[4]<<8)+ippkt[5];
 
-	// TTL
-	ttl = ippkt[8];
+		// TTL
+		ttl = ippkt[8];
+	}
 
 	// "Protocol" field
 	proto = ippkt[9];
 
 	// "Source IP" field
-	src_ip_addr.m_addr = (ippkt[12] << 24) + (ippkt[13] << 16) + (ippkt[14] << 8) + ippkt[15];
+	src_ip_addr.m_addr = (static_cast<unsigned int>(ippkt[12]) << 24) + (ippkt[13] << 16) + (ippkt[14] << 8) + ippkt[15];
 #ifdef _DEBUG
 //	addrip_v4::to_strbuffer(src_ip_addr.m_addr, src_ip_addr.m_addr2);
 #endif
 
 	// "Destination IP" field
-	dst_ip_addr.m_addr = (ippkt[16] << 24) + (ippkt[17] << 16) + (ippkt[18] << 8) + ippkt[19];
+	dst_ip_addr.m_addr = (static_cast<unsigned int>(ippkt[16]) << 24) + (ippkt[17] << 16) + (ippkt[18] << 8) + ippkt[19];
 #ifdef _DEBUG
 //	addrip_v4::to_strbuffer(dst_ip_addr.m_addr, dst_ip_addr.m_addr2);
 #endif
@@ -58,7 +69,7 @@ bool ip_header::parse_raw_buffer(const unsigned char *ippkt)
 	// offset for actual data after IP header
 	int ipd = ip_hl*4;
 
-	if (proto == 1)
+	if ((proto == 1) && (need & IPHDR_NEED_FLAGS))
 	{
 		flags = (ippkt[ipd] << 8) + ippkt[ipd+1];
 	};
@@ -76,17 +87,23 @@ bool ip_header::parse_raw_buffer(const unsigned char *ippkt)
 
 	if (proto == 6)
 	{
-		// TCP Sequence number
-		seq_num = ippkt[ipd+4] << 24;
-		seq_num += ippkt[ipd+5] << 16;
-		seq_num += ippkt[ipd+6] << 8;
-		seq_num += ippkt[ipd+7];
-
-		// TCP Acknowlegement number
-		ack_num = ippkt[ipd+8] << 24;
-		ack_num += ippkt[ipd+9] << 16;
-		ack_num += ippkt[ipd+10] << 8;
-		ack_num += ippkt[ipd+11];
+		if (need & IPHDR_NEED_DETAILS)
+		{
+			// TCP Sequence number
+			seq_num = ippkt[ipd+4] << 24;
+			seq_num += ippkt[ipd+5] << 16;
+			seq_num += ippkt[ipd+6] << 8;
+			seq_num += ippkt[ipd+7];
+
+			// TCP Acknowlegement number
+			ack_num = ippkt[ipd+8] << 24;
+			ack_num += ippkt[ipd+9] << 16;
+			ack_num += ippkt[ipd+10] << 8;
+			ack_num += ippkt[ipd+11];
+		}
+
+		if ((need & (IPHDR_NEED_FLAGS | IPHDR_NEED_FTP)) == 0)
+			return true;
 
 		// Data offset + flags
 		flags = ippkt[ipd+12] << 8;
@@ -94,6 +111,9 @@ bool ip_header::parse_raw_buffer(const unsigned char *ippkt)
 
 		tcp_hl = ((ippkt[ipd + 12] >> 4) & 0x0F);
 
+		if ((need & IPHDR_NEED_FTP) == 0)
+			return true;
+
 		UINT pktd = ipd + tcp_hl*4;
 
 		if ((src_port == 21) && (length > pktd))
@@ -264,4 +284,148 @@ void ip_header::test_fill_packet(int packet_num)
 	};
 }
 
+
+#ifdef UTM_DEBUG
+static void ip_header_test_packet(std::vector<unsigned char>& pkt, unsigned short sport, unsigned short dport, unsigned char tcp_flags, const char* payload)
+{
+	size_t payload_len = strlen(payload);
+
+	// The tail is zero like in the capture buffers
+	pkt.assign(40 + payload_len + 64, 0);
+	pkt[0] = 0x45;
+	pkt[2] = static_cast<unsigned char>((40 + payload_len) >> 8);
+	pkt[3] = static_cast<unsigned char>(40 + payload_len);
+	pkt[5] = 7;
+	pkt[8] = 64;
+	pkt[9] = 6;
+	pkt[12] = 192; pkt[13] = 168; pkt[14] = 1; pkt[15] = 2;
+	pkt[16] = 10; pkt[19] = 180;
+	pkt[20] = static_cast<unsigned char>(sport >> 8);
+	pkt[21] = static_cast<unsigned char>(sport);
+	pkt[22] = static_cast<unsigned char>(dport >> 8);
+	pkt[23] = static_cast<unsigned char>(dport);
+	pkt[27] = 1;
+	pkt[32] = 0x50;
+	pkt[33] = tcp_flags;
+
+	memcpy(&pkt[40], payload, payload_len);
+}
+
+void ip_header::test_all()
+{
+	test_report tr(this_class_name);
+	test_case::classname.assign(this_class_name);
+
+	std::vector<unsigned char> pkt;
+	ip_header_test_packet(pkt, 21, 1030, 0x18, "227 Entering Passive Mode (10,0,0,180,4,1)\r\n");
+
+	{
+		test_case::testcase_num = 1;
+
+		ip_header ih;
+		TEST_CASE_CHECK(true, ih.parse_raw_buffer(&pkt[0]));
+		TEST_CASE_CHECK(addrip_v4("192.168.1.2").m_addr, ih.src_ip_addr.m_addr);
+		TEST_CASE_CHECK((unsigned short)21, ih.src_port);
+		TEST_CASE_CHECK((unsigned short)1030, ih.dst_port);
+		TEST_CASE_CHECK((unsigned short)7, ih.identification);
+		TEST_CASE_CHECK((unsigned char)64, ih.ttl);
+		TEST_CASE_CHECK(1u, ih.seq_num);
+		TEST_CASE_CHECK((unsigned short)0x5018, ih.flags);
+		TEST_CASE_CHECK((unsigned short)FTPMODE_PASSIVE, ih.ftpdata_mode);
+		TEST_CASE_CHECK(static_cast<unsigned int>(addrip_v4("10.0.0.180").m_addr), ih.ftpdata_ip);
+		TEST_CASE_CHECK((unsigned short)1025, ih.ftpdata_port);
+	}
+
+	{
+		// Only the addresses, ports and length, the rest is not touched
+		test_case::testcase_num = 2;
+
+		ip_header ih;
+		ih.ttl = 0;
+		ih.seq_num = 0;
+		ih.flags = 0;
+		ih.ftpdata_mode = FTPMODE_ACTIVE;
+
+		TEST_CASE_CHECK(true, ih.parse_raw_buffer(&pkt[0], IPHDR_NEED_NONE));
+		TEST_CASE_CHECK(addrip_v4("10.0.0.180").m_addr, ih.dst_ip_addr.m_addr);
+		TEST_CASE_CHECK((unsigned short)6, ih.proto);
+		TEST_CASE_CHECK((unsigned int)pkt[3], ih.length);
+		TEST_CASE_CHECK((unsigned short)1030, ih.dst_port);
+		TEST_CASE_CHECK((unsigned char)0, ih.ttl);
+		TEST_CASE_CHECK(0u, ih.seq_num);
+		TEST_CASE_CHECK((unsigned short)0, ih.flags);
+		TEST_CASE_CHECK((unsigned short)FTPMODE_NONE, ih.ftpdata_mode);
+	}
+
+	{
+		test_case::testcase_num = 3;
+
+		ip_header ih;
+		TEST_CASE_CHECK(true, ih.parse_raw_buffer(&pkt[0], IPHDR_NEED_FLAGS));
+		TEST_CASE_CHECK((unsigned short)0x5018, ih.flags);
+		TEST_CASE_CHECK((unsigned short)FTPMODE_NONE, ih.ftpdata_mode);
+
+		TEST_CASE_CHECK(true, ih.parse_raw_buffer(&pkt[0], IPHDR_NEED_FTP));
+		TEST_CASE_CHECK((unsigned short)FTPMODE_PASSIVE, ih.ftpdata_mode);
+	}
+
+	{
+		test_case::testcase_num = 4;
+
+		ip_header_test_packet(pkt, 1030, 21, 0x18, "PORT 192,168,1,2,7,208\r\n");
+
+		ip_header ih;
+		TEST_CASE_CHECK(true, ih.parse_raw_buffer(&pkt[0], IPHDR_NEED_FTP));
+		TEST_CASE_CHECK((unsigned short)FTPMODE_ACTIVE, ih.ftpdata_mode);
+		TEST_CASE_CHECK(static_cast<unsigned int>(addrip_v4("192.168.1.2").m_addr), ih.ftpdata_ip);
+		TEST_CASE_CHECK((unsigned short)2000, ih.ftpdata_port);
+
+		pkt[0] = 0x65;
+		TEST_CASE_CHECK(false, ih.parse_raw_buffer(&pkt[0], IPHDR_NEED_NONE));
+	}
+
+	return;
+}
+
+void ip_header::benchmark()
+{
+	// The FTP control connection is a small share of the traffic
+	static const size_t packet_count = 1000;
+	std::vector<std::vector<unsigned char> > packets(packet_count);
+	for (size_t i = 0; i < packet_count; i++)
+	{
+		if (i % 100 == 0)
+			ip_header_test_packet(packets[i], 21, 1030, 0x18, "227 Entering Passive Mode (10,0,0,180,4,1)\r\n");
+		else
+			ip_header_test_packet(packets[i], static_cast<unsigned short>(1024 + i), 443, 0x10, "");
+	}
+
+	static const int rounds = 2000;
+	static const unsigned int needs[3] = { IPHDR_NEED_ALL, IPHDR_NEED_FLAGS, IPHDR_NEED_NONE };
+	static const char* names[3] = { "all fields", "flags", "addresses and ports" };
+
+	ip_header ih;
+
+	for (int kind = 0; kind < 3; kind++)
+	{
+		unsigned int total = 0;
+		std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+
+		for (int n = 0; n < rounds; n++)
+		{
+			for (size_t i = 0; i < packet_count; i++)
+			{
+				ih.parse_raw_buffer(&packets[i][0], needs[kind]);
+				total += ih.src_port + ih.length;
+			}
+		}
+
+		double elapsed = std::chrono::duration<double, std::micro>(std::chrono::steady_clock::now() - start).count();
+
+		std::cout << this_class_name << ": " << names[kind] << ": " << (elapsed * 1000.0 / (rounds * packet_count)) << " ns/packet ("
+			<< total << ")" << std::endl;
+	}
+}
+#endif
+
 }
@@ -21,6 +21,13 @@
 #define FTPMODE_ACTIVE 2
 #endif
 
+// Fields decoded by parse_raw_buffer() besides the addresses, ports, protocol and length
+#define IPHDR_NEED_NONE 0
+#define IPHDR_NEED_DETAILS 1		// identification, TOS, TTL, TCP sequence and ack numbers
+#define IPHDR_NEED_FLAGS 2			// TCP flags, ICMP type and code
+#define IPHDR_NEED_FTP 4			// FTP data connections from the control packets
+#define IPHDR_NEED_ALL 0xFFFF
+
 #include <addrip_v4.h>
 
 namespace utm {
@@ -28,6 +35,8 @@ namespace utm {
 struct ip_header
 {
 public:
+	static const char this_class_name[];
+
 	ip_header(void);
 	~ip_header(void);
 
@@ -56,11 +65,17 @@ public:
 	unsigned short			ftpdata_port;		// TCP port for data connection during FTP session
 	unsigned short			ftpdata_mode;		// mode for FTP data connection (passive or active)
 
-	bool parse_raw_buffer(const unsigned char *ippkt);
+	// Fields not in the need mask keep their values
+	bool parse_raw_buffer(const unsigned char *ippkt, unsigned int need = IPHDR_NEED_ALL);
 	void swap_src_dst();
 	void compare(const ip_header& rhs, std::string& result);
 
 	void test_fill_packet(int packet_num);
+
+#ifdef UTM_DEBUG
+	static void test_all();
+	static void benchmark();
+#endif
 };
 
 }
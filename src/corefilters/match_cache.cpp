@@ -0,0 +1,352 @@
+#include "StdAfx.h"
+#include "match_cache.h"
+
+#include <utime.h>
+#include <ubase_test.h>
+
+namespace utm {
+
+const char match_cache::this_class_name[] = "match_cache";
+
+void match_cache_key::assign(const match_filter_input& data)
+{
+	src_addr = data.ip->src_ip_addr.m_addr;
+	dst_addr = data.ip->dst_ip_addr.m_addr;
+	src_port = data.ip->src_port;
+	dst_port = data.ip->dst_port;
+	proto = data.ip->proto;
+	packet_direction = static_cast<unsigned short>(data.nPacketDirection);
+	nic_alias = data.nNicAlias;
+	precheck_addrtables = data.nPreCheckAddrTables;
+	with_nat = data.bWithNat;
+	prev_filter = data.nPrevFilter;
+}
+
+unsigned int match_cache_key::hash() const
+{
+	unsigned int h = src_addr * 0x9E3779B1;
+	h ^= dst_addr + 0x7F4A7C15 + (h << 6) + (h >> 2);
+	h ^= ((src_port << 16) | dst_port) + 0x7F4A7C15 + (h << 6) + (h >> 2);
+	h ^= ((proto << 16) | (packet_direction << 8) | (nic_alias << 4) | (with_nat ? 2 : 0) | (prev_filter ? 1 : 0)) + (h << 6) + (h >> 2);
+	h ^= precheck_addrtables + (h << 6) + (h >> 2);
+
+	h ^= h >> 16;
+	h *= 0x85EBCA6B;
+	h ^= h >> 13;
+	return h;
+}
+
+bool match_cache_key::operator==(const match_cache_key& rhs) const
+{
+	return (src_addr == rhs.src_addr) && (dst_addr == rhs.dst_addr) &&
+		(src_port == rhs.src_port) && (dst_port == rhs.dst_port) &&
+		(proto == rhs.proto) && (packet_direction == rhs.packet_direction) &&
+		(nic_alias == rhs.nic_alias) && (precheck_addrtables == rhs.precheck_addrtables) &&
+		(with_nat == rhs.with_nat) && (prev_filter == rhs.prev_filter);
+}
+
+match_cache::match_cache(size_t max_entries) : hits(0), misses(0), evictions(0), invalidations(0), uncacheable(0)
+{
+	buckets_per_shard = max_entries / (MATCHCACHE_SHARDS * MATCHCACHE_WAYS);
+	if (buckets_per_shard == 0) buckets_per_shard = 1;
+
+	for (int i = 0; i < MATCHCACHE_SHARDS; i++)
+	{
+		shards[i].entries.resize(buckets_per_shard * MATCHCACHE_WAYS);
+	}
+}
+
+match_cache::~match_cache()
+{
+}
+
+void match_cache::clear()
+{
+	for (int i = 0; i < MATCHCACHE_SHARDS; i++)
+	{
+		boost::mutex::scoped_lock lock(shards[i].guard);
+
+		for (auto iter = shards[i].entries.begin(); iter != shards[i].entries.end(); ++iter)
+		{
+			iter->valid = false;
+			iter->items.clear();
+		}
+	}
+}
+
+void match_cache::get_stat(match_cache_stat& stat) const
+{
+	stat.hits = hits;
+	stat.misses = misses;
+	stat.evictions = evictions;
+	stat.invalidations = invalidations;
+	stat.uncacheable = uncacheable;
+	stat.entries = 0;
+
+	for (int i = 0; i < MATCHCACHE_SHARDS; i++)
+	{
+		boost::mutex::scoped_lock lock(shards[i].guard);
+
+		for (auto iter = shards[i].entries.begin(); iter != shards[i].entries.end(); ++iter)
+		{
+			if (iter->valid) stat.entries++;
+		}
+	}
+}
+
+bool match_cache::lookup(shard& sh, const match_cache_key& key, unsigned int hash, unsigned int generation, unsigned int epoch, filterset_match_list& matches)
+{
+	boost::mutex::scoped_lock lock(sh.guard);
+
+	size_t first = ((hash >> 4) % buckets_per_shard) * MATCHCACHE_WAYS;
+	for (size_t i = first; i < first + MATCHCACHE_WAYS; i++)
+	{
+		match_cache_entry& e = sh.entries[i];
+
+		if (!e.valid || (e.hash != hash) || !(e.key == key))
+			continue;
+
+		if ((e.generation != generation) || (e.epoch != epoch))
+		{
+			// Filterset was reloaded or the hour is over
+			e.valid = false;
+			invalidations++;
+			return false;
+		}
+
+		e.last_use = ++sh.use_counter;
+		matches.items.assign(e.items.begin(), e.items.end());
+		return true;
+	}
+
+	return false;
+}
+
+void match_cache::insert(shard& sh, const match_cache_key& key, unsigned int hash, unsigned int generation, unsigned int epoch, const filterset_match_list& matches)
+{
+	boost::mutex::scoped_lock lock(sh.guard);
+
+	size_t first = ((hash >> 4) % buckets_per_shard) * MATCHCACHE_WAYS;
+	size_t victim = first;
+
+	for (size_t i = first; i < first + MATCHCACHE_WAYS; i++)
+	{
+		match_cache_entry& e = sh.entries[i];
+
+		if (!e.valid)
+		{
+			victim = i;
+			break;
+		}
+
+		if ((e.hash == hash) && (e.key == key))
+		{
+			victim = i;
+			break;
+		}
+
+		if (e.last_use < sh.entries[victim].last_use)
+			victim = i;
+	}
+
+	match_cache_entry& e = sh.entries[victim];
+
+	if (e.valid && !((e.hash == hash) && (e.key == key)))
+		evictions++;
+
+	e.key = key;
+	e.hash = hash;
+	e.generation = generation;
+	e.epoch = epoch;
+	e.last_use = ++sh.use_counter;
+	e.valid = true;
+	e.items.assign(matches.items.begin(), matches.items.end());
+}
+
+void match_cache::match(filterset& fs, const match_filter_input& data, filterset_match_list& matches)
+{
+	std::shared_ptr<const filterset_classifier> fc = fs.get_classifier();
+
+	if ((fc.get() == NULL) || !fc->is_valid_for(&fs, fs.filters.size()))
+	{
+		uncacheable++;
+		fs.match_filters(data, matches);
+		return;
+	}
+
+	match_cache_key key;
+	key.assign(data);
+
+	unsigned int hash = key.hash();
+	unsigned int epoch = filterset_classifier::get_time_epoch(*data.lt);
+	shard& sh = shards[hash % MATCHCACHE_SHARDS];
+
+	matches.reset(fc->get_filter_count());
+
+	if (lookup(sh, key, hash, fc->get_generation(), epoch, matches))
+	{
+		hits++;
+
+		// Same rules as before, but counters and limits are up to date
+		match_filter_result result;
+		for (size_t i = 0; i < matches.items.size(); i++)
+		{
+			const filterset_match& m = matches.items[i];
+
+			result.clear();
+			m.filter_ptr->apply_match(*m.rule_ptr, m.rule_no, m.direction, data, result);
+			matches.update(i, result);
+		}
+
+		return;
+	}
+
+	misses++;
+	fc->match(data, matches);
+
+	if (matches.is_volatile)
+	{
+		uncacheable++;
+		return;
+	}
+
+	insert(sh, key, hash, fc->get_generation(), epoch, matches);
+}
+
+#ifdef UTM_DEBUG
+void match_cache::test_all()
+{
+	test_report tr(this_class_name);
+	test_case::classname.assign(this_class_name);
+
+	tm lt = utm::utime(2010, 05, 30, 12, 59, 12).to_tm();
+
+	filterset fs;
+	{
+		filter2 f1;
+		f1.set_id(1);
+		f1.rule_add(rule(RULE_IP, "192.168.1.0", "255.255.255.0", RULE_IP, "0.0.0.0", "0.0.0.0"));
+		fs.filters.add_element(f1);
+
+		filter2 f2;
+		f2.set_id(2);
+		rule r(RULE_IP, "0.0.0.0", "0.0.0.0", RULE_IP, "10.0.0.180", "255.255.255.255");
+		r.prevfilter_type = PREVFILTER_MATCHED;
+		f2.rule_add(r);
+		fs.filters.add_element(f2);
+
+		filter2 f3;
+		f3.set_id(3);
+		rule r3(RULE_IP, "0.0.0.0", "0.0.0.0", RULE_IP, "10.0.0.181", "255.255.255.255");
+		r3.condition_type = COND_SENT_LESS;
+		r3.condition_limit = 1;
+		f3.rule_add(r3);
+		fs.filters.add_element(f3);
+	}
+
+	ip_header iphdr;
+	iphdr.test_fill_packet(0);
+
+	match_filter_input input;
+	input.ip = &iphdr;
+	input.mat = &fs.table_mat;
+	input.nModifyCounter = MODIFY_COUNTER_YES;
+	input.lt = &lt;
+	input.mbytes = 1048576;
+
+	filterset_match_list matches;
+	match_cache_stat stat;
+
+	{
+		test_case::testcase_num = 1;
+
+		match_cache mc(256);
+
+		// Without a classifier the filterset is checked directly
+		mc.match(fs, input, matches);
+		TEST_CASE_CHECK(matches.size(), size_t(2));
+
+		mc.get_stat(stat);
+		TEST_CASE_CHECK(stat.uncacheable, uint64_t(1));
+		TEST_CASE_CHECK(stat.entries, uint32_t(0));
+
+		fs.prepare_rule_classifiers();
+
+		mc.match(fs, input, matches);
+		TEST_CASE_CHECK(matches.size(), size_t(2));
+		mc.match(fs, input, matches);
+		TEST_CASE_CHECK(matches.size(), size_t(2));
+		TEST_CASE_CHECK(matches.items[1].filter_id, unsigned int(2));
+		TEST_CASE_CHECK(matches.items[1].direction, int(DIRECTION_FORWARD));
+		TEST_CASE_CHECK(matches.is_matched(1), true);
+
+		mc.get_stat(stat);
+		TEST_CASE_CHECK(stat.misses, uint64_t(1));
+		TEST_CASE_CHECK(stat.hits, uint64_t(1));
+		TEST_CASE_CHECK(stat.entries, uint32_t(1));
+
+		// Counters are updated for the cached flow too
+		filter2* pf = fs.filters.findptr_by_id(2);
+		TEST_CASE_CHECK(pf->cnt_sent.get_cnt(), __int64(180));
+
+		// Next hour
+		tm lt2 = lt;
+		lt2.tm_hour++;
+		input.lt = &lt2;
+		mc.match(fs, input, matches);
+		input.lt = &lt;
+
+		mc.get_stat(stat);
+		TEST_CASE_CHECK(stat.invalidations, uint64_t(1));
+		TEST_CASE_CHECK(stat.misses, uint64_t(2));
+
+		// Filterset reload
+		fs.prepare_rule_classifiers();
+		mc.match(fs, input, matches);
+
+		mc.get_stat(stat);
+		TEST_CASE_CHECK(stat.invalidations, uint64_t(2));
+		TEST_CASE_CHECK(stat.misses, uint64_t(3));
+
+		// The rule with a counter condition is checked, so the flow is not cached
+		iphdr.dst_ip_addr = addrip_v4("10.0.0.181");
+		input.mbytes = 100;
+		mc.match(fs, input, matches);
+		TEST_CASE_CHECK(matches.size(), size_t(2));
+		mc.match(fs, input, matches);
+		TEST_CASE_CHECK(matches.size(), size_t(2));
+		mc.match(fs, input, matches);
+		TEST_CASE_CHECK(matches.size(), size_t(1));
+		input.mbytes = 1048576;
+
+		mc.get_stat(stat);
+		TEST_CASE_CHECK(stat.uncacheable, uint64_t(4));
+		TEST_CASE_CHECK(stat.misses, uint64_t(6));
+		TEST_CASE_CHECK(stat.hits, uint64_t(1));
+
+		mc.clear();
+		mc.get_stat(stat);
+		TEST_CASE_CHECK(stat.entries, uint32_t(0));
+	}
+
+	{
+		test_case::testcase_num = 2;
+
+		// One bucket in every shard
+		match_cache mc(MATCHCACHE_SHARDS * MATCHCACHE_WAYS);
+
+		iphdr.dst_ip_addr = addrip_v4("10.0.0.180");
+		for (unsigned int i = 0; i < 1000; i++)
+		{
+			iphdr.src_port = i;
+			mc.match(fs, input, matches);
+		}
+
+		mc.get_stat(stat);
+		TEST_CASE_CHECK(stat.entries, uint32_t(MATCHCACHE_SHARDS * MATCHCACHE_WAYS));
+		TEST_CASE_CHECK(stat.evictions, uint64_t(1000 - MATCHCACHE_SHARDS * MATCHCACHE_WAYS));
+	}
+}
+#endif
+
+}
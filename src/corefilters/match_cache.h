@@ -0,0 +1,110 @@
+#ifndef _UTM_MATCH_CACHE_H
+#define _UTM_MATCH_CACHE_H
+
+#pragma once
+#include <utm.h>
+
+#include <vector>
+#include <atomic>
+
+#include <boost/thread/mutex.hpp>
+
+#include "filterset.h"
+#include "filterset_classifier.h"
+
+#define MATCHCACHE_DEFAULT_SIZE 65536
+#define MATCHCACHE_SHARDS 16
+#define MATCHCACHE_WAYS 4
+
+namespace utm {
+
+struct match_cache_key
+{
+	unsigned int src_addr;
+	unsigned int dst_addr;
+	unsigned short src_port;
+	unsigned short dst_port;
+	unsigned short proto;
+	unsigned short packet_direction;
+	unsigned int nic_alias;
+	unsigned int precheck_addrtables;
+	bool with_nat;
+	int prev_filter;
+
+	void assign(const match_filter_input& data);
+	unsigned int hash() const;
+	bool operator==(const match_cache_key& rhs) const;
+};
+
+struct match_cache_entry
+{
+	match_cache_entry() : hash(0), generation(0), epoch(0), last_use(0), valid(false) { };
+
+	match_cache_key key;
+	unsigned int hash;
+	unsigned int generation;
+	unsigned int epoch;
+	unsigned int last_use;
+	bool valid;
+
+	std::vector<filterset_match> items;
+};
+
+struct match_cache_stat
+{
+	uint64_t hits;
+	uint64_t misses;
+	uint64_t evictions;
+	uint64_t invalidations;
+	uint64_t uncacheable;
+	uint32_t entries;
+};
+
+//
+// Flow cache of the filterset matches. A cached flow gets the same filters and rules,
+// counters and traffic limits are applied on every packet.
+//
+class match_cache
+{
+public:
+	static const char this_class_name[];
+
+	match_cache(size_t max_entries = MATCHCACHE_DEFAULT_SIZE);
+	~match_cache();
+
+	void match(filterset& fs, const match_filter_input& data, filterset_match_list& matches);
+	void clear();
+
+	void get_stat(match_cache_stat& stat) const;
+
+private:
+	struct shard
+	{
+		shard() : use_counter(0) { };
+
+		std::vector<match_cache_entry> entries;
+		unsigned int use_counter;
+		mutable boost::mutex guard;
+	};
+
+	shard shards[MATCHCACHE_SHARDS];
+	size_t buckets_per_shard;
+
+	std::atomic_uint_fast64_t hits;
+	std::atomic_uint_fast64_t misses;
+	std::atomic_uint_fast64_t evictions;
+	std::atomic_uint_fast64_t invalidations;
+	std::atomic_uint_fast64_t uncacheable;
+
+	bool lookup(shard& sh, const match_cache_key& key, unsigned int hash, unsigned int generation, unsigned int epoch, filterset_match_list& matches);
+	void insert(shard& sh, const match_cache_key& key, unsigned int hash, unsigned int generation, unsigned int epoch, const filterset_match_list& matches);
+
+public:
+#ifdef UTM_DEBUG
+	static void test_all();
+#endif
+};
+
+}
+
+#endif // _UTM_MATCH_CACHE_H
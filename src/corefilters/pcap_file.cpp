@@ -0,0 +1,629 @@
+#include "stdafx.h"
+#include "pcap_file.h"
+
+#include <cstring>
+
+#include <ubase_test.h>
+
+#define PCAP_MAGIC 0xA1B2C3D4
+#define PCAP_MAGIC_NS 0xA1B23C4D
+#define PCAP_MAGIC_BE 0xD4C3B2A1
+#define PCAP_MAGIC_NS_BE 0x4D3CB2A1
+#define PCAP_HEADER_SIZE 24
+#define PCAP_RECORD_SIZE 16
+
+#define PCAPNG_SECTION 0x0A0D0D0A
+#define PCAPNG_INTERFACE 1
+#define PCAPNG_PACKET 2
+#define PCAPNG_SIMPLE_PACKET 3
+#define PCAPNG_ENHANCED_PACKET 6
+#define PCAPNG_BYTE_ORDER 0x1A2B3C4D
+#define PCAPNG_BYTE_ORDER_BE 0x4D3C2B1A
+
+#define PCAPNG_OPT_END 0
+#define PCAPNG_OPT_FLAGS 2
+#define PCAPNG_OPT_TSRESOL 9
+
+#define PCAPNG_MAX_TSRESOL 19			// 10^19 is the last power of ten in 64 bits
+#define PCAPNG_MAX_TSRESOL_BINARY 63
+
+namespace utm {
+
+const char pcap_file::this_class_name[] = "pcap_file";
+
+pcap_file::pcap_file() : data(NULL), size(0), pos(0), first_pos(0),
+	pcapng(false), big_endian(false), nanoseconds(false), linktype(0), last_ts(0)
+{
+}
+
+pcap_file::~pcap_file()
+{
+	close();
+}
+
+void pcap_file::open(const std::string& filename)
+{
+	close();
+
+	file.open(filename);
+	if (!file.is_open())
+		throw std::exception("pcap_file: unable to open the file");
+
+	data = reinterpret_cast<const unsigned char*>(file.data());
+	size = file.size();
+
+	parse_header();
+}
+
+void pcap_file::open_buffer(const unsigned char* data, size_t size)
+{
+	close();
+
+	this->data = data;
+	this->size = size;
+
+	parse_header();
+}
+
+void pcap_file::close()
+{
+	if (file.is_open())
+		file.close();
+
+	data = NULL;
+	size = 0;
+	pos = 0;
+	first_pos = 0;
+	interfaces.clear();
+	last_ts = 0;
+}
+
+uint16_t pcap_file::get16(size_t offset) const
+{
+	const unsigned char* p = data + offset;
+	return big_endian ? static_cast<uint16_t>((p[0] << 8) | p[1]) : static_cast<uint16_t>((p[1] << 8) | p[0]);
+}
+
+uint32_t pcap_file::get32(size_t offset) const
+{
+	const unsigned char* p = data + offset;
+	if (big_endian)
+		return (static_cast<uint32_t>(p[0]) << 24) | (static_cast<uint32_t>(p[1]) << 16) | (static_cast<uint32_t>(p[2]) << 8) | p[3];
+
+	return (static_cast<uint32_t>(p[3]) << 24) | (static_cast<uint32_t>(p[2]) << 16) | (static_cast<uint32_t>(p[1]) << 8) | p[0];
+}
+
+void pcap_file::parse_header()
+{
+	if (size < 12)
+	{
+		close();
+		throw std::exception("pcap_file: unknown file format");
+	}
+
+	big_endian = false;
+	uint32_t magic = get32(0);
+
+	if (magic == PCAPNG_SECTION)
+	{
+		// The byte order is set by every section header
+		pcapng = true;
+		first_pos = 0;
+	}
+	else if (((magic == PCAP_MAGIC) || (magic == PCAP_MAGIC_NS) || (magic == PCAP_MAGIC_BE) || (magic == PCAP_MAGIC_NS_BE)) && (size >= PCAP_HEADER_SIZE))
+	{
+		pcapng = false;
+		big_endian = (magic == PCAP_MAGIC_BE) || (magic == PCAP_MAGIC_NS_BE);
+		nanoseconds = (magic == PCAP_MAGIC_NS) || (magic == PCAP_MAGIC_NS_BE);
+		linktype = get32(20) & 0xFFFF;
+		first_pos = PCAP_HEADER_SIZE;
+	}
+	else
+	{
+		close();
+		throw std::exception("pcap_file: unknown file format");
+	}
+
+	pos = first_pos;
+}
+
+void pcap_file::rewind()
+{
+	pos = first_pos;
+	interfaces.clear();
+	last_ts = 0;
+}
+
+bool pcap_file::next(pcap_frame& frame)
+{
+	if (data == NULL)
+		return false;
+
+	return pcapng ? next_pcapng(frame) : next_pcap(frame);
+}
+
+bool pcap_file::next_pcap(pcap_frame& frame)
+{
+	if (pos + PCAP_RECORD_SIZE > size)
+		return false;
+
+	uint64_t sec = get32(pos);
+	uint64_t frac = get32(pos + 4);
+	size_t caplen = get32(pos + 8);
+	size_t len = get32(pos + 12);
+
+	if (caplen > size - pos - PCAP_RECORD_SIZE)
+		return false;
+
+	frame.ts = sec * 1000000000ULL + (nanoseconds ? frac : frac * 1000);
+	frame.linktype = linktype;
+	frame.direction = PCAP_DIRECTION_UNKNOWN;
+	frame.data = data + pos + PCAP_RECORD_SIZE;
+	frame.caplen = caplen;
+	frame.len = len;
+
+	pos += PCAP_RECORD_SIZE + caplen;
+	return true;
+}
+
+bool pcap_file::next_pcapng(pcap_frame& frame)
+{
+	while (pos + 12 <= size)
+	{
+		uint32_t type = get32(pos);
+
+		if (type == PCAPNG_SECTION)
+		{
+			uint32_t order = get32(pos + 8);
+			if ((order != PCAPNG_BYTE_ORDER) && (order != PCAPNG_BYTE_ORDER_BE))
+				return false;
+
+			if (order == PCAPNG_BYTE_ORDER_BE)
+				big_endian = !big_endian;
+
+			// Interfaces are numbered in the section
+			interfaces.clear();
+		}
+
+		size_t block_len = get32(pos + 4);
+		if ((block_len < 12) || (block_len % 4 != 0) || (block_len > size - pos))
+			return false;
+
+		size_t body = pos + 8;
+		size_t end = pos + block_len - 4;
+		pos += block_len;
+
+		if (type == PCAPNG_INTERFACE)
+		{
+			if (!parse_interface(body, end))
+				return false;
+
+			continue;
+		}
+
+		if ((type == PCAPNG_ENHANCED_PACKET) || (type == PCAPNG_PACKET))
+		{
+			if (body + 20 > end)
+				continue;
+
+			unsigned int interface_id = (type == PCAPNG_PACKET) ? get16(body) : get32(body);
+			uint64_t ts = (static_cast<uint64_t>(get32(body + 4)) << 32) | get32(body + 8);
+			size_t caplen = get32(body + 12);
+
+			if ((interface_id >= interfaces.size()) || (caplen > end - body - 20))
+				continue;
+
+			frame.ts = get_ng_time(interface_id, ts);
+			frame.linktype = interfaces[interface_id].linktype;
+			frame.direction = get_flags(body + 20 + ((caplen + 3) & ~static_cast<size_t>(3)), end) & 3;
+			frame.data = data + body + 20;
+			frame.caplen = caplen;
+			frame.len = get32(body + 16);
+
+			last_ts = frame.ts;
+			return true;
+		}
+
+		if (type == PCAPNG_SIMPLE_PACKET)
+		{
+			if ((body + 4 > end) || interfaces.empty())
+				continue;
+
+			// No time in the block, the frame is taken as seen with the previous one
+			size_t len = get32(body);
+			size_t caplen = end - body - 4;
+
+			frame.ts = last_ts;
+			frame.linktype = interfaces[0].linktype;
+			frame.direction = PCAP_DIRECTION_UNKNOWN;
+			frame.data = data + body + 4;
+			frame.caplen = (len < caplen) ? len : caplen;
+			frame.len = len;
+			return true;
+		}
+	}
+
+	return false;
+}
+
+bool pcap_file::parse_interface(size_t body, size_t end)
+{
+	ng_interface i;
+	i.linktype = 0;
+	i.binary_resol = false;
+	i.resol = 6;
+
+	if (body + 8 <= end)
+	{
+		i.linktype = get16(body);
+
+		for (size_t opt = body + 8; opt + 4 <= end;)
+		{
+			unsigned int code = get16(opt);
+			size_t len = get16(opt + 2);
+			if ((code == PCAPNG_OPT_END) || (opt + 4 + len > end))
+				break;
+
+			if ((code == PCAPNG_OPT_TSRESOL) && (len >= 1))
+			{
+				i.binary_resol = (data[opt + 4] & 0x80) != 0;
+				i.resol = data[opt + 4] & 0x7F;
+
+				if (i.resol > (i.binary_resol ? PCAPNG_MAX_TSRESOL_BINARY : PCAPNG_MAX_TSRESOL))
+					return false;
+			}
+
+			opt += 4 + ((len + 3) & ~static_cast<size_t>(3));
+		}
+	}
+
+	interfaces.push_back(i);
+	return true;
+}
+
+unsigned int pcap_file::get_flags(size_t options, size_t end) const
+{
+	for (size_t opt = options; opt + 4 <= end;)
+	{
+		unsigned int code = get16(opt);
+		size_t len = get16(opt + 2);
+		if ((code == PCAPNG_OPT_END) || (opt + 4 + len > end))
+			break;
+
+		if ((code == PCAPNG_OPT_FLAGS) && (len == 4))
+			return get32(opt + 4);
+
+		opt += 4 + ((len + 3) & ~static_cast<size_t>(3));
+	}
+
+	return 0;
+}
+
+uint64_t pcap_file::get_ng_time(unsigned int interface_id, uint64_t ts) const
+{
+	const ng_interface& i = interfaces[interface_id];
+
+	if (!i.binary_resol)
+	{
+		uint64_t scale = 1;
+		for (unsigned int n = (i.resol <= 9) ? i.resol : 9; n < ((i.resol <= 9) ? 9 : i.resol); n++)
+			scale *= 10;
+
+		return (i.resol <= 9) ? ts * scale : ts / scale;
+	}
+
+	uint64_t sec = ts >> i.resol;
+	uint64_t frac = ts - (sec << i.resol);
+	unsigned int shift = i.resol;
+
+	if (shift > 32)
+	{
+		frac >>= (shift - 32);
+		shift = 32;
+	}
+
+	return sec * 1000000000ULL + ((frac * 1000000000ULL) >> shift);
+}
+
+#ifdef UTM_DEBUG
+struct pcap_test_writer
+{
+	pcap_test_writer(bool _big_endian) : big_endian(_big_endian) { };
+
+	void put16(uint32_t v)
+	{
+		if (big_endian)
+		{
+			buf.push_back(static_cast<unsigned char>(v >> 8));
+			buf.push_back(static_cast<unsigned char>(v));
+		}
+		else
+		{
+			buf.push_back(static_cast<unsigned char>(v));
+			buf.push_back(static_cast<unsigned char>(v >> 8));
+		}
+	}
+
+	void put32(uint32_t v)
+	{
+		if (big_endian)
+		{
+			put16(v >> 16);
+			put16(v & 0xFFFF);
+		}
+		else
+		{
+			put16(v & 0xFFFF);
+			put16(v >> 16);
+		}
+	}
+
+	void put_frame(size_t len, unsigned char first)
+	{
+		for (size_t i = 0; i < len; i++)
+			buf.push_back(static_cast<unsigned char>(first + i));
+
+		while (buf.size() % 4 != 0)
+			buf.push_back(0);
+	}
+
+	void set32(size_t offset, uint32_t v)
+	{
+		pcap_test_writer w(big_endian);
+		w.put32(v);
+		memcpy(&buf[offset], &w.buf[0], 4);
+	}
+
+	bool big_endian;
+	std::vector<unsigned char> buf;
+};
+
+static void pcap_test_ng_block(pcap_test_writer& w, uint32_t type, const std::vector<unsigned char>& body)
+{
+	w.put32(type);
+	w.put32(static_cast<uint32_t>(body.size() + 12));
+	w.buf.insert(w.buf.end(), body.begin(), body.end());
+	w.put32(static_cast<uint32_t>(body.size() + 12));
+}
+
+void pcap_file::test_all()
+{
+	test_report tr(this_class_name);
+
+	pcap_frame frame;
+
+	test_case::classname.assign("pcap");
+	for (int kind = 0; kind < 4; kind++)
+	{
+		test_case::testcase_num = kind + 1;
+
+		// Both byte orders, micro and nanoseconds
+		bool be = (kind & 1) != 0;
+		bool ns = (kind & 2) != 0;
+
+		pcap_test_writer w(be);
+		w.put32(ns ? PCAP_MAGIC_NS : PCAP_MAGIC);
+		w.put16(2);
+		w.put16(4);
+		w.put32(0);
+		w.put32(0);
+		w.put32(65535);
+		w.put32(PCAP_LINKTYPE_ETHERNET);
+
+		for (unsigned int i = 0; i < 3; i++)
+		{
+			w.put32(1400000000 + i);
+			w.put32(ns ? 123456789 : 123456);
+			w.put32(60 + i);
+			w.put32(1514);
+			for (unsigned int n = 0; n < 60 + i; n++)
+				w.buf.push_back(static_cast<unsigned char>(i + n));
+		}
+
+		// A record cut by the end of the file
+		w.put32(1400000010);
+		w.put32(0);
+		w.put32(100);
+		w.put32(100);
+		w.buf.resize(w.buf.size() + 10, 0);
+
+		pcap_file f;
+		f.open_buffer(&w.buf[0], w.buf.size());
+		TEST_CASE_CHECK(false, f.is_pcapng());
+
+		size_t frames = 0;
+		bool right = true;
+		while (f.next(frame))
+		{
+			uint64_t ts = (1400000000ULL + frames) * 1000000000ULL + (ns ? 123456789 : 123456000);
+			if ((frame.ts != ts) || (frame.caplen != 60 + frames) || (frame.len != 1514) || (frame.data[5] != frames + 5) ||
+				(frame.linktype != PCAP_LINKTYPE_ETHERNET) || (frame.direction != PCAP_DIRECTION_UNKNOWN))
+				right = false;
+
+			frames++;
+		}
+
+		TEST_CASE_CHECK(size_t(3), frames);
+		TEST_CASE_CHECK(true, right);
+
+		f.rewind();
+		TEST_CASE_CHECK(true, f.next(frame));
+		TEST_CASE_CHECK(size_t(60), frame.caplen);
+	}
+
+	test_case::classname.assign("pcapng");
+	for (int kind = 0; kind < 2; kind++)
+	{
+		test_case::testcase_num = kind + 1;
+
+		pcap_test_writer w(kind != 0);
+		pcap_test_writer b(kind != 0);
+
+		// Section header
+		b.put32(PCAPNG_BYTE_ORDER);
+		b.put16(1);
+		b.put16(0);
+		b.put32(0xFFFFFFFF);
+		b.put32(0xFFFFFFFF);
+		pcap_test_ng_block(w, PCAPNG_SECTION, b.buf);
+
+		// Ethernet in microseconds, raw IP in nanoseconds
+		b.buf.clear();
+		b.put16(PCAP_LINKTYPE_ETHERNET);
+		b.put16(0);
+		b.put32(65535);
+		pcap_test_ng_block(w, PCAPNG_INTERFACE, b.buf);
+
+		b.buf.clear();
+		b.put16(PCAP_LINKTYPE_RAW);
+		b.put16(0);
+		b.put32(65535);
+		b.put16(PCAPNG_OPT_TSRESOL);
+		b.put16(1);
+		b.buf.push_back(9);
+		b.buf.resize(b.buf.size() + 3, 0);
+		b.put16(PCAPNG_OPT_END);
+		b.put16(0);
+		pcap_test_ng_block(w, PCAPNG_INTERFACE, b.buf);
+
+		// An unknown block is skipped
+		b.buf.assign(8, 0);
+		pcap_test_ng_block(w, 0x80000001, b.buf);
+
+		for (unsigned int i = 0; i < 2; i++)
+		{
+			uint64_t ts = (i == 0) ? 1400000000123456ULL : 1400000000123456789ULL;
+
+			b.buf.clear();
+			b.put32(i);
+			b.put32(static_cast<uint32_t>(ts >> 32));
+			b.put32(static_cast<uint32_t>(ts & 0xFFFFFFFF));
+			b.put32(41);
+			b.put32(41);
+			b.put_frame(41, static_cast<unsigned char>(i * 100));
+			b.put16(PCAPNG_OPT_FLAGS);
+			b.put16(4);
+			b.put32(i + 1);
+			b.put16(PCAPNG_OPT_END);
+			b.put16(0);
+			pcap_test_ng_block(w, PCAPNG_ENHANCED_PACKET, b.buf);
+		}
+
+		b.buf.clear();
+		b.put32(70);
+		b.put_frame(64, 7);
+		pcap_test_ng_block(w, PCAPNG_SIMPLE_PACKET, b.buf);
+
+		// The packet of a missing interface
+		b.buf.clear();
+		b.put32(5);
+		b.put32(0);
+		b.put32(0);
+		b.put32(4);
+		b.put32(4);
+		b.put32(0);
+		pcap_test_ng_block(w, PCAPNG_ENHANCED_PACKET, b.buf);
+
+		pcap_file f;
+		f.open_buffer(&w.buf[0], w.buf.size());
+		TEST_CASE_CHECK(true, f.is_pcapng());
+
+		TEST_CASE_CHECK(true, f.next(frame));
+		TEST_CASE_CHECK(uint64_t(1400000000123456000ULL), frame.ts);
+		TEST_CASE_CHECK((unsigned int)PCAP_LINKTYPE_ETHERNET, frame.linktype);
+		TEST_CASE_CHECK((unsigned int)PCAP_DIRECTION_INBOUND, frame.direction);
+		TEST_CASE_CHECK(size_t(41), frame.caplen);
+		TEST_CASE_CHECK((unsigned char)40, frame.data[40]);
+
+		TEST_CASE_CHECK(true, f.next(frame));
+		TEST_CASE_CHECK(uint64_t(1400000000123456789ULL), frame.ts);
+		TEST_CASE_CHECK((unsigned int)PCAP_LINKTYPE_RAW, frame.linktype);
+		TEST_CASE_CHECK((unsigned int)PCAP_DIRECTION_OUTBOUND, frame.direction);
+		TEST_CASE_CHECK((unsigned char)100, frame.data[0]);
+
+		TEST_CASE_CHECK(true, f.next(frame));
+		TEST_CASE_CHECK(uint64_t(1400000000123456789ULL), frame.ts);
+		TEST_CASE_CHECK(size_t(64), frame.caplen);
+		TEST_CASE_CHECK(size_t(70), frame.len);
+		TEST_CASE_CHECK((unsigned char)7, frame.data[0]);
+
+		TEST_CASE_CHECK(false, f.next(frame));
+	}
+
+	test_case::classname.assign("bad");
+	{
+		test_case::testcase_num = 1;
+		const unsigned char text[] = "GET / HTTP/1.1\r\nHost: example.com\r\n\r\n";
+		bool failed = false;
+
+		pcap_file f;
+		try
+		{
+			f.open_buffer(text, sizeof(text) - 1);
+		}
+		catch (const std::exception&)
+		{
+			failed = true;
+		}
+
+		TEST_CASE_CHECK(true, failed);
+		TEST_CASE_CHECK(false, f.is_open());
+		TEST_CASE_CHECK(false, f.next(frame));
+	}
+
+	{
+		// Time resolutions at the limits of 64 bits and over them
+		const unsigned char resols[] = { 19, 20, 0x80 | 63, 0x80 | 64 };
+		const uint64_t stamps[] = { 14000000001234567890ULL, 0, 0x8000000000000000ULL, 0 };
+		const uint64_t times[] = { 1400000000ULL, 0, 1000000000ULL, 0 };
+
+		for (int kind = 0; kind < 4; kind++)
+		{
+			test_case::testcase_num = kind + 2;
+
+			pcap_test_writer w(false);
+			pcap_test_writer b(false);
+
+			b.put32(PCAPNG_BYTE_ORDER);
+			b.put16(1);
+			b.put16(0);
+			b.put32(0xFFFFFFFF);
+			b.put32(0xFFFFFFFF);
+			pcap_test_ng_block(w, PCAPNG_SECTION, b.buf);
+
+			b.buf.clear();
+			b.put16(PCAP_LINKTYPE_RAW);
+			b.put16(0);
+			b.put32(65535);
+			b.put16(PCAPNG_OPT_TSRESOL);
+			b.put16(1);
+			b.buf.push_back(resols[kind]);
+			b.buf.resize(b.buf.size() + 3, 0);
+			b.put16(PCAPNG_OPT_END);
+			b.put16(0);
+			pcap_test_ng_block(w, PCAPNG_INTERFACE, b.buf);
+
+			b.buf.clear();
+			b.put32(0);
+			b.put32(static_cast<uint32_t>(stamps[kind] >> 32));
+			b.put32(static_cast<uint32_t>(stamps[kind] & 0xFFFFFFFF));
+			b.put32(20);
+			b.put32(20);
+			b.put_frame(20, 1);
+			pcap_test_ng_block(w, PCAPNG_ENHANCED_PACKET, b.buf);
+
+			pcap_file f;
+			f.open_buffer(&w.buf[0], w.buf.size());
+
+			bool is_valid = (kind % 2) == 0;
+			TEST_CASE_CHECK(is_valid, f.next(frame));
+			if (is_valid)
+				TEST_CASE_CHECK(times[kind], frame.ts);
+		}
+	}
+
+	return;
+}
+#endif
+
+}
@@ -0,0 +1,107 @@
+#ifndef _UTM_PCAP_FILE_H
+#define _UTM_PCAP_FILE_H
+
+#pragma once
+#include <utm.h>
+
+#include <string>
+#include <vector>
+
+#include <boost/iostreams/device/mapped_file.hpp>
+
+// Link types of the captured frames
+#define PCAP_LINKTYPE_NULL 0
+#define PCAP_LINKTYPE_ETHERNET 1
+#define PCAP_LINKTYPE_RAW_OPENBSD 12
+#define PCAP_LINKTYPE_RAW 101
+#define PCAP_LINKTYPE_LOOP 108
+#define PCAP_LINKTYPE_LINUX_SLL 113
+#define PCAP_LINKTYPE_IPV4 228
+
+// Direction of the frame if the capture has it
+#define PCAP_DIRECTION_UNKNOWN 0
+#define PCAP_DIRECTION_INBOUND 1
+#define PCAP_DIRECTION_OUTBOUND 2
+
+namespace utm {
+
+struct pcap_frame
+{
+	uint64_t ts;				// nanoseconds since the epoch
+	unsigned int linktype;
+	unsigned int direction;
+	const unsigned char* data;
+	size_t caplen;
+	size_t len;					// on the wire
+};
+
+//
+// Reader of the pcap and pcapng capture files. The file is mapped into memory and frames
+// point into the mapping, they are valid until the file is closed. Both byte orders, the
+// nanosecond pcap and pcapng sections with several interfaces are read. A record cut by the
+// end of the file or an interface with a time resolution out of 64 bits ends the capture.
+//
+class pcap_file
+{
+	struct ng_interface
+	{
+		unsigned int linktype;
+		bool binary_resol;
+		unsigned int resol;		// 10^-resol or 2^-resol of a second
+	};
+
+public:
+	static const char this_class_name[];
+
+	pcap_file();
+	~pcap_file();
+
+	void open(const std::string& filename);
+
+	// The data stays with the caller
+	void open_buffer(const unsigned char* data, size_t size);
+	void close();
+
+	bool is_open() const { return data != NULL; };
+	bool is_pcapng() const { return pcapng; };
+
+	// Returns false at the end of the capture
+	bool next(pcap_frame& frame);
+	void rewind();
+
+private:
+	pcap_file(const pcap_file&);
+	pcap_file& operator=(const pcap_file&);
+
+	void parse_header();
+	bool next_pcap(pcap_frame& frame);
+	bool next_pcapng(pcap_frame& frame);
+	bool parse_interface(size_t body, size_t end);
+	unsigned int get_flags(size_t options, size_t end) const;
+	uint64_t get_ng_time(unsigned int interface_id, uint64_t ts) const;
+
+	uint16_t get16(size_t offset) const;
+	uint32_t get32(size_t offset) const;
+
+	boost::iostreams::mapped_file_source file;
+	const unsigned char* data;
+	size_t size;
+	size_t pos;
+	size_t first_pos;
+
+	bool pcapng;
+	bool big_endian;
+	bool nanoseconds;
+	unsigned int linktype;
+	std::vector<ng_interface> interfaces;
+	uint64_t last_ts;
+
+#ifdef UTM_DEBUG
+public:
+	static void test_all();
+#endif
+};
+
+}
+
+#endif // _UTM_PCAP_FILE_H
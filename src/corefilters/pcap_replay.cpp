@@ -0,0 +1,461 @@
+#include "stdafx.h"
+#include "pcap_replay.h"
+
+#include <cstring>
+#include <thread>
+
+#include <utime.h>
+#include <ubase_test.h>
+
+#define ETHERTYPE_IPV4 0x0800
+#define ETHERTYPE_VLAN 0x8100
+#define ETHERTYPE_QINQ 0x88A8
+#define ETHERTYPE_QINQ_OLD 0x9100
+
+#define SLL_HEADER_SIZE 16
+#define SLL_HOST 0
+#define SLL_OUTGOING 4
+
+#define LOOP_AF_INET 2
+
+namespace utm {
+
+const char pcap_replay::this_class_name[] = "pcap_replay";
+
+static inline unsigned int get_be16(const unsigned char* p)
+{
+	return (p[0] << 8) | p[1];
+}
+
+pcap_replay::pcap_replay(filterset& _fs) : fs(_fs), history(NULL), delta(NULL), paced(false), speed(1.0), default_direction(PACKET_DIRECTION_PASSIVE),
+	lt_time(0), next_refresh(0)
+{
+	buf.resize(REPLAY_MAX_PACKET + REPLAY_PACKET_PAD, 0);
+	memset(&lt, 0, sizeof(lt));
+
+	input.ip = &ip;
+	input.mat = &fs.table_mat;
+	input.nModifyCounter = MODIFY_COUNTER_YES;
+	input.lt = &lt;
+	input.mbytes = fs.get_megabytes();
+}
+
+pcap_replay::~pcap_replay()
+{
+}
+
+void pcap_replay::set_paced(bool paced, double speed)
+{
+	this->paced = paced;
+	this->speed = (speed > 0) ? speed : 1.0;
+}
+
+bool pcap_replay::get_ip_packet(const pcap_frame& frame, size_t& offset, ip_header& ip, unsigned int& direction)
+{
+	const unsigned char* p = frame.data;
+	size_t caplen = frame.caplen;
+
+	memset(ip.src_mac, 0, sizeof(ip.src_mac));
+	memset(ip.dst_mac, 0, sizeof(ip.dst_mac));
+
+	if (frame.direction == PCAP_DIRECTION_INBOUND)
+		direction = PACKET_DIRECTION_INCOMING;
+	else if (frame.direction == PCAP_DIRECTION_OUTBOUND)
+		direction = PACKET_DIRECTION_OUTGOING;
+
+	switch (frame.linktype)
+	{
+	case PCAP_LINKTYPE_ETHERNET:
+		{
+			if (caplen < 14)
+				return false;
+
+			memcpy(ip.dst_mac, p, 6);
+			memcpy(ip.src_mac, p + 6, 6);
+
+			offset = 12;
+			unsigned int ethertype = get_be16(p + offset);
+
+			// VLAN tags, stacked too
+			while (((ethertype == ETHERTYPE_VLAN) || (ethertype == ETHERTYPE_QINQ) || (ethertype == ETHERTYPE_QINQ_OLD)) && (offset + 6 <= caplen))
+			{
+				offset += 4;
+				ethertype = get_be16(p + offset);
+			}
+
+			if (ethertype != ETHERTYPE_IPV4)
+				return false;
+
+			offset += 2;
+			break;
+		}
+
+	case PCAP_LINKTYPE_NULL:
+	case PCAP_LINKTYPE_LOOP:
+		{
+			// The family is in the byte order of the host which wrote the capture
+			if (caplen < 4)
+				return false;
+
+			uint32_t family = (static_cast<uint32_t>(get_be16(p)) << 16) | get_be16(p + 2);
+			if ((family != LOOP_AF_INET) && (family != (static_cast<uint32_t>(LOOP_AF_INET) << 24)))
+				return false;
+
+			offset = 4;
+			break;
+		}
+
+	case PCAP_LINKTYPE_LINUX_SLL:
+		{
+			if ((caplen < SLL_HEADER_SIZE) || (get_be16(p + 14) != ETHERTYPE_IPV4))
+				return false;
+
+			if (get_be16(p + 4) == 6)
+				memcpy(ip.src_mac, p + 6, 6);
+
+			if (frame.direction == PCAP_DIRECTION_UNKNOWN)
+			{
+				if (get_be16(p) == SLL_HOST)
+					direction = PACKET_DIRECTION_INCOMING;
+				else if (get_be16(p) == SLL_OUTGOING)
+					direction = PACKET_DIRECTION_OUTGOING;
+			}
+
+			offset = SLL_HEADER_SIZE;
+			break;
+		}
+
+	case PCAP_LINKTYPE_RAW:
+	case PCAP_LINKTYPE_RAW_OPENBSD:
+	case PCAP_LINKTYPE_IPV4:
+		offset = 0;
+		break;
+
+	default:
+		return false;
+	}
+
+	// IPv4 header, the version is checked by parse_raw_buffer()
+	if ((caplen < offset + 20) || (caplen < offset + (p[offset] & 0x0F) * 4))
+		return false;
+
+	return true;
+}
+
+bool pcap_replay::process_frame(const pcap_frame& frame)
+{
+	if (stat.frames++ == 0)
+	{
+		stat.first_ts = frame.ts;
+		start = std::chrono::steady_clock::now();
+	}
+
+	stat.last_ts = frame.ts;
+
+	size_t offset = 0;
+	unsigned int direction = default_direction;
+
+	if (!get_ip_packet(frame, offset, ip, direction))
+	{
+		stat.skipped++;
+		return false;
+	}
+
+	// The copy is padded with zeros, parse_raw_buffer() reads past a short snapshot
+	size_t len = frame.caplen - offset;
+	if (len > REPLAY_MAX_PACKET)
+		len = REPLAY_MAX_PACKET;
+
+	memcpy(&buf[0], frame.data + offset, len);
+	memset(&buf[len], 0, REPLAY_PACKET_PAD);
+
+	if (!ip.parse_raw_buffer(&buf[0], fs.get_header_usage()))
+	{
+		stat.skipped++;
+		return false;
+	}
+
+	if (paced)
+		wait(frame.ts);
+
+	unsigned int now = static_cast<unsigned int>(frame.ts / 1000000000ULL);
+
+	if (next_refresh == 0)
+	{
+		next_refresh = now + REFRESH_INTERVAL;
+	}
+	else if (now >= next_refresh)
+	{
+		refresh(now);
+		next_refresh = now + REFRESH_INTERVAL;
+	}
+
+	if (now != lt_time)
+	{
+		utime t;
+		t.from_time_t(now);
+		lt = t.to_tm();
+		lt_time = now;
+	}
+
+	input.nPacketDirection = direction;
+	fs.match_filters(input, matches);
+
+	stat.packets++;
+	stat.bytes += ip.length;
+
+	if (matches.size() != 0)
+	{
+		stat.matched++;
+		fs.collect_packet(ip, matches, now);
+	}
+
+	return true;
+}
+
+void pcap_replay::wait(uint64_t ts)
+{
+	double offset_ns = static_cast<double>(ts - stat.first_ts) / speed;
+	std::chrono::steady_clock::time_point due = start + std::chrono::duration_cast<std::chrono::steady_clock::duration>(std::chrono::duration<double, std::nano>(offset_ns));
+
+	if (due > std::chrono::steady_clock::now())
+		std::this_thread::sleep_until(due);
+}
+
+void pcap_replay::refresh(unsigned int now)
+{
+	std::list<counterdata> cdatas;
+
+	for (auto iter = fs.filters.items.begin(); iter != fs.filters.items.end(); ++iter)
+	{
+		__int64 sent = iter->cnt_sent.get_cnt();
+		__int64 recv = iter->cnt_recv.get_cnt();
+
+		std::pair<__int64, __int64>& last = reported[iter->get_id()];
+		if ((sent == last.first) && (recv == last.second))
+			continue;
+
+		cdatas.push_back(counterdata(iter->get_id(), sent - last.first, recv - last.second, iter->get_name()));
+		last = std::make_pair(sent, recv);
+	}
+
+	if (!cdatas.empty())
+	{
+		utime t;
+		t.from_time_t(now);
+		report.update_mass_counters(t, cdatas);
+	}
+
+	fs.refresh_points(now, delta);
+
+	if (history != NULL)
+		history->put_counters(fs, now);
+
+	flush_container_shared fc;
+	fs.pcollector.flush(fc, now);
+	flows.splice(flows.end(), fc);
+}
+
+void pcap_replay::finish()
+{
+	if (stat.packets != 0)
+		refresh(static_cast<unsigned int>(stat.last_ts / 1000000000ULL));
+}
+
+void pcap_replay::run(pcap_file& file)
+{
+	pcap_frame frame;
+
+	while (file.next(frame))
+		process_frame(frame);
+
+	finish();
+}
+
+#ifdef UTM_DEBUG
+static void replay_test_put32(std::vector<unsigned char>& cap, uint32_t v)
+{
+	for (int i = 0; i < 4; i++)
+		cap.push_back(static_cast<unsigned char>(v >> (i * 8)));
+}
+
+static void replay_test_frame(std::vector<unsigned char>& cap, uint32_t sec, const char* src, const char* dst, unsigned int length, bool vlan)
+{
+	std::vector<unsigned char> frame(12, 0x11);
+
+	if (vlan)
+	{
+		frame.push_back(0x81);
+		frame.push_back(0x00);
+		frame.push_back(0x00);
+		frame.push_back(0x05);
+	}
+
+	frame.push_back(0x08);
+	frame.push_back(0x00);
+
+	addrip_v4 s(src), d(dst);
+	unsigned char iphdr[20] = { 0x45, 0, static_cast<unsigned char>(length >> 8), static_cast<unsigned char>(length), 0, 1, 0, 0, 64, 6, 0, 0 };
+	for (int i = 0; i < 4; i++)
+	{
+		iphdr[12 + i] = static_cast<unsigned char>(s.m_addr >> (24 - i * 8));
+		iphdr[16 + i] = static_cast<unsigned char>(d.m_addr >> (24 - i * 8));
+	}
+
+	frame.insert(frame.end(), iphdr, iphdr + 20);
+
+	// TCP ports 40000 -> 80, the snapshot ends in the TCP header
+	unsigned char tcphdr[8] = { 0x9C, 0x40, 0, 80, 0, 0, 0, 1 };
+	frame.insert(frame.end(), tcphdr, tcphdr + 8);
+
+	replay_test_put32(cap, sec);
+	replay_test_put32(cap, 0);
+	replay_test_put32(cap, static_cast<uint32_t>(frame.size()));
+	replay_test_put32(cap, static_cast<uint32_t>(length + 14));
+	cap.insert(cap.end(), frame.begin(), frame.end());
+}
+
+void pcap_replay::test_all()
+{
+	test_report tr(this_class_name);
+	test_case::classname.assign(this_class_name);
+
+	std::vector<unsigned char> cap;
+	replay_test_put32(cap, 0xA1B2C3D4);
+	replay_test_put32(cap, 0x00040002);
+	replay_test_put32(cap, 0);
+	replay_test_put32(cap, 0);
+	replay_test_put32(cap, 96);
+	replay_test_put32(cap, PCAP_LINKTYPE_ETHERNET);
+
+	uint32_t t0 = 1400000000;
+	replay_test_frame(cap, t0, "10.0.0.1", "10.0.0.2", 100, true);
+	replay_test_frame(cap, t0 + 1, "10.0.0.2", "10.0.0.1", 300, false);
+	replay_test_frame(cap, t0 + 3, "10.0.0.1", "10.0.0.2", 500, false);
+	replay_test_frame(cap, t0 + 4, "10.0.0.5", "10.0.0.6", 1000, false);
+
+	// ARP
+	replay_test_put32(cap, t0 + 5);
+	replay_test_put32(cap, 0);
+	replay_test_put32(cap, 42);
+	replay_test_put32(cap, 42);
+	std::vector<unsigned char> arp(42, 0);
+	arp[12] = 0x08;
+	arp[13] = 0x06;
+	cap.insert(cap.end(), arp.begin(), arp.end());
+
+	replay_test_frame(cap, t0 + 6, "10.0.0.1", "10.0.0.2", 40, true);
+
+	{
+		test_case::testcase_num = 1;
+
+		filterset fs;
+
+		filter2 f;
+		f.set_id(1);
+		f.m_nPktLogDest = LOGPKT_INTOFILE;
+		f.rule_add(rule(RULE_IP, "10.0.0.1", "255.255.255.255", RULE_IP, "10.0.0.2", "255.255.255.255"));
+		fs.filters.add_element(f);
+
+		filter2 f2;
+		f2.set_id(2);
+		f2.rule_add(rule(RULE_IP, "10.0.0.3", "255.255.255.255", RULE_IP, "10.0.0.4", "255.255.255.255"));
+		fs.filters.add_element(f2);
+
+		pcap_file file;
+		file.open_buffer(&cap[0], cap.size());
+
+		filterset_delta server;
+		pcap_replay replay(fs);
+		replay.set_delta(&server);
+		replay.run(file);
+
+		const pcap_replay_stat& st = replay.get_stat();
+		TEST_CASE_CHECK(uint64_t(6), st.frames);
+		TEST_CASE_CHECK(uint64_t(5), st.packets);
+		TEST_CASE_CHECK(uint64_t(1), st.skipped);
+		TEST_CASE_CHECK(uint64_t(4), st.matched);
+		TEST_CASE_CHECK(uint64_t(1940), st.bytes);
+		TEST_CASE_CHECK(uint64_t(t0 + 6) * 1000000000, st.last_ts);
+
+		const filter2& f1 = fs.filters.items.front();
+		TEST_CASE_CHECK(__int64(640), f1.cnt_sent.get_cnt());
+		TEST_CASE_CHECK(__int64(300), f1.cnt_recv.get_cnt());
+		TEST_CASE_CHECK(__int64(0), fs.filters.items.back().cnt_sent.get_cnt());
+
+		// The report has all counted bytes of the filter, it is not updated for the other one
+		TEST_CASE_CHECK(size_t(1), replay.report.filters.items.size());
+		TEST_CASE_CHECK(__int64(640), replay.report.filters.items.front().sent);
+		TEST_CASE_CHECK(__int64(300), replay.report.filters.items.front().recv);
+
+		std::uint64_t flow_bytes = 0;
+		for (auto iter = replay.flows.begin(); iter != replay.flows.end(); ++iter)
+		{
+			TEST_CASE_CHECK(1u, iter->filter_id);
+			flow_bytes += iter->value.sent_flush + iter->value.recv_flush;
+		}
+
+		TEST_CASE_CHECK(std::uint64_t(940), flow_bytes);
+
+		// Two refreshes by the capture time and the last one, the console gets the counters
+		TEST_CASE_CHECK(3u, fs.fdata.get_total_points());
+
+		filterset client_fs;
+		client_fs.filters.add_element(f);
+		client_fs.filters.add_element(f2);
+
+		filterset_delta client;
+		std::string data;
+		server.build(fs, client.get_layout_id(), client.get_seqnum(), data);
+		client.apply(data, client_fs);
+
+		TEST_CASE_CHECK(fs.fdata.get_current_seqnum(), client.get_seqnum());
+		TEST_CASE_CHECK(__int64(640), client_fs.filters.items.front().cnt_sent.get_cnt());
+	}
+
+	{
+		test_case::testcase_num = 2;
+
+		// Link types and directions
+		pcap_frame frame;
+		ip_header ih;
+		size_t offset = 0;
+		unsigned int direction = PACKET_DIRECTION_PASSIVE;
+
+		unsigned char sll[36] = { 0, 4, 0, 1, 0, 6, 1, 2, 3, 4, 5, 6, 0, 0, 0x08, 0x00, 0x45 };
+		frame.ts = 0;
+		frame.linktype = PCAP_LINKTYPE_LINUX_SLL;
+		frame.direction = PCAP_DIRECTION_UNKNOWN;
+		frame.data = sll;
+		frame.caplen = sizeof(sll);
+		frame.len = sizeof(sll);
+
+		TEST_CASE_CHECK(true, get_ip_packet(frame, offset, ih, direction));
+		TEST_CASE_CHECK(size_t(SLL_HEADER_SIZE), offset);
+		TEST_CASE_CHECK((unsigned int)PACKET_DIRECTION_OUTGOING, direction);
+		TEST_CASE_CHECK((unsigned char)6, ih.src_mac[5]);
+
+		unsigned char loop[24] = { 2, 0, 0, 0, 0x45 };
+		frame.linktype = PCAP_LINKTYPE_NULL;
+		frame.direction = PCAP_DIRECTION_INBOUND;
+		frame.data = loop;
+		frame.caplen = sizeof(loop);
+
+		TEST_CASE_CHECK(true, get_ip_packet(frame, offset, ih, direction));
+		TEST_CASE_CHECK(size_t(4), offset);
+		TEST_CASE_CHECK((unsigned int)PACKET_DIRECTION_INCOMING, direction);
+
+		// AF_INET6 and a header longer than the snapshot
+		loop[0] = 24;
+		TEST_CASE_CHECK(false, get_ip_packet(frame, offset, ih, direction));
+
+		loop[0] = 2;
+		loop[4] = 0x4F;
+		TEST_CASE_CHECK(false, get_ip_packet(frame, offset, ih, direction));
+	}
+
+	return;
+}
+#endif
+
+}
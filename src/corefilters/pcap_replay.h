@@ -0,0 +1,116 @@
+#ifndef _UTM_PCAP_REPLAY_H
+#define _UTM_PCAP_REPLAY_H
+
+#pragma once
+#include <utm.h>
+
+#include <pcap_file.h>
+#include <filterset.h>
+#include <trafficreport.h>
+#include <speed_history.h>
+#include <filterset_delta.h>
+
+#include <chrono>
+#include <map>
+#include <vector>
+
+#define REPLAY_MAX_PACKET 65535
+#define REPLAY_PACKET_PAD 256		// parse_raw_buffer() reads FTP commands past the headers
+
+namespace utm {
+
+struct pcap_replay_stat
+{
+	pcap_replay_stat() : frames(0), packets(0), bytes(0), skipped(0), matched(0), first_ts(0), last_ts(0) { };
+
+	uint64_t frames;
+	uint64_t packets;			// IPv4 packets given to the filters
+	uint64_t bytes;				// by the IP header
+	uint64_t skipped;			// frames without an IPv4 packet
+	uint64_t matched;			// packets matched by a filter
+	uint64_t first_ts;
+	uint64_t last_ts;
+};
+
+//
+// Replays a capture through the accounting of the filterset: frames are parsed into
+// ip_header, matched by the filters which count them, and the packets of the logging filters
+// go to the shared collector. Every REFRESH_INTERVAL seconds of the capture time the counter
+// deltas are put into the traffic report, the speed points are refreshed and the collector
+// flows are flushed, as the service does on its timer. Frames are taken as fast as possible or paced to their timestamps.
+//
+class pcap_replay
+{
+public:
+	static const char this_class_name[];
+
+	pcap_replay(filterset& fs);
+	~pcap_replay();
+
+	// Speed 2.0 replays twice as fast as captured
+	void set_paced(bool paced, double speed = 1.0);
+
+	// Direction of the packets if the capture has none, PACKET_DIRECTION_PASSIVE by default
+	void set_direction(unsigned int direction) { default_direction = direction; };
+	void set_nic_alias(unsigned int nic_alias) { input.nNicAlias = nic_alias; };
+
+	// The counters go to the speed history on every refresh
+	void set_history(speed_history* sh) { history = sh; };
+
+	// The refreshed points are encoded for the console clients
+	void set_delta(filterset_delta* d) { delta = d; };
+
+	// Replays the whole capture and makes the last refresh
+	void run(pcap_file& file);
+
+	// Returns false if the frame has no IPv4 packet
+	bool process_frame(const pcap_frame& frame);
+	void finish();
+
+	const pcap_replay_stat& get_stat() const { return stat; };
+
+	trafficreport report;
+	flush_container_shared flows;
+
+	// Finds the IPv4 packet in the frame, sets the MAC addresses and the direction if the link has them
+	static bool get_ip_packet(const pcap_frame& frame, size_t& offset, ip_header& ip, unsigned int& direction);
+
+private:
+	pcap_replay(const pcap_replay&);
+	pcap_replay& operator=(const pcap_replay&);
+
+	void wait(uint64_t ts);
+	void refresh(unsigned int now);
+
+	filterset& fs;
+	speed_history* history;
+	filterset_delta* delta;
+
+	bool paced;
+	double speed;
+	unsigned int default_direction;
+
+	std::vector<unsigned char> buf;
+	ip_header ip;
+	match_filter_input input;
+	filterset_match_list matches;
+
+	struct tm lt;
+	unsigned int lt_time;
+	unsigned int next_refresh;
+
+	// Counters of the filters put into the report
+	std::map<unsigned int, std::pair<__int64, __int64> > reported;
+
+	std::chrono::steady_clock::time_point start;
+	pcap_replay_stat stat;
+
+#ifdef UTM_DEBUG
+public:
+	static void test_all();
+#endif
+};
+
+}
+
+#endif // _UTM_PCAP_REPLAY_H
@@ -7,78 +7,69 @@ namespace utm {
 
 const char pkt_queue::this_class_name[] = "pkt_queue";
 
-pkt_queue::pkt_queue() : pktput_counter(0), pktget_counter(0), current_freeslot(0), 
-	ticks_left(0), adjust_speed_value(0), adjust_speed_seqnum(0),
-	maxpackets(0), packetbuf_size(0), data(NULL)
+pkt_queue::pkt_queue() : ticks_left(0), adjust_speed_value(0), adjust_speed_seqnum(0), packetbuf_size(0)
 {
 }
 
-pkt_queue::pkt_queue(const pkt_queue& rhs)
+pkt_queue::pkt_queue(const pkt_queue& rhs) : ticks_left(0), adjust_speed_value(0), adjust_speed_seqnum(0), packetbuf_size(0)
 {
 	operator=(rhs);
 }
 
 pkt_queue::~pkt_queue()
 {
-	if (data != NULL)
-		delete[] data;
 }
 
 pkt_queue& pkt_queue::operator=(const pkt_queue& rhs)
 {
-	pktput_counter = rhs.pktput_counter;
-	pktget_counter = rhs.pktget_counter;
-	current_freeslot = rhs.current_freeslot;
 	ticks_left = rhs.ticks_left;
 	adjust_speed_value = rhs.adjust_speed_value;
 	adjust_speed_seqnum = rhs.adjust_speed_seqnum;
-	maxpackets = rhs.maxpackets;
 	packetbuf_size = rhs.packetbuf_size;
-	data = new unsigned char[get_datasize()];
-	memcpy(data, rhs.data, get_datasize());
+	ring = rhs.ring;
 
 	return *this;
 }
 
-void pkt_queue::init(size_t maxpackets, size_t packetbuf_size)
+void pkt_queue::init(uint32_t maxpackets, size_t packetbuf_size)
 {
-	this->maxpackets = maxpackets;
 	this->packetbuf_size = packetbuf_size;
 
-	data = new unsigned char[get_datasize()];
+	// Room for maxpackets of the full size and the tail skipped at the end of the ring
+	size_t slot_size = (packetbuf_size + PKTRING_ALIGN - 1) & ~static_cast<size_t>(PKTRING_ALIGN - 1);
+	ring.init(maxpackets, (maxpackets + 1) * slot_size);
 }
 
-int pkt_queue::put_packet(const unsigned char* pkt, size_t packetbuf_size, const pkt_additional_data* ppkt_data)
+int pkt_queue::put_packet(const unsigned char* pkt, size_t pkt_len, const pkt_additional_data* ppkt_data)
 {
-	boost::mutex::scoped_lock lock(guard);
+	if (pkt_len > packetbuf_size)
+		return PKTQUEUE_TOOLONG;
 
-	uint32_t qsize = static_cast<uint32_t>(pktput_counter - pktget_counter);
-	if (qsize >= maxpackets)
+	if (!ring.put(pkt, pkt_len, ppkt_data))
 		return PKTQUEUE_NOSPACE;
 
-	unsigned char* ptr = get_pktposptr(current_freeslot);
-	if (ptr == NULL)
-		return PKTQUEUE_NOSPACE;
-
-	memcpy(ptr, pkt, packetbuf_size);
-
-	if (ppkt_data != NULL)
-		memcpy(ptr + packetbuf_size, ppkt_data, sizeof(pkt_additional_data));
+	return PKTQUEUE_STORED;
+}
 
-	pktput_counter++;
-	current_freeslot++;
-	if (current_freeslot >= maxpackets)
-		current_freeslot = 0;
+unsigned char* pkt_queue::reserve_packet(size_t pkt_len, pkt_ring_slot& slot)
+{
+	if (pkt_len > packetbuf_size)
+		return NULL;
 
-	return PKTQUEUE_STORED;
+	return ring.reserve(pkt_len, slot);
 }
 
 bool pkt_queue::get_packet(unsigned char* pkt, size_t packetbuf_size, pkt_additional_data* ppkt_data)
 {
-	boost::mutex::scoped_lock lock(guard);
+	size_t pkt_len = 0;
+	return get_packet(pkt, packetbuf_size, ppkt_data, pkt_len);
+}
 
-	uint32_t qsize = static_cast<uint32_t>(pktput_counter - pktget_counter);
-	if (qsize == 0)
+bool pkt_queue::get_packet(unsigned char* pkt, size_t packetbuf_size, pkt_additional_data* ppkt_data, size_t& pkt_len)
+{
+	const pkt_additional_data* pdata = NULL;
+	const unsigned char* ptr = ring.peek(pkt_len, pdata);
+	if (ptr == NULL)
 		return false;
 
 	if (ticks_left > 0)
@@ -87,34 +78,25 @@ bool pkt_queue::get_packet(unsigned char* pkt, size_t packetbuf_size, pkt_additi
 		return false;
 	};
 
-	uint32_t lastpos = ((maxpackets + current_freeslot - qsize) % maxpackets);
-	unsigned char* ptr = get_pktposptr(lastpos);
-	if (ptr == NULL)
-		return false;
+	memcpy(pkt, ptr, (pkt_len < packetbuf_size) ? pkt_len : packetbuf_size);
 
-	memcpy(pkt, ptr, packetbuf_size);
-	memcpy(ppkt_data, ptr + packetbuf_size, sizeof(pkt_additional_data));
+	if (ppkt_data != NULL)
+		*ppkt_data = *pdata;
 
-	pktget_counter++;
+	ring.release();
 	return true;
 }
 
-unsigned char* pkt_queue::get_pktposptr(uint32_t pktpos) const
+void pkt_queue::get_stat(uint64_t& pktput_counter, uint64_t& pktget_counter, uint32_t& current_freeslot) const
 {
-	if (pktpos >= maxpackets)
-		return NULL;
-
-	if (data == NULL)
-		return NULL;
+	pkt_ring_stat st;
+	ring.get_stat(st);
 
-	return (data + (pktpos * (packetbuf_size + sizeof(pkt_additional_data))));
-}
+	pktput_counter = st.put_counter;
+	pktget_counter = st.get_counter;
 
-void pkt_queue::get_stat(uint64_t& pktput_counter, uint64_t& pktget_counter, uint32_t& current_freeslot) const
-{
-	pktput_counter = this->pktput_counter;
-	pktget_counter = this->pktget_counter;
-	current_freeslot = this->current_freeslot;
+	uint32_t maxpackets = ring.get_maxpackets();
+	current_freeslot = (maxpackets > 0) ? static_cast<uint32_t>(st.put_counter % maxpackets) : 0;
 }
 
 #ifdef UTM_DEBUG
@@ -182,6 +164,51 @@ void pkt_queue::test_all()
 		TEST_CASE_CHECK(pktget_counter, uint64_t(MAXPKT));
 		TEST_CASE_CHECK(current_freeslot, uint32_t(0));
 	}
+
+	// Small packets take their own length only
+	pkt_queue pq2;
+	pq2.init(MAXPKT * 4, PKTBUFSIZE);
+
+	memset(&pktbuf[0], 0xAA, PKTBUFSIZE);
+	TEST_CASE_CHECK(pq2.put_packet(&pktbuf[0], PKTBUFSIZE + 1, &data), int(PKTQUEUE_TOOLONG));
+
+	for (size_t i = 0; i < (MAXPKT * 4); i++)
+	{
+		pktbuf[0] = static_cast<unsigned char>(i);
+		TEST_CASE_CHECK(pq2.put_packet(&pktbuf[0], 60, &data), int(PKTQUEUE_STORED));
+	}
+
+	{
+		pkt_ring_stat st;
+		pq2.get_stat(st);
+		TEST_CASE_CHECK(st.bytes, uint32_t(MAXPKT * 4 * 64));
+	}
+
+	size_t pkt_len = 0;
+	memset(&pktbuf[0], 0, PKTBUFSIZE);
+	res = pq2.get_packet(&pktbuf[0], PKTBUFSIZE, &data, pkt_len);
+	TEST_CASE_CHECK(res, true);
+	TEST_CASE_CHECK(pkt_len, size_t(60));
+	TEST_CASE_CHECK(pktbuf[59], static_cast<unsigned char>(0xAA));
+	TEST_CASE_CHECK(pktbuf[60], static_cast<unsigned char>(0));
+
+	// The shaper delay holds the batch too
+	pq2.ticks_left = 1;
+	size_t batch = 0;
+	auto f = [&](const unsigned char* p, size_t len, const pkt_additional_data& d) { if ((len == 60) && (p[0] == batch + 1)) batch++; };
+	TEST_CASE_CHECK(pq2.get_batch(8, f), size_t(0));
+	TEST_CASE_CHECK(pq2.get_batch(8, f), size_t(8));
+	TEST_CASE_CHECK(batch, size_t(8));
+
+	{
+		uint64_t pktput_counter = 0;
+		uint64_t pktget_counter = 0;
+		uint32_t current_freeslot = 0;
+		pq2.get_stat(pktput_counter, pktget_counter, current_freeslot);
+
+		TEST_CASE_CHECK(pktput_counter, uint64_t(MAXPKT * 4));
+		TEST_CASE_CHECK(pktget_counter, uint64_t(9));
+	}
 }
 #endif
 
@@ -5,20 +5,19 @@
 #include <utm.h>
 
 #include <filter_extra.h>
+#include <pkt_ring.h>
 
 #define PKTQUEUE_STORED 0
 #define PKTQUEUE_NOSPACE 1
-
-#include <boost/thread/mutex.hpp>
+#define PKTQUEUE_TOOLONG 2
+#define PKTQUEUE_NOTSHAPED 3		// the filter is not limited, the packet goes on at once
 
 namespace utm {
 
-struct pkt_additional_data
-{
-	HANDLE hAdapterHandle;
-	unsigned int nic_alias;
-};
-
+//
+// Packets of a shaper queue. Packets are put from any thread, only one thread gets them.
+// A packet takes its own length in the ring, not the packet buffer size.
+//
 class pkt_queue
 {
 public:
@@ -31,11 +30,38 @@ public:
 	pkt_queue& operator=(const pkt_queue& rhs);
 
 	void init(uint32_t maxpackets, size_t packetbuf_size);
-	int put_packet(const unsigned char* pkt, size_t packetbuf_size, const pkt_additional_data* ppkt_data);
+
+	// Copies pkt_len bytes of the packet
+	int put_packet(const unsigned char* pkt, size_t pkt_len, const pkt_additional_data* ppkt_data);
+
+	// Copies the packet into the buffer, a longer packet is truncated
 	bool get_packet(unsigned char* pkt, size_t packetbuf_size, pkt_additional_data* ppkt_data);
+	bool get_packet(unsigned char* pkt, size_t packetbuf_size, pkt_additional_data* ppkt_data, size_t& pkt_len);
+
+	// The packet is written in place, then committed or canceled
+	unsigned char* reserve_packet(size_t pkt_len, pkt_ring_slot& slot);
+	void commit_packet(const pkt_ring_slot& slot, size_t pkt_len, const pkt_additional_data* ppkt_data) { ring.commit(slot, pkt_len, ppkt_data); };
+	void cancel_packet(const pkt_ring_slot& slot) { ring.cancel(slot); };
+
+	// Calls f(pkt, pkt_len, pkt_data) for up to maxcount packets read in place
+	template<class F>
+	size_t get_batch(size_t maxcount, F f)
+	{
+		if (ring.empty())
+			return 0;
+
+		if (ticks_left > 0)
+		{
+			ticks_left--;
+			return 0;
+		}
+
+		return ring.get_batch(maxcount, f);
+	}
 
 	size_t get_packetbuf_size() const { return packetbuf_size; };
 	void get_stat(uint64_t& pktput_counter, uint64_t& pktget_counter, uint32_t& current_freeslot) const;
+	void get_stat(pkt_ring_stat& st) const { ring.get_stat(st); };
 
 public:
 	// variables required for traffic shaper algorithm
@@ -44,18 +70,8 @@ public:
 	uint32_t adjust_speed_seqnum;
 
 private:
-	unsigned char* get_pktposptr(uint32_t pktpos) const;
-	size_t get_datasize() const { return (maxpackets * (packetbuf_size + sizeof(pkt_additional_data))); };
-
-	uint64_t pktput_counter;
-	uint64_t pktget_counter;
-	uint32_t current_freeslot;
-
-	uint32_t maxpackets;
 	size_t packetbuf_size;
-	unsigned char* data;
-	
-	boost::mutex guard;
+	pkt_ring ring;
 
 public:
 #ifdef UTM_DEBUG
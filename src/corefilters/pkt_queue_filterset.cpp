@@ -1,6 +1,8 @@
 #include "stdafx.h"
 #include "pkt_queue_filterset.h"
 
+#include <iterator>
+
 namespace utm {
 
 const char pkt_queue_filterset::this_class_name[] = "pkt_queue_filterset";
@@ -77,21 +79,145 @@ void pkt_queue_filterset::init(const filterset& fs, size_t packetbuf_size)
 
 	filterids = ids;
 	pq.reset(ppq);
+
+	init_shaper(fs, packetbuf_size);
+}
+
+void pkt_queue_filterset::init_shaper(const filterset& fs, size_t packetbuf_size)
+{
+	std::shared_ptr<pkt_queue_shaper> ps(new pkt_queue_shaper());
+	ps->packetbuf_size = packetbuf_size;
+
+	size_t count = fs.filters.items.size() * MAX_FILTERQUEUES;
+	ps->filter_classes.assign(count, SHAPER_NO_CLASS);
+	ps->is_limited.reset(new std::atomic<bool>[count]);
+
+	// Every filter gets its classes, so a new limit is set by update_speed() in place
+	for (unsigned int q = 0; q < MAX_FILTERQUEUES; q++)
+	{
+		uint32_t root = ps->shaper.add_class(SHAPER_NO_CLASS, q, 0, 0);
+
+		unsigned int filter_seq_id = 0;
+		for (auto iter = fs.filters.items.begin(); iter != fs.filters.items.end(); ++iter, filter_seq_id++)
+		{
+			unsigned int tag = filter_seq_id * MAX_FILTERQUEUES + q;
+			uint64_t rate = get_filter_rate(*iter);
+
+			uint32_t filter_class = ps->shaper.add_class(root, tag, rate, get_filter_burst(rate, packetbuf_size));
+			for (unsigned int u = 0; u < MAX_SHAPER_USER_CLASSES; u++)
+				ps->shaper.add_class(filter_class, tag, 0, 0, MAX_SHAPER_USER_PACKETS, packetbuf_size);
+
+			ps->filter_classes[tag] = filter_class;
+			ps->is_limited[tag].store(rate > 0);
+		}
+	}
+
+	ps->shaper.prepare();
+
+	// Packets still in the old classes are dropped, this is a new filterset
+	std::atomic_store(&shaper, ps);
+}
+
+uint64_t pkt_queue_filterset::get_filter_rate(const filter2& f)
+{
+	int speed = f.get_actual_speed();
+	return (speed > 0) ? static_cast<uint64_t>(speed) * 1024 : 0;
+}
+
+size_t pkt_queue_filterset::get_filter_burst(uint64_t rate, size_t packetbuf_size)
+{
+	size_t burst = static_cast<size_t>(rate / SHAPER_BURST_DIVIDER);
+	return (burst > packetbuf_size * 2) ? burst : packetbuf_size * 2;
+}
+
+void pkt_queue_filterset::update_speed(const filterset& fs)
+{
+	std::shared_ptr<pkt_queue_shaper> ps = std::atomic_load(&shaper);
+	if (!ps)
+		return;
+
+	unsigned int filter_seq_id = 0;
+	for (auto iter = fs.filters.items.begin(); iter != fs.filters.items.end(); ++iter, filter_seq_id++)
+	{
+		uint64_t rate = get_filter_rate(*iter);
+		size_t burst = get_filter_burst(rate, ps->packetbuf_size);
+
+		for (unsigned int q = 0; q < MAX_FILTERQUEUES; q++)
+		{
+			unsigned int tag = filter_seq_id * MAX_FILTERQUEUES + q;
+			if (tag >= ps->filter_classes.size())
+				break;
+
+			// Without the rate the queued packets go by the class timer and the new ones are not shaped
+			ps->shaper.set_rate(ps->filter_classes[tag], rate, burst);
+			ps->is_limited[tag].store(rate > 0);
+		}
+	}
+}
+
+int pkt_queue_filterset::shape_packet(unsigned int filter_seq_id, unsigned int qnumber, unsigned int user_hash, const unsigned char* pkt, size_t pkt_len, const pkt_additional_data* ppkt_data)
+{
+	if (qnumber >= MAX_FILTERQUEUES)
+		throw std::exception("Invalid queue number");
+
+	std::shared_ptr<pkt_queue_shaper> ps = std::atomic_load(&shaper);
+	if (!ps)
+		return PKTQUEUE_NOSPACE;
+
+	unsigned int tag = filter_seq_id * MAX_FILTERQUEUES + qnumber;
+	if (tag >= ps->filter_classes.size())
+		return PKTQUEUE_NOSPACE;
+
+	if (!ps->is_limited[tag].load())
+		return PKTQUEUE_NOTSHAPED;
+
+	// The user classes follow the filter class
+	uint32_t index = ps->filter_classes[tag] + 1 + (user_hash % MAX_SHAPER_USER_CLASSES);
+	if (!ps->shaper.put_packet(index, pkt, pkt_len, ppkt_data))
+		return PKTQUEUE_NOSPACE;
+
+	return PKTQUEUE_STORED;
+}
+
+uint64_t pkt_queue_filterset::get_next_due() const
+{
+	std::shared_ptr<pkt_queue_shaper> ps = std::atomic_load(&shaper);
+	if (!ps)
+		return SHAPER_IDLE;
+
+	return ps->shaper.get_next_due();
 }
 
-int pkt_queue_filterset::put_packet(unsigned int filter_seq_id, unsigned int qnumber, const unsigned char* pkt, size_t packetbuf_size, const pkt_additional_data* ppkt_data)
+void pkt_queue_filterset::get_shaper_stat(unsigned int filter_seq_id, unsigned int qnumber, uint64_t& sent_packets, uint64_t& sent_bytes) const
+{
+	sent_packets = 0;
+	sent_bytes = 0;
+
+	std::shared_ptr<pkt_queue_shaper> ps = std::atomic_load(&shaper);
+	if (!ps)
+		return;
+
+	unsigned int tag = filter_seq_id * MAX_FILTERQUEUES + qnumber;
+	if (tag < ps->filter_classes.size())
+	{
+		sent_packets = ps->shaper.get_sent_packets(ps->filter_classes[tag]);
+		sent_bytes = ps->shaper.get_sent_bytes(ps->filter_classes[tag]);
+	}
+}
+
+int pkt_queue_filterset::put_packet(unsigned int filter_seq_id, unsigned int qnumber, const unsigned char* pkt, size_t pkt_len, const pkt_additional_data* ppkt_data)
 {
 	if (qnumber >= MAX_FILTERQUEUES)
 		throw std::exception("Invalid queue number");
 
 	if (pq.get() == NULL)
 	{
-		init(packetbuf_size);
+		init((pkt_len > MAX_FILTERQUEUE_PACKETSIZE) ? pkt_len : MAX_FILTERQUEUE_PACKETSIZE);
 	}
 
 	if ((pq.get()->size() > filter_seq_id))
 	{
-		return pq.get()->at(filter_seq_id).q[qnumber].put_packet(pkt, packetbuf_size, ppkt_data);
+		return pq.get()->at(filter_seq_id).q[qnumber].put_packet(pkt, pkt_len, ppkt_data);
 	}
 
 	return PKTQUEUE_NOSPACE;
@@ -173,6 +299,78 @@ void pkt_queue_filterset::test_all()
 	pkt_queue_filterset pkf;
 	pkf.init(1514);
 	TEST_CASE_CHECK(pkf.get_queue_qty(), size_t(1));
+
+	// The first filter is shaped to 100 kbytes per second, the second is not limited and goes on at once
+	filterset fs;
+	filter2 f1;
+	f1.set_id(1);
+	f1.m_nSpeed = 100;
+	fs.filters.add_element(f1);
+	filter2 f2;
+	f2.set_id(2);
+	f2.m_nSpeed = 0;
+	fs.filters.add_element(f2);
+
+	pkt_queue_filterset pkf2;
+	pkf2.init(fs, 1514);
+	TEST_CASE_CHECK(pkf2.get_queue_qty(), size_t(2));
+	TEST_CASE_CHECK(pkf2.get_next_due(), uint64_t(SHAPER_IDLE));
+
+	unsigned char pkt[1000];
+	memset(pkt, 0, sizeof(pkt));
+
+	uint64_t bytes[2] = { 0, 0 };
+	size_t wrong = 0;
+	for (uint64_t now = 1000000000ULL; now < 2000000000ULL; now += 100000)
+	{
+		for (unsigned int user = 0; user < 4; user++)
+		{
+			pkf2.shape_packet(0, DIRECTION_SENT, user, pkt, sizeof(pkt), NULL);
+			if (pkf2.shape_packet(1, DIRECTION_RECV, user, pkt, sizeof(pkt), NULL) == PKTQUEUE_NOTSHAPED)
+				bytes[1] += sizeof(pkt);
+		}
+
+		pkf2.dispatch(now, 1000, [&](unsigned int filter_seq_id, unsigned int qnumber, const unsigned char* p, size_t pkt_len, const pkt_additional_data& data)
+		{
+			if ((filter_seq_id > 1) || (qnumber != ((filter_seq_id == 0) ? DIRECTION_SENT : DIRECTION_RECV)))
+				wrong++;
+			else
+				bytes[filter_seq_id] += pkt_len;
+		});
+	}
+
+	TEST_CASE_CHECK(wrong, size_t(0));
+	TEST_CASE_CHECK(true, (bytes[0] >= 102400) && (bytes[0] <= 102400 + 4000));
+	TEST_CASE_CHECK(bytes[1], uint64_t(10000 * 4 * 1000));
+
+	uint64_t sent_packets = 0;
+	uint64_t sent_bytes = 0;
+	pkf2.get_shaper_stat(0, DIRECTION_SENT, sent_packets, sent_bytes);
+	TEST_CASE_CHECK(sent_bytes, bytes[0]);
+	TEST_CASE_CHECK(true, pkf2.get_next_due() > 0);
+
+	// The second filter gets its limit, the packets queued by the first one are kept
+	TEST_CASE_CHECK(pkf2.shape_packet(1, DIRECTION_RECV, 0, pkt, sizeof(pkt), NULL), int(PKTQUEUE_NOTSHAPED));
+	std::next(fs.filters.items.begin())->m_nSpeed = 50;
+	pkf2.update_speed(fs);
+	TEST_CASE_CHECK(pkf2.shape_packet(1, DIRECTION_RECV, 0, pkt, sizeof(pkt), NULL), int(PKTQUEUE_STORED));
+
+	uint64_t queued[2] = { 0, 0 };
+	pkf2.dispatch(3000000000ULL, 1000, [&](unsigned int filter_seq_id, unsigned int qnumber, const unsigned char* p, size_t pkt_len, const pkt_additional_data& data)
+	{
+		queued[filter_seq_id % 2] += pkt_len;
+	});
+
+	TEST_CASE_CHECK(true, queued[0] > 0);
+	TEST_CASE_CHECK(queued[1], uint64_t(sizeof(pkt)));
+
+	// The first filter loses its limit, its queue goes by the next timer
+	fs.filters.items.begin()->m_nSpeed = 0;
+	pkf2.update_speed(fs);
+	TEST_CASE_CHECK(pkf2.shape_packet(0, DIRECTION_SENT, 0, pkt, sizeof(pkt), NULL), int(PKTQUEUE_NOTSHAPED));
+
+	pkf2.dispatch(4000000000ULL, 1000, [](unsigned int filter_seq_id, unsigned int qnumber, const unsigned char* p, size_t pkt_len, const pkt_additional_data& data) { });
+	TEST_CASE_CHECK(pkf2.get_next_due(), uint64_t(SHAPER_IDLE));
 }
 #endif
 
@@ -5,10 +5,12 @@
 #include <utm.h>
 
 #include <pkt_queue.h>
+#include <pkt_shaper.h>
 #include <filterset.h>
 #include <ubase_test.h>
 #include <idset.h>
 
+#include <atomic>
 #include <vector>
 #include <memory>
 #include <boost/thread/mutex.hpp>
@@ -16,6 +18,10 @@
 #define MAX_FILTERQUEUE_PACKETS 200
 #define MAX_FILTERSETQUEUE_PACKETS 1000
 #define MAX_FILTERQUEUES 2
+#define MAX_FILTERQUEUE_PACKETSIZE 1514
+#define MAX_SHAPER_USER_CLASSES 8		// users of a filter are spread over the classes by their hash
+#define MAX_SHAPER_USER_PACKETS 64
+#define SHAPER_BURST_DIVIDER 500		// the burst is the rate of 2 ms
 #define DIRECTION_SENT 0
 #define DIRECTION_RECV 1
 
@@ -36,6 +42,17 @@ struct pkt_queue_filter
 
 typedef std::vector<pkt_queue_filter> pkt_queue_filterset_container;
 
+// Shaper classes: a root for each queue number, a class for each filter under it and the user
+// classes of the filter under the filter class. The queue of a user class is allocated by its
+// first packet. A filter without a rate is not shaped, its class only sends the packets queued before.
+struct pkt_queue_shaper
+{
+	pkt_shaper shaper;
+	std::vector<uint32_t> filter_classes;		// by filter_seq_id * MAX_FILTERQUEUES + qnumber
+	std::unique_ptr<std::atomic<bool>[]> is_limited;	// by the same index
+	size_t packetbuf_size;
+};
+
 class pkt_queue_filterset
 {
 public:
@@ -45,8 +62,7 @@ public:
 	~pkt_queue_filterset();
 
 	void init(const filterset& fs, size_t packetbuf_size);
-	int put_packet(unsigned int filter_
-		, unsigned int qnumber, const unsigned char* pkt, size_t packetbuf_size, const pkt_additional_data* ppkt_data);
+	int put_packet(unsigned int filter_seq_id, unsigned int qnumber, const unsigned char* pkt, size_t pkt_len, const pkt_additional_data* ppkt_data);
 	bool get_packet(unsigned int filter_seq_id, unsigned int qnumber, unsigned char* pkt, size_t packetbuf_size, pkt_additional_data* ppkt_data);
 
 	size_t get_queue_qty() const;
@@ -54,9 +70,40 @@ public:
 	void get_queue_state(unsigned int filter_seq_id, unsigned int qnumber, int& ticks_left, int& adjust_speed_value, uint32_t& adjust_speed_seqnum) const;
 	void set_queue_state(unsigned int filter_seq_id, unsigned int qnumber, int ticks_left, int adjust_speed_value, uint32_t adjust_speed_seqnum);
 
+	// Puts the packet into the shaper class of the user, any thread. Returns PKTQUEUE_NOTSHAPED
+	// if the filter is not limited.
+	int shape_packet(unsigned int filter_seq_id, unsigned int qnumber, unsigned int user_hash, const unsigned char* pkt, size_t pkt_len, const pkt_additional_data* ppkt_data);
+
+	// Sends the shaped packets due by now (nanoseconds), calls f(filter_seq_id, qnumber, pkt, pkt_len, pkt_data).
+	// Called from one thread, as update_speed().
+	template<class F>
+	size_t dispatch(uint64_t now, size_t maxcount, F f)
+	{
+		std::shared_ptr<pkt_queue_shaper> ps = std::atomic_load(&shaper);
+		if (!ps)
+			return 0;
+
+		return ps->shaper.dispatch(now, maxcount, [&f](unsigned int tag, const unsigned char* pkt, size_t pkt_len, const pkt_additional_data& pkt_data)
+		{
+			f(tag / MAX_FILTERQUEUES, tag % MAX_FILTERQUEUES, pkt, pkt_len, pkt_data);
+		});
+	}
+
+	// Time of the next dispatch, see pkt_shaper::get_next_due()
+	uint64_t get_next_due() const;
+
+	// Takes the actual speed of the filters, the queued packets are kept
+	void update_speed(const filterset& fs);
+	void get_shaper_stat(unsigned int filter_seq_id, unsigned int qnumber, uint64_t& sent_packets, uint64_t& sent_bytes) const;
+
 private:
 	void init(size_t packetbuf_size);
+	void init_shaper(const filterset& fs, size_t packetbuf_size);
+	static uint64_t get_filter_rate(const filter2& f);
+	static size_t get_filter_burst(uint64_t rate, size_t packetbuf_size);
+
 	idvector_container filterids;
+	std::shared_ptr<pkt_queue_shaper> shaper;
 	std::unique_ptr<pkt_queue_filterset_container> pq;
 	boost::mutex guard;
 
@@ -0,0 +1,603 @@
+#include "stdafx.h"
+#include "pkt_ring.h"
+
+#include <cstring>
+#include <vector>
+
+#include <boost/thread.hpp>
+#include <ubase_test.h>
+
+namespace utm {
+
+const char pkt_ring::this_class_name[] = "pkt_ring";
+
+static inline uint32_t pkt_ring_align(size_t size)
+{
+	if (size == 0)
+		size = 1;
+
+	return static_cast<uint32_t>((size + PKTRING_ALIGN - 1) & ~static_cast<size_t>(PKTRING_ALIGN - 1));
+}
+
+pkt_ring::pkt_ring() : maxpackets(0), descmask(0), capacity(0),
+	head(0), put_counter(0), drop_counter(0), packets_watermark(0), bytes_watermark(0),
+	tail(0), get_counter(0), read_seq(0), read_next(0)
+{
+}
+
+pkt_ring::pkt_ring(const pkt_ring& rhs) : maxpackets(0), descmask(0), capacity(0),
+	head(0), put_counter(0), drop_counter(0), packets_watermark(0), bytes_watermark(0),
+	tail(0), get_counter(0), read_seq(0), read_next(0)
+{
+	operator=(rhs);
+}
+
+pkt_ring::~pkt_ring()
+{
+}
+
+pkt_ring& pkt_ring::operator=(const pkt_ring& rhs)
+{
+	if (this == &rhs)
+		return *this;
+
+	maxpackets = rhs.maxpackets;
+	descmask = rhs.descmask;
+	capacity = rhs.capacity;
+
+	descs.reset();
+	buffer.reset();
+
+	if (rhs.descs)
+	{
+		descs.reset(new desc[descmask + 1]);
+		for (uint32_t i = 0; i <= descmask; i++)
+		{
+			desc& d = descs[i];
+			const desc& r = rhs.descs[i];
+			d.state.store(r.state.load(std::memory_order_acquire), std::memory_order_relaxed);
+			d.offset = r.offset;
+			d.next = r.next;
+			d.len = r.len;
+			d.pkt_data = r.pkt_data;
+		}
+
+		buffer.reset(new unsigned char[capacity]);
+		memcpy(buffer.get(), rhs.buffer.get(), capacity);
+	}
+
+	head.store(rhs.head.load());
+	put_counter.store(rhs.put_counter.load());
+	drop_counter.store(rhs.drop_counter.load());
+	packets_watermark.store(rhs.packets_watermark.load());
+	bytes_watermark.store(rhs.bytes_watermark.load());
+
+	tail.store(rhs.tail.load());
+	get_counter.store(rhs.get_counter.load());
+	read_seq = rhs.read_seq;
+	read_next = rhs.read_next;
+
+	return *this;
+}
+
+void pkt_ring::init(uint32_t maxpackets, size_t bytes)
+{
+	if ((maxpackets == 0) || (bytes == 0) || (bytes >= 0x7FFFFFFF))
+		throw std::exception("pkt_ring: bad size");
+
+	this->maxpackets = maxpackets;
+
+	uint32_t n = 1;
+	while (n < maxpackets)
+		n <<= 1;
+
+	descmask = n - 1;
+	capacity = pkt_ring_align(bytes);
+
+	descs.reset(new desc[n]);
+	for (uint32_t i = 0; i < n; i++)
+	{
+		desc& d = descs[i];
+		d.state.store(0, std::memory_order_relaxed);
+		d.offset = 0;
+		d.next = 0;
+		d.len = 0;
+		memset(&d.pkt_data, 0, sizeof(d.pkt_data));
+	}
+
+	buffer.reset(new unsigned char[capacity]);
+
+	head.store(0);
+	put_counter.store(0);
+	drop_counter.store(0);
+	packets_watermark.store(0);
+	bytes_watermark.store(0);
+
+	tail.store(0);
+	get_counter.store(0);
+	read_seq = 0;
+	read_next = 0;
+}
+
+unsigned char* pkt_ring::reserve(size_t size, pkt_ring_slot& slot)
+{
+	if ((capacity == 0) || (size > capacity))
+	{
+		drop_counter.fetch_add(1, std::memory_order_relaxed);
+		return NULL;
+	}
+
+	uint32_t need = pkt_ring_align(size);
+
+	for (;;)
+	{
+		// The tail is taken first, it never passes the head taken after it
+		uint64_t t = tail.load(std::memory_order_acquire);
+		uint64_t h = head.load(std::memory_order_acquire);
+
+		uint32_t seq = get_seq(h);
+		uint32_t offset = get_offset(h);
+
+		uint32_t packets = seq - get_seq(t);
+		uint32_t used = 0;
+		if (packets > 0)
+		{
+			used = (offset + capacity - get_offset(t)) % capacity;
+			if (used == 0)
+				used = capacity;
+		}
+
+		uint32_t start = offset;
+		uint32_t pad = 0;
+		if (offset + need > capacity)
+		{
+			pad = capacity - offset;
+			start = 0;
+		}
+
+		if ((packets >= maxpackets) || (used + pad + need > capacity))
+		{
+			drop_counter.fetch_add(1, std::memory_order_relaxed);
+			return NULL;
+		}
+
+		uint32_t next = start + need;
+		if (next == capacity)
+			next = 0;
+
+		if (!head.compare_exchange_weak(h, pack(seq + 1, next), std::memory_order_acq_rel))
+			continue;
+
+		desc& d = descs[seq & descmask];
+		d.offset = start;
+		d.next = next;
+
+		update_watermark(packets + 1, used + pad + need);
+
+		slot.seq = seq;
+		slot.ptr = buffer.get() + start;
+		slot.size = need;
+		return slot.ptr;
+	}
+}
+
+void pkt_ring::commit(const pkt_ring_slot& slot, size_t len, const pkt_additional_data* ppkt_data)
+{
+	desc& d = descs[slot.seq & descmask];
+	d.len = static_cast<uint32_t>((len > slot.size) ? slot.size : len);
+
+	if (ppkt_data != NULL)
+		d.pkt_data = *ppkt_data;
+	else
+		memset(&d.pkt_data, 0, sizeof(d.pkt_data));
+
+	if (d.len > 0)
+		put_counter.fetch_add(1, std::memory_order_relaxed);
+
+	d.state.store(slot.seq + 1, std::memory_order_release);
+}
+
+bool pkt_ring::put(const unsigned char* pkt, size_t len, const pkt_additional_data* ppkt_data)
+{
+	if (len == 0)
+		return false;
+
+	pkt_ring_slot slot;
+	unsigned char* ptr = reserve(len, slot);
+	if (ptr == NULL)
+		return false;
+
+	memcpy(ptr, pkt, len);
+	commit(slot, len, ppkt_data);
+
+	return true;
+}
+
+const pkt_ring::desc* pkt_ring::get_ready(uint32_t seq) const
+{
+	if (!descs)
+		return NULL;
+
+	const desc* d = &descs[seq & descmask];
+	if (d->state.load(std::memory_order_acquire) != seq + 1)
+		return NULL;
+
+	return d;
+}
+
+const unsigned char* pkt_ring::peek(size_t& len, const pkt_additional_data*& ppkt_data)
+{
+	for (;;)
+	{
+		const desc* d = get_ready(read_seq);
+		if (d == NULL)
+			return NULL;
+
+		if (d->len > 0)
+		{
+			len = d->len;
+			ppkt_data = &d->pkt_data;
+			return buffer.get() + d->offset;
+		}
+
+		// Canceled reservation
+		read_seq++;
+		read_next = d->next;
+		publish_tail();
+	}
+}
+
+void pkt_ring::release()
+{
+	const desc* d = get_ready(read_seq);
+	if (d == NULL)
+		return;
+
+	read_seq++;
+	read_next = d->next;
+	publish_tail();
+
+	get_counter.fetch_add(1, std::memory_order_relaxed);
+}
+
+void pkt_ring::publish_tail()
+{
+	tail.store(pack(read_seq, read_next), std::memory_order_release);
+}
+
+void pkt_ring::update_watermark(uint32_t packets, uint32_t bytes)
+{
+	uint32_t cur = packets_watermark.load(std::memory_order_relaxed);
+	while ((packets > cur) && !packets_watermark.compare_exchange_weak(cur, packets, std::memory_order_relaxed))
+		;
+
+	cur = bytes_watermark.load(std::memory_order_relaxed);
+	while ((bytes > cur) && !bytes_watermark.compare_exchange_weak(cur, bytes, std::memory_order_relaxed))
+		;
+}
+
+bool pkt_ring::empty() const
+{
+	return get_seq(head.load(std::memory_order_acquire)) == get_seq(tail.load(std::memory_order_acquire));
+}
+
+void pkt_ring::get_stat(pkt_ring_stat& st) const
+{
+	uint64_t t = tail.load(std::memory_order_acquire);
+	uint64_t h = head.load(std::memory_order_acquire);
+
+	st.put_counter = put_counter.load(std::memory_order_relaxed);
+	st.get_counter = get_counter.load(std::memory_order_relaxed);
+	st.drop_counter = drop_counter.load(std::memory_order_relaxed);
+	st.packets = get_seq(h) - get_seq(t);
+	st.bytes = 0;
+	if ((st.packets > 0) && (capacity > 0))
+	{
+		st.bytes = (get_offset(h) + capacity - get_offset(t)) % capacity;
+		if (st.bytes == 0)
+			st.bytes = capacity;
+	}
+	st.packets_watermark = packets_watermark.load(std::memory_order_relaxed);
+	st.bytes_watermark = bytes_watermark.load(std::memory_order_relaxed);
+}
+
+#ifdef UTM_DEBUG
+static void pkt_ring_test_fill(unsigned char* ptr, size_t len, unsigned int id)
+{
+	for (size_t i = 0; i < len; i++)
+		ptr[i] = static_cast<unsigned char>(id + i);
+}
+
+static bool pkt_ring_test_check(const unsigned char* ptr, size_t len, unsigned int id)
+{
+	for (size_t i = 0; i < len; i++)
+	{
+		if (ptr[i] != static_cast<unsigned char>(id + i))
+			return false;
+	}
+
+	return true;
+}
+
+struct pkt_ring_test_producer
+{
+	pkt_ring* ring;
+	unsigned int producer;
+	unsigned int count;
+
+	void operator()() const
+	{
+		unsigned char pkt[256];
+		for (unsigned int n = 0; n < count; n++)
+		{
+			size_t len = 8 + (n * 37 + producer * 11) % 200;
+			pkt_ring_test_fill(pkt, len, n);
+
+			pkt_additional_data data;
+			data.hAdapterHandle = NULL;
+			data.nic_alias = (producer << 24) | n;
+
+			while (!ring->put(pkt, len, &data))
+				boost::this_thread::yield();
+		}
+	}
+};
+
+void pkt_ring::test_all()
+{
+	test_report tr(this_class_name);
+
+	unsigned char pkt[256];
+	pkt_additional_data data;
+	const pkt_additional_data* pdata = NULL;
+	size_t len = 0;
+
+	test_case::classname.assign("put/get");
+	{
+		test_case::testcase_num = 1;
+		pkt_ring r;
+		r.init(4, 256);
+
+		for (unsigned int i = 0; i < 3; i++)
+		{
+			pkt_ring_test_fill(pkt, 20 + i, i);
+			data.hAdapterHandle = NULL;
+			data.nic_alias = i;
+			TEST_CASE_CHECK(true, r.put(pkt, 20 + i, &data));
+		}
+
+		pkt_ring_stat st;
+		r.get_stat(st);
+		TEST_CASE_CHECK(uint32_t(3), st.packets);
+		TEST_CASE_CHECK(uint32_t(72), st.bytes);
+
+		for (unsigned int i = 0; i < 3; i++)
+		{
+			const unsigned char* p = r.peek(len, pdata);
+			TEST_CASE_CHECK(true, p != NULL);
+			TEST_CASE_CHECK(size_t(20 + i), len);
+			TEST_CASE_CHECK(true, pkt_ring_test_check(p, len, i));
+			TEST_CASE_CHECK(i, pdata->nic_alias);
+			r.release();
+		}
+
+		TEST_CASE_CHECK(true, r.peek(len, pdata) == NULL);
+		TEST_CASE_CHECK(true, r.empty());
+
+		// The packet which does not fit before the end starts from the beginning
+		test_case::testcase_num = 2;
+		pkt_ring_test_fill(pkt, 150, 7);
+		TEST_CASE_CHECK(true, r.put(pkt, 150, NULL));
+		const unsigned char* p = r.peek(len, pdata);
+		TEST_CASE_CHECK(true, pkt_ring_test_check(p, len, 7));
+		r.release();
+
+		pkt_ring_test_fill(pkt, 100, 9);
+		TEST_CASE_CHECK(true, r.put(pkt, 100, NULL));
+		r.get_stat(st);
+		TEST_CASE_CHECK(uint32_t(256 - 224 + 104), st.bytes);
+
+		p = r.peek(len, pdata);
+		TEST_CASE_CHECK(true, p == r.buffer.get());
+		TEST_CASE_CHECK(size_t(100), len);
+		TEST_CASE_CHECK(true, pkt_ring_test_check(p, len, 9));
+		r.release();
+
+		r.get_stat(st);
+		TEST_CASE_CHECK(uint64_t(5), st.put_counter);
+		TEST_CASE_CHECK(uint64_t(5), st.get_counter);
+		TEST_CASE_CHECK(uint32_t(0), st.bytes);
+		TEST_CASE_CHECK(uint32_t(3), st.packets_watermark);
+	}
+
+	test_case::classname.assign("drop");
+	{
+		// Out of packets
+		test_case::testcase_num = 1;
+		pkt_ring r;
+		r.init(2, 1024);
+		TEST_CASE_CHECK(true, r.put(pkt, 10, NULL));
+		TEST_CASE_CHECK(true, r.put(pkt, 10, NULL));
+		TEST_CASE_CHECK(false, r.put(pkt, 10, NULL));
+
+		// Out of bytes
+		test_case::testcase_num = 2;
+		pkt_ring r2;
+		r2.init(8, 64);
+		TEST_CASE_CHECK(true, r2.put(pkt, 40, NULL));
+		TEST_CASE_CHECK(false, r2.put(pkt, 40, NULL));
+		TEST_CASE_CHECK(true, r2.put(pkt, 24, NULL));
+		TEST_CASE_CHECK(false, r2.put(pkt, 1, NULL));
+		TEST_CASE_CHECK(false, r2.put(pkt, 100, NULL));
+
+		pkt_ring_stat st;
+		r.get_stat(st);
+		TEST_CASE_CHECK(uint64_t(1), st.drop_counter);
+		r2.get_stat(st);
+		TEST_CASE_CHECK(uint64_t(3), st.drop_counter);
+		TEST_CASE_CHECK(uint32_t(64), st.bytes);
+		TEST_CASE_CHECK(uint32_t(64), st.bytes_watermark);
+	}
+
+	test_case::classname.assign("reserve/commit");
+	{
+		test_case::testcase_num = 1;
+		pkt_ring r;
+		r.init(8, 1024);
+
+		pkt_ring_slot s1;
+		pkt_ring_slot s2;
+		pkt_ring_slot s3;
+		unsigned char* p1 = r.reserve(1514, s1);
+		unsigned char* p2 = r.reserve(60, s2);
+		TEST_CASE_CHECK(true, p1 == NULL);
+		TEST_CASE_CHECK(true, p2 != NULL);
+		TEST_CASE_CHECK(size_t(64), s2.size);
+
+		p1 = r.reserve(500, s1);
+		TEST_CASE_CHECK(true, p1 != NULL);
+
+		// Packets are taken in the reservation order
+		pkt_ring_test_fill(p1, 40, 1);
+		r.commit(s1, 40, NULL);
+		TEST_CASE_CHECK(true, r.peek(len, pdata) == NULL);
+
+		pkt_ring_test_fill(p2, 60, 2);
+		r.commit(s2, 60, NULL);
+		const unsigned char* p = r.peek(len, pdata);
+		TEST_CASE_CHECK(true, pkt_ring_test_check(p, len, 2));
+		r.release();
+		p = r.peek(len, pdata);
+		TEST_CASE_CHECK(true, pkt_ring_test_check(p, len, 1));
+		TEST_CASE_CHECK(size_t(40), len);
+		r.release();
+
+		// A canceled reservation is skipped
+		test_case::testcase_num = 2;
+		r.reserve(100, s1);
+		p2 = r.reserve(100, s2);
+		p1 = r.reserve(100, s3);
+		r.cancel(s1);
+		pkt_ring_test_fill(p2, 30, 3);
+		r.commit(s2, 30, NULL);
+		r.cancel(s3);
+		p = r.peek(len, pdata);
+		TEST_CASE_CHECK(true, pkt_ring_test_check(p, len, 3));
+		r.release();
+		TEST_CASE_CHECK(true, r.peek(len, pdata) == NULL);
+		TEST_CASE_CHECK(true, r.empty());
+
+		pkt_ring_stat st;
+		r.get_stat(st);
+		TEST_CASE_CHECK(uint64_t(3), st.put_counter);
+		TEST_CASE_CHECK(uint64_t(3), st.get_counter);
+		TEST_CASE_CHECK(uint64_t(1), st.drop_counter);
+	}
+
+	test_case::classname.assign("batch");
+	{
+		test_case::testcase_num = 1;
+		pkt_ring r;
+		r.init(16, 16 * 64);
+		for (unsigned int i = 0; i < 10; i++)
+		{
+			pkt_ring_test_fill(pkt, 50, i);
+			data.hAdapterHandle = NULL;
+			data.nic_alias = i;
+			r.put(pkt, 50, &data);
+		}
+
+		std::vector<unsigned int> got;
+		size_t wrong = 0;
+		auto f = [&](const unsigned char* p, size_t n, const pkt_additional_data& d)
+		{
+			got.push_back(d.nic_alias);
+			if (!pkt_ring_test_check(p, n, d.nic_alias))
+				wrong++;
+		};
+
+		TEST_CASE_CHECK(size_t(4), r.get_batch(4, f));
+		TEST_CASE_CHECK(size_t(6), r.get_batch(100, f));
+		TEST_CASE_CHECK(size_t(0), r.get_batch(100, f));
+		TEST_CASE_CHECK(size_t(10), got.size());
+		TEST_CASE_CHECK(9U, got.back());
+		TEST_CASE_CHECK(size_t(0), wrong);
+
+		pkt_ring_stat st;
+		r.get_stat(st);
+		TEST_CASE_CHECK(uint64_t(10), st.get_counter);
+		TEST_CASE_CHECK(uint32_t(10), st.packets_watermark);
+		TEST_CASE_CHECK(uint32_t(10 * 56), st.bytes_watermark);
+
+		// A copy keeps the packets
+		test_case::testcase_num = 2;
+		pkt_ring_test_fill(pkt, 33, 5);
+		r.put(pkt, 33, NULL);
+		pkt_ring r2(r);
+		const unsigned char* p = r2.peek(len, pdata);
+		TEST_CASE_CHECK(true, pkt_ring_test_check(p, len, 5));
+		TEST_CASE_CHECK(size_t(33), len);
+		r2.release();
+		TEST_CASE_CHECK(true, r2.empty());
+		TEST_CASE_CHECK(false, r.empty());
+	}
+
+	test_case::classname.assign("threads");
+	{
+		test_case::testcase_num = 1;
+
+		static const unsigned int PRODUCERS = 4;
+		static const unsigned int COUNT = 50000;
+
+		pkt_ring r;
+		r.init(64, 64 * 64);
+
+		boost::thread_group threads;
+		for (unsigned int i = 0; i < PRODUCERS; i++)
+		{
+			pkt_ring_test_producer p;
+			p.ring = &r;
+			p.producer = i;
+			p.count = COUNT;
+			threads.create_thread(p);
+		}
+
+		std::vector<unsigned int> next(PRODUCERS, 0);
+		size_t total = 0;
+		size_t wrong = 0;
+		while (total < PRODUCERS * COUNT)
+		{
+			size_t n = r.get_batch(16, [&](const unsigned char* p, size_t plen, const pkt_additional_data& d)
+			{
+				unsigned int producer = d.nic_alias >> 24;
+				unsigned int seq = d.nic_alias & 0xFFFFFF;
+				if ((producer >= PRODUCERS) || (seq != next[producer]) || (plen != 8 + (seq * 37 + producer * 11) % 200) || !pkt_ring_test_check(p, plen, seq))
+					wrong++;
+				else
+					next[producer]++;
+			});
+
+			if (n == 0)
+				boost::this_thread::yield();
+
+			total += n;
+		}
+
+		threads.join_all();
+
+		TEST_CASE_CHECK(size_t(0), wrong);
+		TEST_CASE_CHECK(true, r.empty());
+
+		pkt_ring_stat st;
+		r.get_stat(st);
+		TEST_CASE_CHECK(uint64_t(PRODUCERS * COUNT), st.put_counter);
+		TEST_CASE_CHECK(uint64_t(PRODUCERS * COUNT), st.get_counter);
+		TEST_CASE_CHECK(true, st.packets_watermark <= 64);
+		TEST_CASE_CHECK(true, st.bytes_watermark <= 64 * 64);
+	}
+
+	return;
+}
+#endif
+
+}
@@ -0,0 +1,160 @@
+#ifndef _UTM_PKT_RING_H
+#define _UTM_PKT_RING_H
+
+#pragma once
+#include <utm.h>
+
+#include <atomic>
+#include <cstdint>
+#include <memory>
+
+#define PKTRING_ALIGN 8
+#define PKTRING_CACHELINE 64
+
+namespace utm {
+
+struct pkt_additional_data
+{
+	HANDLE hAdapterHandle;
+	unsigned int nic_alias;
+};
+
+// Reservation of a producer, it must be committed or canceled
+struct pkt_ring_slot
+{
+	pkt_ring_slot() : seq(0), ptr(NULL), size(0) { };
+
+	uint32_t seq;
+	unsigned char* ptr;
+	size_t size;
+};
+
+struct pkt_ring_stat
+{
+	uint64_t put_counter;
+	uint64_t get_counter;
+	uint64_t drop_counter;
+	uint32_t packets;				// in the ring now
+	uint32_t bytes;
+	uint32_t packets_watermark;		// the most ever used
+	uint32_t bytes_watermark;
+};
+
+//
+// Lock free ring of packets for one or many producers and one consumer. Packets take their own length
+// (rounded up to PKTRING_ALIGN) in one byte buffer, producers write them in place between
+// reserve() and commit(), the consumer reads them in place between peek() and release().
+//
+// The position of the next packet (its sequence number and byte offset) is one 64-bit word, so
+// a producer reserves the descriptor and the bytes with one compare and swap. A packet which does
+// not fit before the end of the buffer starts from the beginning, the rest of the buffer is skipped.
+// The descriptor of a packet is ready when its state is the sequence number plus one.
+// The consumer waits for the packets in the reservation order.
+//
+class pkt_ring
+{
+	struct desc
+	{
+		std::atomic<uint32_t> state;
+		uint32_t offset;		// of the packet in the buffer
+		uint32_t next;			// offset after the packet
+		uint32_t len;			// zero for a canceled reservation
+		pkt_additional_data pkt_data;
+	};
+
+public:
+	static const char this_class_name[];
+
+	pkt_ring();
+	pkt_ring(const pkt_ring& rhs);
+	~pkt_ring();
+
+	// Copies the packets, the rings must not be used meanwhile
+	pkt_ring& operator=(const pkt_ring& rhs);
+
+	void init(uint32_t maxpackets, size_t bytes);
+
+	uint32_t get_maxpackets() const { return maxpackets; };
+	size_t get_capacity() const { return capacity; };
+
+	// Producer side, any thread. Returns NULL and counts the drop if there is no room.
+	unsigned char* reserve(size_t size, pkt_ring_slot& slot);
+	void commit(const pkt_ring_slot& slot, size_t len, const pkt_additional_data* ppkt_data);
+	void cancel(const pkt_ring_slot& slot) { commit(slot, 0, NULL); };
+
+	// Copies the packet in
+	bool put(const unsigned char* pkt, size_t len, const pkt_additional_data* ppkt_data);
+
+	// Consumer side, one thread. The packet stays valid until release().
+	const unsigned char* peek(size_t& len, const pkt_additional_data*& ppkt_data);
+	void release();
+
+	// Calls f(pkt, len, pkt_data) for up to maxcount packets, then releases them at once
+	template<class F>
+	size_t get_batch(size_t maxcount, F f)
+	{
+		size_t n = 0;
+		while (n < maxcount)
+		{
+			const desc* d = get_ready(read_seq);
+			if (d == NULL)
+				break;
+
+			if (d->len > 0)
+			{
+				f(static_cast<const unsigned char*>(buffer.get() + d->offset), static_cast<size_t>(d->len), d->pkt_data);
+				n++;
+			}
+
+			read_seq++;
+			read_next = d->next;
+		}
+
+		publish_tail();
+		get_counter.fetch_add(n, std::memory_order_relaxed);
+		return n;
+	}
+
+	bool empty() const;
+	void get_stat(pkt_ring_stat& st) const;
+
+private:
+	static uint64_t pack(uint32_t seq, uint32_t offset) { return (static_cast<uint64_t>(seq) << 32) | offset; };
+	static uint32_t get_seq(uint64_t pos) { return static_cast<uint32_t>(pos >> 32); };
+	static uint32_t get_offset(uint64_t pos) { return static_cast<uint32_t>(pos & 0xFFFFFFFF); };
+
+	const desc* get_ready(uint32_t seq) const;
+	void publish_tail();
+	void update_watermark(uint32_t packets, uint32_t bytes);
+
+	uint32_t maxpackets;
+	uint32_t descmask;
+	uint32_t capacity;
+	std::unique_ptr<desc[]> descs;
+	std::unique_ptr<unsigned char[]> buffer;
+
+	// Written by producers
+	char pad0[PKTRING_CACHELINE];
+	std::atomic<uint64_t> head;		// next reservation
+	std::atomic<uint64_t> put_counter;
+	std::atomic<uint64_t> drop_counter;
+	std::atomic<uint32_t> packets_watermark;
+	std::atomic<uint32_t> bytes_watermark;
+
+	// Written by the consumer, read_* are published to tail by release()
+	char pad1[PKTRING_CACHELINE];
+	std::atomic<uint64_t> tail;		// first packet not released
+	std::atomic<uint64_t> get_counter;
+	uint32_t read_seq;
+	uint32_t read_next;
+	char pad2[PKTRING_CACHELINE];
+
+#ifdef UTM_DEBUG
+public:
+	static void test_all();
+#endif
+};
+
+}
+
+#endif // _UTM_PKT_RING_H
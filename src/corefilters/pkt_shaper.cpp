@@ -0,0 +1,636 @@
+#include "stdafx.h"
+#include "pkt_shaper.h"
+
+#include <chrono>
+#include <cstring>
+#include <iostream>
+
+#include <boost/thread.hpp>
+#include <ubase_test.h>
+
+namespace utm {
+
+const char pkt_shaper::this_class_name[] = "pkt_shaper";
+
+pkt_shaper::pkt_shaper() : wheel_tick(0)
+{
+}
+
+pkt_shaper::~pkt_shaper()
+{
+}
+
+uint32_t pkt_shaper::add_class(uint32_t parent, unsigned int tag, uint64_t rate, size_t burst, uint32_t maxpackets, size_t packetbuf_size)
+{
+	if ((parent != SHAPER_NO_CLASS) && (parent >= classes.size()))
+		throw std::exception("pkt_shaper: bad parent class");
+
+	if (activations.get_maxpackets() > 0)
+		throw std::exception("pkt_shaper: the classes are prepared already");
+
+	std::unique_ptr<shaper_class> c(new shaper_class());
+	c->tag = tag;
+	c->parent = parent;
+
+	if (maxpackets > 0)
+	{
+		// Room for maxpackets of the full size and the tail skipped at the end of the ring
+		size_t slot_size = (packetbuf_size + PKTRING_ALIGN - 1) & ~static_cast<size_t>(PKTRING_ALIGN - 1);
+		c->maxpackets = maxpackets;
+		c->queue_bytes = (maxpackets + 1) * slot_size;
+	}
+
+	classes.push_back(std::move(c));
+
+	uint32_t index = static_cast<uint32_t>(classes.size() - 1);
+	set_rate(index, rate, burst);
+
+	return index;
+}
+
+void pkt_shaper::prepare()
+{
+	if (classes.empty() || (activations.get_maxpackets() > 0))
+		return;
+
+	// A leaf is in the activations once at most
+	uint32_t count = static_cast<uint32_t>(classes.size());
+	activations.init(count, (count + 1) * PKTRING_ALIGN);
+}
+
+void pkt_shaper::set_rate(uint32_t index, uint64_t rate, size_t burst)
+{
+	shaper_class& c = *classes.at(index);
+	c.rate = rate;
+	c.burst_ns = (rate > 0) ? (static_cast<uint64_t>(burst) * 1000000000ULL / rate) : 0;
+}
+
+pkt_ring* pkt_shaper::get_queue(uint32_t index)
+{
+	if ((index >= classes.size()) || (activations.get_maxpackets() == 0))
+		return NULL;
+
+	shaper_class& c = *classes[index];
+	if (c.maxpackets == 0)
+		return NULL;
+
+	if (!c.has_queue.load())
+	{
+		boost::mutex::scoped_lock lock(queue_guard);
+		if (!c.has_queue.load())
+		{
+			c.queue.init(c.maxpackets, c.queue_bytes);
+			c.has_queue.store(true);
+		}
+	}
+
+	return &c.queue;
+}
+
+bool pkt_shaper::put_packet(uint32_t index, const unsigned char* pkt, size_t len, const pkt_additional_data* ppkt_data)
+{
+	pkt_ring* queue = get_queue(index);
+	if ((queue == NULL) || !queue->put(pkt, len, ppkt_data))
+		return false;
+
+	activate(index);
+	return true;
+}
+
+unsigned char* pkt_shaper::reserve_packet(uint32_t index, size_t len, pkt_ring_slot& slot)
+{
+	pkt_ring* queue = get_queue(index);
+	if (queue == NULL)
+		return NULL;
+
+	return queue->reserve(len, slot);
+}
+
+void pkt_shaper::commit_packet(uint32_t index, const pkt_ring_slot& slot, size_t len, const pkt_additional_data* ppkt_data)
+{
+	classes[index]->queue.commit(slot, len, ppkt_data);
+	activate(index);
+}
+
+void pkt_shaper::get_stat(uint32_t index, pkt_ring_stat& st) const
+{
+	const shaper_class& c = *classes[index];
+	if (c.has_queue.load())
+	{
+		c.queue.get_stat(st);
+		return;
+	}
+
+	memset(&st, 0, sizeof(st));
+}
+
+void pkt_shaper::activate(uint32_t index)
+{
+	if (!classes[index]->active.exchange(true))
+		activations.put(reinterpret_cast<const unsigned char*>(&index), sizeof(index), NULL);
+}
+
+void pkt_shaper::deactivate(uint32_t index)
+{
+	shaper_class& c = *classes[index];
+	c.deficit = 0;
+	c.active.store(false);
+
+	// A producer which has seen the class active has its packet in the queue already
+	std::atomic_thread_fence(std::memory_order_seq_cst);
+	if (!c.queue.empty() && !c.active.exchange(true))
+	{
+		c.deficit = SHAPER_QUANTUM;
+		ready.push_back(index);
+	}
+}
+
+void pkt_shaper::start_dispatch(uint64_t now)
+{
+	if (wheel.empty())
+	{
+		wheel.resize(SHAPER_WHEEL_SIZE);
+		wheel_tick = now / SHAPER_WHEEL_TICK;
+	}
+
+	activations.get_batch(classes.size(), [this](const unsigned char* pkt, size_t len, const pkt_additional_data& pkt_data)
+	{
+		uint32_t index = 0;
+		memcpy(&index, pkt, sizeof(index));
+
+		classes[index]->deficit = SHAPER_QUANTUM;
+		ready.push_back(index);
+	});
+
+	expire(now);
+}
+
+uint64_t pkt_shaper::get_departure(uint32_t index, uint32_t& blocker) const
+{
+	uint64_t departure = 0;
+	blocker = SHAPER_NO_CLASS;
+
+	for (uint32_t i = index; i != SHAPER_NO_CLASS; i = classes[i]->parent)
+	{
+		const shaper_class& c = *classes[i];
+		if ((c.rate == 0) || (c.tat <= c.burst_ns))
+			continue;
+
+		uint64_t t = c.tat - c.burst_ns;
+		if (t > departure)
+		{
+			departure = t;
+			blocker = i;
+		}
+	}
+
+	return departure;
+}
+
+uint32_t pkt_shaper::get_next(uint64_t now, const unsigned char*& pkt, size_t& len, const pkt_additional_data*& ppkt_data)
+{
+	while (!ready.empty())
+	{
+		uint32_t index = ready.front();
+		shaper_class& c = *classes[index];
+
+		uint32_t blocker = SHAPER_NO_CLASS;
+		uint64_t departure = get_departure(index, blocker);
+		if (departure > now)
+		{
+			ready.pop_front();
+
+			if (blocker == index)
+			{
+				set_timer(index, departure);
+				continue;
+			}
+
+			shaper_class& b = *classes[blocker];
+			b.waiting.push_back(index);
+			if (b.due == 0)
+				set_timer(blocker, departure);
+
+			continue;
+		}
+
+		pkt = c.queue.peek(len, ppkt_data);
+		if (pkt == NULL)
+		{
+			ready.pop_front();
+
+			// The packet is reserved but not committed yet
+			if (!c.queue.empty())
+				set_timer(index, now + SHAPER_WHEEL_TICK);
+			else
+				deactivate(index);
+
+			continue;
+		}
+
+		if (c.deficit < static_cast<int64_t>(len))
+		{
+			c.deficit += SHAPER_QUANTUM;
+			ready.pop_front();
+			ready.push_back(index);
+			continue;
+		}
+
+		return index;
+	}
+
+	return SHAPER_NO_CLASS;
+}
+
+void pkt_shaper::sent(uint32_t index, uint64_t now, size_t len)
+{
+	shaper_class& leaf = *classes[index];
+	leaf.queue.release();
+	leaf.deficit -= len;
+
+	for (uint32_t i = index; i != SHAPER_NO_CLASS; i = classes[i]->parent)
+	{
+		shaper_class& c = *classes[i];
+		c.sent_packets++;
+		c.sent_bytes += len;
+
+		// An idle bucket does not save more than the burst
+		if (c.rate > 0)
+			c.tat = ((c.tat > now) ? c.tat : now) + len * 1000000000ULL / c.rate;
+	}
+
+	if (leaf.queue.empty())
+	{
+		ready.pop_front();
+		deactivate(index);
+	}
+}
+
+void pkt_shaper::set_timer(uint32_t index, uint64_t due)
+{
+	// The wheel does not look back
+	uint64_t first = wheel_tick * SHAPER_WHEEL_TICK;
+	if (due < first)
+		due = first;
+
+	if (due == 0)
+		due = 1;
+
+	classes[index]->due = due;
+
+	shaper_timer t;
+	t.index = index;
+	t.due = due;
+	wheel[(due / SHAPER_WHEEL_TICK) & (SHAPER_WHEEL_SIZE - 1)].push_back(t);
+}
+
+void pkt_shaper::expire(uint64_t now)
+{
+	uint64_t last_tick = now / SHAPER_WHEEL_TICK;
+	if (last_tick < wheel_tick)
+		return;
+
+	uint64_t ticks = last_tick - wheel_tick + 1;
+	if (ticks > SHAPER_WHEEL_SIZE)
+		ticks = SHAPER_WHEEL_SIZE;
+
+	for (uint64_t n = 0; n < ticks; n++)
+	{
+		std::vector<shaper_timer>& bucket = wheel[(wheel_tick + n) & (SHAPER_WHEEL_SIZE - 1)];
+
+		size_t i = 0;
+		while (i < bucket.size())
+		{
+			// A later round of the wheel
+			if (bucket[i].due > now)
+			{
+				i++;
+				continue;
+			}
+
+			shaper_timer t = bucket[i];
+			bucket[i] = bucket.back();
+			bucket.pop_back();
+
+			shaper_class& c = *classes[t.index];
+			if (c.due != t.due)
+				continue;
+
+			c.due = 0;
+
+			// The leaves blocked by the class go on in their order
+			ready.insert(ready.end(), c.waiting.begin(), c.waiting.end());
+			c.waiting.clear();
+
+			if (c.maxpackets > 0)
+				ready.push_back(t.index);
+		}
+	}
+
+	// The last tick may get more timers before the next call
+	wheel_tick = last_tick;
+}
+
+uint64_t pkt_shaper::get_next_due() const
+{
+	if (!ready.empty() || !activations.empty())
+		return 0;
+
+	if (wheel.empty())
+		return SHAPER_IDLE;
+
+	uint64_t due = SHAPER_IDLE;
+	for (size_t n = 0; n < SHAPER_WHEEL_SIZE; n++)
+	{
+		const std::vector<shaper_timer>& bucket = wheel[(wheel_tick + n) & (SHAPER_WHEEL_SIZE - 1)];
+		for (size_t i = 0; i < bucket.size(); i++)
+		{
+			const shaper_timer& t = bucket[i];
+			if ((classes[t.index]->due == t.due) && (t.due < due))
+				due = t.due;
+		}
+
+		// The bucket of this round has the earliest timer
+		if ((due != SHAPER_IDLE) && (due / SHAPER_WHEEL_TICK <= wheel_tick + n))
+			break;
+	}
+
+	return due;
+}
+
+#ifdef UTM_DEBUG
+struct pkt_shaper_test_source
+{
+	uint32_t index;
+	size_t len;
+	size_t backlog;
+};
+
+// Keeps the leaves backlogged and dispatches every step ns, returns the bytes sent by the tags
+static void pkt_shaper_test_run(pkt_shaper& s, const pkt_shaper_test_source* sources, size_t count, uint64_t start, uint64_t duration, uint64_t step,
+	std::vector<uint64_t>& bytes, std::vector<uint64_t>* times = NULL)
+{
+	unsigned char pkt[1514];
+	memset(pkt, 0, sizeof(pkt));
+
+	for (uint64_t now = start; now < start + duration; now += step)
+	{
+		for (size_t i = 0; i < count; i++)
+		{
+			pkt_ring_stat st;
+			s.get_stat(sources[i].index, st);
+			for (size_t n = st.packets; n < sources[i].backlog; n++)
+				s.put_packet(sources[i].index, pkt, sources[i].len, NULL);
+		}
+
+		s.dispatch(now, 100000, [&](unsigned int tag, const unsigned char* p, size_t len, const pkt_additional_data& d)
+		{
+			bytes[tag] += len;
+			if (times != NULL)
+				times->push_back(now);
+		});
+	}
+}
+
+struct pkt_shaper_test_producer
+{
+	pkt_shaper* shaper;
+	uint32_t index;
+	unsigned int producer;
+	unsigned int count;
+
+	void operator()() const
+	{
+		unsigned char pkt[64];
+		memset(pkt, 0, sizeof(pkt));
+
+		for (unsigned int n = 0; n < count; n++)
+		{
+			pkt_additional_data data;
+			data.hAdapterHandle = NULL;
+			data.nic_alias = n;
+
+			while (!shaper->put_packet(index, pkt, 40 + n % 24, &data))
+				boost::this_thread::yield();
+		}
+	}
+};
+
+void pkt_shaper::test_all()
+{
+	test_report tr(this_class_name);
+
+	static const uint64_t second = 1000000000ULL;
+	static const uint64_t start = 5 * second;
+
+	test_case::classname.assign("rate");
+	{
+		// 1000 bytes a millisecond, dispatched every 50 microseconds
+		test_case::testcase_num = 1;
+		pkt_shaper s;
+		uint32_t root = s.add_class(SHAPER_NO_CLASS, 0, 0, 0);
+		uint32_t filter = s.add_class(root, 1, 1000000, 3000);
+		uint32_t leaf = s.add_class(filter, 2, 0, 0, 64, 1514);
+		s.prepare();
+
+		pkt_shaper_test_source src[] = { { leaf, 1000, 20 } };
+		std::vector<uint64_t> bytes(3, 0);
+		std::vector<uint64_t> times;
+		pkt_shaper_test_run(s, src, 1, start, second / 2, 50000, bytes, &times);
+
+		TEST_CASE_CHECK(true, (bytes[2] >= 500000) && (bytes[2] <= 500000 + 4000));
+		TEST_CASE_CHECK(bytes[2], s.get_sent_bytes(filter));
+
+		// Packets after the burst leave every millisecond, late by the dispatch step at most
+		test_case::testcase_num = 2;
+		size_t late = 0;
+		for (size_t i = 10; i + 1 < times.size(); i++)
+		{
+			uint64_t gap = times[i + 1] - times[i];
+			if ((gap + 50000 < 1000000) || (gap > 1000000 + 50000))
+				late++;
+		}
+		TEST_CASE_CHECK(size_t(0), late);
+	}
+
+	test_case::classname.assign("hierarchy");
+	{
+		// The filter over its rate leaves the rest of the root to the other one
+		test_case::testcase_num = 1;
+		pkt_shaper s;
+		uint32_t root = s.add_class(SHAPER_NO_CLASS, 0, 800000, 8000);
+		uint32_t f1 = s.add_class(root, 1, 300000, 3000);
+		uint32_t f2 = s.add_class(root, 2, 0, 0);
+		uint32_t l1 = s.add_class(f1, 3, 0, 0, 64, 1514);
+		uint32_t l2 = s.add_class(f2, 4, 0, 0, 64, 1514);
+		s.prepare();
+
+		pkt_shaper_test_source src[] = { { l1, 1200, 20 }, { l2, 1200, 20 } };
+		std::vector<uint64_t> bytes(5, 0);
+		pkt_shaper_test_run(s, src, 2, start, second, 20000, bytes);
+
+		TEST_CASE_CHECK(true, (bytes[3] >= 300000 - 6000) && (bytes[3] <= 300000 + 6000));
+		TEST_CASE_CHECK(true, (bytes[4] >= 500000 - 10000) && (bytes[4] <= 500000 + 10000));
+		TEST_CASE_CHECK(bytes[3] + bytes[4], s.get_sent_bytes(root));
+	}
+
+	test_case::classname.assign("fairness");
+	{
+		// Users of a filter get the same bytes whatever their packets are
+		test_case::testcase_num = 1;
+		pkt_shaper s;
+		uint32_t filter = s.add_class(SHAPER_NO_CLASS, 0, 1000000, 3000);
+		uint32_t a = s.add_class(filter, 1, 0, 0, 64, 1514);
+		uint32_t b = s.add_class(filter, 2, 0, 0, 256, 1514);
+		uint32_t c = s.add_class(filter, 3, 0, 0, 64, 1514);
+		s.prepare();
+
+		pkt_shaper_test_source src[] = { { a, 1500, 20 }, { b, 100, 200 }, { c, 600, 20 } };
+		std::vector<uint64_t> bytes(4, 0);
+		pkt_shaper_test_run(s, src, 3, start, second / 2, 50000, bytes);
+
+		uint64_t total = bytes[1] + bytes[2] + bytes[3];
+		TEST_CASE_CHECK(true, (total >= 500000) && (total <= 500000 + 4500));
+		for (unsigned int tag = 1; tag <= 3; tag++)
+			TEST_CASE_CHECK(true, (bytes[tag] * 3 >= total - total / 20) && (bytes[tag] * 3 <= total + total / 20));
+	}
+
+	test_case::classname.assign("wheel");
+	{
+		// A wait far after the wheel round
+		test_case::testcase_num = 1;
+		pkt_shaper s;
+		uint32_t leaf = s.add_class(SHAPER_NO_CLASS, 7, 1000, 1000, 8, 1514);
+		unsigned char pkt[1000];
+		memset(pkt, 0, sizeof(pkt));
+
+		// Packets are not taken before the tree is prepared
+		TEST_CASE_CHECK(false, s.put_packet(leaf, pkt, sizeof(pkt), NULL));
+		s.prepare();
+
+		TEST_CASE_CHECK(SHAPER_IDLE, s.get_next_due());
+		for (int i = 0; i < 3; i++)
+			s.put_packet(leaf, pkt, sizeof(pkt), NULL);
+		TEST_CASE_CHECK(uint64_t(0), s.get_next_due());
+
+		size_t sent = 0;
+		auto f = [&](unsigned int tag, const unsigned char* p, size_t len, const pkt_additional_data& d) { if (tag == 7) sent++; };
+		TEST_CASE_CHECK(size_t(2), s.dispatch(start, 100, f));
+		TEST_CASE_CHECK(start + second, s.get_next_due());
+		TEST_CASE_CHECK(size_t(0), s.dispatch(start + second / 2, 100, f));
+		TEST_CASE_CHECK(size_t(0), s.dispatch(start + second - 1, 100, f));
+		TEST_CASE_CHECK(size_t(1), s.dispatch(start + second, 100, f));
+		TEST_CASE_CHECK(size_t(3), sent);
+		TEST_CASE_CHECK(SHAPER_IDLE, s.get_next_due());
+
+		// The rate is changed on the way
+		test_case::testcase_num = 2;
+		for (int i = 0; i < 3; i++)
+			s.put_packet(leaf, pkt, sizeof(pkt), NULL);
+		TEST_CASE_CHECK(size_t(1), s.dispatch(start + second * 5 / 2, 100, f));
+		s.set_rate(leaf, 2000, 1000);
+		TEST_CASE_CHECK(size_t(0), s.dispatch(start + second * 3, 100, f));
+		TEST_CASE_CHECK(start + second * 7 / 2, s.get_next_due());
+		TEST_CASE_CHECK(size_t(1), s.dispatch(start + second * 7 / 2, 100, f));
+		TEST_CASE_CHECK(start + second * 4, s.get_next_due());
+	}
+
+	test_case::classname.assign("threads");
+	{
+		test_case::testcase_num = 1;
+
+		static const unsigned int PRODUCERS = 4;
+		static const unsigned int COUNT = 100000;
+
+		pkt_shaper s;
+		uint32_t root = s.add_class(SHAPER_NO_CLASS, 0, 0, 0);
+		std::vector<uint32_t> leaves;
+		for (unsigned int i = 0; i < PRODUCERS; i++)
+			leaves.push_back(s.add_class(root, i, 0, 0, 32, 64));
+		s.prepare();
+
+		boost::thread_group threads;
+		for (unsigned int i = 0; i < PRODUCERS; i++)
+		{
+			pkt_shaper_test_producer p;
+			p.shaper = &s;
+			p.index = leaves[i];
+			p.producer = i;
+			p.count = COUNT;
+			threads.create_thread(p);
+		}
+
+		std::vector<unsigned int> next(PRODUCERS, 0);
+		size_t total = 0;
+		size_t wrong = 0;
+		uint64_t now = start;
+		while (total < PRODUCERS * COUNT)
+		{
+			size_t n = s.dispatch(now, 256, [&](unsigned int tag, const unsigned char* p, size_t len, const pkt_additional_data& d)
+			{
+				if ((tag >= PRODUCERS) || (d.nic_alias != next[tag]) || (len != 40 + d.nic_alias % 24))
+					wrong++;
+				else
+					next[tag]++;
+			});
+
+			if (n == 0)
+				boost::this_thread::yield();
+
+			total += n;
+			now += SHAPER_WHEEL_TICK;
+		}
+
+		threads.join_all();
+
+		TEST_CASE_CHECK(size_t(0), wrong);
+		TEST_CASE_CHECK(uint64_t(PRODUCERS * COUNT), s.get_sent_packets(root));
+		TEST_CASE_CHECK(size_t(0), s.dispatch(now, 256, [](unsigned int, const unsigned char*, size_t, const pkt_additional_data&) { }));
+		TEST_CASE_CHECK(SHAPER_IDLE, s.get_next_due());
+	}
+
+	return;
+}
+
+void pkt_shaper::benchmark()
+{
+	// Small packets of many users in filters limited over the offered load
+	static const unsigned int filters = 16;
+	static const unsigned int users = 8;
+	static const size_t batch = 256;
+	static const int rounds = 20000;
+
+	pkt_shaper s;
+	uint32_t root = s.add_class(SHAPER_NO_CLASS, 0, 0, 0);
+	std::vector<uint32_t> leaves;
+	for (unsigned int f = 0; f < filters; f++)
+	{
+		uint32_t filter = s.add_class(root, f, 1000000000ULL, 1000000);
+		for (unsigned int u = 0; u < users; u++)
+			leaves.push_back(s.add_class(filter, f, 0, 0, 64, 1514));
+	}
+	s.prepare();
+
+	unsigned char pkt[64];
+	memset(pkt, 0, sizeof(pkt));
+
+	uint64_t now = 1000000000ULL;
+	size_t sent = 0;
+	std::chrono::steady_clock::time_point t0 = std::chrono::steady_clock::now();
+
+	for (int r = 0; r < rounds; r++)
+	{
+		for (size_t i = 0; i < batch; i++)
+			s.put_packet(leaves[(r * batch + i * 7) % leaves.size()], pkt, sizeof(pkt), NULL);
+
+		sent += s.dispatch(now, batch, [](unsigned int, const unsigned char*, size_t, const pkt_additional_data&) { });
+		now += 1000;
+	}
+
+	double elapsed = std::chrono::duration<double, std::micro>(std::chrono::steady_clock::now() - t0).count();
+	std::cout << this_class_name << ": " << (elapsed * 1000.0 / sent) << " ns/packet, " << (sent / elapsed) << " Mpps, "
+		<< sent << " packets" << std::endl;
+}
+#endif
+
+}
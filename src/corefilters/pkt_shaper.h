@@ -0,0 +1,154 @@
+#ifndef _UTM_PKT_SHAPER_H
+#define _UTM_PKT_SHAPER_H
+
+#pragma once
+#include <utm.h>
+
+#include <pkt_ring.h>
+
+#include <atomic>
+#include <deque>
+#include <memory>
+#include <vector>
+
+#include <boost/thread/mutex.hpp>
+
+#define SHAPER_NO_CLASS 0xFFFFFFFF
+#define SHAPER_IDLE 0xFFFFFFFFFFFFFFFFULL
+#define SHAPER_WHEEL_SIZE 1024		// power of two
+#define SHAPER_WHEEL_TICK 16384		// nanoseconds, power of two
+#define SHAPER_QUANTUM 1514			// bytes a class sends in its round robin turn
+
+namespace utm {
+
+//
+// Hierarchical token bucket shaper. Classes make a tree (filterset, filter, user or flow),
+// packets are queued in the leaf classes and leave when every class up to the root allows.
+//
+// A bucket is kept as the earliest departure time of its next packet: the time the bucket
+// has sent all its bytes at its rate, less the burst. Classes which have to wait are put on
+// a timing wheel by their departure time, leaves blocked by a parent wait in the parent and
+// go on in the same order. Leaves share their parents by deficit round robin in bytes.
+//
+// The tree is built and prepare() is called before packets come. The queue of a leaf is allocated
+// by its first packet. Packets are put from any thread without locks, dispatch() and set_rate()
+// are called from one thread.
+//
+class pkt_shaper
+{
+	struct shaper_class
+	{
+		shaper_class() : tag(0), parent(SHAPER_NO_CLASS), rate(0), burst_ns(0), tat(0), due(0), deficit(0),
+			sent_packets(0), sent_bytes(0), maxpackets(0), queue_bytes(0), has_queue(false), active(false) { };
+
+		unsigned int tag;
+		uint32_t parent;
+		uint64_t rate;				// bytes per second, zero is not limited
+		uint64_t burst_ns;
+		uint64_t tat;				// the time the bucket has sent all bytes at its rate
+		uint64_t due;				// of the valid timer, zero if there is none
+		int64_t deficit;
+		std::deque<uint32_t> waiting;	// leaves blocked by this class
+		uint64_t sent_packets;
+		uint64_t sent_bytes;
+
+		uint32_t maxpackets;		// of the leaf queue, zero for an inner class
+		size_t queue_bytes;
+		std::atomic<bool> has_queue;
+		std::atomic<bool> active;	// the leaf is in the dispatch lists
+		pkt_ring queue;
+	};
+
+	struct shaper_timer
+	{
+		uint32_t index;
+		uint64_t due;
+	};
+
+public:
+	static const char this_class_name[];
+
+	pkt_shaper();
+	~pkt_shaper();
+
+	// Returns the index of the class. A leaf class has the queue of maxpackets.
+	uint32_t add_class(uint32_t parent, unsigned int tag, uint64_t rate, size_t burst, uint32_t maxpackets = 0, size_t packetbuf_size = 0);
+	void set_rate(uint32_t index, uint64_t rate, size_t burst);
+
+	// Called once after the tree is built, packets are not taken before
+	void prepare();
+
+	size_t get_class_count() const { return classes.size(); };
+	unsigned int get_tag(uint32_t index) const { return classes[index]->tag; };
+
+	// Producer side, any thread
+	bool put_packet(uint32_t index, const unsigned char* pkt, size_t len, const pkt_additional_data* ppkt_data);
+	unsigned char* reserve_packet(uint32_t index, size_t len, pkt_ring_slot& slot);
+	void commit_packet(uint32_t index, const pkt_ring_slot& slot, size_t len, const pkt_additional_data* ppkt_data);
+
+	// Sends up to maxcount packets due by now (nanoseconds), calls f(tag, pkt, len, pkt_data) for each
+	template<class F>
+	size_t dispatch(uint64_t now, size_t maxcount, F f)
+	{
+		start_dispatch(now);
+
+		size_t n = 0;
+		while (n < maxcount)
+		{
+			const unsigned char* pkt = NULL;
+			size_t len = 0;
+			const pkt_additional_data* ppkt_data = NULL;
+
+			uint32_t index = get_next(now, pkt, len, ppkt_data);
+			if (index == SHAPER_NO_CLASS)
+				break;
+
+			f(classes[index]->tag, pkt, len, *ppkt_data);
+			sent(index, now, len);
+			n++;
+		}
+
+		return n;
+	}
+
+	// Time of the next dispatch, zero if packets are ready now, SHAPER_IDLE if no packet waits
+	uint64_t get_next_due() const;
+
+	void get_stat(uint32_t index, pkt_ring_stat& st) const;
+	uint64_t get_sent_bytes(uint32_t index) const { return classes[index]->sent_bytes; };
+	uint64_t get_sent_packets(uint32_t index) const { return classes[index]->sent_packets; };
+
+private:
+	pkt_shaper(const pkt_shaper&);
+	pkt_shaper& operator=(const pkt_shaper&);
+
+	pkt_ring* get_queue(uint32_t index);
+	void activate(uint32_t index);
+	void deactivate(uint32_t index);
+
+	void start_dispatch(uint64_t now);
+	uint32_t get_next(uint64_t now, const unsigned char*& pkt, size_t& len, const pkt_additional_data*& ppkt_data);
+	void sent(uint32_t index, uint64_t now, size_t len);
+
+	uint64_t get_departure(uint32_t index, uint32_t& blocker) const;
+	void set_timer(uint32_t index, uint64_t due);
+	void expire(uint64_t now);
+
+	std::vector<std::unique_ptr<shaper_class> > classes;
+	pkt_ring activations;		// indexes of leaves which got packets
+	boost::mutex queue_guard;	// allocation of the leaf queues
+
+	std::deque<uint32_t> ready;
+	std::vector<std::vector<shaper_timer> > wheel;
+	uint64_t wheel_tick;
+
+#ifdef UTM_DEBUG
+public:
+	static void test_all();
+	static void benchmark();
+#endif
+};
+
+}
+
+#endif // _UTM_PKT_SHAPER_H
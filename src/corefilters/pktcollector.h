@@ -7,9 +7,12 @@
 #define MAX_UNPRIVELEGED_PORT 65535
 #define MAX_PACKETS 100000
 #define COLLECTOR_FLUSH_TIMEOUT 600
+#define COLLECTOR_SHARDS 16
 
-#include <map>
 #include <list>
+#include <vector>
+#include <cstdint>
+#include <atomic>
 #include <boost/thread/mutex.hpp>
 
 #include <pktcollector_key.h>
@@ -17,183 +20,409 @@
 #include <pktcollector_value_ex.h>
 #include <ip_header.h>
 
+#include "flow_table.h"
+#include "flow_wheel.h"
+
 namespace utm {
 
+// Builds the flow key of the packet seen in the direction, returns true for the TCP SYN packet.
+// Without raw data the unprivileged port is folded, so all connections to a service make one flow.
+inline bool pktcollector_make_key(const ip_header& iphdr, int direction, const unsigned char* rawdata, pktcollector_key& key)
+{
+	unsigned short src_port = iphdr.src_port;
+	unsigned short dst_port = iphdr.dst_port;
+	bool has_syn = ((iphdr.proto == 6) && ((iphdr.flags & 0x0012) == 0x0002));
+
+	if (rawdata == NULL)
+	{
+		if ((iphdr.proto == 6) || (iphdr.proto == 17))
+		{
+			if ((src_port <= MAX_PRIVELEGED_PORT) && (dst_port > MAX_PRIVELEGED_PORT))
+			{
+				dst_port = MAX_UNPRIVELEGED_PORT;
+			}
+			else if ((src_port > MAX_PRIVELEGED_PORT) && (dst_port <= MAX_PRIVELEGED_PORT))
+			{
+				src_port = MAX_UNPRIVELEGED_PORT;
+			}
+		}
+
+		if (has_syn)
+		{
+			if (direction == 0)
+			{
+				src_port = MAX_UNPRIVELEGED_PORT;
+			}
+			else
+			{
+				dst_port = MAX_UNPRIVELEGED_PORT;
+			}
+		}
+	}
+
+	key.proto = iphdr.proto;
+	key.src_port = (direction == 0) ? src_port : dst_port;
+	key.dst_port = (direction == 0) ? dst_port : src_port;
+	key.src_addr = (direction == 0) ? iphdr.src_ip_addr.m_addr : iphdr.dst_ip_addr.m_addr;
+	key.dst_addr = (direction == 0) ? iphdr.dst_ip_addr.m_addr : iphdr.src_ip_addr.m_addr;
+
+	return has_syn;
+}
+
+//
+// Flow keys of a packet in both directions with their hashes. It is built once per packet
+// for all filters which collect the packet.
+//
+struct pktcollector_packet
+{
+	pktcollector_packet(const ip_header& _iphdr, const unsigned char* _rawdata, size_t _rawdata_len) : iphdr(_iphdr), rawdata(_rawdata), rawdata_len(_rawdata_len)
+	{
+		has_syn = pktcollector_make_key(iphdr, 0, rawdata, key[0]);
+		pktcollector_make_key(iphdr, 1, rawdata, key[1]);
+		hash[0] = key[0].hash();
+		hash[1] = key[1].hash();
+	}
+
+	const ip_header& iphdr;
+	const unsigned char* rawdata;
+	size_t rawdata_len;
+
+	pktcollector_key key[2];
+	unsigned int hash[2];
+	bool has_syn;
+
+private:
+	pktcollector_packet& operator=(const pktcollector_packet&);
+};
+
+//
+// Flows are spread over COLLECTOR_SHARDS hash tables by the key hash, each table has its own
+// mutex. Capture threads lock only the shard of the packet flow.
+//
+// Every flow has a timer on the timing wheel of its shard. Timers are not moved when a flow
+// is updated, the flow is rescheduled when its old timer comes up. Updated flows are also kept
+// in the dirty list, so flush() touches only the updated flows and the due timers.
+// When the memory budget is used up, a new flow evicts the least recently updated flow
+// of its shard; the counters of the evicted flow are returned by the next flush().
+// Captured HTTP headers are kept in the header arena of the shard, flushed records refer
+// to them; the data stays valid until the next flush().
+//
 template<class T>
 class pktcollector
 {
-	typedef std::map<pktcollector_key, T> pcdata_container;
+	struct flow
+	{
+		flow() : due(0), dirty(false) { };
+
+		T value;
+		unsigned int due;		// expiry time of the valid timer
+		bool dirty;				// updated after the last flush
+	};
+
+	typedef flow_table<pktcollector_key, flow> pcdata_container;
 	typedef std::pair<pktcollector_key, T> flush_record;
 	typedef std::list<flush_record> flush_container;
+	typedef std::pair<pktcollector_key, unsigned int> flow_ref;
+
+	struct shard
+	{
+		void assign(const shard& rhs)
+		{
+			data = rhs.data;
+			wheel = rhs.wheel;
+			dirty = rhs.dirty;
+			evicted_records = rhs.evicted_records;
+			arena = rhs.arena;
+		}
+
+		pcdata_container data;
+		flow_wheel<pktcollector_key> wheel;
+		header_arena arena;
+		std::vector<flow_ref> dirty;
+		flush_container evicted_records;
+		mutable boost::mutex guard;
+	};
 
 public:
-	pktcollector() { };
-	pktcollector(const pktcollector& rhs) 
+	pktcollector() : count(0), max_flows(MAX_PACKETS), dropped(0), evicted(0), expired(0), hosts(NULL) { };
+	pktcollector(const pktcollector& rhs) : count(0), max_flows(MAX_PACKETS), dropped(0), evicted(0), expired(0), hosts(NULL)
 	{ 
-		data = rhs.data;
+		copy(rhs);
 	};
 	
 	~pktcollector() { };
 
 	pktcollector& operator=(const pktcollector& rhs) 
 	{ 
-		data = rhs.data;
+		if (this != &rhs)
+			copy(rhs);
+
 		return *this;
 	};
 
 	size_t size() const
 	{
-		boost::mutex::scoped_lock lock(guard);
-		return data.size();
+		return count.load();
+	}
+
+	// Approximate memory taken by one flow: table slot at the maximum load, timer and dirty list entry
+	static size_t get_flow_cost()
+	{
+		return (sizeof(pktcollector_key) + sizeof(flow) + 2 * sizeof(unsigned int)) * 8 / 7 + sizeof(flow_timer<pktcollector_key>) + sizeof(flow_ref);
+	}
+
+	void set_memory_budget(size_t bytes)
+	{
+		max_flows = bytes / get_flow_cost();
 	}
 
-	void put_packet(const ip_header& iphdr, int direction, unsigned int now, const unsigned char* rawdata, size_t rawdata_len)
+	size_t get_memory_budget() const
 	{
-		boost::mutex::scoped_lock lock(guard);
-		put_packet_action(iphdr, direction, now, rawdata, rawdata_len);
+		return max_flows.load() * get_flow_cost();
+	}
+
+	// Host names of the captured requests are looked up once per flow, the matcher must not
+	// change while packets are put
+	void set_host_matcher(const host_matcher* hm)
+	{
+		hosts = hm;
+	}
+
+	// New flows which are not collected, as no flow of their shard could be evicted
+	std::uint64_t get_dropped() const { return dropped.load(); };
+
+	// Flows removed to keep the memory budget
+	std::uint64_t get_evicted() const { return evicted.load(); };
+
+	// Flows removed after COLLECTOR_FLUSH_TIMEOUT
+	std::uint64_t get_expired() const { return expired.load(); };
+
+	// With raw data returns the host id of the flow given by the host matcher, zero if the host
+	// name is not seen yet
+	unsigned int put_packet(const ip_header& iphdr, int direction, unsigned int now, const unsigned char* rawdata, size_t rawdata_len)
+	{
+		pktcollector_key key;
+		bool has_syn = pktcollector_make_key(iphdr, direction, rawdata, key);
+		unsigned int hash = key.hash();
+
+		shard& sh = shards[get_shard(hash)];
+		boost::mutex::scoped_lock lock(sh.guard);
+		return put_packet_action(sh, key, hash, has_syn, iphdr, direction, now, rawdata, rawdata_len);
 	}
 
 	void flush(flush_container& fc, unsigned int now)
 	{
-		boost::mutex::scoped_lock lock(guard);
-		flush_action(fc, now);
+		for (int i = 0; i < COLLECTOR_SHARDS; i++)
+		{
+			boost::mutex::scoped_lock lock(shards[i].guard);
+			flush_action(shards[i], fc, now);
+		}
+	}
+
+protected:
+	const header_arena& get_arena(const pktcollector_key& key) const
+	{
+		return shards[get_shard(key.hash())].arena;
 	}
 
 private:
-	void flush_action(flush_container& fc, unsigned int now)
+	static int get_shard(unsigned int hash)
 	{
-		if (now < COLLECTOR_FLUSH_TIMEOUT)
+		// Slots are taken by the low bits of the hash, so the shard is taken by the high ones
+		return static_cast<int>(hash >> 28) % COLLECTOR_SHARDS;
+	}
+
+	static unsigned int get_due(const T& v)
+	{
+		const pktcollector_value *pkv = reinterpret_cast<const pktcollector_value *>(&v);
+		return static_cast<unsigned int>(pkv->last_update) + COLLECTOR_FLUSH_TIMEOUT;
+	}
+
+	void copy(const pktcollector& rhs)
+	{
+		max_flows = rhs.max_flows.load();
+		hosts = rhs.hosts;
+
+		for (int i = 0; i < COLLECTOR_SHARDS; i++)
 		{
-			now = 0;
+			shard tmp;
+			{
+				boost::mutex::scoped_lock lock(rhs.shards[i].guard);
+				tmp.assign(rhs.shards[i]);
+			}
+
+			boost::mutex::scoped_lock lock(shards[i].guard);
+			count -= shards[i].data.size();
+			count += tmp.data.size();
+			shards[i].assign(tmp);
 		}
-		else
+	}
+
+	void erase_flow(shard& sh, const pktcollector_key& key, unsigned int hash, flow& f)
+	{
+		pktcollector_value *pkv = reinterpret_cast<pktcollector_value *>(&f.value);
+		if ((pkv->flags & HTTP_FLAG) == HTTP_FLAG)
+			sh.arena.retire(reinterpret_cast<pktcollector_value_ex *>(pkv)->raw);
+
+		if (sh.data.erase(key, hash))
+			count--;
+	}
+
+	// Checks the flow of the timer, the flow is rescheduled if it was updated after the timer was set
+	static int check_timer(shard& sh, const pktcollector_key& key, unsigned int hash, unsigned int due, unsigned int& new_due, flow*& f)
+	{
+		f = sh.data.find(key, hash);
+		if ((f == NULL) || (f->due != due))
+			return FLOWWHEEL_STALE;
+
+		new_due = get_due(f->value);
+		if (new_due != due)
 		{
-			now = now - COLLECTOR_FLUSH_TIMEOUT;
+			f->due = new_due;
+			return FLOWWHEEL_MOVED;
 		}
 
-		bool is_http_connection_closed;
-		pktcollector_value *pkv;
+		return FLOWWHEEL_DUE;
+	}
+
+	// Removes the least recently updated flow of the shard
+	bool evict_flow(shard& sh)
+	{
+		if (sh.data.empty())
+			return false;
+
+		return sh.wheel.evict([this, &sh](const pktcollector_key& key, unsigned int hash, unsigned int due, unsigned int& new_due) -> int
+		{
+			flow* f;
+			int res = check_timer(sh, key, hash, due, new_due, f);
+			if (res != FLOWWHEEL_DUE)
+				return res;
+
+			pktcollector_value *pkv = reinterpret_cast<pktcollector_value *>(&f->value);
+			if ((pkv->sent_flush > 0) || (pkv->recv_flush > 0))
+				sh.evicted_records.push_back(std::make_pair(key, f->value));
 
-		for (auto iter = data.begin(); iter != data.end();)
+			erase_flow(sh, key, hash, *f);
+			evicted++;
+
+			return res;
+		});
+	}
+
+	void flush_action(shard& sh, flush_container& fc, unsigned int now)
+	{
+		// Records returned by the previous flush are not used any more
+		sh.arena.recycle();
+
+		fc.splice(fc.end(), sh.evicted_records);
+
+		// Updated flows
+
+		for (size_t i = 0; i < sh.dirty.size(); i++)
 		{
-			T& v = iter->second;
-			pkv = reinterpret_cast<pktcollector_value *>(&v);
-			is_http_connection_closed = ((pkv->flags & TCP_FLAG_FIN) == TCP_FLAG_FIN);
+			const flow_ref& ref = sh.dirty[i];
+
+			flow* f = sh.data.find(ref.first, ref.second);
+			if ((f == NULL) || !f->dirty)
+				continue;
+
+			f->dirty = false;
+
+			pktcollector_value *pkv = reinterpret_cast<pktcollector_value *>(&f->value);
+			bool is_http_connection_closed = ((pkv->flags & TCP_FLAG_FIN) == TCP_FLAG_FIN);
 
 			if (((pkv->flags == 0) && ((pkv->recv_flush > 0) || (pkv->sent_flush > 0))) ||
 				(is_http_connection_closed))
 			{
-				fc.push_back(std::make_pair(iter->first, v));
+				fc.push_back(std::make_pair(ref.first, f->value));
 				pkv->sent_flush = 0;
 				pkv->recv_flush = 0;
 			}
 
-			if ((pkv->last_update < now) || is_http_connection_closed)
+			if (is_http_connection_closed)
+				erase_flow(sh, ref.first, ref.second, *f);
+		}
+
+		sh.dirty.clear();
+
+		// Flows which are idle for COLLECTOR_FLUSH_TIMEOUT
+
+		sh.wheel.expire(now, [this, &sh](const pktcollector_key& key, unsigned int hash, unsigned int due, unsigned int& new_due) -> int
+		{
+			flow* f;
+			int res = check_timer(sh, key, hash, due, new_due, f);
+			if (res == FLOWWHEEL_DUE)
 			{
-				iter = data.erase(iter);
-				continue;
+				erase_flow(sh, key, hash, *f);
+				expired++;
 			}
-			++iter;
-		}
+
+			return res;
+		});
 	}
 
-	void put_packet_action(const ip_header& iphdr, int direction, unsigned int now, const unsigned char* rawdata, size_t rawdata_len)
+	unsigned int put_packet_action(shard& sh, const pktcollector_key& key, unsigned int hash, bool has_syn, const ip_header& iphdr, int direction, unsigned int now, const unsigned char* rawdata, size_t rawdata_len)
 	{
-		unsigned short src_port = iphdr.src_port;
-		unsigned short dst_port = iphdr.dst_port;
-		bool has_syn = ((iphdr.proto == 6) && ((iphdr.flags & 0x0012) == 0x0002));
+		unsigned int host_id = 0;
 
-		if (rawdata == NULL)
+		flow* f = sh.data.find(key, hash);
+		if (f == NULL)
 		{
-			if ((iphdr.proto == 6) || (iphdr.proto == 17))
-			{
-				if ((src_port <= MAX_PRIVELEGED_PORT) && (dst_port > MAX_PRIVELEGED_PORT))
-				{
-					dst_port = MAX_UNPRIVELEGED_PORT;
-				}
-				else if ((src_port > MAX_PRIVELEGED_PORT) && (dst_port <= MAX_PRIVELEGED_PORT))
-				{
-					src_port = MAX_UNPRIVELEGED_PORT;
-				}
-			}
+			if ((rawdata != NULL) && !has_syn)
+				return host_id;
 
-			if (has_syn)
+			if ((count.load() >= max_flows.load()) && !evict_flow(sh))
 			{
-				if (direction == 0)
-				{
-					src_port = MAX_UNPRIVELEGED_PORT;
-				}
-				else
-				{
-					dst_port = MAX_UNPRIVELEGED_PORT;
-				}
+				dropped++;
+				return host_id;
 			}
+
+			f = sh.data.insert(key, hash, flow());
+			count++;
+
+			f->due = now + COLLECTOR_FLUSH_TIMEOUT;
+			sh.wheel.set_timer(key, hash, f->due);
 		}
 
-		pktcollector_key key;
-		key.proto = iphdr.proto;
-		key.src_port = (direction == 0) ? src_port : dst_port;
-		key.dst_port = (direction == 0) ? dst_port : src_port;
-		key.src_addr = (direction == 0) ? iphdr.src_ip_addr.m_addr : iphdr.dst_ip_addr.m_addr;
-		key.dst_addr = (direction == 0) ? iphdr.dst_ip_addr.m_addr : iphdr.src_ip_addr.m_addr;
-
-		auto iter = data.find(key);
-		if (iter == data.end())
+		pktcollector_value *pkv = reinterpret_cast<pktcollector_value *>(&f->value);
+
+		pkv->last_update = now;
+		if (direction == 0)
 		{
-			if ((data.size() < MAX_PACKETS) && ((rawdata == NULL) || (has_syn && (rawdata != NULL))))
-			{
-				T vv;
-				pktcollector_value *pkv = reinterpret_cast<pktcollector_value *>(&vv);
-
-				pkv->last_update = now;
-				if (direction == 0)
-				{
-					pkv->sent_fixed += iphdr.length;
-					pkv->sent_flush += iphdr.length;
-				}
-				else
-				{
-					pkv->recv_fixed += iphdr.length;
-					pkv->recv_flush += iphdr.length;
-				}
-
-				if (rawdata != NULL)
-				{
-					pktcollector_value_ex *pkvex = reinterpret_cast<pktcollector_value_ex *>(pkv);
-					pkvex->process_raw_data(iphdr, direction, now, rawdata, rawdata_len);
-				}
-				data.insert(std::make_pair(key, vv));
-			}
+			pkv->sent_fixed += iphdr.length;
+			pkv->sent_flush += iphdr.length;
 		}
 		else
 		{
-			T& vv = iter->second;
-			pktcollector_value *pkv = reinterpret_cast<pktcollector_value *>(&vv);
+			pkv->recv_fixed += iphdr.length;
+			pkv->recv_flush += iphdr.length;
+		}
 
-			pkv->last_update = now;
-			if (direction == 0)
-			{
-				pkv->sent_fixed += iphdr.length;
-				pkv->sent_flush += iphdr.length;
-			}
-			else
-			{
-				pkv->recv_fixed += iphdr.length;
-				pkv->recv_flush += iphdr.length;
-			}
+		if (rawdata != NULL)
+		{
+			pktcollector_value_ex *pkvex = reinterpret_cast<pktcollector_value_ex *>(pkv);
+			pkvex->process_raw_data(sh.arena, hosts, iphdr, direction, now, rawdata, rawdata_len);
+			host_id = pkvex->host_id;
+		}
 
-			if (rawdata != NULL)
-			{
-				pktcollector_value_ex *pkvex = reinterpret_cast<pktcollector_value_ex *>(pkv);
-				pkvex->process_raw_data(iphdr, direction, now, rawdata, rawdata_len);
-			}
+		if (!f->dirty)
+		{
+			f->dirty = true;
+			sh.dirty.push_back(flow_ref(key, hash));
 		}
+
+		return host_id;
 	}
 
-	pcdata_container data;
-	mutable boost::mutex guard;
+	shard shards[COLLECTOR_SHARDS];
+	std::atomic<size_t> count;
+	std::atomic<size_t> max_flows;
+	std::atomic<std::uint64_t> dropped;
+	std::atomic<std::uint64_t> evicted;
+	std::atomic<std::uint64_t> expired;
+	const host_matcher* hosts;
 };
 
 }
 
-#endif // _PKTCOLLECTOR_H 
\ No newline at end of file
+#endif // _PKTCOLLECTOR_H
\ No newline at end of file
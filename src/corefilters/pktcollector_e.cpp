@@ -79,6 +79,63 @@ void pktcollector_e::test_all()
 	pce.put_packet(ih0, 0, 200, NULL, 0);
 	TEST_CASE_CHECK(size_t(2), pce.size());
 
+	// Many flows over all shards, the old half expires (the flow of ih1 is refreshed)
+
+	pktcollector_e pce2;
+
+	for (unsigned int i = 0; i < 5000; i++)
+	{
+		ih0.src_ip_addr.m_addr = a1.m_addr + i;
+		pce2.put_packet(ih0, 0, (i % 2) ? 1000 : 10, NULL, 0);
+		pce2.put_packet(ih1, 1, (i % 2) ? 1000 : 10, NULL, 0);
+	}
+
+	TEST_CASE_CHECK(size_t(5000), pce2.size());
+
+	std::list<std::pair<pktcollector_key, pktcollector_value>> fc2;
+	pce2.flush(fc2, 1000);
+	TEST_CASE_CHECK(size_t(5000), fc2.size());
+	TEST_CASE_CHECK(size_t(2501), pce2.size());
+
+	fc2.clear();
+	pce2.flush(fc2, 1000);
+	TEST_CASE_CHECK(size_t(0), fc2.size());
+
+	ih0.src_ip_addr.m_addr = a1.m_addr + 1;
+	pce2.put_packet(ih0, 0, 1001, NULL, 0);
+	TEST_CASE_CHECK(size_t(2501), pce2.size());
+
+	pce2.flush(fc2, 1001);
+	TEST_CASE_CHECK(size_t(1), fc2.size());
+	TEST_CASE_CHECK(std::uint64_t(2400), fc2.front().second.sent_fixed);
+
+	pktcollector_e pce3(pce2);
+	TEST_CASE_CHECK(size_t(2501), pce3.size());
+	TEST_CASE_CHECK(std::uint64_t(2499), pce2.get_expired());
+
+	// The least recently updated flows are evicted over the memory budget
+
+	pktcollector_e pce4;
+	pce4.set_memory_budget(100 * pktcollector_e::get_flow_cost());
+
+	for (unsigned int i = 0; i < 150; i++)
+	{
+		ih0.src_ip_addr.m_addr = a1.m_addr + i;
+		pce4.put_packet(ih0, 0, 100 + i, NULL, 0);
+	}
+
+	TEST_CASE_CHECK(size_t(100), pce4.size());
+	TEST_CASE_CHECK(std::uint64_t(50), pce4.get_evicted());
+	TEST_CASE_CHECK(std::uint64_t(0), pce4.get_dropped());
+
+	std::list<std::pair<pktcollector_key, pktcollector_value>> fc4;
+	pce4.flush(fc4, 300);
+	TEST_CASE_CHECK(size_t(150), fc4.size());
+
+	pce4.flush(fc4, 1000);
+	TEST_CASE_CHECK(size_t(0), pce4.size());
+	TEST_CASE_CHECK(std::uint64_t(100), pce4.get_expired());
+
 	return;
 }
 #endif
@@ -16,11 +16,185 @@ pktcollector_ex::~pktcollector_ex()
 {
 }
 
+void pktcollector_ex::add_seen_hosts(const flush_container_ex& fc, hosttable& ht, dns_resolver& resolver) const
+{
+	for (flush_container_ex::const_iterator iter = fc.begin(); iter != fc.end(); ++iter)
+	{
+		const pktcollector_value_ex& v = iter->second;
+		if (v.host_id == 0)
+			continue;
+
+		// The request goes from the client to the server
+		bool is_sent = (v.flags & FIRST_PACKET_DIRECTION_BIT) == 0;
+		addrip_v4 server(is_sent ? iter->first.dst_addr : iter->first.src_addr);
+
+		std::string name(get_hostname(*iter), v.get_hostname_length());
+		ht.confirm_seen_addr(v.host_id, name.c_str(), server, resolver);
+	}
+
+	ht.publish_seen_addrs();
+}
+
 #ifdef UTM_DEBUG
 void pktcollector_ex::test_all()
 {
 	test_report tr(this_class_name);
 
+	addrip_v4 a1("192.168.1.2");
+	addrip_v4 a2("201.202.203.204");
+
+	ip_header ih0;
+	ih0.src_ip_addr = a1;
+	ih0.dst_ip_addr = a2;
+	ih0.src_port = 65000;
+	ih0.dst_port = 80;
+	ih0.proto = 6;
+	ih0.ip_hl = 5;
+	ih0.version = 4;
+	ih0.length = 60;
+	ih0.flags = 0x0002;
+
+	ip_header ih1 = ih0;
+	ih1.src_ip_addr = a2;
+	ih1.dst_ip_addr = a1;
+	ih1.src_port = 80;
+	ih1.dst_port = 65000;
+	ih1.flags = 0x0012;
+
+	const char req1[] = "GET /index.html HTTP/1.1\r\nHost: www.example.com\r\n";
+	const char req2[] = "Accept: */*\r\n\r\n";
+	std::string req(req1);
+	req.append(req2);
+
+	const unsigned char* none = reinterpret_cast<const unsigned char*>("");
+
+	pktcollector_ex pcx;
+
+	// Handshake, the request in two packets and FIN
+	pcx.put_packet(ih0, 0, 10, none, 0);
+	pcx.put_packet(ih1, 1, 10, none, 0);
+	ih0.flags = 0x0010;
+	pcx.put_packet(ih0, 0, 10, none, 0);
+	pcx.put_packet(ih0, 0, 11, reinterpret_cast<const unsigned char*>(req1), sizeof(req1) - 1);
+	pcx.put_packet(ih0, 0, 11, reinterpret_cast<const unsigned char*>(req2), sizeof(req2) - 1);
+	TEST_CASE_CHECK(size_t(1), pcx.size());
+
+	ih1.flags = 0x0011;
+	pcx.put_packet(ih1, 1, 12, none, 0);
+
+	flush_container_ex fc;
+	pcx.flush(fc, 20);
+	TEST_CASE_CHECK(size_t(1), fc.size());
+	TEST_CASE_CHECK(size_t(0), pcx.size());
+
+	const flush_record_ex& rec = fc.front();
+	TEST_CASE_CHECK((unsigned int)IS_HTTP_REQUEST_FINISH, rec.second.flags & IS_HTTP_REQUEST_FINISH);
+	TEST_CASE_CHECK(req, std::string(pcx.get_raw(rec), rec.second.get_raw_length()));
+	TEST_CASE_CHECK(std::string("www.example.com"), std::string(pcx.get_hostname(rec), rec.second.get_hostname_length()));
+	TEST_CASE_CHECK(std::string("GET"), std::string(rec.second.get_methodname()));
+
+	// TLS ClientHello in two packets, the server name gives the host of the flow
+
+	const unsigned char hello_head[] = { 0x16, 0x03, 0x01, 0x00, 0x47, 0x01, 0x00, 0x00, 0x43, 0x03, 0x03 };
+	const unsigned char hello_tail[] = { 0x00, 0x00, 0x02, 0x13, 0x01, 0x01, 0x00, 0x00, 0x18, 0x00, 0x00, 0x00, 0x14, 0x00, 0x12, 0x00, 0x00, 0x0F };
+
+	auto make_hello = [&hello_head, &hello_tail](const char* name, std::vector<unsigned char>& hello)
+	{
+		// The lengths of hello_head and hello_tail are given for a name of 15 characters
+		size_t len = strlen(name);
+		hello.assign(hello_head, hello_head + sizeof(hello_head));
+		hello.resize(hello.size() + 32, 0x11);
+		hello.insert(hello.end(), hello_tail, hello_tail + sizeof(hello_tail));
+		hello.insert(hello.end(), name, name + len);
+
+		const size_t pos[6] = { 4, 8, 43 + 8, 43 + 12, 43 + 14, 43 + 17 };
+		for (int i = 0; i < 6; i++)
+			hello[pos[i]] = static_cast<unsigned char>(hello[pos[i]] + len - 15);
+	};
+
+	// Handshake, the hello in two packets and FIN, returns the host id of the flow
+	auto put_flow = [&ih0, &ih1, none](pktcollector_ex& pc, unsigned short client_port, const addrip_v4& server, const std::vector<unsigned char>& hello) -> unsigned int
+	{
+		ip_header c = ih0;
+		c.dst_ip_addr = server;
+		c.src_port = client_port;
+		c.dst_port = 443;
+		c.flags = 0x0002;
+
+		ip_header sv = ih1;
+		sv.src_ip_addr = server;
+		sv.src_port = 443;
+		sv.dst_port = client_port;
+		sv.flags = 0x0012;
+
+		pc.put_packet(c, 0, 10, none, 0);
+		pc.put_packet(sv, 1, 10, none, 0);
+		c.flags = 0x0010;
+		pc.put_packet(c, 0, 10, none, 0);
+		pc.put_packet(c, 0, 11, &hello[0], 40);
+		unsigned int host_id = pc.put_packet(c, 0, 11, &hello[40], hello.size() - 40);
+		sv.flags = 0x0011;
+		pc.put_packet(sv, 1, 12, none, 0);
+
+		return host_id;
+	};
+
+	const char hello_name[] = "www.example.org";
+	std::vector<unsigned char> hello;
+	make_hello(hello_name, hello);
+
+	hosttable ht;
+	ht.add_host("mail.example.org");
+	ht.add_host("www.example.org");
+	ht.add_host("localhost");
+
+	pktcollector_ex pcx2;
+	pcx2.set_host_matcher(&ht.get_matcher());
+
+	TEST_CASE_CHECK(2U, put_flow(pcx2, 65000, a2, hello));
+
+	flush_container_ex fc2;
+	pcx2.flush(fc2, 20);
+	TEST_CASE_CHECK(size_t(1), fc2.size());
+
+	const flush_record_ex& rec2 = fc2.front();
+	TEST_CASE_CHECK((unsigned int)IS_TLS_REQUEST_FINISH, rec2.second.flags & IS_TLS_REQUEST_FINISH);
+	TEST_CASE_CHECK(std::string(hello_name), std::string(pcx2.get_hostname(rec2), rec2.second.get_hostname_length()));
+	TEST_CASE_CHECK(2U, rec2.second.host_id);
+
+	// The host rules match the server of the classified flow only
+	hostname hw;
+	hw.set_host(hello_name);
+	ht.bind_host(hw);
+	TEST_CASE_CHECK(true, ht.checkflow(hw, rec2.second.host_id, a2, a2));
+	TEST_CASE_CHECK(false, ht.checkflow(hw, rec2.second.host_id, a2, a1));
+	TEST_CASE_CHECK(false, ht.checkflow(hw, 1U, a2, a2));
+	TEST_CASE_CHECK(false, ht.checkaddr(hw, a2));
+
+	// The server of a flow is added to the host if the name resolves to it.
+	// The answer is taken from the resolver cache, so the servers are added at once.
+	addrip_v4 loopback("127.0.0.1");
+
+	dns_resolver resolver;
+	dns_result result;
+	resolver.resolve_host("localhost", result);
+	TEST_CASE_CHECK(size_t(1), result.addrs.count(loopback));
+
+	make_hello("localhost", hello);
+	TEST_CASE_CHECK(3U, put_flow(pcx2, 65001, a2, hello));
+	TEST_CASE_CHECK(3U, put_flow(pcx2, 65002, loopback, hello));
+
+	flush_container_ex fc3;
+	pcx2.flush(fc3, 30);
+	TEST_CASE_CHECK(size_t(2), fc3.size());
+
+	hostname hl;
+	hl.set_host("localhost");
+	pcx2.add_seen_hosts(fc3, ht, resolver);
+	TEST_CASE_CHECK(false, ht.checkaddr(hl, a2));
+	TEST_CASE_CHECK(true, ht.checkaddr(hl, loopback));
+
+	return;
 }
 #endif
 
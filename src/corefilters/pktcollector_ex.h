@@ -5,6 +5,7 @@
 
 #include "pktcollector.h"
 #include "pktcollector_value_ex.h"
+#include "hosttable.h"
 
 namespace utm {
 
@@ -20,6 +21,15 @@ public:
 	pktcollector_ex();
 	~pktcollector_ex();
 
+	// Captured request header of a flushed record, valid until the next flush()
+	const char* get_raw(const flush_record_ex& rec) const { return rec.second.get_raw(get_arena(rec.first)); };
+	const char* get_hostname(const flush_record_ex& rec) const { return rec.second.get_hostname(get_arena(rec.first)); };
+
+	// Adds the servers of the flushed flows classified by the host matcher of the host table,
+	// if the DNS confirms the server for the name of the flow. The confirmed servers are
+	// published at once, the ones answered later by the next call.
+	void add_seen_hosts(const flush_container_ex& fc, hosttable& ht, dns_resolver& resolver) const;
+
 #ifdef UTM_DEBUG
 public:
 	static void test_all();
@@ -2,6 +2,7 @@
 #include "pktcollector_key.h"
 
 #include <tuple>
+#include <cstdint>
 
 namespace utm {
 
@@ -50,4 +51,20 @@ bool pktcollector_key::operator==(const pktcollector_key& rhs) const
 	return true;
 }
 
+unsigned int pktcollector_key::hash() const
+{
+	// Multiply-xorshift mix of the addresses, then of the ports and the protocol
+	std::uint64_t h = (static_cast<std::uint64_t>(src_addr) << 32) | dst_addr;
+	h ^= ((static_cast<std::uint64_t>(src_port) << 16) | dst_port) * 0x9E3779B97F4A7C15ULL;
+	h ^= static_cast<std::uint64_t>(proto) << 56;
+
+	h ^= h >> 33;
+	h *= 0xFF51AFD7ED558CCDULL;
+	h ^= h >> 33;
+	h *= 0xC4CEB9FE1A85EC53ULL;
+	h ^= h >> 33;
+
+	return static_cast<unsigned int>(h);
+}
+
 }
\ No newline at end of file
@@ -20,6 +20,9 @@ public:
 
 	bool operator<(const pktcollector_key& rhs) const;
 	bool operator==(const pktcollector_key& rhs) const;
+
+	// Hash of the 5-tuple for flow_table
+	unsigned int hash() const;
 };
 
 }
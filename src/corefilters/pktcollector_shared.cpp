@@ -0,0 +1,442 @@
+#include "stdafx.h"
+#include "pktcollector_shared.h"
+#include "pktcollector_e.h"
+
+#include <ubase_test.h>
+
+namespace utm {
+
+const char pktcollector_shared::this_class_name[] = "pktcollector_shared";
+
+void pktcollector_shared::shard::assign(const shard& rhs)
+{
+	data = rhs.data;
+	wheel = rhs.wheel;
+	slots = rhs.slots;
+	free_slot = rhs.free_slot;
+	dirty = rhs.dirty;
+	evicted_records = rhs.evicted_records;
+}
+
+pktcollector_shared::pktcollector_shared() : count(0), slot_count(0), budget(MAX_PACKETS * (get_flow_cost() + get_slot_cost())), dropped(0), evicted(0), expired(0)
+{
+}
+
+pktcollector_shared::pktcollector_shared(const pktcollector_shared& rhs) : count(0), slot_count(0), budget(rhs.budget.load()), dropped(0), evicted(0), expired(0)
+{
+	copy(rhs);
+}
+
+pktcollector_shared::~pktcollector_shared()
+{
+}
+
+pktcollector_shared& pktcollector_shared::operator=(const pktcollector_shared& rhs)
+{
+	if (this != &rhs)
+	{
+		budget = rhs.budget.load();
+		copy(rhs);
+	}
+
+	return *this;
+}
+
+void pktcollector_shared::copy(const pktcollector_shared& rhs)
+{
+	for (int i = 0; i < COLLECTOR_SHARDS; i++)
+	{
+		shard tmp;
+		size_t tmp_slots;
+		{
+			boost::mutex::scoped_lock lock(rhs.shards[i].guard);
+			tmp.assign(rhs.shards[i]);
+		}
+
+		tmp_slots = tmp.slots.size();
+		for (unsigned int idx = tmp.free_slot; idx != COLLECTOR_NO_SLOT; idx = tmp.slots[idx].next)
+			tmp_slots--;
+
+		boost::mutex::scoped_lock lock(shards[i].guard);
+
+		size_t old_slots = shards[i].slots.size();
+		for (unsigned int idx = shards[i].free_slot; idx != COLLECTOR_NO_SLOT; idx = shards[i].slots[idx].next)
+			old_slots--;
+
+		count -= shards[i].data.size();
+		count += tmp.data.size();
+		slot_count -= old_slots;
+		slot_count += tmp_slots;
+		shards[i].assign(tmp);
+	}
+}
+
+size_t pktcollector_shared::get_flow_cost()
+{
+	// Table slot at the maximum load, timer and dirty list entry
+	return (sizeof(pktcollector_key) + sizeof(flow) + 2 * sizeof(unsigned int)) * 8 / 7 + sizeof(flow_timer<pktcollector_key>) + sizeof(flow_ref);
+}
+
+size_t pktcollector_shared::get_slot_cost()
+{
+	return sizeof(pktcollector_filter_slot);
+}
+
+int pktcollector_shared::get_shard(unsigned int hash)
+{
+	// Slots are taken by the low bits of the hash, so the shard is taken by the high ones
+	return static_cast<int>(hash >> 28) % COLLECTOR_SHARDS;
+}
+
+int pktcollector_shared::check_timer(shard& sh, const pktcollector_key& key, unsigned int hash, unsigned int due, unsigned int& new_due, flow*& f)
+{
+	f = sh.data.find(key, hash);
+	if ((f == NULL) || (f->due != due))
+		return FLOWWHEEL_STALE;
+
+	new_due = f->last_update + COLLECTOR_FLUSH_TIMEOUT;
+	if (new_due != due)
+	{
+		f->due = new_due;
+		return FLOWWHEEL_MOVED;
+	}
+
+	return FLOWWHEEL_DUE;
+}
+
+bool pktcollector_shared::is_budget_exceeded(size_t flows, size_t slots) const
+{
+	return (count.load() + flows) * get_flow_cost() + (slot_count.load() + slots) * get_slot_cost() > budget.load();
+}
+
+unsigned int pktcollector_shared::alloc_slot(shard& sh, unsigned int filter_id)
+{
+	unsigned int idx = sh.free_slot;
+
+	if (idx != COLLECTOR_NO_SLOT)
+	{
+		sh.free_slot = sh.slots[idx].next;
+		sh.slots[idx] = pktcollector_filter_slot();
+	}
+	else
+	{
+		idx = static_cast<unsigned int>(sh.slots.size());
+		sh.slots.push_back(pktcollector_filter_slot());
+	}
+
+	sh.slots[idx].filter_id = filter_id;
+	slot_count++;
+
+	return idx;
+}
+
+void pktcollector_shared::erase_flow(shard& sh, const pktcollector_key& key, unsigned int hash)
+{
+	flow* f = sh.data.find(key, hash);
+	if (f == NULL)
+		return;
+
+	unsigned int idx = f->first_slot;
+	while (idx != COLLECTOR_NO_SLOT)
+	{
+		unsigned int next = sh.slots[idx].next;
+		sh.slots[idx].next = sh.free_slot;
+		sh.free_slot = idx;
+		slot_count--;
+		idx = next;
+	}
+
+	sh.data.erase(key, hash);
+	count--;
+}
+
+void pktcollector_shared::put_records(shard& sh, const pktcollector_key& key, const flow& f, flush_container_shared& fc, bool clear_flush)
+{
+	for (unsigned int idx = f.first_slot; idx != COLLECTOR_NO_SLOT; idx = sh.slots[idx].next)
+	{
+		pktcollector_filter_slot& s = sh.slots[idx];
+
+		if ((s.sent_flush == 0) && (s.recv_flush == 0))
+			continue;
+
+		pktcollector_shared_record rec;
+		rec.filter_id = s.filter_id;
+		rec.key = key;
+		rec.value.sent_fixed = s.sent_fixed;
+		rec.value.recv_fixed = s.recv_fixed;
+		rec.value.sent_flush = s.sent_flush;
+		rec.value.recv_flush = s.recv_flush;
+		rec.value.last_update = f.last_update;
+		fc.push_back(rec);
+
+		if (clear_flush)
+		{
+			s.sent_flush = 0;
+			s.recv_flush = 0;
+		}
+	}
+}
+
+bool pktcollector_shared::evict_flow(shard& sh)
+{
+	if (sh.data.empty())
+		return false;
+
+	return sh.wheel.evict([this, &sh](const pktcollector_key& key, unsigned int hash, unsigned int due, unsigned int& new_due) -> int
+	{
+		flow* f;
+		int res = check_timer(sh, key, hash, due, new_due, f);
+		if (res != FLOWWHEEL_DUE)
+			return res;
+
+		put_records(sh, key, *f, sh.evicted_records, false);
+		erase_flow(sh, key, hash);
+		evicted++;
+
+		return res;
+	});
+}
+
+void pktcollector_shared::put_packet(const pktcollector_packet& pkt, unsigned int filter_id, int direction, unsigned int now)
+{
+	int d = (direction == 0) ? 0 : 1;
+	unsigned int hash = pkt.hash[d];
+
+	shard& sh = shards[get_shard(hash)];
+	boost::mutex::scoped_lock lock(sh.guard);
+	put_packet_action(sh, pkt.key[d], hash, filter_id, direction, pkt.iphdr.length, now);
+}
+
+void pktcollector_shared::put_packet_action(shard& sh, const pktcollector_key& key, unsigned int hash, unsigned int filter_id, int direction, unsigned int length, unsigned int now)
+{
+	flow* f;
+	unsigned int idx;
+
+	for (;;)
+	{
+		f = sh.data.find(key, hash);
+
+		idx = (f == NULL) ? COLLECTOR_NO_SLOT : f->first_slot;
+		while ((idx != COLLECTOR_NO_SLOT) && (sh.slots[idx].filter_id != filter_id))
+			idx = sh.slots[idx].next;
+
+		if (idx != COLLECTOR_NO_SLOT)
+			break;
+
+		if (!is_budget_exceeded((f == NULL) ? 1 : 0, 1))
+			break;
+
+		// The flow itself may be evicted, so it is looked up again
+		if (!evict_flow(sh))
+		{
+			dropped++;
+			return;
+		}
+	}
+
+	if (f == NULL)
+	{
+		f = sh.data.insert(key, hash, flow());
+		count++;
+
+		f->due = now + COLLECTOR_FLUSH_TIMEOUT;
+		sh.wheel.set_timer(key, hash, f->due);
+	}
+
+	if (idx == COLLECTOR_NO_SLOT)
+	{
+		idx = alloc_slot(sh, filter_id);
+		sh.slots[idx].next = f->first_slot;
+		f->first_slot = idx;
+	}
+
+	pktcollector_filter_slot& s = sh.slots[idx];
+	if (direction == 0)
+	{
+		s.sent_fixed += length;
+		s.sent_flush += length;
+	}
+	else
+	{
+		s.recv_fixed += length;
+		s.recv_flush += length;
+	}
+
+	f->last_update = now;
+
+	if (!f->dirty)
+	{
+		f->dirty = true;
+		sh.dirty.push_back(flow_ref(key, hash));
+	}
+}
+
+void pktcollector_shared::flush(flush_container_shared& fc, unsigned int now)
+{
+	for (int i = 0; i < COLLECTOR_SHARDS; i++)
+	{
+		boost::mutex::scoped_lock lock(shards[i].guard);
+		flush_action(shards[i], fc, now);
+	}
+}
+
+void pktcollector_shared::flush_action(shard& sh, flush_container_shared& fc, unsigned int now)
+{
+	fc.splice(fc.end(), sh.evicted_records);
+
+	for (size_t i = 0; i < sh.dirty.size(); i++)
+	{
+		const flow_ref& ref = sh.dirty[i];
+
+		flow* f = sh.data.find(ref.first, ref.second);
+		if ((f == NULL) || !f->dirty)
+			continue;
+
+		f->dirty = false;
+		put_records(sh, ref.first, *f, fc, true);
+	}
+
+	sh.dirty.clear();
+
+	sh.wheel.expire(now, [this, &sh](const pktcollector_key& key, unsigned int hash, unsigned int due, unsigned int& new_due) -> int
+	{
+		flow* f;
+		int res = check_timer(sh, key, hash, due, new_due, f);
+		if (res == FLOWWHEEL_DUE)
+		{
+			erase_flow(sh, key, hash);
+			expired++;
+		}
+
+		return res;
+	});
+}
+
+#ifdef UTM_DEBUG
+void pktcollector_shared::test_all()
+{
+	test_report tr(this_class_name);
+	test_case::classname.assign(this_class_name);
+
+	addrip_v4 a1("192.168.1.2");
+	addrip_v4 a2("201.202.203.204");
+
+	ip_header ih0;
+	ih0.src_ip_addr = a1;
+	ih0.dst_ip_addr = a2;
+	ih0.src_port = 65000;
+	ih0.dst_port = 80;
+	ih0.proto = 6;
+	ih0.ip_hl = 5;
+	ih0.version = 4;
+	ih0.length = 1200;
+
+	ip_header ih1;
+	ih1.src_ip_addr = a2;
+	ih1.dst_ip_addr = a1;
+	ih1.src_port = 80;
+	ih1.dst_port = 65000;
+	ih1.proto = 6;
+	ih1.ip_hl = 5;
+	ih1.version = 4;
+	ih1.length = 400;
+
+	{
+		// One flow for all filters, the same results as separate collectors
+
+		test_case::testcase_num = 1;
+
+		pktcollector_shared pcs;
+		pktcollector_e pce[3];
+
+		for (unsigned int i = 0; i < 10; i++)
+		{
+			pktcollector_packet pkt0(ih0, NULL, 0);
+			pktcollector_packet pkt1(ih1, NULL, 0);
+
+			for (unsigned int filter_id = 1; filter_id <= 3; filter_id++)
+			{
+				// Filter 3 sees the packets backward
+				int d = (filter_id == 3) ? 1 : 0;
+
+				pcs.put_packet(pkt0, filter_id, d, 10 + i);
+				pcs.put_packet(pkt1, filter_id, 1 - d, 10 + i);
+
+				pce[filter_id - 1].put_packet(ih0, d, 10 + i, NULL, 0);
+				pce[filter_id - 1].put_packet(ih1, 1 - d, 10 + i, NULL, 0);
+			}
+		}
+
+		TEST_CASE_CHECK(pcs.size(), size_t(2));
+		TEST_CASE_CHECK(pcs.get_slot_count(), size_t(3));
+
+		flush_container_shared fcs;
+		pcs.flush(fcs, 100);
+		TEST_CASE_CHECK(fcs.size(), size_t(3));
+
+		bool is_equal = true;
+		for (auto iter = fcs.begin(); iter != fcs.end(); ++iter)
+		{
+			flush_container_e fce;
+			pce[iter->filter_id - 1].flush(fce, 100);
+
+			if ((fce.size() != 1) || !(fce.front().first == iter->key) ||
+				(fce.front().second.sent_fixed != iter->value.sent_fixed) ||
+				(fce.front().second.recv_fixed != iter->value.recv_fixed) ||
+				(fce.front().second.sent_flush != iter->value.sent_flush))
+			{
+				is_equal = false;
+			}
+		}
+
+		std::uint64_t sent = 0;
+		for (auto iter = fcs.begin(); iter != fcs.end(); ++iter)
+			sent += iter->value.sent_fixed;
+
+		TEST_CASE_CHECK(is_equal, true);
+		TEST_CASE_CHECK(sent, std::uint64_t(12000 + 12000 + 4000));
+
+		fcs.clear();
+		pcs.flush(fcs, 100);
+		TEST_CASE_CHECK(fcs.size(), size_t(0));
+
+		pcs.flush(fcs, 1000);
+		TEST_CASE_CHECK(pcs.size(), size_t(0));
+		TEST_CASE_CHECK(pcs.get_slot_count(), size_t(0));
+		TEST_CASE_CHECK(pcs.get_expired(), std::uint64_t(2));
+	}
+
+	{
+		// Least recently updated flows are evicted with their counters
+
+		test_case::testcase_num = 2;
+
+		pktcollector_shared pcs;
+		pcs.set_memory_budget(100 * (get_flow_cost() + 2 * get_slot_cost()));
+
+		for (unsigned int i = 0; i < 150; i++)
+		{
+			ih0.src_ip_addr.m_addr = a1.m_addr + i;
+			pktcollector_packet pkt(ih0, NULL, 0);
+
+			pcs.put_packet(pkt, 1, 0, 100 + i);
+			pcs.put_packet(pkt, 2, 0, 100 + i);
+		}
+
+		TEST_CASE_CHECK(pcs.size(), size_t(100));
+		TEST_CASE_CHECK(pcs.get_slot_count(), size_t(200));
+		TEST_CASE_CHECK(pcs.get_evicted(), std::uint64_t(50));
+		TEST_CASE_CHECK(pcs.get_memory_usage() <= pcs.get_memory_budget(), true);
+
+		flush_container_shared fcs;
+		pcs.flush(fcs, 300);
+		TEST_CASE_CHECK(fcs.size(), size_t(300));
+
+		pktcollector_shared pcs2(pcs);
+		TEST_CASE_CHECK(pcs2.size(), size_t(100));
+		TEST_CASE_CHECK(pcs2.get_slot_count(), size_t(200));
+	}
+}
+#endif
+
+}
@@ -0,0 +1,130 @@
+#ifndef _PKTCOLLECTOR_SHARED_H
+#define _PKTCOLLECTOR_SHARED_H
+
+#pragma once
+
+#include "pktcollector.h"
+
+#define COLLECTOR_NO_SLOT 0xFFFFFFFF
+
+namespace utm {
+
+// Counters of one filter in a shared flow
+struct pktcollector_filter_slot
+{
+	pktcollector_filter_slot() : filter_id(0), next(COLLECTOR_NO_SLOT), sent_fixed(0), recv_fixed(0), sent_flush(0), recv_flush(0) { };
+
+	unsigned int filter_id;
+	unsigned int next;
+	std::uint64_t sent_fixed;
+	std::uint64_t recv_fixed;
+	std::uint64_t sent_flush;
+	std::uint64_t recv_flush;
+};
+
+struct pktcollector_shared_record
+{
+	unsigned int filter_id;
+	pktcollector_key key;
+	pktcollector_value value;
+};
+
+typedef std::list<pktcollector_shared_record> flush_container_shared;
+
+//
+// Flow collector shared by all filters of a filterset. A flow is kept once, with a chain of
+// counter slots for the filters which collected it; the slots live in an array of the shard.
+// Sharding, expiry and the memory budget are the same as in pktcollector. Raw data is not
+// processed, it is the counterpart of pktcollector_e.
+//
+class pktcollector_shared
+{
+	struct flow
+	{
+		flow() : last_update(0), due(0), first_slot(COLLECTOR_NO_SLOT), dirty(false) { };
+
+		unsigned int last_update;
+		unsigned int due;			// expiry time of the valid timer
+		unsigned int first_slot;
+		bool dirty;					// updated after the last flush
+	};
+
+	typedef std::pair<pktcollector_key, unsigned int> flow_ref;
+
+	struct shard
+	{
+		shard() : free_slot(COLLECTOR_NO_SLOT) { };
+
+		void assign(const shard& rhs);
+
+		flow_table<pktcollector_key, flow> data;
+		flow_wheel<pktcollector_key> wheel;
+		std::vector<pktcollector_filter_slot> slots;
+		unsigned int free_slot;
+		std::vector<flow_ref> dirty;
+		flush_container_shared evicted_records;
+		mutable boost::mutex guard;
+	};
+
+public:
+	static const char this_class_name[];
+
+public:
+	pktcollector_shared();
+	pktcollector_shared(const pktcollector_shared& rhs);
+	~pktcollector_shared();
+
+	pktcollector_shared& operator=(const pktcollector_shared& rhs);
+
+	size_t size() const { return count.load(); };
+	size_t get_slot_count() const { return slot_count.load(); };
+
+	static size_t get_flow_cost();
+	static size_t get_slot_cost();
+
+	void set_memory_budget(size_t bytes) { budget = bytes; };
+	size_t get_memory_budget() const { return budget.load(); };
+	size_t get_memory_usage() const { return count.load() * get_flow_cost() + slot_count.load() * get_slot_cost(); };
+
+	std::uint64_t get_dropped() const { return dropped.load(); };
+	std::uint64_t get_evicted() const { return evicted.load(); };
+	std::uint64_t get_expired() const { return expired.load(); };
+
+	// Counts the packet for the filter in the flow seen in the direction
+	void put_packet(const pktcollector_packet& pkt, unsigned int filter_id, int direction, unsigned int now);
+
+	// Returns the updated counters by filter
+	void flush(flush_container_shared& fc, unsigned int now);
+
+private:
+	void copy(const pktcollector_shared& rhs);
+
+	static int get_shard(unsigned int hash);
+	static int check_timer(shard& sh, const pktcollector_key& key, unsigned int hash, unsigned int due, unsigned int& new_due, flow*& f);
+
+	unsigned int alloc_slot(shard& sh, unsigned int filter_id);
+	void erase_flow(shard& sh, const pktcollector_key& key, unsigned int hash);
+	void put_records(shard& sh, const pktcollector_key& key, const flow& f, flush_container_shared& fc, bool clear_flush);
+	bool evict_flow(shard& sh);
+	bool is_budget_exceeded(size_t flows, size_t slots) const;
+
+	void put_packet_action(shard& sh, const pktcollector_key& key, unsigned int hash, unsigned int filter_id, int direction, unsigned int length, unsigned int now);
+	void flush_action(shard& sh, flush_container_shared& fc, unsigned int now);
+
+	shard shards[COLLECTOR_SHARDS];
+	std::atomic<size_t> count;
+	std::atomic<size_t> slot_count;
+	std::atomic<size_t> budget;
+	std::atomic<std::uint64_t> dropped;
+	std::atomic<std::uint64_t> evicted;
+	std::atomic<std::uint64_t> expired;
+
+#ifdef UTM_DEBUG
+public:
+	static void test_all();
+#endif
+};
+
+}
+
+#endif // _PKTCOLLECTOR_SHARED_H
@@ -1,5 +1,6 @@
 #include "stdafx.h"
 #include "pktcollector_value_ex.h"
+#include "tls_sni.h"
 
 namespace utm {
 
@@ -11,6 +12,7 @@ pktcollector_value_ex::pktcollector_value_ex()
 	request_type = 11;
 	end_type = 1;
 	method = HTTP_METHOD_UNKNOWN;
+	host_id = 0;
 }
 
 
@@ -32,7 +34,7 @@ const char* pktcollector_value_ex::get_methodname() const
 	return "UNKNOWN";
 }
 
-bool pktcollector_value_ex::process_raw_data(const ip_header& iphdr, int direction, unsigned int now, const unsigned char* rawdata, size_t rawdata_len)
+bool pktcollector_value_ex::process_raw_data(header_arena& arena, const host_matcher* hosts, const ip_header& iphdr, int direction, unsigned int now, const unsigned char* rawdata, size_t rawdata_len)
 {
 	bool retval = false;
 
@@ -48,19 +50,18 @@ bool pktcollector_value_ex::process_raw_data(const ip_header& iphdr, int directi
 		{
 			if (sent_packets == 3)
 			{
-				// detect HTTP request here
-				first_http_header_packet(rawdata, rawdata_len); 
-				if ((flags & IS_HTTP_REQUEST) == IS_HTTP_REQUEST)
+				// detect HTTP or TLS request here
+				first_request_packet(arena, rawdata, rawdata_len);
+				if ((flags & (IS_HTTP_REQUEST | IS_TLS_REQUEST)) != 0)
 				{
 					retval = true;
 				}
 			}
 			else if (sent_packets > 3)
 			{
-				if (((flags & IS_HTTP_REQUEST) == IS_HTTP_REQUEST) &&
-					((flags & IS_HTTP_REQUEST_FINISH) == 0))
+				if (is_request_open())
 				{
-					next_http_header_packet(rawdata, rawdata_len);
+					next_request_packet(arena, rawdata, rawdata_len);
 					retval = true;
 				}
 			}
@@ -86,19 +87,18 @@ bool pktcollector_value_ex::process_raw_data(const ip_header& iphdr, int directi
 		{
 			if (recv_packets == 3)
 			{
-				// detect HTTP request here
-				first_http_header_packet(rawdata, rawdata_len);
-				if ((flags & IS_HTTP_REQUEST) == IS_HTTP_REQUEST)
+				// detect HTTP or TLS request here
+				first_request_packet(arena, rawdata, rawdata_len);
+				if ((flags & (IS_HTTP_REQUEST | IS_TLS_REQUEST)) != 0)
 				{
 					retval = true;
 				}
 			}
 			else if (recv_packets > 3)
 			{
-				if (((flags & IS_HTTP_REQUEST) == IS_HTTP_REQUEST) &&
-					((flags & IS_HTTP_REQUEST_FINISH) == 0)) 
+				if (is_request_open())
 				{
-					next_http_header_packet(rawdata, rawdata_len);
+					next_request_packet(arena, rawdata, rawdata_len);
 					retval = true;
 				}
 			}
@@ -113,161 +113,142 @@ bool pktcollector_value_ex::process_raw_data(const ip_header& iphdr, int directi
 		}
 	}
 
+	lookup_host(arena, hosts);
+
 	return retval;
 }
 
-
-void pktcollector_value_ex::first_http_header_packet(const unsigned char *rawdata, size_t rawdata_len)
+bool pktcollector_value_ex::is_request_open() const
 {
-	if (is_http_request_begin(rawdata, rawdata_len))
+	if ((flags & IS_HTTP_REQUEST) == IS_HTTP_REQUEST)
 	{
-		flags |= IS_HTTP_REQUEST;
-		size_t endpos = lookup_http_request_end(rawdata, rawdata_len);
-		size_t btc = endpos == std::string::npos ? rawdata_len : endpos;
-		raw.clear();
-		raw.append((const char*)rawdata, btc);
+		return (flags & IS_HTTP_REQUEST_FINISH) == 0;
+	}
 
-		if (endpos != std::string::npos)
-		{
-			flags |= IS_HTTP_REQUEST_FINISH;
-			lookup_hostname();
-		}
+	if ((flags & IS_TLS_REQUEST) == IS_TLS_REQUEST)
+	{
+		return (flags & IS_TLS_REQUEST_FINISH) == 0;
 	}
+
+	return false;
 }
 
-void pktcollector_value_ex::next_http_header_packet(const unsigned char *rawdata, size_t rawdata_len)
+void pktcollector_value_ex::first_request_packet(header_arena& arena, const unsigned char *rawdata, size_t rawdata_len)
 {
-	size_t sz = raw.size();
-	if (sz >= 8192)
+	first_http_header_packet(arena, rawdata, rawdata_len);
+	if ((flags & IS_HTTP_REQUEST) == 0)
 	{
-		return;
+		first_tls_packet(arena, rawdata, rawdata_len);
 	}
+}
 
-	size_t cap = raw.capacity();
-	if ((sz + rawdata_len) > cap)
+void pktcollector_value_ex::next_request_packet(header_arena& arena, const unsigned char *rawdata, size_t rawdata_len)
+{
+	if ((flags & IS_HTTP_REQUEST) == IS_HTTP_REQUEST)
 	{
-		raw.reserve(sz + rawdata_len);
+		next_http_header_packet(arena, rawdata, rawdata_len);
 	}
-
-	const char *pt = (const char *)rawdata;
-	const char *p;
-	char c;
-	for (size_t t = 0; t < rawdata_len; t++, pt++)
+	else
 	{
-		c = *pt;
-		raw.push_back(c);
-		sz++;
-		if ((c == '\r') || (c == '\n'))
-		{
-			p = raw.c_str();
-			if (((*(p + sz - 4)) == '\r') &&
-				((*(p + sz - 3)) == '\n') &&
-				((*(p + sz - 2)) == '\r') &&
-				((*(p + sz - 1)) == '\n'))
-			{
-				flags |= IS_HTTP_REQUEST_FINISH;
-				lookup_hostname();
-				break;
-			}
-		}
+		next_tls_packet(arena, rawdata, rawdata_len);
 	}
 }
 
-bool pktcollector_value_ex::is_http_request_begin(const unsigned char* rawdata, size_t rawdata_len)
+void pktcollector_value_ex::lookup_host(const header_arena& arena, const host_matcher* hosts)
 {
-	if ((rawdata == NULL) || (rawdata_len < 8))
+	// Once per flow, when the host name is known
+	if ((hosts == NULL) || ((flags & HOST_LOOKUP_DONE) == HOST_LOOKUP_DONE) || (get_hostname_length() == 0))
 	{
-		return false;
+		return;
 	}
 
-	const char *p = (const char*)(rawdata);
+	flags |= HOST_LOOKUP_DONE;
+	host_id = hosts->lookup(get_hostname(arena), get_hostname_length());
+}
+
 
-	if (strncmp(p, "GET ", 4) == 0)
+void pktcollector_value_ex::first_http_header_packet(header_arena& arena, const unsigned char *rawdata, size_t rawdata_len)
+{
+	if (is_http_request_begin(rawdata, rawdata_len))
 	{
-		method = HTTP_METHOD_GET;
-		return true;
+		flags |= IS_HTTP_REQUEST;
+		raw.length = 0;
+		header_scan = http_scan_state();
+		scan_http_header(arena, rawdata, rawdata_len);
 	}
+}
 
-	if (strncmp(p, "POST ", 5) == 0)
+void pktcollector_value_ex::next_http_header_packet(header_arena& arena, const unsigned char *rawdata, size_t rawdata_len)
+{
+	if (raw.length >= 8192)
 	{
-		method = HTTP_METHOD_POST;
-		return true;
+		return;
 	}
 
-	if (strncmp(p, "PUT ", 4) == 0)
+	scan_http_header(arena, rawdata, rawdata_len);
+}
+
+bool pktcollector_value_ex::is_http_request_begin(const unsigned char* rawdata, size_t rawdata_len)
+{
+	method = http_scanner::get_method(rawdata, rawdata_len);
+	return method != HTTP_METHOD_UNKNOWN;
+}
+
+void pktcollector_value_ex::scan_http_header(header_arena& arena, const unsigned char *rawdata, size_t rawdata_len)
+{
+	size_t cap = arena.reserve(raw, raw.length + rawdata_len);
+	char *p = arena.get(raw);
+	if (p == NULL)
 	{
-		method = HTTP_METHOD_PUT;
-		return true;
+		return;
 	}
 
-	if (strncmp(p, "HEAD ", 5) == 0)
+	raw.length = static_cast<unsigned int>(http_scanner::scan(p, raw.length, cap, rawdata, rawdata_len, header_scan));
+	if (header_scan.finished)
 	{
-		method = HTTP_METHOD_HEAD;
-		return true;
+		flags |= IS_HTTP_REQUEST_FINISH;
 	}
-
-	return false;
 }
 
-size_t pktcollector_value_ex::lookup_http_request_end(const unsigned char* rawdata, size_t rawdata_len)
+void pktcollector_value_ex::first_tls_packet(header_arena& arena, const unsigned char *rawdata, size_t rawdata_len)
 {
-	size_t r = 0;
-	const char *p = (const char*)(rawdata);
-
-	while ((r + 3) < rawdata_len)
+	if (tls_sni::is_client_hello(rawdata, rawdata_len))
 	{
-		if (*p == '\r')
-		{
-			if ((*(p + 1) == '\n') && (*(p + 2) == '\r') && (*(p + 3) == '\n'))
-			{
-				return r + 3;
-			}
-		}
-
-		r++;
-		p++;
+		flags |= IS_TLS_REQUEST;
+		raw.length = 0;
+		next_tls_packet(arena, rawdata, rawdata_len);
 	}
-
-	return std::string::npos;
 }
 
-void pktcollector_value_ex::lookup_hostname()
+void pktcollector_value_ex::next_tls_packet(header_arena& arena, const unsigned char *rawdata, size_t rawdata_len)
 {
-	size_t r = 0;
-	const char *p = raw.c_str();
-	size_t rawlen = raw.size();
+	// The ClientHello is kept until the server name is found
+	size_t cap = arena.reserve(raw, raw.length + rawdata_len);
+	char *p = arena.get(raw);
+	if (p == NULL)
+	{
+		flags |= IS_TLS_REQUEST_FINISH;
+		return;
+	}
 
-	const char *host = NULL;
-	size_t hostlen = 0;
+	size_t btc = (rawdata_len < cap - raw.length) ? rawdata_len : cap - raw.length;
+	memcpy(p + raw.length, rawdata, btc);
+	raw.length += static_cast<unsigned int>(btc);
 
-	while ((r + 8) < rawlen)
-	{
-		if (*p == '\r')
-		{
-			if (host == NULL)
-			{
-				if ((*(p + 1) == '\n') && (*(p + 2) == 'H') && (*(p + 3) == 'o') && (*(p + 4) == 's') && (*(p + 5) == 't') && (*(p + 6) == ':') && (*(p + 7) == ' '))
-				{
-					host = p + 8;
-				}
-			}
-			else
-			{
-				if (*(p + 1) == '\n')
-				{
-					hostlen = p - host;
-					break;
-				}
-			}
-		}
+	size_t name_offset = 0;
+	size_t name_len = 0;
+	int res = tls_sni::parse(reinterpret_cast<const unsigned char*>(p), raw.length, name_offset, name_len);
 
-		r++;
-		p++;
+	if ((res == TLS_SNI_MORE_DATA) && (btc == rawdata_len))
+	{
+		return;
 	}
 
-	if ((host != NULL) && (hostlen > 0))
+	flags |= IS_TLS_REQUEST_FINISH;
+	if (res == TLS_SNI_FOUND)
 	{
-		hostname.assign(host, hostlen);
+		header_scan.host_offset = static_cast<unsigned short>(name_offset);
+		header_scan.host_length = static_cast<unsigned short>(name_len);
 	}
 }
 
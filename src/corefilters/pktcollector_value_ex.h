@@ -4,6 +4,9 @@
 #pragma once
 
 #include "pktcollector_value.h"
+#include "header_arena.h"
+#include "http_scanner.h"
+#include "host_matcher.h"
 
 #define HTTP_FLAG 1
 #define FIRST_PACKET_DIRECTION_BIT 2
@@ -11,17 +14,13 @@
 #define IS_HTTP_REQUEST 8
 #define IS_HTTP_REQUEST_FINISH 16
 #define TCP_FLAG_FIN 32
+#define IS_TLS_REQUEST 64
+#define IS_TLS_REQUEST_FINISH 128
+#define HOST_LOOKUP_DONE 256
 
 #include <cstdint>
 #include <string>
 
-#define HTTP_METHOD_UNKNOWN 0
-#define HTTP_METHOD_GET 1
-#define HTTP_METHOD_POST 2
-#define HTTP_METHOD_HEAD 3
-#define HTTP_METHOD_PUT 4
-#define HTTP_METHOD_OPTIONS 5
-
 namespace utm {
 
 class pktcollector_value_ex : public pktcollector_value
@@ -30,22 +29,36 @@ public:
 	pktcollector_value_ex();
 	~pktcollector_value_ex();
 
-	bool process_raw_data(const ip_header& iphdr, int direction, unsigned int now, const unsigned char* rawdata, size_t rawdata_len);
+	bool process_raw_data(header_arena& arena, const host_matcher* hosts, const ip_header& iphdr, int direction, unsigned int now, const unsigned char* rawdata, size_t rawdata_len);
 	const char *get_methodname() const;
 
-	void first_http_header_packet(const unsigned char *rawdata, size_t rawdata_len);
-	void next_http_header_packet(const unsigned char *rawdata, size_t rawdata_len);
+	// Captured request (HTTP header or TLS ClientHello) and the host name in it (Host value or
+	// TLS server name), the data is kept in the arena of the collector
+	const char *get_raw(const header_arena& arena) const { return arena.get(raw); };
+	size_t get_raw_length() const { return raw.length; };
+	const char *get_hostname(const header_arena& arena) const { return (get_hostname_length() == 0) ? NULL : arena.get(raw) + header_scan.host_offset; };
+	size_t get_hostname_length() const { return ((flags & (IS_HTTP_REQUEST_FINISH | IS_TLS_REQUEST_FINISH)) == 0) ? 0 : header_scan.host_length; };
+
+	bool is_request_open() const;
+	void first_request_packet(header_arena& arena, const unsigned char *rawdata, size_t rawdata_len);
+	void next_request_packet(header_arena& arena, const unsigned char *rawdata, size_t rawdata_len);
+	void lookup_host(const header_arena& arena, const host_matcher* hosts);
+
+	void first_http_header_packet(header_arena& arena, const unsigned char *rawdata, size_t rawdata_len);
+	void next_http_header_packet(header_arena& arena, const unsigned char *rawdata, size_t rawdata_len);
 	bool is_http_request_begin(const unsigned char* rawdata, size_t rawdata_len);
-	size_t lookup_http_request_end(const unsigned char* rawdata, size_t rawdata_len);
-	void lookup_hostname();
+	void scan_http_header(header_arena& arena, const unsigned char *rawdata, size_t rawdata_len);
+	void first_tls_packet(header_arena& arena, const unsigned char *rawdata, size_t rawdata_len);
+	void next_tls_packet(header_arena& arena, const unsigned char *rawdata, size_t rawdata_len);
 
 	std::uint32_t sent_packets;
 	std::uint32_t recv_packets;
 	int request_type;
 	int end_type;
 	int method;
-	std::string raw;
-	std::string hostname;
+	header_ref raw;
+	http_scan_state header_scan;
+	unsigned int host_id;			// by the host_matcher of the collector, zero if unknown
 //	std::string uri;
 };
 
@@ -0,0 +1,558 @@
+#include "StdAfx.h"
+#include "rule_classifier.h"
+
+#include <algorithm>
+#include <iterator>
+
+#include <ubase_test.h>
+
+namespace utm {
+
+const char rule_classifier::this_class_name[] = "rule_classifier";
+
+addr_interval_index::addr_interval_index()
+{
+}
+
+addr_interval_index::~addr_interval_index()
+{
+}
+
+void addr_interval_index::clear()
+{
+	starts.clear();
+	offsets.clear();
+	ids.clear();
+}
+
+void addr_interval_index::build(const addr_interval_container& entries, const std::vector<unsigned int>& wildcard)
+{
+	clear();
+
+	// Events: (position, id), an id is added at entry.lo and removed at entry.hi + 1
+	std::vector<std::pair<unsigned int, unsigned int> > adds;
+	std::vector<std::pair<unsigned int, unsigned int> > removes;
+
+	adds.reserve(entries.size());
+	removes.reserve(entries.size());
+
+	for (auto iter = entries.begin(); iter != entries.end(); ++iter)
+	{
+		if (iter->lo > iter->hi)
+			continue;
+
+		adds.push_back(std::make_pair(iter->lo, iter->id));
+		if (iter->hi != 0xFFFFFFFF)
+			removes.push_back(std::make_pair(iter->hi + 1, iter->id));
+	}
+
+	std::sort(adds.begin(), adds.end());
+	std::sort(removes.begin(), removes.end());
+
+	std::vector<unsigned int> active;
+	std::vector<unsigned int> current;
+	std::vector<unsigned int> last;
+
+	size_t ai = 0;
+	size_t ri = 0;
+	unsigned int pos = 0;
+
+	while (true)
+	{
+		while ((ri < removes.size()) && (removes[ri].first == pos))
+		{
+			auto it = std::lower_bound(active.begin(), active.end(), removes[ri].second);
+			if ((it != active.end()) && (*it == removes[ri].second))
+				active.erase(it);
+			ri++;
+		}
+
+		while ((ai < adds.size()) && (adds[ai].first == pos))
+		{
+			auto it = std::lower_bound(active.begin(), active.end(), adds[ai].second);
+			if ((it == active.end()) || (*it != adds[ai].second))
+				active.insert(it, adds[ai].second);
+			ai++;
+		}
+
+		current.clear();
+		std::set_union(active.begin(), active.end(), wildcard.begin(), wildcard.end(), std::back_inserter(current));
+
+		// Neighbour intervals with the same id list are merged
+		if (starts.empty() || (current != last))
+		{
+			starts.push_back(pos);
+			offsets.push_back(static_cast<unsigned int>(ids.size()));
+			ids.insert(ids.end(), current.begin(), current.end());
+			last.swap(current);
+		}
+
+		bool has_next = false;
+		unsigned int next_pos = 0;
+
+		if (ai < adds.size())
+		{
+			next_pos = adds[ai].first;
+			has_next = true;
+		}
+
+		if ((ri < removes.size()) && (!has_next || (removes[ri].first < next_pos)))
+		{
+			next_pos = removes[ri].first;
+			has_next = true;
+		}
+
+		if (!has_next)
+			break;
+
+		pos = next_pos;
+	}
+
+	offsets.push_back(static_cast<unsigned int>(ids.size()));
+}
+
+void addr_interval_index::lookup(unsigned int addr, const unsigned int*& begin, const unsigned int*& end) const
+{
+	if (starts.empty())
+	{
+		begin = NULL;
+		end = NULL;
+		return;
+	}
+
+	size_t idx = std::upper_bound(starts.begin(), starts.end(), addr) - starts.begin() - 1;
+
+	const unsigned int* p = ids.empty() ? NULL : &ids[0];
+	begin = p + offsets[idx];
+	end = p + offsets[idx + 1];
+}
+
+rule_classifier::rule_classifier() : mat(NULL)
+{
+}
+
+rule_classifier::~rule_classifier()
+{
+}
+
+int rule_classifier::get_proto_class(unsigned int proto)
+{
+	switch (proto)
+	{
+		case 6:		return RULECLASS_PROTO_TCP;
+		case 17:	return RULECLASS_PROTO_UDP;
+		case 1:		return RULECLASS_PROTO_ICMP;
+	}
+
+	return RULECLASS_PROTO_OTHER;
+}
+
+int rule_classifier::get_gate_class(bool with_nat, unsigned int nicalias)
+{
+	int gate = with_nat ? 4 : 0;
+
+	switch (nicalias)
+	{
+		case NICALIAS_PUBLIC:	gate += 1; break;
+		case NICALIAS_PRIVATE:	gate += 2; break;
+		case NICALIAS_NETFLOW:	gate += 3; break;
+	}
+
+	return gate;
+}
+
+bool rule_classifier::is_gate_passed(const rule& r, bool with_nat, unsigned int nicalias)
+{
+	if ((r.natuse == NATUSE_YES) && (with_nat == false))
+		return false;
+
+	if ((r.natuse == NATUSE_NO) && (with_nat == true))
+		return false;
+
+	if ((r.nicalias == NICALIAS_PUBLIC) || (r.nicalias == NICALIAS_PRIVATE) || (r.nicalias == NICALIAS_NETFLOW))
+	{
+		if (r.nicalias != nicalias)
+			return false;
+	}
+
+	return true;
+}
+
+bool rule_classifier::get_addr_range(int type, const addrip_v4& ip, const addrip_v4& mask, unsigned int& lo, unsigned int& hi)
+{
+	unsigned int iip = ip.m_addr;
+	unsigned int imask = mask.m_addr;
+
+	if (type == RULE_IP)
+	{
+		// Every address with (addr & mask) == (ip & mask) lies within this range
+		lo = iip & imask;
+		hi = lo | ~imask;
+		return true;
+	}
+
+	if (type == RULE_RANGE)
+	{
+		lo = iip;
+		hi = imask;
+		return true;
+	}
+
+	return false;
+}
+
+static bool is_volatile_addr_type(int type)
+{
+	switch (type)
+	{
+		case RULE_MAC:
+		case RULE_HOST:
+		case RULE_USER:
+		case RULE_USER_ANY:
+		case RULE_PROCNAME:
+		case RULE_PROCUSER:
+			return true;
+	}
+
+	return false;
+}
+
+bool rule_classifier::is_volatile_rule(const rule& r)
+{
+	// Counters, MAC addresses, TCP/ICMP flags, DNS, users and processes are not a part of the flow key
+	if (r.condition_type != COND_ALWAYS)
+		return true;
+
+	if (r.cond_mac_type != COND_MAC_ANY)
+		return true;
+
+	if (r.pkt_options & (PKTOPT_TCPSYN | PKTOPT_ICMPECHOREQUEST | PKTOPT_ICMPTTLEXCEEDED))
+		return true;
+
+	return is_volatile_addr_type(r.src_type) || is_volatile_addr_type(r.dst_type);
+}
+
+bool rule_classifier::is_time_passed(const rule& r, const tm* lt)
+{
+	// Same checks as in filter2::match_rule(), they do not depend on the packet
+	static const unsigned int wdays[7] = { WDAY_SUN, WDAY_MON, WDAY_TUE, WDAY_WED, WDAY_THU, WDAY_FRI, WDAY_SAT };
+
+	if ((lt->tm_wday >= 0) && (lt->tm_wday < 7) && ((r.wday & wdays[lt->tm_wday]) == 0))
+		return false;
+
+	if (lt->tm_hour < r.time_from)
+		return false;
+
+	if (lt->tm_hour > r.time_to)
+		return false;
+
+	return true;
+}
+
+void rule_classifier::compile(const std::list<rule>& rules, addrtablemap_v4* mat, std::shared_ptr<const addrgroup_index> groups)
+{
+	this->mat = mat;
+	this->groups = groups;
+
+	crules.clear();
+	crules.reserve(rules.size());
+
+	unsigned int gate_counters[RULECLASS_GATE_MAX];
+	for (int g = 0; g < RULECLASS_GATE_MAX; g++) gate_counters[g] = 1;
+
+	static const unsigned int nicaliases[4] = { NICALIAS_DEFAULT, NICALIAS_PUBLIC, NICALIAS_PRIVATE, NICALIAS_NETFLOW };
+
+	for (auto iter = rules.begin(); iter != rules.end(); ++iter)
+	{
+		const rule& r = *iter;
+		unsigned int idx = static_cast<unsigned int>(crules.size());
+
+		crules.push_back(compiled_rule());
+		compiled_rule& cr = crules.back();
+		cr.r = r;
+
+		// Rule numbers as the interpreter counts them: skipped rules are not numbered
+		for (int g = 0; g < RULECLASS_GATE_MAX; g++)
+		{
+			if (is_gate_passed(r, g >= 4, nicaliases[g % 4]))
+				cr.rule_no[g] = gate_counters[g]++;
+		}
+
+		if (mat != NULL)
+		{
+			if ((r.src_type == RULE_ADDRGRP) || (r.src_type == RULE_ADDRGRP_NO))
+			{
+				cr.src_at = mat->findptr_by_id(r.src_atkey);
+				if (cr.src_at == NULL) cr.at_resolved = false;
+			}
+
+			if ((r.dst_type == RULE_ADDRGRP) || (r.dst_type == RULE_ADDRGRP_NO))
+			{
+				cr.dst_at = mat->findptr_by_id(r.dst_atkey);
+				if (cr.dst_at == NULL) cr.at_resolved = false;
+			}
+		}
+
+		if (groups.get() != NULL)
+		{
+			if ((r.src_type == RULE_ADDRGRP) || (r.src_type == RULE_ADDRGRP_NO))
+				cr.src_grp_bit = groups->get_bit(r.src_atkey);
+
+			if ((r.dst_type == RULE_ADDRGRP) || (r.dst_type == RULE_ADDRGRP_NO))
+				cr.dst_grp_bit = groups->get_bit(r.dst_atkey);
+		}
+
+		cr.mirror_capable = !((r.mirrored == DIRECTION_ONEWAY) || (r.pkt_options & PKTOPT_TCPSYN) || (r.pkt_options & PKTOPT_ICMPECHOREQUEST));
+		cr.is_volatile = is_volatile_rule(r);
+
+		rule_kernel::select(r, cr);
+
+		if ((r.proto == 6) || (r.proto == 17))
+		{
+			cr.port_indexed = true;
+
+			switch (r.dst_port_type)
+			{
+				case PORT_EQUAL:
+					cr.port_lo = r.dst_port;
+					cr.port_hi = r.dst_port;
+					break;
+
+				case PORT_BETWEEN:
+					cr.port_lo = r.dst_port;
+					cr.port_hi = r.dst_port_to;
+					break;
+
+				case PORT_EQUAL_OR:
+					cr.port_lo = std::min(r.dst_port, r.dst_port_to);
+					cr.port_hi = std::max(r.dst_port, r.dst_port_to);
+					break;
+
+				case PORT_GREATER:
+					cr.port_lo = (r.dst_port == 0xFFFF) ? 0xFFFF : r.dst_port + 1;
+					cr.port_hi = (r.dst_port == 0xFFFF) ? 0 : 0xFFFF;
+					break;
+
+				case PORT_LESS:
+					cr.port_lo = (r.dst_port == 0) ? 0xFFFF : 0;
+					cr.port_hi = (r.dst_port == 0) ? 0 : r.dst_port - 1;
+					break;
+
+				default:
+					cr.port_indexed = false;
+					break;
+			}
+		}
+
+		// Choose the more selective address side for the index
+
+		unsigned int src_lo, src_hi, dst_lo, dst_hi;
+		bool src_indexed = get_addr_range(r.src_type, r.src_ip, r.src_mask, src_lo, src_hi);
+		bool dst_indexed = get_addr_range(r.dst_type, r.dst_ip, r.dst_mask, dst_lo, dst_hi);
+
+		if ((src_indexed && (src_lo > src_hi)) || (dst_indexed && (dst_lo > dst_hi)))
+		{
+			// Empty range: the rule never matches
+			cr.index_side = RULEINDEX_NEVER;
+			continue;
+		}
+
+		if (src_indexed && (src_hi - src_lo == 0xFFFFFFFF)) src_indexed = false;
+		if (dst_indexed && (dst_hi - dst_lo == 0xFFFFFFFF)) dst_indexed = false;
+
+		if (dst_indexed && (!src_indexed || ((dst_hi - dst_lo) <= (src_hi - src_lo))))
+		{
+			cr.index_side = RULEINDEX_DST;
+			cr.index_lo = dst_lo;
+			cr.index_hi = dst_hi;
+		}
+		else if (src_indexed)
+		{
+			cr.index_side = RULEINDEX_SRC;
+			cr.index_lo = src_lo;
+			cr.index_hi = src_hi;
+		}
+	}
+
+	rule_index_entries entries;
+	collect_index_entries(0, entries);
+	index.build(entries);
+}
+
+void rule_classifier::collect_index_entries(unsigned int id_base, rule_index_entries& entries) const
+{
+	for (unsigned int idx = 0; idx < crules.size(); idx++)
+	{
+		const compiled_rule& cr = crules[idx];
+		unsigned int id = id_base + idx;
+
+		if (cr.index_side == RULEINDEX_NEVER)
+			continue;
+
+		for (int pc = 0; pc < RULECLASS_PROTO_MAX; pc++)
+		{
+			if ((cr.r.proto > 0) && (get_proto_class(cr.r.proto) != pc))
+				continue;
+
+			// The backward direction swaps the packet addresses, so a mirrored rule goes to both indexes
+			switch (cr.index_side)
+			{
+				case RULEINDEX_DST:
+					entries.by_dst[pc].push_back(addr_interval(cr.index_lo, cr.index_hi, id));
+					if (cr.mirror_capable)
+						entries.by_src[pc].push_back(addr_interval(cr.index_lo, cr.index_hi, id));
+					break;
+
+				case RULEINDEX_SRC:
+					entries.by_src[pc].push_back(addr_interval(cr.index_lo, cr.index_hi, id));
+					if (cr.mirror_capable)
+						entries.by_dst[pc].push_back(addr_interval(cr.index_lo, cr.index_hi, id));
+					break;
+
+				default:
+					entries.wildcard[pc].push_back(id);
+					break;
+			}
+		}
+	}
+}
+
+void rule_index::clear()
+{
+	for (int pc = 0; pc < RULECLASS_PROTO_MAX; pc++)
+	{
+		by_dst[pc].clear();
+		by_src[pc].clear();
+	}
+}
+
+void rule_index::build(const rule_index_entries& entries)
+{
+	std::vector<unsigned int> empty;
+
+	for (int pc = 0; pc < RULECLASS_PROTO_MAX; pc++)
+	{
+		by_dst[pc].build(entries.by_dst[pc], entries.wildcard[pc]);
+		by_src[pc].build(entries.by_src[pc], empty);
+	}
+}
+
+void rule_index::lookup(const ip_header& ip, rule_candidates& cand) const
+{
+	int pc = rule_classifier::get_proto_class(ip.proto);
+
+	by_dst[pc].lookup(ip.dst_ip_addr.m_addr, cand.p1, cand.e1);
+	by_src[pc].lookup(ip.src_ip_addr.m_addr, cand.p2, cand.e2);
+}
+
+void rule_classifier::disable_kernels()
+{
+	for (auto iter = crules.begin(); iter != crules.end(); ++iter)
+	{
+		iter->kernel = NULL;
+	}
+}
+
+void rule_classifier::lookup(const ip_header& ip, rule_candidates& cand) const
+{
+	index.lookup(ip, cand);
+}
+
+#ifdef UTM_DEBUG
+void rule_classifier::test_all()
+{
+	test_report tr(this_class_name);
+
+	{
+		test_case::classname.assign("addr_interval_index");
+		test_case::testcase_num = 1;
+
+		addr_interval_container entries;
+		entries.push_back(addr_interval(addrip_v4("10.0.0.0").m_addr, addrip_v4("10.0.0.255").m_addr, 1));
+		entries.push_back(addr_interval(addrip_v4("10.0.0.128").m_addr, addrip_v4("10.0.1.255").m_addr, 2));
+		entries.push_back(addr_interval(addrip_v4("192.168.0.1").m_addr, addrip_v4("192.168.0.1").m_addr, 3));
+
+		std::vector<unsigned int> wildcard;
+		wildcard.push_back(0);
+
+		addr_interval_index index;
+		index.build(entries, wildcard);
+
+		const unsigned int *b, *e;
+
+		index.lookup(addrip_v4("9.255.255.255").m_addr, b, e);
+		TEST_CASE_CHECK(size_t(e - b), size_t(1));
+
+		index.lookup(addrip_v4("10.0.0.1").m_addr, b, e);
+		TEST_CASE_CHECK(size_t(e - b), size_t(2));
+		TEST_CASE_CHECK(b[1], unsigned int(1));
+
+		index.lookup(addrip_v4("10.0.0.200").m_addr, b, e);
+		TEST_CASE_CHECK(size_t(e - b), size_t(3));
+		TEST_CASE_CHECK(b[2], unsigned int(2));
+
+		index.lookup(addrip_v4("10.0.1.0").m_addr, b, e);
+		TEST_CASE_CHECK(size_t(e - b), size_t(2));
+		TEST_CASE_CHECK(b[1], unsigned int(2));
+
+		index.lookup(addrip_v4("192.168.0.1").m_addr, b, e);
+		TEST_CASE_CHECK(size_t(e - b), size_t(2));
+		TEST_CASE_CHECK(b[1], unsigned int(3));
+
+		index.lookup(addrip_v4("255.255.255.255").m_addr, b, e);
+		TEST_CASE_CHECK(size_t(e - b), size_t(1));
+
+		// Starts: 0.0.0.0, 10.0.0.0, 10.0.0.128, 10.0.1.0, 10.0.2.0, 192.168.0.1, 192.168.0.2
+		TEST_CASE_CHECK(index.get_interval_count(), size_t(7));
+	}
+
+	{
+		test_case::classname.assign(this_class_name);
+		test_case::testcase_num = 2;
+
+		std::list<rule> rules;
+		rules.push_back(rule(RULE_IP, "192.168.1.0", "255.255.255.0", RULE_IP, "0.0.0.0", "0.0.0.0"));
+		rules.push_back(rule(RULE_MYIP, "0.0.0.0", "0.0.0.0", RULE_RANGE, "10.0.0.1", "10.0.0.10"));
+		rules.push_back(rule(RULE_LAN, "0.0.0.0", "0.0.0.0", RULE_WAN, "0.0.0.0", "0.0.0.0"));
+		rules.back().natuse = NATUSE_YES;
+		rules.push_back(rule(RULE_IP, "172.16.0.1", "255.255.255.255", RULE_IP, "0.0.0.0", "0.0.0.0"));
+		rules.back().proto = 6;
+		rules.back().dst_port_type = PORT_EQUAL;
+		rules.back().dst_port = 80;
+
+		rule_classifier rc;
+		rc.compile(rules, NULL);
+
+		TEST_CASE_CHECK(rc.size(), size_t(4));
+		TEST_CASE_CHECK(rc.at(3).port_indexed, true);
+		TEST_CASE_CHECK(rc.at(3).is_port_possible(1024, 80), true);
+		TEST_CASE_CHECK(rc.at(3).is_port_possible(1024, 81), false);
+
+		// Rule numbers skip the rules which do not pass the NAT check
+		TEST_CASE_CHECK(rc.at(3).rule_no[get_gate_class(false, NICALIAS_DEFAULT)], unsigned int(3));
+		TEST_CASE_CHECK(rc.at(3).rule_no[get_gate_class(true, NICALIAS_DEFAULT)], unsigned int(4));
+		TEST_CASE_CHECK(rc.at(2).rule_no[get_gate_class(false, NICALIAS_DEFAULT)], unsigned int(0));
+
+		ip_header iphdr;
+		iphdr.test_fill_packet(0);
+		iphdr.proto = 6;
+		iphdr.src_ip_addr = addrip_v4("192.168.1.2");
+		iphdr.dst_ip_addr = addrip_v4("10.0.0.5");
+
+		rule_candidates cand;
+		rc.lookup(iphdr, cand);
+
+		std::vector<unsigned int> ids;
+		unsigned int id;
+		while (cand.next(id)) ids.push_back(id);
+
+		// Rule 4 is not selected: its source address is 172.16.0.1
+		TEST_CASE_CHECK(ids.size(), size_t(3));
+		TEST_CASE_CHECK(ids[0], unsigned int(0));
+		TEST_CASE_CHECK(ids[1], unsigned int(1));
+		TEST_CASE_CHECK(ids[2], unsigned int(2));
+	}
+}
+#endif
+
+}
@@ -0,0 +1,245 @@
+#ifndef _UTM_RULE_CLASSIFIER_H
+#define _UTM_RULE_CLASSIFIER_H
+
+#pragma once
+#include <utm.h>
+
+#include <vector>
+#include <memory>
+
+#include <addrtablemap_v4.h>
+
+#include "rule.h"
+#include "rule_common.h"
+#include "ip_header.h"
+#include "addrgroup_index.h"
+#include "rule_kernel.h"
+
+#define RULECLASS_PROTO_TCP 0
+#define RULECLASS_PROTO_UDP 1
+#define RULECLASS_PROTO_ICMP 2
+#define RULECLASS_PROTO_OTHER 3
+#define RULECLASS_PROTO_MAX 4
+
+// Number of combinations (NAT flag x NIC alias) which affect the rule numbering
+#define RULECLASS_GATE_MAX 8
+
+#define RULEINDEX_NONE 0		// listed in every interval
+#define RULEINDEX_SRC 1
+#define RULEINDEX_DST 2
+#define RULEINDEX_NEVER 3		// the rule never matches
+
+namespace utm {
+
+typedef addrtablemaprec<addrtable_v4> addrtablemaprec_ptr_type;
+
+struct addr_interval
+{
+	addr_interval() : lo(0), hi(0), id(0) { };
+	addr_interval(unsigned int _lo, unsigned int _hi, unsigned int _id) : lo(_lo), hi(_hi), id(_id) { };
+
+	unsigned int lo;
+	unsigned int hi;
+	unsigned int id;
+};
+
+typedef std::vector<addr_interval> addr_interval_container;
+
+//
+// Immutable index: splits the IPv4 address space into elementary intervals,
+// every interval keeps the sorted list of ids whose ranges cover it.
+//
+class addr_interval_index
+{
+public:
+	addr_interval_index();
+	~addr_interval_index();
+
+	void clear();
+	void build(const addr_interval_container& entries, const std::vector<unsigned int>& wildcard);
+
+	void lookup(unsigned int addr, const unsigned int*& begin, const unsigned int*& end) const;
+
+	size_t get_interval_count() const { return starts.size(); };
+	size_t get_id_count() const { return ids.size(); };
+
+private:
+	std::vector<unsigned int> starts;
+	std::vector<unsigned int> offsets;
+	std::vector<unsigned int> ids;
+};
+
+//
+// Walks two sorted id lists as one sorted list without duplicates.
+// Only ids below limit are returned, they are returned relative to base.
+//
+struct rule_candidates
+{
+	rule_candidates() : p1(NULL), e1(NULL), p2(NULL), e2(NULL), base(0), limit(0xFFFFFFFF) { };
+
+	const unsigned int* p1;
+	const unsigned int* e1;
+	const unsigned int* p2;
+	const unsigned int* e2;
+
+	unsigned int base;
+	unsigned int limit;
+
+	inline bool peek(unsigned int& id) const
+	{
+		if (p1 != e1)
+		{
+			id = ((p2 != e2) && (*p2 < *p1)) ? *p2 : *p1;
+			return true;
+		}
+
+		if (p2 != e2)
+		{
+			id = *p2;
+			return true;
+		}
+
+		return false;
+	}
+
+	inline bool next(unsigned int& id)
+	{
+		unsigned int v;
+		if (!peek(v) || (v >= limit))
+			return false;
+
+		if ((p1 != e1) && (*p1 == v)) ++p1;
+		if ((p2 != e2) && (*p2 == v)) ++p2;
+
+		id = v - base;
+		return true;
+	}
+};
+
+struct compiled_rule
+{
+	compiled_rule() : src_at(NULL), dst_at(NULL), at_resolved(true), src_grp_bit(-1), dst_grp_bit(-1), mirror_capable(false), is_volatile(false), port_indexed(false), port_lo(0), port_hi(0xFFFF),
+		index_side(RULEINDEX_NONE), index_lo(0), index_hi(0),
+		kernel(NULL), kernel_any_time(false)
+	{
+		memset(rule_no, 0, sizeof(rule_no));
+		memset(kernel_src, 0, sizeof(kernel_src));
+		memset(kernel_dst, 0, sizeof(kernel_dst));
+	};
+
+	rule r;
+
+	// MAT records resolved at compile time
+	addrtablemaprec_ptr_type* src_at;
+	addrtablemaprec_ptr_type* dst_at;
+	bool at_resolved;		// false if some group was not found, it is looked up per packet
+
+	// Bits of the groups in addrgroup_index, -1 if the group is checked by its table
+	int src_grp_bit;
+	int dst_grp_bit;
+
+	// The rule can be matched in the backward direction
+	bool mirror_capable;
+
+	// The rule result may change for the same flow
+	bool is_volatile;
+
+	// TCP/UDP destination port range (for forward direction)
+	bool port_indexed;
+	unsigned short port_lo;
+	unsigned short port_hi;
+
+	// Rule number reported in match_filter_result for every gate class.
+	// Zero means that the rule is skipped for this gate class.
+	unsigned int rule_no[RULECLASS_GATE_MAX];
+
+	// Address range the rule is indexed by
+	int index_side;
+	unsigned int index_lo;
+	unsigned int index_hi;
+
+	// Matcher specialized on the rule shape, NULL if the rule is checked by filter2::match_rule()
+	rule_kernel_func kernel;
+	unsigned int kernel_src[2];
+	unsigned int kernel_dst[2];
+	bool kernel_any_time;
+
+	inline bool is_port_possible(unsigned short src_port, unsigned short dst_port) const
+	{
+		if (!port_indexed)
+			return true;
+
+		if ((dst_port >= port_lo) && (dst_port <= port_hi))
+			return true;
+
+		return mirror_capable && (src_port >= port_lo) && (src_port <= port_hi);
+	}
+};
+
+typedef std::vector<compiled_rule> compiled_rule_container;
+
+struct rule_index_entries
+{
+	addr_interval_container by_dst[RULECLASS_PROTO_MAX];
+	addr_interval_container by_src[RULECLASS_PROTO_MAX];
+	std::vector<unsigned int> wildcard[RULECLASS_PROTO_MAX];
+};
+
+//
+// Address indexes for every protocol class, probed by the destination and by the source address of the packet
+//
+class rule_index
+{
+public:
+	void clear();
+	void build(const rule_index_entries& entries);
+	void lookup(const ip_header& ip, rule_candidates& cand) const;
+
+private:
+	addr_interval_index by_dst[RULECLASS_PROTO_MAX];
+	addr_interval_index by_src[RULECLASS_PROTO_MAX];
+};
+
+class rule_classifier
+{
+public:
+	static const char this_class_name[];
+
+	rule_classifier();
+	~rule_classifier();
+
+	void compile(const std::list<rule>& rules, addrtablemap_v4* mat, std::shared_ptr<const addrgroup_index> groups = std::shared_ptr<const addrgroup_index>());
+
+	size_t size() const { return crules.size(); };
+	const compiled_rule& at(unsigned int idx) const { return crules[idx]; };
+	const addrtablemap_v4* get_mat() const { return mat; };
+	const addrgroup_index* get_addrgroups() const { return groups.get(); };
+
+	void lookup(const ip_header& ip, rule_candidates& cand) const;
+	void collect_index_entries(unsigned int id_base, rule_index_entries& entries) const;
+
+	// All rules are checked by the generic matcher then (to compare with the kernels)
+	void disable_kernels();
+
+	static int get_proto_class(unsigned int proto);
+	static int get_gate_class(bool with_nat, unsigned int nicalias);
+	static bool is_gate_passed(const rule& r, bool with_nat, unsigned int nicalias);
+	static bool get_addr_range(int type, const addrip_v4& ip, const addrip_v4& mask, unsigned int& lo, unsigned int& hi);
+	static bool is_volatile_rule(const rule& r);
+	static bool is_time_passed(const rule& r, const tm* lt);
+
+private:
+	compiled_rule_container crules;
+	addrtablemap_v4* mat;
+	std::shared_ptr<const addrgroup_index> groups;
+	rule_index index;
+
+public:
+#ifdef UTM_DEBUG
+	static void test_all();
+#endif
+};
+
+}
+
+#endif // _UTM_RULE_CLASSIFIER_H
@@ -0,0 +1,488 @@
+#include "StdAfx.h"
+#include "rule_kernel.h"
+#include "rule_classifier.h"
+#include "filter2.h"
+
+#include <list>
+#include <vector>
+#include <chrono>
+#include <iostream>
+
+#include <utime.h>
+#include <ubase_test.h>
+
+namespace utm {
+
+const char rule_kernel::this_class_name[] = "rule_kernel";
+
+template<int KIND>
+inline bool kernel_match_addr(const unsigned int* param, unsigned int addr, unsigned int precheck, unsigned int mypc_flag, unsigned int lat_flag)
+{
+	switch (KIND)
+	{
+		case RULEKERNEL_ADDR_MASK:
+			return (addr & param[1]) == param[0];
+
+		case RULEKERNEL_ADDR_RANGE:
+			return (addr >= param[0]) && (addr <= param[1]);
+
+		case RULEKERNEL_ADDR_LAN:
+			return (precheck & lat_flag) != 0;
+
+		case RULEKERNEL_ADDR_WAN:
+			return (precheck & lat_flag) == 0;
+
+		case RULEKERNEL_ADDR_MYIP:
+			return (precheck & mypc_flag) != 0;
+	}
+
+	return true;
+}
+
+template<int PORTS>
+inline bool kernel_match_ports(const rule& r, bool check_ports, unsigned short src_port, unsigned short dst_port)
+{
+	switch (PORTS)
+	{
+		case RULEKERNEL_PORTS_DST_EQUAL:
+			return !check_ports || (dst_port == r.dst_port);
+
+		case RULEKERNEL_PORTS_SRC_EQUAL:
+			return !check_ports || (src_port == r.src_port);
+	}
+
+	return true;
+}
+
+template<int SRC, int DST, int PORTS>
+int kernel_match(const compiled_rule& cr, const match_filter_input& data)
+{
+	const rule& r = cr.r;
+	const ip_header* ip = data.ip;
+
+	// Checks which do not depend on the direction
+	if ((r.proto > 0) && (r.proto != ip->proto))
+		return -1;
+
+	if ((r.prevfilter_type == PREVFILTER_NOTMATCHED) && (data.nPrevFilter != 0))
+		return -1;
+
+	if ((r.prevfilter_type == PREVFILTER_MATCHED) && (data.nPrevFilter != 1))
+		return -1;
+
+	if (!cr.kernel_any_time && !rule_classifier::is_time_passed(r, data.lt))
+		return -1;
+
+	unsigned int src_ip = ip->src_ip_addr.m_addr;
+	unsigned int dst_ip = ip->dst_ip_addr.m_addr;
+	unsigned int precheck = data.nPreCheckAddrTables;
+	bool check_ports = (r.proto > 0) && ((ip->proto == 6) || (ip->proto == 17));
+
+	if (kernel_match_addr<SRC>(cr.kernel_src, src_ip, precheck, CHECKADDR_MYPC_SRC, CHECKADDR_LAT_SRC) &&
+		kernel_match_addr<DST>(cr.kernel_dst, dst_ip, precheck, CHECKADDR_MYPC_DST, CHECKADDR_LAT_DST) &&
+		kernel_match_ports<PORTS>(r, check_ports, ip->src_port, ip->dst_port))
+	{
+		return DIRECTION_FORWARD;
+	}
+
+	if (cr.mirror_capable &&
+		kernel_match_addr<SRC>(cr.kernel_src, dst_ip, precheck, CHECKADDR_MYPC_DST, CHECKADDR_LAT_DST) &&
+		kernel_match_addr<DST>(cr.kernel_dst, src_ip, precheck, CHECKADDR_MYPC_SRC, CHECKADDR_LAT_SRC) &&
+		kernel_match_ports<PORTS>(r, check_ports, ip->dst_port, ip->src_port))
+	{
+		return DIRECTION_BACKWARD;
+	}
+
+	return -1;
+}
+
+template<int SRC, int DST>
+rule_kernel_func select_kernel_ports(int ports)
+{
+	switch (ports)
+	{
+		case RULEKERNEL_PORTS_NONE: return &kernel_match<SRC, DST, RULEKERNEL_PORTS_NONE>;
+		case RULEKERNEL_PORTS_DST_EQUAL: return &kernel_match<SRC, DST, RULEKERNEL_PORTS_DST_EQUAL>;
+		case RULEKERNEL_PORTS_SRC_EQUAL: return &kernel_match<SRC, DST, RULEKERNEL_PORTS_SRC_EQUAL>;
+	}
+
+	return NULL;
+}
+
+template<int SRC>
+rule_kernel_func select_kernel_dst(int dst, int ports)
+{
+	switch (dst)
+	{
+		case RULEKERNEL_ADDR_ANY: return select_kernel_ports<SRC, RULEKERNEL_ADDR_ANY>(ports);
+		case RULEKERNEL_ADDR_MASK: return select_kernel_ports<SRC, RULEKERNEL_ADDR_MASK>(ports);
+		case RULEKERNEL_ADDR_RANGE: return select_kernel_ports<SRC, RULEKERNEL_ADDR_RANGE>(ports);
+		case RULEKERNEL_ADDR_LAN: return select_kernel_ports<SRC, RULEKERNEL_ADDR_LAN>(ports);
+		case RULEKERNEL_ADDR_WAN: return select_kernel_ports<SRC, RULEKERNEL_ADDR_WAN>(ports);
+		case RULEKERNEL_ADDR_MYIP: return select_kernel_ports<SRC, RULEKERNEL_ADDR_MYIP>(ports);
+	}
+
+	return NULL;
+}
+
+static rule_kernel_func select_kernel(int src, int dst, int ports)
+{
+	switch (src)
+	{
+		case RULEKERNEL_ADDR_ANY: return select_kernel_dst<RULEKERNEL_ADDR_ANY>(dst, ports);
+		case RULEKERNEL_ADDR_MASK: return select_kernel_dst<RULEKERNEL_ADDR_MASK>(dst, ports);
+		case RULEKERNEL_ADDR_RANGE: return select_kernel_dst<RULEKERNEL_ADDR_RANGE>(dst, ports);
+		case RULEKERNEL_ADDR_LAN: return select_kernel_dst<RULEKERNEL_ADDR_LAN>(dst, ports);
+		case RULEKERNEL_ADDR_WAN: return select_kernel_dst<RULEKERNEL_ADDR_WAN>(dst, ports);
+		case RULEKERNEL_ADDR_MYIP: return select_kernel_dst<RULEKERNEL_ADDR_MYIP>(dst, ports);
+	}
+
+	return NULL;
+}
+
+int rule_kernel::get_addr_kind(int type, const addrip_v4& ip, const addrip_v4& mask)
+{
+	switch (type)
+	{
+		case RULE_IP:
+			return (mask.m_addr == 0) ? RULEKERNEL_ADDR_ANY : RULEKERNEL_ADDR_MASK;
+
+		case RULE_RANGE:
+			return RULEKERNEL_ADDR_RANGE;
+
+		case RULE_LAN:
+			return RULEKERNEL_ADDR_LAN;
+
+		case RULE_WAN:
+			return RULEKERNEL_ADDR_WAN;
+
+		case RULE_MYIP:
+			return RULEKERNEL_ADDR_MYIP;
+	}
+
+	return -1;
+}
+
+int rule_kernel::get_ports_kind(const rule& r)
+{
+	// Ports are checked for TCP and UDP rules only
+	if ((r.proto != 6) && (r.proto != 17))
+		return RULEKERNEL_PORTS_NONE;
+
+	// The destination port check overrides the source port check in filter2::match_rule()
+	switch (r.dst_port_type)
+	{
+		case PORT_ANY:
+			break;
+
+		case PORT_EQUAL:
+			return RULEKERNEL_PORTS_DST_EQUAL;
+
+		default:
+			return -1;
+	}
+
+	switch (r.src_port_type)
+	{
+		case PORT_ANY:
+			return RULEKERNEL_PORTS_NONE;
+
+		case PORT_EQUAL:
+			return RULEKERNEL_PORTS_SRC_EQUAL;
+	}
+
+	return -1;
+}
+
+bool rule_kernel::select(const rule& r, compiled_rule& cr)
+{
+	cr.kernel = NULL;
+
+	if ((r.condition_type != COND_ALWAYS) || (r.cond_mac_type != COND_MAC_ANY))
+		return false;
+
+	if (r.pkt_options & (PKTOPT_TCPSYN | PKTOPT_ICMPECHOREQUEST | PKTOPT_ICMPTTLEXCEEDED))
+		return false;
+
+	int src = get_addr_kind(r.src_type, r.src_ip, r.src_mask);
+	int dst = get_addr_kind(r.dst_type, r.dst_ip, r.dst_mask);
+	int ports = get_ports_kind(r);
+
+	if ((src < 0) || (dst < 0) || (ports < 0))
+		return false;
+
+	// RULE_IP keeps network and mask, RULE_RANGE keeps the first and the last address
+	cr.kernel_src[0] = (r.src_type == RULE_IP) ? (r.src_ip.m_addr & r.src_mask.m_addr) : r.src_ip.m_addr;
+	cr.kernel_src[1] = r.src_mask.m_addr;
+	cr.kernel_dst[0] = (r.dst_type == RULE_IP) ? (r.dst_ip.m_addr & r.dst_mask.m_addr) : r.dst_ip.m_addr;
+	cr.kernel_dst[1] = r.dst_mask.m_addr;
+
+	cr.kernel_any_time = ((r.wday & WDAY_ALL) == WDAY_ALL) && (r.time_from == 0) && (r.time_to >= 23);
+	cr.kernel = select_kernel(src, dst, ports);
+
+	return cr.kernel != NULL;
+}
+
+#ifdef UTM_DEBUG
+void rule_kernel::test_all()
+{
+	test_report tr(this_class_name);
+	test_case::classname.assign(this_class_name);
+
+	tm lt = utm::utime(2010, 05, 30, 12, 59, 12).to_tm();
+
+	{
+		test_case::testcase_num = 1;
+
+		rule r(RULE_IP, "192.168.1.0", "255.255.255.0", RULE_IP, "0.0.0.0", "0.0.0.0");
+		r.proto = 6;
+		r.dst_port_type = PORT_EQUAL;
+		r.dst_port = 80;
+
+		compiled_rule cr;
+		cr.r = r;
+		TEST_CASE_CHECK(select(r, cr), true);
+		TEST_CASE_CHECK(cr.kernel_any_time, true);
+		TEST_CASE_CHECK(cr.kernel == &kernel_match<RULEKERNEL_ADDR_MASK, RULEKERNEL_ADDR_ANY, RULEKERNEL_PORTS_DST_EQUAL>, true);
+
+		r.dst_port_type = PORT_BETWEEN;
+		TEST_CASE_CHECK(select(r, cr), false);
+
+		r.dst_port_type = PORT_ANY;
+		r.src_port_type = PORT_EQUAL;
+		TEST_CASE_CHECK(select(r, cr), true);
+		TEST_CASE_CHECK(cr.kernel == &kernel_match<RULEKERNEL_ADDR_MASK, RULEKERNEL_ADDR_ANY, RULEKERNEL_PORTS_SRC_EQUAL>, true);
+
+		// Ports are not checked for other protocols
+		r.proto = 1;
+		r.src_port_type = PORT_BETWEEN;
+		TEST_CASE_CHECK(select(r, cr), true);
+
+		r.condition_type = COND_SENT_LESS;
+		TEST_CASE_CHECK(select(r, cr), false);
+
+		r.condition_type = COND_ALWAYS;
+		r.src_type = RULE_HOST;
+		TEST_CASE_CHECK(select(r, cr), false);
+
+		r.src_type = RULE_LAN;
+		r.time_from = 8;
+		TEST_CASE_CHECK(select(r, cr), true);
+		TEST_CASE_CHECK(cr.kernel_any_time, false);
+	}
+
+	{
+		// Kernels must give the same result as filter2::match_rule()
+
+		test_case::testcase_num = 2;
+
+		static const int addr_types[] = { RULE_MYIP, RULE_IP, RULE_IP, RULE_RANGE, RULE_LAN, RULE_WAN };
+		static const char* addrs[] = { "10.0.0.1", "10.0.0.2", "10.0.0.130", "192.168.1.2", "172.30.1.1", "0.0.0.0" };
+		static const char* masks[] = { "255.255.255.255", "255.255.255.0", "255.255.255.128", "0.0.0.0" };
+		static const int protos[] = { 0, 6, 17, 1 };
+		static const unsigned short port_types[] = { PORT_ANY, PORT_ANY, PORT_EQUAL, PORT_EQUAL };
+		static const unsigned short ports[] = { 21, 80, 443, 5000 };
+		static const int prevfilters[] = { PREVFILTER_ANY, PREVFILTER_ANY, PREVFILTER_MATCHED, PREVFILTER_NOTMATCHED };
+
+		unsigned int seed = 2468;
+		auto test_rand = [&seed](unsigned int n) -> unsigned int { seed = seed * 1103515245 + 12345; return (seed >> 16) % n; };
+
+		std::list<rule> rules;
+		for (int i = 0; i < 300; i++)
+		{
+			rule r;
+			r.src_type = addr_types[test_rand(6)];
+			r.dst_type = addr_types[test_rand(6)];
+			r.src_ip.from_string(addrs[test_rand(6)]);
+			r.dst_ip.from_string(addrs[test_rand(6)]);
+			r.src_mask.from_string(masks[test_rand(4)]);
+			r.dst_mask.from_string(masks[test_rand(4)]);
+
+			if (r.src_type == RULE_RANGE) r.src_mask = r.src_ip.m_addr + test_rand(200);
+			if (r.dst_type == RULE_RANGE) r.dst_mask = r.dst_ip.m_addr + test_rand(200);
+
+			r.proto = protos[test_rand(4)];
+			r.src_port_type = port_types[test_rand(4)];
+			r.dst_port_type = port_types[test_rand(4)];
+			r.src_port = ports[test_rand(4)];
+			r.dst_port = ports[test_rand(4)];
+			r.mirrored = test_rand(2) ? DIRECTION_TWOWAY : DIRECTION_ONEWAY;
+			r.prevfilter_type = prevfilters[test_rand(4)];
+
+			if (test_rand(4) == 0)
+			{
+				r.wday = WDAY_MON | WDAY_SUN;
+				r.time_from = static_cast<unsigned short>(test_rand(24));
+				r.time_to = static_cast<unsigned short>(test_rand(24));
+			}
+
+			rules.push_back(r);
+		}
+
+		rule_classifier rc_kernel, rc_generic;
+		rc_kernel.compile(rules, NULL);
+		rc_generic.compile(rules, NULL);
+		rc_generic.disable_kernels();
+
+		size_t kernel_count = 0;
+		for (unsigned int i = 0; i < rc_kernel.size(); i++)
+		{
+			if (rc_kernel.at(i).kernel != NULL) kernel_count++;
+		}
+
+		TEST_CASE_CHECK(kernel_count, rc_kernel.size());
+
+		filter2 f_kernel, f_generic;
+
+		ip_header iphdr;
+		iphdr.test_fill_packet(0);
+
+		match_filter_input input;
+		input.ip = &iphdr;
+		input.nModifyCounter = MODIFY_COUNTER_YES;
+		input.lt = &lt;
+		input.mbytes = 1048576;
+
+		match_filter_result res_kernel, res_generic;
+
+		bool is_equal = true;
+		size_t matched = 0;
+
+		for (int i = 0; i < 5000; i++)
+		{
+			iphdr.src_ip_addr = addrip_v4(addrs[test_rand(5)]).m_addr + test_rand(3);
+			iphdr.dst_ip_addr = addrip_v4(addrs[test_rand(5)]).m_addr + test_rand(3);
+			iphdr.proto = protos[1 + test_rand(3)];
+			iphdr.src_port = ports[test_rand(4)];
+			iphdr.dst_port = ports[test_rand(4)];
+			input.nPreCheckAddrTables = test_rand(16);
+			input.nPrevFilter = test_rand(2);
+			lt.tm_hour = test_rand(24);
+			lt.tm_wday = test_rand(7);
+
+			rule_candidates cand_kernel, cand_generic;
+			rc_kernel.lookup(iphdr, cand_kernel);
+			rc_generic.lookup(iphdr, cand_generic);
+
+			res_kernel.clear();
+			res_generic.clear();
+			f_kernel.match_filter_compiled(input, res_kernel, rc_kernel, cand_kernel);
+			f_generic.match_filter_compiled(input, res_generic, rc_generic, cand_generic);
+
+			if (res_kernel.filter_match_result)
+				matched++;
+
+			if ((res_kernel.filter_match_result != res_generic.filter_match_result) ||
+				(res_kernel.rule_no != res_generic.rule_no) ||
+				(res_kernel.direction != res_generic.direction))
+			{
+				is_equal = false;
+				break;
+			}
+		}
+
+		TEST_CASE_CHECK(is_equal, true);
+		TEST_CASE_CHECK(matched > 0, true);
+		TEST_CASE_CHECK(f_kernel.cnt_sent.get_cnt(), f_generic.cnt_sent.get_cnt());
+		TEST_CASE_CHECK(f_kernel.cnt_recv.get_cnt(), f_generic.cnt_recv.get_cnt());
+	}
+}
+
+void rule_kernel::benchmark()
+{
+	// Typical filterset rules: subnets, hosts and services
+	static const char* nets[] = { "10.0.0.0", "10.0.1.0", "192.168.0.0", "172.16.0.0", "10.10.0.0" };
+	static const unsigned short ports[] = { 21, 25, 53, 80, 110, 143, 443, 3389, 8080 };
+
+	unsigned int seed = 1357;
+	auto bench_rand = [&seed](unsigned int n) -> unsigned int { seed = seed * 1103515245 + 12345; return (seed >> 16) % n; };
+
+	std::list<rule> rules;
+	for (int i = 0; i < 1000; i++)
+	{
+		rule r(RULE_IP, nets[bench_rand(5)], "255.255.255.0", RULE_IP, "0.0.0.0", "0.0.0.0");
+		r.src_ip = r.src_ip.m_addr + bench_rand(4) * 256;
+		r.proto = (bench_rand(3) == 0) ? 17 : 6;
+		r.dst_port_type = PORT_EQUAL;
+		r.dst_port = ports[bench_rand(9)];
+		r.mirrored = DIRECTION_TWOWAY;
+		rules.push_back(r);
+	}
+
+	rule_classifier rc_kernel, rc_generic;
+	rc_kernel.compile(rules, NULL);
+	rc_generic.compile(rules, NULL);
+	rc_generic.disable_kernels();
+
+	filter2 f_interp, f_kernel, f_generic;
+	for (auto iter = rules.begin(); iter != rules.end(); ++iter)
+		f_interp.rule_add(*iter);
+
+	static const size_t packet_count = 10000;
+	std::vector<ip_header> packets(packet_count);
+	for (size_t i = 0; i < packet_count; i++)
+	{
+		packets[i].test_fill_packet(0);
+		packets[i].src_ip_addr = addrip_v4(nets[bench_rand(5)]).m_addr + bench_rand(1024);
+		packets[i].dst_ip_addr = addrip_v4("8.8.8.8").m_addr + bench_rand(256);
+		packets[i].proto = bench_rand(2) ? 6 : 17;
+		packets[i].src_port = static_cast<unsigned short>(1024 + bench_rand(60000));
+		packets[i].dst_port = bench_rand(4) ? ports[bench_rand(9)] : static_cast<unsigned short>(bench_rand(65536));
+	}
+
+	tm lt = utm::utime(2010, 05, 30, 12, 59, 12).to_tm();
+
+	match_filter_input input;
+	input.nModifyCounter = MODIFY_COUNTER_NO;
+	input.lt = &lt;
+	input.mbytes = 1048576;
+
+	match_filter_result result;
+	static const int rounds = 20;
+
+	size_t matched[3] = { 0, 0, 0 };
+	double elapsed[3];
+
+	for (int kind = 0; kind < 3; kind++)
+	{
+		std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+
+		for (int n = 0; n < rounds; n++)
+		{
+			for (size_t i = 0; i < packet_count; i++)
+			{
+				input.ip = &packets[i];
+				result.clear();
+
+				if (kind == 0)
+				{
+					f_interp.match_filter(input, result);
+				}
+				else
+				{
+					const rule_classifier& rc = (kind == 1) ? rc_generic : rc_kernel;
+					filter2& f = (kind == 1) ? f_generic : f_kernel;
+
+					rule_candidates cand;
+					rc.lookup(packets[i], cand);
+					f.match_filter_compiled(input, result, rc, cand);
+				}
+
+				if (result.filter_match_result)
+					matched[kind]++;
+			}
+		}
+
+		elapsed[kind] = std::chrono::duration<double, std::micro>(std::chrono::steady_clock::now() - start).count();
+	}
+
+	static const char* names[3] = { "interpreter", "indexed, generic", "indexed, kernels" };
+	for (int kind = 0; kind < 3; kind++)
+	{
+		std::cout << this_class_name << ": " << names[kind] << ": " << (elapsed[kind] * 1000.0 / (rounds * packet_count)) << " ns/packet, "
+			<< matched[kind] << " matched" << std::endl;
+	}
+}
+#endif
+
+}
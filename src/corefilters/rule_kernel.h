@@ -0,0 +1,54 @@
+#ifndef _UTM_RULE_KERNEL_H
+#define _UTM_RULE_KERNEL_H
+
+#pragma once
+#include <utm.h>
+
+#include "rule.h"
+
+// Address kinds of the rule kernels
+#define RULEKERNEL_ADDR_ANY 0
+#define RULEKERNEL_ADDR_MASK 1
+#define RULEKERNEL_ADDR_RANGE 2
+#define RULEKERNEL_ADDR_LAN 3
+#define RULEKERNEL_ADDR_WAN 4
+#define RULEKERNEL_ADDR_MYIP 5
+
+// Port checks of the rule kernels
+#define RULEKERNEL_PORTS_NONE 0
+#define RULEKERNEL_PORTS_DST_EQUAL 1
+#define RULEKERNEL_PORTS_SRC_EQUAL 2
+
+namespace utm {
+
+struct compiled_rule;
+struct match_filter_input;
+
+// Returns the matched direction or -1, as filter2::match_rule() does
+typedef int (*rule_kernel_func)(const compiled_rule& cr, const match_filter_input& data);
+
+//
+// Rule matchers instantiated for the common rule shapes: IP/mask, range, LAN/WAN/MyIP
+// addresses, protocol and equal ports. Other rules are checked by filter2::match_rule().
+//
+class rule_kernel
+{
+public:
+	static const char this_class_name[];
+
+	// Sets the kernel and its parameters of cr, returns false if the rule shape is not supported
+	static bool select(const rule& r, compiled_rule& cr);
+
+	static int get_addr_kind(int type, const addrip_v4& ip, const addrip_v4& mask);
+	static int get_ports_kind(const rule& r);
+
+public:
+#ifdef UTM_DEBUG
+	static void test_all();
+	static void benchmark();
+#endif
+};
+
+}
+
+#endif // _UTM_RULE_KERNEL_H
@@ -0,0 +1,640 @@
+#include "stdafx.h"
+#include "speed_history.h"
+
+#include <cstring>
+
+#include <ubase_test.h>
+
+#include <boost/filesystem.hpp>
+
+namespace utm {
+
+const char speed_history::this_class_name[] = "speed_history";
+
+static const unsigned int speedhist_intervals[SPEEDHIST_TIERS] = { REFRESH_INTERVAL, 60, 3600, 86400 };
+static const unsigned int speedhist_blocks[SPEEDHIST_TIERS] = { 128, 64, 32, 16 };
+
+// The longest encoded point
+#define SPEEDHIST_MAX_VARINT 10
+
+speed_history::speed_history() : data(NULL), series_capacity(0), series_offset(0), blocks_offset(0)
+{
+}
+
+speed_history::~speed_history()
+{
+	close();
+}
+
+unsigned int speed_history::get_interval(unsigned int tier)
+{
+	return (tier < SPEEDHIST_TIERS) ? speedhist_intervals[tier] : 0;
+}
+
+size_t speed_history::put_varint(unsigned char* p, uint64_t value)
+{
+	size_t n = 0;
+	while (value >= 0x80)
+	{
+		p[n++] = static_cast<unsigned char>(value | 0x80);
+		value >>= 7;
+	}
+
+	p[n++] = static_cast<unsigned char>(value);
+	return n;
+}
+
+size_t speed_history::get_varint(const unsigned char* p, const unsigned char* end, uint64_t& value)
+{
+	value = 0;
+	for (size_t n = 0; (n < SPEEDHIST_MAX_VARINT) && (p + n < end); n++)
+	{
+		value |= static_cast<uint64_t>(p[n] & 0x7F) << (7 * n);
+		if ((p[n] & 0x80) == 0)
+			return n + 1;
+	}
+
+	return 0;
+}
+
+void speed_history::open(const std::string& filename, unsigned int capacity)
+{
+	close();
+
+	if (capacity == 0)
+		throw std::exception("speed_history: no series");
+
+	unsigned int blocks_per_series = 0;
+	for (unsigned int t = 0; t < SPEEDHIST_TIERS; t++)
+		blocks_per_series += speedhist_blocks[t];
+
+	size_t s_offset = SPEEDHIST_BLOCK_SIZE;
+	size_t b_offset = s_offset + ((capacity * sizeof(series_header) + SPEEDHIST_BLOCK_SIZE - 1) / SPEEDHIST_BLOCK_SIZE) * SPEEDHIST_BLOCK_SIZE;
+	size_t file_size = b_offset + static_cast<size_t>(capacity) * blocks_per_series * SPEEDHIST_BLOCK_SIZE;
+
+	// The new file is zeros, the header is written after the mapping
+	bool is_new = !boost::filesystem::exists(filename);
+
+	boost::iostreams::mapped_file_params params(filename);
+	params.flags = boost::iostreams::mapped_file::readwrite;
+	if (is_new)
+		params.new_file_size = file_size;
+
+	boost::mutex::scoped_lock lock(guard);
+
+	file.open(params);
+	if (!file.is_open())
+		throw std::exception("speed_history: unable to open the file");
+
+	file_header* h = reinterpret_cast<file_header*>(file.data());
+
+	if (is_new)
+	{
+		h->magic = SPEEDHIST_MAGIC;
+		h->version = SPEEDHIST_VERSION;
+		h->series_capacity = capacity;
+		h->block_size = SPEEDHIST_BLOCK_SIZE;
+		for (unsigned int t = 0; t < SPEEDHIST_TIERS; t++)
+		{
+			h->intervals[t] = speedhist_intervals[t];
+			h->blocks[t] = speedhist_blocks[t];
+		}
+	}
+
+	bool is_valid = (file.size() == file_size) && (h->magic == SPEEDHIST_MAGIC) && (h->version == SPEEDHIST_VERSION) &&
+		(h->series_capacity == capacity) && (h->block_size == SPEEDHIST_BLOCK_SIZE);
+
+	for (unsigned int t = 0; is_valid && (t < SPEEDHIST_TIERS); t++)
+	{
+		if ((h->intervals[t] != speedhist_intervals[t]) || (h->blocks[t] != speedhist_blocks[t]))
+			is_valid = false;
+	}
+
+	if (!is_valid)
+	{
+		file.close();
+		throw std::exception("speed_history: the file has another layout");
+	}
+
+	data = reinterpret_cast<unsigned char*>(file.data());
+	series_capacity = capacity;
+	series_offset = s_offset;
+	blocks_offset = b_offset;
+	primed.assign(capacity, false);
+	counter_sets.assign(capacity, 0);
+
+	for (unsigned int i = 0; i < capacity; i++)
+	{
+		const series_header& sh = get_series(i);
+		if (sh.in_use != 0)
+			keys[sh.key] = i;
+	}
+}
+
+void speed_history::close()
+{
+	boost::mutex::scoped_lock lock(guard);
+
+	if (file.is_open())
+		file.close();
+
+	data = NULL;
+	series_capacity = 0;
+	keys.clear();
+	primed.clear();
+	counter_sets.clear();
+}
+
+speed_history::block_header& speed_history::get_block(unsigned int index, unsigned int tier, unsigned int block) const
+{
+	size_t n = 0;
+	for (unsigned int t = 0; t < SPEEDHIST_TIERS; t++)
+		n += speedhist_blocks[t];
+
+	n *= index;
+	for (unsigned int t = 0; t < tier; t++)
+		n += speedhist_blocks[t];
+
+	return *reinterpret_cast<block_header*>(data + blocks_offset + (n + block) * SPEEDHIST_BLOCK_SIZE);
+}
+
+int speed_history::find_series(unsigned int key) const
+{
+	auto iter = keys.find(key);
+	return (iter == keys.end()) ? -1 : static_cast<int>(iter->second);
+}
+
+int speed_history::add_series(unsigned int key)
+{
+	int index = find_series(key);
+	if (index >= 0)
+		return index;
+
+	for (unsigned int i = 0; i < series_capacity; i++)
+	{
+		series_header& sh = get_series(i);
+		if (sh.in_use != 0)
+			continue;
+
+		memset(&sh, 0, sizeof(sh));
+		sh.key = key;
+		sh.in_use = 1;
+
+		keys[key] = i;
+		primed[i] = false;
+		return static_cast<int>(i);
+	}
+
+	return -1;
+}
+
+void speed_history::append(unsigned int index, unsigned int tier, unsigned int time, uint64_t bytes)
+{
+	tier_state& ts = get_series(index).tiers[tier];
+	const unsigned int interval = speedhist_intervals[tier];
+
+	block_header* b = (ts.used != 0) ? &get_block(index, tier, ts.head) : NULL;
+
+	if (b != NULL)
+	{
+		unsigned int next_time = b->start_time + b->count * interval;
+
+		// The clock went back
+		if (time < next_time)
+			return;
+
+		if ((time != next_time) || (b->used + SPEEDHIST_MAX_VARINT > SPEEDHIST_BLOCK_SIZE - sizeof(block_header)) || (b->count == 0xFFFF))
+			b = NULL;
+	}
+
+	if (b == NULL)
+	{
+		if (ts.used != 0)
+			ts.head = (ts.head + 1) % speedhist_blocks[tier];
+
+		if (ts.used < speedhist_blocks[tier])
+			ts.used++;
+
+		b = &get_block(index, tier, ts.head);
+		memset(b, 0, sizeof(block_header));
+		b->start_time = time;
+	}
+
+	// Zigzag coded difference to the previous point of the block
+	int64_t delta = static_cast<int64_t>(bytes - b->last_value);
+	uint64_t coded = (static_cast<uint64_t>(delta) << 1) ^ static_cast<uint64_t>(delta >> 63);
+
+	unsigned char* p = reinterpret_cast<unsigned char*>(b) + sizeof(block_header) + b->used;
+	b->used = static_cast<uint16_t>(b->used + put_varint(p, coded));
+	b->count++;
+	b->last_value = bytes;
+}
+
+void speed_history::put_series(unsigned int index, unsigned int time, uint64_t bytes)
+{
+	series_header& sh = get_series(index);
+
+	for (unsigned int t = 0; t < SPEEDHIST_TIERS; t++)
+	{
+		tier_state& ts = sh.tiers[t];
+		unsigned int bucket_time = time - (time % speedhist_intervals[t]);
+
+		if (ts.bucket_time != bucket_time)
+		{
+			if (ts.bucket_time != 0)
+				append(index, t, ts.bucket_time, ts.bucket_bytes);
+
+			ts.bucket_time = bucket_time;
+			ts.bucket_bytes = 0;
+		}
+
+		ts.bucket_bytes += bytes;
+	}
+}
+
+// Guard must be locked
+void speed_history::put_elapsed(unsigned int index, unsigned int from, unsigned int to, uint64_t bytes)
+{
+	unsigned int first = from - (from % REFRESH_INTERVAL);
+	unsigned int count = (to - first + REFRESH_INTERVAL - 1) / REFRESH_INTERVAL;
+
+	if ((count == 0) || (to - from > SPEEDHIST_MAX_SPREAD))
+	{
+		put_series(index, (to > REFRESH_INTERVAL) ? to - REFRESH_INTERVAL : to, bytes);
+		return;
+	}
+
+	// The rest of the division goes to the last interval
+	uint64_t part = bytes / count;
+	for (unsigned int n = 0; n < count; n++)
+		put_series(index, first + n * REFRESH_INTERVAL, (n + 1 < count) ? part : bytes - part * (count - 1));
+}
+
+bool speed_history::put(unsigned int filter_id, unsigned int direction, unsigned int time, uint64_t bytes)
+{
+	boost::mutex::scoped_lock lock(guard);
+
+	if (data == NULL)
+		return false;
+
+	int index = add_series(get_key(filter_id, direction));
+	if (index < 0)
+		return false;
+
+	put_series(index, time, bytes);
+	return true;
+}
+
+void speed_history::put_counters(const filterset& fs, unsigned int now)
+{
+	boost::mutex::scoped_lock lock(guard);
+
+	if (data == NULL)
+		return;
+
+	for (auto iter = fs.filters.items.begin(); iter != fs.filters.items.end(); ++iter)
+	{
+		for (unsigned int direction = SPEEDHIST_DIRECTION_SENT; direction <= SPEEDHIST_DIRECTION_RECV; direction++)
+		{
+			int index = add_series(get_key(iter->get_id(), direction));
+			if (index < 0)
+				continue;
+
+			series_header& sh = get_series(index);
+			const filtercnt& fc = (direction == SPEEDHIST_DIRECTION_SENT) ? iter->cnt_sent : iter->cnt_recv;
+			__int64 cnt = fc.get_cnt();
+			unsigned int sets = fc.get_sets();
+			unsigned int last_time = sh.last_time;
+			sh.last_time = now;
+
+			// The counters may be reset after a restart or given by a snapshot, such a call takes the counter only.
+			// So does a call after the clock went back.
+			if (!primed[index] || (counter_sets[index] != sets) || (now < last_time))
+			{
+				primed[index] = true;
+				counter_sets[index] = sets;
+				sh.last_cnt = cnt;
+				continue;
+			}
+
+			// Counters of the reverse filters go down. A counter nearer to zero than the last one
+			// is reset, it has the bytes since the reset.
+			uint64_t bytes = static_cast<uint64_t>((cnt < 0) ? -cnt : cnt);
+			uint64_t last_bytes = static_cast<uint64_t>((sh.last_cnt < 0) ? -sh.last_cnt : sh.last_cnt);
+			bool is_reset = (bytes < last_bytes) || ((cnt < 0) != (sh.last_cnt < 0));
+			sh.last_cnt = cnt;
+
+			put_elapsed(index, last_time, now, is_reset ? bytes : bytes - last_bytes);
+		}
+	}
+}
+
+void speed_history::remove(unsigned int filter_id)
+{
+	boost::mutex::scoped_lock lock(guard);
+
+	if (data == NULL)
+		return;
+
+	for (unsigned int direction = SPEEDHIST_DIRECTION_SENT; direction <= SPEEDHIST_DIRECTION_RECV; direction++)
+	{
+		int index = find_series(get_key(filter_id, direction));
+		if (index < 0)
+			continue;
+
+		memset(&get_series(index), 0, sizeof(series_header));
+		keys.erase(get_key(filter_id, direction));
+	}
+}
+
+unsigned int speed_history::get_oldest_time(const series_header& sh, unsigned int tier) const
+{
+	const tier_state& ts = sh.tiers[tier];
+
+	if (ts.used == 0)
+		return ts.bucket_time;
+
+	unsigned int oldest = (ts.head + speedhist_blocks[tier] - ts.used + 1) % speedhist_blocks[tier];
+	unsigned int index = static_cast<unsigned int>(&sh - &get_series(0));
+
+	return get_block(index, tier, oldest).start_time;
+}
+
+void speed_history::select_tier(unsigned int filter_id, unsigned int direction, unsigned int tier, unsigned int from, unsigned int to, std::vector<speed_point>& points) const
+{
+	boost::mutex::scoped_lock lock(guard);
+
+	points.clear();
+
+	if ((data == NULL) || (tier >= SPEEDHIST_TIERS))
+		return;
+
+	int index = find_series(get_key(filter_id, direction));
+	if (index < 0)
+		return;
+
+	const tier_state& ts = get_series(index).tiers[tier];
+	const unsigned int interval = speedhist_intervals[tier];
+
+	for (unsigned int n = 0; n < ts.used; n++)
+	{
+		unsigned int block = (ts.head + speedhist_blocks[tier] - ts.used + 1 + n) % speedhist_blocks[tier];
+		const block_header& b = get_block(index, tier, block);
+
+		if ((b.start_time > to) || (b.start_time + b.count * interval <= from))
+			continue;
+
+		const unsigned char* p = reinterpret_cast<const unsigned char*>(&b) + sizeof(block_header);
+		const unsigned char* end = p + b.used;
+		uint64_t value = 0;
+
+		for (unsigned int i = 0; i < b.count; i++)
+		{
+			uint64_t coded;
+			size_t len = get_varint(p, end, coded);
+			if (len == 0)
+				break;
+
+			p += len;
+			value += (coded >> 1) ^ (0 - (coded & 1));
+
+			unsigned int time = b.start_time + i * interval;
+			if ((time >= from) && (time <= to))
+				points.push_back(speed_point(time, value));
+		}
+	}
+
+	if ((ts.bucket_time != 0) && (ts.bucket_time >= from) && (ts.bucket_time <= to))
+		points.push_back(speed_point(ts.bucket_time, ts.bucket_bytes));
+}
+
+unsigned int speed_history::select(unsigned int filter_id, unsigned int direction, unsigned int from, unsigned int to, unsigned int max_points, std::vector<speed_point>& points) const
+{
+	unsigned int tier = SPEEDHIST_TIERS - 1;
+
+	{
+		boost::mutex::scoped_lock lock(guard);
+
+		int index = (data != NULL) ? find_series(get_key(filter_id, direction)) : -1;
+
+		for (unsigned int t = 0; (index >= 0) && (t < SPEEDHIST_TIERS); t++)
+		{
+			unsigned int oldest = get_oldest_time(get_series(index), t);
+			bool is_covered = (oldest != 0) && (oldest <= from);
+			bool is_fit = ((to - from) / speedhist_intervals[t]) < max_points;
+
+			if (is_covered && is_fit)
+			{
+				tier = t;
+				break;
+			}
+		}
+	}
+
+	select_tier(filter_id, direction, tier, from, to, points);
+	return speedhist_intervals[tier];
+}
+
+#ifdef UTM_DEBUG
+void speed_history::test_all()
+{
+	test_report tr(this_class_name);
+	test_case::classname.assign(this_class_name);
+
+	{
+		test_case::testcase_num = 1;
+
+		unsigned char buf[SPEEDHIST_MAX_VARINT];
+		uint64_t values[] = { 0, 1, 127, 128, 300, 0xFFFFFFFFULL, 0xFFFFFFFFFFFFFFFFULL };
+
+		for (size_t i = 0; i < sizeof(values) / sizeof(values[0]); i++)
+		{
+			uint64_t v = 0;
+			size_t len = put_varint(buf, values[i]);
+			TEST_CASE_CHECK(len, get_varint(buf, buf + len, v));
+			TEST_CASE_CHECK(values[i], v);
+		}
+
+		TEST_CASE_CHECK(size_t(1), put_varint(buf, 127));
+		TEST_CASE_CHECK(size_t(10), put_varint(buf, 0xFFFFFFFFFFFFFFFFULL));
+		TEST_CASE_CHECK(size_t(0), get_varint(buf, buf + 3, values[0]));
+	}
+
+	boost::filesystem::path path = boost::filesystem::temp_directory_path() / boost::filesystem::unique_path("speed_history-%%%%-%%%%.dat");
+	const unsigned int t0 = 1400000000 - (1400000000 % 86400);
+
+	{
+		test_case::testcase_num = 2;
+
+		speed_history sh;
+		sh.open(path.string(), 4);
+
+		// Two hours of 2 seconds points, then a gap
+		for (unsigned int t = t0; t < t0 + 7200; t += REFRESH_INTERVAL)
+			sh.put(5, SPEEDHIST_DIRECTION_SENT, t, (t / REFRESH_INTERVAL) % 1000);
+
+		sh.put(5, SPEEDHIST_DIRECTION_SENT, t0 + 9000, 12345);
+
+		std::vector<speed_point> points;
+		sh.select_tier(5, SPEEDHIST_DIRECTION_SENT, 0, t0 + 7000, t0 + 9000, points);
+
+		TEST_CASE_CHECK(size_t(101), points.size());
+		TEST_CASE_CHECK(t0 + 7000, points[0].time);
+		TEST_CASE_CHECK(uint64_t(((t0 + 7000) / REFRESH_INTERVAL) % 1000), points[0].bytes);
+		TEST_CASE_CHECK(t0 + 9000, points.back().time);
+		TEST_CASE_CHECK(uint64_t(12345), points.back().bytes);
+
+		// Minutes are the sums of their points
+		sh.select_tier(5, SPEEDHIST_DIRECTION_SENT, 1, t0, t0 + 59, points);
+		uint64_t minute = 0;
+		for (unsigned int t = t0; t < t0 + 60; t += REFRESH_INTERVAL)
+			minute += (t / REFRESH_INTERVAL) % 1000;
+
+		TEST_CASE_CHECK(size_t(1), points.size());
+		TEST_CASE_CHECK(minute, points[0].bytes);
+
+		// The hour tier has the whole range and the open bucket
+		sh.select_tier(5, SPEEDHIST_DIRECTION_SENT, 2, t0, t0 + 9000, points);
+		TEST_CASE_CHECK(size_t(3), points.size());
+		TEST_CASE_CHECK(t0 + 7200, points[2].time);
+		TEST_CASE_CHECK(uint64_t(12345), points[2].bytes);
+
+		TEST_CASE_CHECK((unsigned int)REFRESH_INTERVAL, sh.select(5, SPEEDHIST_DIRECTION_SENT, t0 + 7000, t0 + 7200, 1000, points));
+		TEST_CASE_CHECK(3600u, sh.select(5, SPEEDHIST_DIRECTION_SENT, t0, t0 + 9000, 100, points));
+
+		sh.select_tier(5, SPEEDHIST_DIRECTION_RECV, 0, t0, t0 + 9000, points);
+		TEST_CASE_CHECK(size_t(0), points.size());
+
+		// Four series only
+		TEST_CASE_CHECK(true, sh.put(6, SPEEDHIST_DIRECTION_SENT, t0, 1));
+		TEST_CASE_CHECK(true, sh.put(6, SPEEDHIST_DIRECTION_RECV, t0, 1));
+		TEST_CASE_CHECK(true, sh.put(7, SPEEDHIST_DIRECTION_SENT, t0, 1));
+		TEST_CASE_CHECK(false, sh.put(7, SPEEDHIST_DIRECTION_RECV, t0, 1));
+
+		sh.remove(6);
+		TEST_CASE_CHECK(true, sh.put(7, SPEEDHIST_DIRECTION_RECV, t0, 1));
+	}
+
+	{
+		// The history is kept after a restart, the oldest blocks of a tier are overwritten
+		test_case::testcase_num = 3;
+
+		speed_history sh;
+		sh.open(path.string(), 4);
+
+		std::vector<speed_point> points;
+		sh.select_tier(5, SPEEDHIST_DIRECTION_SENT, 0, t0 + 9000, t0 + 9000, points);
+		TEST_CASE_CHECK(size_t(1), points.size());
+
+		for (unsigned int t = t0 + 10000; t < t0 + 200000; t += REFRESH_INTERVAL)
+			sh.put(5, SPEEDHIST_DIRECTION_SENT, t, 0);
+
+		sh.select_tier(5, SPEEDHIST_DIRECTION_SENT, 0, t0, t0 + 9000, points);
+		TEST_CASE_CHECK(size_t(0), points.size());
+
+		sh.select_tier(5, SPEEDHIST_DIRECTION_SENT, 3, t0, t0 + 200000, points);
+		TEST_CASE_CHECK(size_t(3), points.size());
+
+		uint64_t total = 12345;
+		for (unsigned int t = t0; t < t0 + 7200; t += REFRESH_INTERVAL)
+			total += (t / REFRESH_INTERVAL) % 1000;
+
+		TEST_CASE_CHECK(total, points[0].bytes);
+
+		bool is_failed = false;
+		try
+		{
+			speed_history other;
+			other.open(path.string(), 8);
+		}
+		catch (const std::exception&)
+		{
+			is_failed = true;
+		}
+
+		TEST_CASE_CHECK(true, is_failed);
+	}
+
+	{
+		// Filter counters, the first call only takes them
+		test_case::testcase_num = 4;
+
+		filterset fs;
+		filter2 f;
+		f.set_id(9);
+		fs.filters.add_element(f);
+
+		speed_history sh;
+		sh.open(path.string(), 4);
+		sh.remove(5);
+		sh.remove(7);
+
+		filter2& fr = fs.filters.items.front();
+		fr.cnt_sent.set_cnt(1000);
+		sh.put_counters(fs, t0 + 2);
+
+		fr.cnt_sent.add_cnt(500);
+		fr.cnt_recv.add_cnt(-40);
+		sh.put_counters(fs, t0 + 4);
+
+		std::vector<speed_point> points;
+		sh.select_tier(9, SPEEDHIST_DIRECTION_SENT, 0, t0, t0 + 4, points);
+		TEST_CASE_CHECK(size_t(1), points.size());
+		TEST_CASE_CHECK(t0 + 2, points[0].time);
+		TEST_CASE_CHECK(uint64_t(500), points[0].bytes);
+
+		sh.select_tier(9, SPEEDHIST_DIRECTION_RECV, 0, t0, t0 + 4, points);
+		TEST_CASE_CHECK(size_t(1), points.size());
+		TEST_CASE_CHECK(uint64_t(40), points[0].bytes);
+
+		// A reset counter has the bytes since the reset, a counter given a value is taken only
+		test_case::testcase_num = 5;
+
+		fr.reset_filter_counters(false);
+		fr.cnt_sent.add_cnt(300);
+		sh.put_counters(fs, t0 + 6);
+
+		fr.cnt_sent.set_cnt(100000);
+		sh.put_counters(fs, t0 + 8);
+
+		fr.cnt_sent.add_cnt(20);
+		sh.put_counters(fs, t0 + 10);
+
+		sh.select_tier(9, SPEEDHIST_DIRECTION_SENT, 0, t0, t0 + 10, points);
+		TEST_CASE_CHECK(size_t(3), points.size());
+		TEST_CASE_CHECK(uint64_t(300), points[1].bytes);
+		TEST_CASE_CHECK(t0 + 8, points[2].time);
+		TEST_CASE_CHECK(uint64_t(20), points[2].bytes);
+
+		// A late call spreads its bytes over the intervals since the previous one
+		test_case::testcase_num = 6;
+
+		fr.cnt_sent.add_cnt(301);
+		sh.put_counters(fs, t0 + 16);
+
+		sh.select_tier(9, SPEEDHIST_DIRECTION_SENT, 0, t0 + 10, t0 + 16, points);
+		TEST_CASE_CHECK(size_t(3), points.size());
+		TEST_CASE_CHECK(t0 + 10, points[0].time);
+		TEST_CASE_CHECK(uint64_t(100), points[0].bytes);
+		TEST_CASE_CHECK(t0 + 14, points[2].time);
+		TEST_CASE_CHECK(uint64_t(101), points[2].bytes);
+
+		// A call after the clock went back takes the counter only
+		fr.cnt_sent.add_cnt(50);
+		sh.put_counters(fs, t0 + 12);
+
+		fr.cnt_sent.add_cnt(7);
+		sh.put_counters(fs, t0 + 18);
+
+		sh.select_tier(9, SPEEDHIST_DIRECTION_SENT, 1, t0, t0 + 59, points);
+		TEST_CASE_CHECK(size_t(1), points.size());
+		TEST_CASE_CHECK(uint64_t(500 + 300 + 20 + 301 + 7), points[0].bytes);
+	}
+
+	boost::filesystem::remove(path);
+
+	return;
+}
+#endif
+
+}
@@ -0,0 +1,164 @@
+#ifndef _UTM_SPEED_HISTORY_H
+#define _UTM_SPEED_HISTORY_H
+
+#pragma once
+#include <utm.h>
+
+#include <filterset.h>
+
+#include <map>
+#include <string>
+#include <vector>
+
+#include <boost/iostreams/device/mapped_file.hpp>
+#include <boost/thread/mutex.hpp>
+
+#define SPEEDHIST_TIERS 4
+#define SPEEDHIST_BLOCK_SIZE 256
+#define SPEEDHIST_MAGIC 0x48535455			// "UTSH"
+#define SPEEDHIST_VERSION 2
+#define SPEEDHIST_DEFAULT_SERIES 512		// two series per filter
+#define SPEEDHIST_MAX_SPREAD 3600			// seconds, a longer gap between the counters goes to one point
+
+#define SPEEDHIST_DIRECTION_SENT 0
+#define SPEEDHIST_DIRECTION_RECV 1
+
+namespace utm {
+
+struct speed_point
+{
+	speed_point() : time(0), bytes(0) { };
+	speed_point(unsigned int _time, uint64_t _bytes) : time(_time), bytes(_bytes) { };
+
+	unsigned int time;			// start of the interval
+	uint64_t bytes;				// bytes during the interval
+};
+
+//
+// Traffic history of the filters in a memory-mapped file. Every filter has a series for the
+// sent and the received traffic, a series keeps the bytes per interval in four tiers:
+// REFRESH_INTERVAL, minute, hour and day. A point goes to all tiers, the coarse tiers sum it
+// into their open bucket.
+//
+// A tier is a ring of fixed size blocks, a block holds the points of consecutive intervals
+// from its start time as varint encoded differences of the values. The oldest block of the
+// ring is overwritten, so the file has a fixed size and the coarse tiers keep longer
+// periods. A series takes 240 blocks, 60 KB of the file; only the blocks which are written or
+// read are touched in memory, the open block of each tier when the points are put.
+//
+// The history does not replace filtercnt::cnt_set, the speed window of the GUI protocol
+// stays in memory next to it.
+//
+class speed_history
+{
+	struct tier_state
+	{
+		uint32_t head;				// the block written now
+		uint32_t used;				// blocks with data
+		uint32_t bucket_time;		// the open bucket, zero if none
+		uint32_t reserved;
+		uint64_t bucket_bytes;
+	};
+
+	struct series_header
+	{
+		uint32_t key;
+		uint32_t in_use;
+		int64_t last_cnt;			// the filter counter at the last put_counters()
+		uint32_t last_time;			// of the last put_counters()
+		uint32_t reserved;
+		tier_state tiers[SPEEDHIST_TIERS];
+	};
+
+	struct block_header
+	{
+		uint32_t start_time;
+		uint16_t count;
+		uint16_t used;				// bytes of the encoded points
+		uint64_t last_value;
+	};
+
+	struct file_header
+	{
+		uint32_t magic;
+		uint32_t version;
+		uint32_t series_capacity;
+		uint32_t block_size;
+		uint32_t intervals[SPEEDHIST_TIERS];
+		uint32_t blocks[SPEEDHIST_TIERS];
+		uint32_t reserved[4];
+	};
+
+public:
+	static const char this_class_name[];
+
+	speed_history();
+	~speed_history();
+
+	// Creates the file or opens the existing one, it must have the same layout
+	void open(const std::string& filename, unsigned int series_capacity);
+	void close();
+	bool is_open() const { return file.is_open(); };
+
+	// The bytes which passed in the interval starting at the time. False if there is no free series.
+	bool put(unsigned int filter_id, unsigned int direction, unsigned int time, uint64_t bytes);
+
+	// Puts the counter changes of all filters since the previous call, the bytes are spread over
+	// the intervals between the times of the calls
+	void put_counters(const filterset& fs, unsigned int now);
+
+	void remove(unsigned int filter_id);
+
+	// Points of the tier in [from, to] including the open bucket
+	void select_tier(unsigned int filter_id, unsigned int direction, unsigned int tier, unsigned int from, unsigned int to, std::vector<speed_point>& points) const;
+
+	// The finest tier which has the start of the range and no more than max_points in it,
+	// returns the interval of the points
+	unsigned int select(unsigned int filter_id, unsigned int direction, unsigned int from, unsigned int to, unsigned int max_points, std::vector<speed_point>& points) const;
+
+	static unsigned int get_interval(unsigned int tier);
+
+	static size_t put_varint(unsigned char* p, uint64_t value);
+	static size_t get_varint(const unsigned char* p, const unsigned char* end, uint64_t& value);
+
+private:
+	speed_history(const speed_history&);
+	speed_history& operator=(const speed_history&);
+
+	static unsigned int get_key(unsigned int filter_id, unsigned int direction) { return (filter_id << 1) | (direction & 1); };
+
+	int find_series(unsigned int key) const;
+	int add_series(unsigned int key);
+
+	series_header& get_series(unsigned int index) const { return reinterpret_cast<series_header*>(data + series_offset)[index]; };
+	block_header& get_block(unsigned int index, unsigned int tier, unsigned int block) const;
+
+	void put_series(unsigned int index, unsigned int time, uint64_t bytes);
+	void put_elapsed(unsigned int index, unsigned int from, unsigned int to, uint64_t bytes);
+	void append(unsigned int index, unsigned int tier, unsigned int time, uint64_t bytes);
+	unsigned int get_oldest_time(const series_header& sh, unsigned int tier) const;
+
+	boost::iostreams::mapped_file file;
+	unsigned char* data;
+	unsigned int series_capacity;
+	size_t series_offset;
+	size_t blocks_offset;
+
+	// Series index by the key
+	std::map<unsigned int, unsigned int> keys;
+
+	// Series which have their last counter from this process, and filtercnt::get_sets() of the counter
+	std::vector<bool> primed;
+	std::vector<unsigned int> counter_sets;
+
+	mutable boost::mutex guard;
+
+#ifdef UTM_DEBUG
+public:
+	static void test_all();
+#endif
+};
+
+}
+
+#endif // _UTM_SPEED_HISTORY_H
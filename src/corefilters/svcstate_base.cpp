@@ -49,6 +49,8 @@ svcstate_base& svcstate_base::operator=(const svcstate_base& rhs)
     total_packets_captured_prev = rhs.total_packets_captured_prev.load();
     total_packets_speed = rhs.total_packets_speed.load();
     total_netflow_packets_captured = rhs.total_netflow_packets_captured.load();
+    total_packets_dropped = rhs.total_packets_dropped.load();
+    total_ring_freezes = rhs.total_ring_freezes.load();
     CaptureStatus = rhs.CaptureStatus;
     license_type = rhs.license_type;
     reg_name = rhs.reg_name;
@@ -85,6 +87,8 @@ bool svcstate_base::operator==(const svcstate_base& rhs) const
     if (!(total_packets_captured_prev == rhs.total_packets_captured_prev)) return false;
     if (!(total_packets_speed == rhs.total_packets_speed)) return false;
     if (!(total_netflow_packets_captured == rhs.total_netflow_packets_captured)) return false;
+    if (!(total_packets_dropped == rhs.total_packets_dropped)) return false;
+    if (!(total_ring_freezes == rhs.total_ring_freezes)) return false;
     if (!(CaptureStatus == rhs.CaptureStatus)) return false;
     if (!(license_type == rhs.license_type)) return false;
     if (!(reg_name == rhs.reg_name)) return false;
@@ -122,6 +126,8 @@ void svcstate_base::clear()
     total_packets_captured_prev = 0;
     total_packets_speed = 0;
     total_netflow_packets_captured = 0;
+    total_packets_dropped = 0;
+    total_ring_freezes = 0;
     CaptureStatus.set_stopped();
     license_type.clear();
     reg_name.clear();
@@ -170,6 +176,8 @@ void svcstate_base::xml_create()
     xml_append_node("TotalPacketsCapturedPrev", total_packets_captured_prev.load(), orig.total_packets_captured_prev.load());
     xml_append_node("TotalPacketsSpeed", total_packets_speed.load(), orig.total_packets_speed.load());
     xml_append_node("TotalNetflowPacketsCaptured", total_netflow_packets_captured.load(), orig.total_netflow_packets_captured.load());
+    xml_append_node("TotalPacketsDropped", total_packets_dropped.load(), orig.total_packets_dropped.load());
+    xml_append_node("TotalRingFreezes", total_ring_freezes.load(), orig.total_ring_freezes.load());
     xml_append_node("CaptureStatus", CaptureStatus, orig.CaptureStatus);
     xml_append_node("LicenseType", license_type, orig.license_type);
     xml_append_node("RegName", reg_name, orig.reg_name);
@@ -205,6 +213,8 @@ void svcstate_base::xml_catch_value(const char *keyname, const char *keyvalue)
     if (xml_check_value(keyname, "TotalPacketsCapturedPrev", keyvalue, total_packets_captured_prev)) return;
     if (xml_check_value(keyname, "TotalPacketsSpeed", keyvalue, total_packets_speed)) return;
     if (xml_check_value(keyname, "TotalNetflowPacketsCaptured", keyvalue, total_netflow_packets_captured)) return;
+    if (xml_check_value(keyname, "TotalPacketsDropped", keyvalue, total_packets_dropped)) return;
+    if (xml_check_value(keyname, "TotalRingFreezes", keyvalue, total_ring_freezes)) return;
     if (xml_check_value(keyname, "CaptureStatus", keyvalue, CaptureStatus)) return;
     if (xml_check_value(keyname, "LicenseType", keyvalue, license_type)) return;
     if (xml_check_value(keyname, "RegName", keyvalue, reg_name)) return;
@@ -9,6 +9,7 @@
 #include <ubase.h>
 #include <gstring.h>
 #include <capture_status.h>
+#include <sharded_counter.h>
 #include <atomic>
 
 #define  SVCSTATE_XMLTAG_ROOT "SvcState"
@@ -45,13 +46,15 @@ public:
     std::atomic_uint_fast32_t uptime_seconds;
     time_t current_time;
     tm current_tm;
-    std::atomic_uint_fast64_t total_bytes_captured;
+    utm::sharded_counter<uint64_t> total_bytes_captured;
     std::atomic_uint_fast64_t total_bytes_captured_prev;
     std::atomic_uint_fast32_t total_bytes_speed;
-    std::atomic_uint_fast64_t total_packets_captured;
+    utm::sharded_counter<uint64_t> total_packets_captured;
     std::atomic_uint_fast64_t total_packets_captured_prev;
     std::atomic_uint_fast32_t total_packets_speed;
     std::atomic_uint_fast32_t total_netflow_packets_captured;
+    std::atomic_uint_fast64_t total_packets_dropped;
+    std::atomic_uint_fast64_t total_ring_freezes;
     utm::capture_status CaptureStatus;
     utm::gstring license_type;
     utm::gstring reg_name;
@@ -0,0 +1,247 @@
+#include "stdafx.h"
+#include "tls_sni.h"
+
+#include <cstring>
+#include <string>
+#include <vector>
+
+#include <ubase_test.h>
+
+namespace utm {
+
+const char tls_sni::this_class_name[] = "tls_sni";
+
+static inline size_t tls_get_short(const unsigned char* p)
+{
+	return (static_cast<size_t>(p[0]) << 8) | p[1];
+}
+
+bool tls_sni::is_client_hello(const unsigned char* data, size_t len)
+{
+	if ((data == NULL) || (len < TLS_RECORD_HEADER + 1))
+		return false;
+
+	// Handshake record of SSL 3.0 - TLS 1.3 with the ClientHello message
+	return (data[0] == 0x16) && (data[1] == 0x03) && (data[2] <= 0x04) && (data[5] == 0x01);
+}
+
+size_t tls_sni::get_record_length(const unsigned char* data, size_t len)
+{
+	if ((data == NULL) || (len < TLS_RECORD_HEADER))
+		return 0;
+
+	return TLS_RECORD_HEADER + tls_get_short(data + 3);
+}
+
+int tls_sni::parse(const unsigned char* data, size_t len, size_t& name_offset, size_t& name_len)
+{
+	if (!is_client_hello(data, len))
+		return TLS_SNI_NOT_TLS;
+
+	size_t record_end = get_record_length(data, len);
+	size_t end = (len < record_end) ? len : record_end;
+
+	// A field after the received data is either coming or is not there at all
+	int truncated = (len < record_end) ? TLS_SNI_MORE_DATA : TLS_SNI_NONE;
+
+	// Handshake header, version and random
+	size_t pos = TLS_RECORD_HEADER;
+	if (pos + 4 > end)
+		return truncated;
+
+	size_t hs_end = pos + 4 + ((static_cast<size_t>(data[pos + 1]) << 16) | tls_get_short(data + pos + 2));
+	if (hs_end > record_end)
+		hs_end = record_end;
+
+	pos += 4 + 2 + 32;
+
+	// Session id
+	if (pos + 1 > end)
+		return truncated;
+	pos += 1 + data[pos];
+
+	// Cipher suites
+	if (pos + 2 > end)
+		return truncated;
+	pos += 2 + tls_get_short(data + pos);
+
+	// Compression methods
+	if (pos + 1 > end)
+		return truncated;
+	pos += 1 + data[pos];
+
+	// Extensions
+	if (pos + 2 > end)
+		return truncated;
+
+	size_t ext_end = pos + 2 + tls_get_short(data + pos);
+	if (ext_end > hs_end)
+		ext_end = hs_end;
+
+	pos += 2;
+
+	while (pos + 4 <= ext_end)
+	{
+		if (pos + 4 > end)
+			return truncated;
+
+		size_t ext_type = tls_get_short(data + pos);
+		size_t ext_len = tls_get_short(data + pos + 2);
+		pos += 4;
+
+		if (ext_type != 0)
+		{
+			pos += ext_len;
+			continue;
+		}
+
+		// server_name: list length, then name type, name length and the name
+		if (pos + ext_len > ext_end)
+			return TLS_SNI_NONE;
+
+		if (pos + ext_len > end)
+			return truncated;
+
+		if ((ext_len < 5) || (data[pos + 2] != 0))
+			return TLS_SNI_NONE;
+
+		size_t nlen = tls_get_short(data + pos + 3);
+		if ((nlen == 0) || (5 + nlen > ext_len))
+			return TLS_SNI_NONE;
+
+		for (size_t i = 0; i < nlen; i++)
+		{
+			unsigned char c = data[pos + 5 + i];
+			if ((c <= 0x20) || (c >= 0x7F))
+				return TLS_SNI_NONE;
+		}
+
+		name_offset = pos + 5;
+		name_len = nlen;
+		return TLS_SNI_FOUND;
+	}
+
+	return TLS_SNI_NONE;
+}
+
+#ifdef UTM_DEBUG
+static void tls_test_put_short(std::vector<unsigned char>& v, size_t n)
+{
+	v.push_back(static_cast<unsigned char>(n >> 8));
+	v.push_back(static_cast<unsigned char>(n & 0xFF));
+}
+
+// ClientHello with the padding extension before the server name
+static std::vector<unsigned char> tls_test_client_hello(const char* name)
+{
+	std::vector<unsigned char> ext;
+
+	tls_test_put_short(ext, 0x0015);
+	tls_test_put_short(ext, 100);
+	ext.resize(ext.size() + 100, 0);
+
+	if (name != NULL)
+	{
+		size_t nlen = strlen(name);
+		tls_test_put_short(ext, 0x0000);
+		tls_test_put_short(ext, nlen + 5);
+		tls_test_put_short(ext, nlen + 3);
+		ext.push_back(0);
+		tls_test_put_short(ext, nlen);
+		ext.insert(ext.end(), name, name + nlen);
+	}
+
+	tls_test_put_short(ext, 0x000B);
+	tls_test_put_short(ext, 2);
+	ext.push_back(1);
+	ext.push_back(0);
+
+	std::vector<unsigned char> body;
+	body.push_back(0x03);
+	body.push_back(0x03);
+	body.resize(body.size() + 32, 0x5A);			// random
+	body.push_back(32);
+	body.resize(body.size() + 32, 0xA5);			// session id
+	tls_test_put_short(body, 4);
+	tls_test_put_short(body, 0x1301);
+	tls_test_put_short(body, 0xC02F);
+	body.push_back(1);
+	body.push_back(0);
+	tls_test_put_short(body, ext.size());
+	body.insert(body.end(), ext.begin(), ext.end());
+
+	std::vector<unsigned char> rec;
+	rec.push_back(0x16);
+	rec.push_back(0x03);
+	rec.push_back(0x01);
+	tls_test_put_short(rec, body.size() + 4);
+	rec.push_back(0x01);
+	rec.push_back(0);
+	tls_test_put_short(rec, body.size());
+	rec.insert(rec.end(), body.begin(), body.end());
+
+	return rec;
+}
+
+void tls_sni::test_all()
+{
+	test_report tr(this_class_name);
+
+	size_t offset = 0;
+	size_t len = 0;
+
+	test_case::classname.assign("parse");
+	{
+		test_case::testcase_num = 1;
+		std::vector<unsigned char> hello = tls_test_client_hello("www.example.com");
+		TEST_CASE_CHECK(true, is_client_hello(&hello[0], hello.size()));
+		TEST_CASE_CHECK(hello.size(), get_record_length(&hello[0], hello.size()));
+		TEST_CASE_CHECK(TLS_SNI_FOUND, parse(&hello[0], hello.size(), offset, len));
+		TEST_CASE_CHECK(std::string("www.example.com"), std::string(reinterpret_cast<const char*>(&hello[offset]), len));
+
+		// Every prefix needs more data until the name is there
+		test_case::testcase_num = 2;
+		size_t name_end = offset + len;
+		size_t wrong = 0;
+		for (size_t n = TLS_RECORD_HEADER + 1; n < hello.size(); n++)
+		{
+			int res = parse(&hello[0], n, offset, len);
+			if (res != ((n >= name_end) ? TLS_SNI_FOUND : TLS_SNI_MORE_DATA))
+				wrong++;
+		}
+		TEST_CASE_CHECK(size_t(0), wrong);
+
+		test_case::testcase_num = 3;
+		std::vector<unsigned char> noname = tls_test_client_hello(NULL);
+		TEST_CASE_CHECK(TLS_SNI_NONE, parse(&noname[0], noname.size(), offset, len));
+		TEST_CASE_CHECK(TLS_SNI_MORE_DATA, parse(&noname[0], noname.size() - 5, offset, len));
+
+		test_case::testcase_num = 4;
+		const unsigned char http[] = "GET / HTTP/1.1\r\n";
+		TEST_CASE_CHECK(TLS_SNI_NOT_TLS, parse(http, sizeof(http) - 1, offset, len));
+
+		// Lengths out of the record are not followed
+		test_case::testcase_num = 5;
+		size_t failed = 0;
+		unsigned int seed = 2015;
+		for (int n = 0; n < 20000; n++)
+		{
+			std::vector<unsigned char> bad(hello);
+			for (int k = 0; k < 4; k++)
+			{
+				seed = seed * 1103515245 + 12345;
+				bad[TLS_RECORD_HEADER + 1 + (seed >> 8) % (bad.size() - TLS_RECORD_HEADER - 1)] = static_cast<unsigned char>(seed >> 24);
+			}
+
+			int res = parse(&bad[0], bad.size(), offset, len);
+			if ((res == TLS_SNI_FOUND) && (offset + len > bad.size()))
+				failed++;
+		}
+		TEST_CASE_CHECK(size_t(0), failed);
+	}
+
+	return;
+}
+#endif
+
+}
@@ -0,0 +1,45 @@
+#ifndef _TLS_SNI_H
+#define _TLS_SNI_H
+
+#pragma once
+
+// Results of tls_sni::parse
+#define TLS_SNI_NOT_TLS 0		// not a ClientHello record
+#define TLS_SNI_MORE_DATA 1		// the server name can be in the bytes not received yet
+#define TLS_SNI_NONE 2			// the ClientHello has no server name
+#define TLS_SNI_FOUND 3
+
+#define TLS_RECORD_HEADER 5
+#define TLS_MAX_RECORD (16384 + TLS_RECORD_HEADER)
+
+namespace utm {
+
+//
+// Server name of the TLS ClientHello. Only the first handshake record is parsed, fields are
+// skipped by their lengths. The data can be a prefix of the record which comes in several
+// packets, then the parse is repeated with more data.
+//
+class tls_sni
+{
+public:
+	static const char this_class_name[];
+
+public:
+	// The payload starts with a handshake record of a ClientHello
+	static bool is_client_hello(const unsigned char* data, size_t len);
+
+	// Length of the record, the payload must start with its header
+	static size_t get_record_length(const unsigned char* data, size_t len);
+
+	// Returns TLS_SNI_*, the name is at name_offset of the data when TLS_SNI_FOUND
+	static int parse(const unsigned char* data, size_t len, size_t& name_offset, size_t& name_len);
+
+#ifdef UTM_DEBUG
+public:
+	static void test_all();
+#endif
+};
+
+}
+
+#endif // _TLS_SNI_H
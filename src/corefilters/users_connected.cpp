@@ -3,23 +3,32 @@
 
 #include <ubase_test.h>
 
+#ifdef UTM_DEBUG
+#include <boost/thread.hpp>
+#include <chrono>
+#include <iostream>
+#endif
+
 namespace utm {
 
 unsigned int users_connected::update_timeout_sec = 10;
 const char users_connected::this_class_name[] = "users_connected";
 
-users_connected::users_connected(void)
+users_connected::users_connected(void) : current(NULL), is_stale(false)
 {
 }
 
 users_connected::~users_connected(void)
 {
+	delete current.load();
 }
 
-users_connected::users_connected(const users_connected& rhs)
+users_connected::users_connected(const users_connected& rhs) : current(NULL), is_stale(false)
 {
 	users = rhs.users;
-	ips = rhs.ips;
+	rebuild_expiries();
+	set_stale();
+	publish_table();
 }
 
 users_connected& users_connected::operator=(const users_connected& rhs)
@@ -39,14 +48,18 @@ void users_connected::copy_from_safe(const users_connected& source)
 {
 	boost::mutex::scoped_lock lock(guard);
 	users = source.users;
-	ips = source.ips;
+	rebuild_expiries();
+	set_stale();
+	publish_table();
 }
 
 void users_connected::copy_to_safe(users_connected& destination) const
 {
 	boost::mutex::scoped_lock lock(guard);
 	destination.users = users;
-	destination.ips = ips;
+	destination.rebuild_expiries();
+	destination.set_stale();
+	destination.publish_table();
 }
 
 void users_connected::update_user(unsigned int uid, const user_connection& request)
@@ -66,17 +79,41 @@ void users_connected::update_user(unsigned int uid, const user_connection& reque
 			if (uc.addr == request.addr)
 			{
 				uc = request;
-				ips[request.addr] = std::pair<unsigned int, utimestamp>(uid, request.updatestamp);
 				addr_found = true;
 			}
 		}
 	}
 
 	if (!addr_found)
-	{
 		users.insert(std::pair<unsigned int, user_connection>(uid, request));
-		ips[request.addr] = std::pair<unsigned int, utimestamp>(uid, request.updatestamp);
+
+	push_expiry(uid, request);
+
+	// A heartbeat of a published connection is stored in place
+	std::int64_t seen = request.updatestamp.ts;
+	const seen_table* t = current.load();
+	const seen_slot* user_slot = (t == NULL) ? NULL : find_slot(t->users.get(), t->mask, make_key(uid, request.addr));
+	if (user_slot == NULL)
+	{
+		// A new connection takes a free slot while at most half of the slots are used,
+		// otherwise the table grows
+		if ((t == NULL) || is_stale || (users.size() * 2 > t->mask + 1))
+		{
+			set_stale();
+			publish_table();
+			return;
+		}
+
+		insert_seen(t->users.get(), t->mask, make_key(uid, request.addr), seen);
+		insert_seen(t->addrs.get(), t->mask, make_key(request.addr), seen);
+		return;
 	}
+
+	user_slot->seen.store(seen);
+
+	const seen_slot* addr_slot = find_slot(t->addrs.get(), t->mask, make_key(request.addr));
+	if ((addr_slot != NULL) && (addr_slot->seen.load() < seen))
+		addr_slot->seen.store(seen);
 }
 
 bool users_connected::check_for_double_login(unsigned int uid, const addrip_v4& addr, const utimestamp& current_timestamp)
@@ -109,27 +146,15 @@ bool users_connected::check_for_double_login(unsigned int uid, const addrip_v4&
 
 bool users_connected::check_user_and_ip(unsigned int uid, const addrip_v4& addr, const utimestamp& current_timestamp)
 {
-	boost::mutex::scoped_lock lock(guard);
-
-	std::pair<users_connected_container::iterator, users_connected_container::iterator> key_range = users.equal_range(uid);
+	rcu_domain<seen_table>::reader section(tables);
 
 	bool found_user = false;
-
-	if (key_range.first != users.end())
+	const seen_table* t = current.load();
+	if (t != NULL)
 	{
-		users_connected_container::iterator iter;
-		for (iter = key_range.first; iter != key_range.second; ++iter)
-		{
-			user_connection& uc = iter->second;
-			if (uc.addr == addr)
-			{
-				if (!current_timestamp.is_greater_than_by_sec(uc.updatestamp, users_connected::update_timeout_sec))
-				{
-					found_user = true;
-				}
-				break;
-			}
-		}
+		const seen_slot* slot = find_slot(t->users.get(), t->mask, make_key(uid, addr));
+		if (slot != NULL)
+			found_user = !current_timestamp.is_greater_than_by_sec(utimestamp(time_t(slot->seen.load())), users_connected::update_timeout_sec);
 	}
 
 	return found_user;
@@ -137,16 +162,18 @@ bool users_connected::check_user_and_ip(unsigned int uid, const addrip_v4& addr,
 
 bool users_connected::check_for_any_ip(const addrip_v4& addr, const utimestamp& current_timestamp)
 {
-	boost::mutex::scoped_lock lock(guard);
-
-	ip2user_container::iterator iter = ips.find(addr);
-	if (iter == ips.end())
-		return false;
+	rcu_domain<seen_table>::reader section(tables);
 
-	if (current_timestamp.is_greater_than_by_sec(iter->second.second, users_connected::update_timeout_sec))
-		return false;
+	bool found_user = false;
+	const seen_table* t = current.load();
+	if (t != NULL)
+	{
+		const seen_slot* slot = find_slot(t->addrs.get(), t->mask, make_key(addr));
+		if (slot != NULL)
+			found_user = !current_timestamp.is_greater_than_by_sec(utimestamp(time_t(slot->seen.load())), users_connected::update_timeout_sec);
+	}
 
-	return true;
+	return found_user;
 }
 
 bool users_connected::find_user_ips(unsigned int uid, addr4s_container& addrs, bool& is_disabled)
@@ -175,35 +202,138 @@ void users_connected::purge_disconnected_users(const utimestamp& current_timesta
 
 	bool found_disconnected = false;
 
-	users_connected_container::iterator iter;
-	for (iter = users.begin(); iter != users.end(); )
+	while (!expiries.empty())
 	{
-		if (current_timestamp.is_greater_than_by_sec(iter->second.updatestamp, users_connected::update_timeout_sec))
-		{
-			iter = users.erase(iter);
-			found_disconnected = true;
-		}
-		else
+		expiry e = expiries.top();
+		if (!current_timestamp.is_greater_than_by_sec(utimestamp(time_t(e.seen)), users_connected::update_timeout_sec))
+			break;
+
+		expiries.pop();
+
+		// The connection could be updated after the entry was pushed
+		std::pair<users_connected_container::iterator, users_connected_container::iterator> key_range = users.equal_range(e.uid);
+
+		users_connected_container::iterator iter;
+		for (iter = key_range.first; iter != key_range.second; ++iter)
 		{
-			++iter;
+			if ((iter->second.addr == e.addr) && (iter->second.updatestamp.ts == e.seen))
+			{
+				users.erase(iter);
+				found_disconnected = true;
+				break;
+			}
 		}
 	}
 
 	if (found_disconnected)
+		set_stale();
+
+	publish_table();
+}
+
+void users_connected::publish_users()
+{
+	boost::mutex::scoped_lock lock(guard);
+	publish_table();
+}
+
+// Guard must be locked
+void users_connected::publish_table()
+{
+	if (!is_stale)
+		return;
+
+	is_stale = false;
+
+	// At most half of the slots are used, so the probes are short
+	size_t size = 16;
+	while (size < users.size() * 2)
+		size <<= 1;
+
+	seen_table* t = new seen_table(size);
+
+	users_connected_container::iterator iter;
+	for (iter = users.begin(); iter != users.end(); ++iter)
 	{
-		ips.clear();
-		for (iter = users.begin(); iter != users.end(); ++iter)
-		{
-			ips[iter->second.addr] = std::pair<unsigned int, utimestamp>(iter->first, iter->second.updatestamp);
-		}
+		std::int64_t seen = iter->second.updatestamp.ts;
+		insert_seen(t->users.get(), t->mask, make_key(iter->first, iter->second.addr), seen);
+		insert_seen(t->addrs.get(), t->mask, make_key(iter->second.addr), seen);
 	}
+
+	tables.retire(current.exchange(t));
 }
 
 void users_connected::clear()
 {
 	boost::mutex::scoped_lock lock(guard);
 	users.clear();
-	ips.clear();
+	expiries = expiry_heap();
+	is_stale = false;
+	tables.retire(current.exchange(NULL));
+}
+
+void users_connected::set_stale()
+{
+	is_stale = true;
+}
+
+void users_connected::push_expiry(unsigned int uid, const user_connection& uc)
+{
+	expiry e;
+	e.seen = uc.updatestamp.ts;
+	e.uid = uid;
+	e.addr = uc.addr;
+	expiries.push(e);
+
+	// Without purges the entries of the heartbeats are piling up
+	if (expiries.size() > users.size() * 4 + 64)
+		rebuild_expiries();
+}
+
+void users_connected::rebuild_expiries()
+{
+	std::vector<expiry> entries;
+	entries.reserve(users.size());
+
+	users_connected_container::iterator iter;
+	for (iter = users.begin(); iter != users.end(); ++iter)
+	{
+		expiry e;
+		e.seen = iter->second.updatestamp.ts;
+		e.uid = iter->first;
+		e.addr = iter->second.addr;
+		entries.push_back(e);
+	}
+
+	expiries = expiry_heap(std::greater<expiry>(), std::move(entries));
+}
+
+const users_connected::seen_slot* users_connected::find_slot(const seen_slot* slots, size_t mask, uint64_t key)
+{
+	for (size_t n = get_slot(key, mask); slots[n].key != USERSCONN_EMPTY_KEY; n = (n + 1) & mask)
+	{
+		if (slots[n].key == key)
+			return &slots[n];
+	}
+
+	return NULL;
+}
+
+void users_connected::insert_seen(seen_slot* slots, size_t mask, uint64_t key, std::int64_t seen)
+{
+	size_t n = get_slot(key, mask);
+	while ((slots[n].key != USERSCONN_EMPTY_KEY) && (slots[n].key != key))
+		n = (n + 1) & mask;
+
+	if (slots[n].key != key)
+	{
+		slots[n].seen.store(seen);
+		slots[n].key.store(key);
+	}
+	else if (slots[n].seen.load() < seen)
+	{
+		slots[n].seen.store(seen);
+	}
 }
 
 void users_connected::xml_create()
@@ -237,19 +367,8 @@ void users_connected::xml_catch_value(const char *keyname, const char *keyvalue)
 		{
 			boost::mutex::scoped_lock lock(guard);
 			users.insert(std::pair<unsigned int, user_connection>(uid, uc));
-
-			ip2user_container::iterator iter = ips.find(uc.addr);
-			if (iter != ips.end())
-			{
-				if (iter->second.second < uc.updatestamp)
-				{
-					iter->second = std::pair<unsigned int, utimestamp>(uid, uc.updatestamp);
-				}
-			}
-			else
-			{
-				ips[uc.addr] = std::pair<unsigned int, utimestamp>(uid, uc.updatestamp);
-			}
+			push_expiry(uid, uc);
+			set_stale();
 		}
 	}
 }
@@ -291,10 +410,136 @@ void users_connected::test_fillparams(int test_num)
 
 	test_case::classname.assign(this_class_name);
 	TEST_CASE_CHECK(users.size(), size_t(4));
-	TEST_CASE_CHECK(ips.size(), size_t(2));
+
+	utimestamp now;
+	now.now();
+
+	TEST_CASE_CHECK(check_user_and_ip(10, utm::addrip_v4("192.168.1.1"), now), true);
+	TEST_CASE_CHECK(check_user_and_ip(16, utm::addrip_v4("192.168.1.2"), now), true);
+	TEST_CASE_CHECK(check_user_and_ip(10, utm::addrip_v4("192.168.1.2"), now), false);
+	TEST_CASE_CHECK(check_for_any_ip(utm::addrip_v4("192.168.1.2"), now), true);
+	TEST_CASE_CHECK(check_for_any_ip(utm::addrip_v4("192.168.1.3"), now), false);
+
+	{
+		// The connection is expired, then a heartbeat is stored in the published table
+		user_connection uc;
+		uc.addr = utm::addrip_v4("192.168.1.3");
+		uc.updatestamp.ts = now.ts - 100;
+		uc.is_disabled = false;
+		update_user(20, uc);
+
+		TEST_CASE_CHECK(check_user_and_ip(20, uc.addr, now), false);
+		TEST_CASE_CHECK(check_for_any_ip(uc.addr, now), false);
+
+		uc.updatestamp = now;
+		update_user(20, uc);
+
+		TEST_CASE_CHECK(check_user_and_ip(20, uc.addr, now), true);
+		TEST_CASE_CHECK(check_for_any_ip(uc.addr, now), true);
+
+		// The first entry of the heap is outdated by the heartbeat
+		purge_disconnected_users(now);
+		TEST_CASE_CHECK(users.size(), size_t(5));
+
+		uc.updatestamp.ts = now.ts - 50;
+		update_user(20, uc);
+
+		purge_disconnected_users(now);
+		TEST_CASE_CHECK(users.size(), size_t(4));
+		TEST_CASE_CHECK(check_user_and_ip(20, uc.addr, now), false);
+		TEST_CASE_CHECK(check_for_any_ip(uc.addr, now), false);
+		TEST_CASE_CHECK(check_user_and_ip(17, utm::addrip_v4("192.168.1.2"), now), true);
+	}
+
+	{
+		// New connections are visible at once, in free slots and after the table grows
+		user_connection uc;
+		uc.updatestamp = now;
+		uc.is_disabled = false;
+
+		bool all_found = true;
+		for (unsigned int uid = 100; uid < 140; uid++)
+		{
+			uc.addr.m_addr = 0x0A000000 + uid;
+			update_user(uid, uc);
+			all_found = all_found && check_user_and_ip(uid, uc.addr, now) && check_user_and_ip(100, addrip_v4(0x0A000000 + 100), now);
+		}
+		TEST_CASE_CHECK(all_found, true);
+
+		users_connected copy(*this);
+		TEST_CASE_CHECK(copy.check_user_and_ip(139, uc.addr, now), true);
+		TEST_CASE_CHECK(copy.check_for_any_ip(utm::addrip_v4("192.168.1.1"), now), true);
+
+		// The loaded connections are checked without a write after the load
+		std::string xml = xml_createstring();
+
+		users_connected loaded;
+		loaded.xml_parse(xml.c_str());
+		TEST_CASE_CHECK(loaded.check_user_and_ip(139, uc.addr, now), true);
+		TEST_CASE_CHECK(loaded.check_user_and_ip(10, utm::addrip_v4("192.168.1.1"), now), true);
+		TEST_CASE_CHECK(loaded.check_for_any_ip(utm::addrip_v4("192.168.1.2"), now), true);
+	}
 
 	return;
 }
+
+void users_connected::benchmark()
+{
+	const unsigned int user_count = 10000;
+	const int check_count = 2000000;
+
+	users_connected uconn;
+
+	utimestamp now;
+	now.now();
+
+	for (unsigned int uid = 1; uid <= user_count; uid++)
+	{
+		user_connection uc;
+		uc.addr.m_addr = 0x0A000000 + uid;
+		uc.updatestamp = now;
+		uc.is_disabled = false;
+		uconn.update_user(uid, uc);
+	}
+
+	// The agents send their heartbeats while the packets are checked
+	std::atomic<bool> is_stopped(false);
+	boost::thread heartbeats([&uconn, &is_stopped, &now, user_count]()
+	{
+		unsigned int uid = 1;
+		while (!is_stopped.load())
+		{
+			user_connection uc;
+			uc.addr.m_addr = 0x0A000000 + uid;
+			uc.updatestamp = now;
+			uc.is_disabled = false;
+			uconn.update_user(uid, uc);
+
+			uid = (uid % user_count) + 1;
+		}
+	});
+
+	int matched = 0;
+	auto start = std::chrono::high_resolution_clock::now();
+	for (int i = 0; i < check_count; i++)
+	{
+		unsigned int uid = (i % user_count) + 1;
+		addrip_v4 addr;
+		addr.m_addr = 0x0A000000 + uid;
+
+		if (uconn.check_user_and_ip(uid, addr, now))
+			matched++;
+		if (uconn.check_for_any_ip(addr, now))
+			matched++;
+	}
+	auto finish = std::chrono::high_resolution_clock::now();
+
+	is_stopped.store(true);
+	heartbeats.join();
+
+	double ns = std::chrono::duration_cast<std::chrono::nanoseconds>(finish - start).count() / double(check_count * 2);
+	std::cout << this_class_name << ": " << ns << " ns/check, " << matched << " matched, " << user_count << " users with heartbeats" << std::endl;
+}
 #endif
 
 }
\ No newline at end of file
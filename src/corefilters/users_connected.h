@@ -8,13 +8,21 @@
 #include <boost/thread/mutex.hpp>
 
 #include <addrip_v4.h>
+#include <rcu_domain.h>
 #include <ubase.h>
 #include <utimestamp.h>
+#include <atomic>
+#include <cstdint>
+#include <functional>
 #include <map>
 #include <list>
+#include <memory>
+#include <queue>
+#include <vector>
+
+#define USERSCONN_EMPTY_KEY 0xFFFFFFFFFFFFFFFFULL
 
 typedef std::multimap<unsigned int, utm::user_connection> users_connected_container;
-typedef std::map<utm::addrip_v4, std::pair<unsigned int, utm::utimestamp>> ip2user_container;
 typedef std::list<utm::addrip_v4> addr4s_container;
 
 namespace utm {
@@ -22,6 +30,35 @@ namespace utm {
 class users_connected :
 	public ubase
 {
+	// The keys of a published table are not changed, the last seen time is updated in place
+	struct seen_slot
+	{
+		seen_slot() : key(USERSCONN_EMPTY_KEY), seen(0) { };
+
+		std::atomic<uint64_t> key;				// stored after seen, a check finds the slot filled
+		mutable std::atomic<std::int64_t> seen;
+	};
+
+	struct seen_table
+	{
+		seen_table(size_t size) : users(new seen_slot[size]), addrs(new seen_slot[size]), mask(size - 1) { };
+
+		std::unique_ptr<seen_slot[]> users;		// by uid and address
+		std::unique_ptr<seen_slot[]> addrs;		// by address, the last seen of any user
+		size_t mask;
+	};
+
+	struct expiry
+	{
+		std::int64_t seen;
+		unsigned int uid;
+		addrip_v4 addr;
+
+		bool operator>(const expiry& rhs) const { return seen > rhs.seen; };
+	};
+
+	typedef std::priority_queue<expiry, std::vector<expiry>, std::greater<expiry> > expiry_heap;
+
 public:
     static const char this_class_name[];
 
@@ -47,20 +84,47 @@ public:
 	bool find_user_ips(unsigned int uid, addr4s_container& addrs, bool& is_disabled);
 	void purge_disconnected_users(const utimestamp& current_timestamp);
 
+	// The writers publish their changes for the checks, the connections loaded by
+	// xml_catch_value() are published once by xml_parse_finished()
+	void publish_users();
+
     void clear();
     void xml_create();
     void xml_catch_value(const char *keyname, const char *keyvalue);
+	void xml_parse_finished() { publish_users(); };
     virtual ubase* xml_catch_subnode(const char *name) { return NULL; };
 
 protected:
 	mutable boost::mutex guard;
 	users_connected_container users;
-	ip2user_container ips;
+
+private:
+	// The checks of the packets read the table without locks, the old tables are freed by
+	// the epochs of the readers
+	std::atomic<const seen_table*> current;
+	rcu_domain<seen_table> tables;
+	bool is_stale;								// connections are added or removed, guard is locked
+
+	// Connections by the last update, the entries of updated connections are skipped
+	expiry_heap expiries;
+
+	void set_stale();
+	void publish_table();
+	void push_expiry(unsigned int uid, const user_connection& uc);
+	void rebuild_expiries();
+
+	static const seen_slot* find_slot(const seen_slot* slots, size_t mask, uint64_t key);
+	static void insert_seen(seen_slot* slots, size_t mask, uint64_t key, std::int64_t seen);
+
+	static uint64_t make_key(unsigned int uid, const addrip_v4& addr) { return (static_cast<uint64_t>(uid) << 32) | static_cast<uint32_t>(addr.m_addr); };
+	static uint64_t make_key(const addrip_v4& addr) { return static_cast<uint32_t>(addr.m_addr); };
+	static size_t get_slot(uint64_t key, size_t mask) { return static_cast<size_t>((key * 0x9E3779B97F4A7C15ULL) >> 32) & mask; };
 
 public:
 #ifdef UTM_DEBUG
 	static int test_get_testcases_number() { return 1; };
 	void test_fillparams(int test_num);
+	static void benchmark();
 #endif
 };
 
@@ -48,6 +48,9 @@ void monitor_pinger2::main(monitor_total& mt, const macvendors& mv)
 	boost::system::error_code err;
 	err.assign(0, boost::system::generic_category());
 	handle_next_ping(err);
+
+	// The names of the hosts for the ranges with the reverse lookup, the cache keeps them for their TTL
+	mt.resolve_hostnames(dns_resolver::shared());
 }
 
 void monitor_pinger2::handle_next_ping(const boost::system::error_code &err)
@@ -165,15 +165,34 @@ void monitor_total::set_reverse_hostname(const addrip_v4& addr, const char *host
 {
 	boost::mutex::scoped_lock lock(guard);
 
-	monitor_result_container::iterator iter;
-	for (iter = results.begin(); iter != results.end(); ++iter)
+	monitor_index_container::iterator iter = results_index.find(addr);
+	if ((iter != results_index.end()) && (iter->second < results.size()))
+		results[iter->second].hostname.assign(hostname);
+}
+
+void monitor_total::resolve_hostnames(dns_resolver& resolver)
+{
+	host2resolve_container hosts;
+	{
+		boost::mutex::scoped_lock lock(guard);
+		hosts = host2resolve;
+	}
+
+	dns_batch batch;
+	for (host2resolve_container::iterator iter = hosts.begin(); iter != hosts.end(); ++iter)
 	{
-		if (iter->addr == addr.m_addr)
+		addrip_v4 addr = iter->addr;
+		resolver.async_resolve_addr(iter->addr, iter->dns, batch.wrap([this, addr](const dns_result& result)
 		{
-			iter->hostname.assign(hostname);
-			break;
-		}
+			if (result.found)
+				set_reverse_hostname(addr, result.hostname.c_str());
+		}));
 	}
+
+	batch.wait();
+
+	boost::mutex::scoped_lock lock(guard);
+	last_reverse_lookup_tick = get_current_hires_tick();
 }
 
 void monitor_total::extract_minidump(monitor_minidump& mini, __int64 nRemoteReverseLookupTick)
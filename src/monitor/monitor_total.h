@@ -10,6 +10,7 @@
 #include "monitor_result.h"
 #include "monitor_minidump.h"
 #include <monitor_range_list.h>
+#include <dns_resolver.h>
 #include <addrip_v4.h>
 #include <gstring.h>
 #include <enumhelper.h>
@@ -66,6 +67,9 @@ public:
 	void set_result_record(size_t index, const monitor_result& mr);
 	void set_reverse_hostname(const addrip_v4& addr, const char *hostname);
 
+	// Reverse lookups of host2resolve in parallel, returns when all are answered
+	void resolve_hostnames(dns_resolver& resolver);
+
 	void extract_minidump(monitor_minidump& mini, __int64 nRemoteReverseLookupTick);
 	void apply_minidump(const monitor_minidump& mini);
 
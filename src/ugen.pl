@@ -133,7 +133,7 @@ sub generate_uclass {
 	}
 
         my $is_atomic = 0;
-        $is_atomic = 1 if ($member{'typename'} =~ /std::atomic/);
+        $is_atomic = 1 if ($member{'typename'} =~ /std::atomic|sharded_counter/);
 
         my $nodefault = 0;
         if ($member{'typename'} =~ /:nodefault/) {
@@ -1,6 +1,7 @@
 #include "stdafx.h"
 
 #include "addrtable_v4.h"
+#include "addrtablemap_v4.h"
 #include "stringtools.h"
 #include <boost/test/unit_test.hpp>
 
@@ -107,6 +108,8 @@ bool addrtable_v4::check_addr_network(const addrip_v4& addr, addrip_v4& net, add
 
 bool addrtable_v4::import_from_txt(const gstring& input_filename)
 {
+	// The readers keep the old table until the whole file is loaded
+	BeginUpdate();
 	clear();
 
 #ifdef UTM_WIN
@@ -116,6 +119,7 @@ bool addrtable_v4::import_from_txt(const gstring& input_filename)
 	HANDLE h = FindFirstFile(input_filename.c_str(), &fd);
 	if (h == INVALID_HANDLE_VALUE)
 	{
+		CommitUpdate();
 		return false;
 	}
 
@@ -185,6 +189,8 @@ bool addrtable_v4::import_from_txt(const gstring& input_filename)
 		infile.close();
 	}
 
+	CommitUpdate();
+
 	if (!report.empty())
 	{
 		report.append("//\n");
@@ -338,4 +344,89 @@ BOOST_AUTO_TEST_CASE(addrtable_v4_test_all)
 
 }
 
+
+BOOST_AUTO_TEST_CASE(addrtable_v4_test_flat)
+{
+	addrtable_v4 a1;
+	a1.AddAddrPair("192.168.0.0", "192.168.0.255", false);
+	a1.AddAddrPair("10.0.0.0", "10.0.0.10", false);
+	a1.AddAddrPair("10.0.0.5", "10.0.0.20", false);
+	a1.AddAddrPair("172.16.0.0", "172.16.0.9", false);
+
+	BOOST_REQUIRE_EQUAL(a1.GetAddrCount(), size_t(4));
+
+	addrip_v4 addr_start, addr_end;
+	BOOST_REQUIRE_EQUAL(a1.GetAddrPair(2, addr_start, addr_end), true);
+	BOOST_REQUIRE_EQUAL(addr_start, addrip_v4("172.16.0.0"));
+	BOOST_REQUIRE_EQUAL(addr_end, addrip_v4("172.16.0.9"));
+	BOOST_REQUIRE_EQUAL(a1.GetAddrPair(4, addr_start, addr_end), false);
+
+	// Only the range with the nearest start is checked
+	BOOST_REQUIRE_EQUAL(a1.CheckAddrRange(addrip_v4("10.0.0.4")), true);
+	BOOST_REQUIRE_EQUAL(a1.CheckAddrRange(addrip_v4("10.0.0.15")), true);
+	BOOST_REQUIRE_EQUAL(a1.CheckAddrRange(addrip_v4("10.0.0.21")), false);
+
+	addrip_v4 addrs[4] = { addrip_v4("10.0.0.1"), addrip_v4("10.0.0.30"), addrip_v4("192.168.0.7"), addrip_v4("255.255.255.255") };
+	bool results[4];
+	a1.CheckAddrRange(addrs, 4, results);
+	BOOST_REQUIRE_EQUAL(results[0], true);
+	BOOST_REQUIRE_EQUAL(results[1], false);
+	BOOST_REQUIRE_EQUAL(results[2], true);
+	BOOST_REQUIRE_EQUAL(results[3], false);
+
+	// The table is changed after the flat copy was used
+	BOOST_REQUIRE_EQUAL(a1.DeleteAddr(0), true);
+	BOOST_REQUIRE_EQUAL(a1.DeleteAddr(3), false);
+	BOOST_REQUIRE_EQUAL(a1.GetAddrCount(), size_t(3));
+	BOOST_REQUIRE_EQUAL(a1.CheckAddrRange(addrip_v4("10.0.0.4")), false);
+	BOOST_REQUIRE_EQUAL(a1.CheckAddrSingle(addrip_v4("10.0.0.5")), true);
+
+	addrtable_v4 a2(a1);
+	a1.clear();
+	BOOST_REQUIRE_EQUAL(a1.GetAddrCount(), size_t(0));
+	BOOST_REQUIRE_EQUAL(a1.CheckAddrRange(addrip_v4("192.168.0.7")), false);
+	BOOST_REQUIRE_EQUAL(a2.GetAddrCount(), size_t(3));
+	BOOST_REQUIRE_EQUAL(a2.CheckAddrRange(addrip_v4("192.168.0.7")), true);
+
+	// The readers see the old table until the bulk update is committed
+	a2.BeginUpdate();
+	a2.clear();
+	a2.AddAddrPair("172.20.0.0", "172.20.0.9", true);
+	BOOST_REQUIRE_EQUAL(a2.CheckAddrRange(addrip_v4("192.168.0.7")), true);
+	BOOST_REQUIRE_EQUAL(a2.CheckAddrRange(addrip_v4("172.20.0.1")), false);
+	a2.CommitUpdate();
+	BOOST_REQUIRE_EQUAL(a2.CheckAddrRange(addrip_v4("192.168.0.7")), false);
+	BOOST_REQUIRE_EQUAL(a2.CheckAddrRange(addrip_v4("172.20.0.1")), true);
+	BOOST_REQUIRE_EQUAL(a2.GetAddrCount(), size_t(1));
+
+	// Deletes of a bulk update take the indexes of the published table
+	a2.AddAddrPair("172.21.0.0", "172.21.0.9", true);
+	a2.AddAddrPair("172.22.0.0", "172.22.0.9", true);
+	a2.BeginUpdate();
+	BOOST_REQUIRE_EQUAL(a2.DeleteAddr(2), true);
+	BOOST_REQUIRE_EQUAL(a2.DeleteAddr(0), true);
+	BOOST_REQUIRE_EQUAL(a2.GetAddrCount(), size_t(3));
+	a2.CommitUpdate();
+	BOOST_REQUIRE_EQUAL(a2.GetAddrCount(), size_t(1));
+	BOOST_REQUIRE_EQUAL(a2.CheckAddrRange(addrip_v4("172.21.0.1")), true);
+	BOOST_REQUIRE_EQUAL(a2.CheckAddrRange(addrip_v4("172.22.0.1")), false);
+
+	// A table loaded from xml is published at the end of the load
+	addrtable_v4 a3;
+	a3.AddAddrPair("192.168.0.0", "192.168.0.255", false);
+	a3.AddAddrPair("10.0.0.0", "10.0.0.10", false);
+	a3.AddAddrPair("10.0.0.5", "10.0.0.20", false);
+
+	addrtablemaprec_v4 r1(a3);
+	r1.set_id(7);
+	std::string xml = r1.xml_createstring();
+
+	addrtablemaprec_v4 r2;
+	BOOST_REQUIRE_EQUAL(r2.xml_parse(xml.c_str()), true);
+	BOOST_REQUIRE_EQUAL(r2 == r1, true);
+	BOOST_REQUIRE_EQUAL(r2.addrtable.GetAddrCount(), size_t(3));
+	BOOST_REQUIRE_EQUAL(r2.addrtable.CheckAddrRange(addrip_v4("192.168.0.7")), true);
+	BOOST_REQUIRE_EQUAL(r2.addrtable.CheckAddrSingle(addrip_v4("10.0.0.5")), true);
+}
+
 }
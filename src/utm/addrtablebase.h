@@ -7,12 +7,21 @@
 #include <iostream>
 #include <fstream>
 #include <map>
+#include <vector>
 #include <algorithm>
+#include <atomic>
 
 #include <boost/thread/mutex.hpp>
 
+#include "rcu_domain.h"
+
 namespace utm {
 
+//
+// Address ranges are kept in a map for writers. Readers use an immutable sorted copy
+// of the map which is published by pointer swap, so they never take the mutex.
+// The copy is rebuilt by the writer after every change, or once by CommitUpdate().
+//
 template<class T>
 class addrtablebase
 {
@@ -20,13 +29,14 @@ public:
 	typedef typename std::map<T, T>::iterator AddrTableIter;
 	typedef typename std::map<T, T>::const_iterator AddrTableConstIter;
 
-	addrtablebase()
+	addrtablebase() : current(NULL), update_depth(0)
 	{
 		clear();
 	}
 
 	virtual ~addrtablebase()
 	{
+		delete current.load();
 	}
 
 	addrtablebase& operator=(const addrtablebase& rhs)
@@ -40,7 +50,7 @@ public:
 		return items == rhs.itemsref();
 	}
 
-	addrtablebase(const addrtablebase& r)
+	addrtablebase(const addrtablebase& r) : current(NULL), update_depth(0)
 	{
 		copy(r);
 	}
@@ -55,12 +65,31 @@ public:
 	{
 		boost::mutex::scoped_lock lock(guard);
 		items.clear();
+		publish_flat();
 	}
 
 	void copy(const addrtablebase& r)
 	{
+		if (this == &r)
+			return;
+
 		boost::mutex::scoped_lock lock(guard);
 		items = r.items;
+		publish_flat();
+	}
+
+	// The readers see the changes made between these calls at once, after CommitUpdate()
+	void BeginUpdate()
+	{
+		boost::mutex::scoped_lock lock(guard);
+		update_depth++;
+	}
+
+	void CommitUpdate()
+	{
+		boost::mutex::scoped_lock lock(guard);
+		if ((update_depth > 0) && (--update_depth == 0))
+			publish_flat();
 	}
 
 protected:
@@ -68,78 +97,93 @@ protected:
 	{
 		boost::mutex::scoped_lock lock(guard);
 		items.clear();
+		publish_flat();
 	}
 
 	std::map<T, T> items;
 	mutable boost::mutex guard;
 
-public:
-
-	const std::map<T,T>& itemsref() const
+private:
+	struct flat_table
 	{
-		return items;
-	}
+		std::vector<T> starts;
+		std::vector<T> ends;
+	};
 
-	size_t GetAddrCount()
+	// Keeps the published table alive while it is read
+	class flat_reader
 	{
-		boost::mutex::scoped_lock lock(guard);
-		return items.size();
-	}
+	public:
+		flat_reader(const addrtablebase& owner) : section(owner.tables)
+		{
+			table = owner.current.load();
+		}
 
-	bool GetAddrPair(size_t index, T& AddrStart, T& AddrEnd)
+	private:
+		typename rcu_domain<flat_table>::reader section;
+
+	public:
+		const flat_table* table;
+	};
+
+	std::atomic<const flat_table*> current;
+	rcu_domain<flat_table> tables;
+	unsigned int update_depth;
+
+	// Guard must be locked. The old table is freed when nobody reads it.
+	void publish_flat()
 	{
-		boost::mutex::scoped_lock lock(guard);
+		if (update_depth > 0)
+			return;
 
-		bool retval = false;
-		AddrTableConstIter iter;
+		flat_table* ft = new flat_table();
+		ft->starts.reserve(items.size());
+		ft->ends.reserve(items.size());
 
-		if (index < items.size())
+		for (AddrTableConstIter iter = items.begin(); iter != items.end(); ++iter)
 		{
-			iter = items.begin();
-			while (index > 0)
-			{
-				index--;
-				++iter;
-			}
-
-			AddrStart = iter->first;
-			AddrEnd = iter->second;
-			retval = true;
+			ft->starts.push_back(iter->first);
+			ft->ends.push_back(iter->second);
 		}
 
-		return retval;
+		tables.retire(current.exchange(ft));
 	}
 
-	bool AddAddrPair(const char* pAddrStart, const char* pAddrEnd, bool checkRange)
+	// Index of the range with the nearest start not above Addr, or size() if there is none
+	static size_t find_nearest(const flat_table* t, const T& Addr)
 	{
-		T AddrStart(pAddrStart);
-		T AddrEnd(pAddrEnd);
-		return AddAddrPair(AddrStart, AddrEnd, checkRange);
-	}
+		size_t n = t->starts.size();
+		if ((n == 0) || (Addr < t->starts[0]))
+			return n;
 
-	bool AddAddrPair(const T& AddrStart, const T& AddrEnd, bool checkRange)
-	{
-		if (checkRange)
+		const T* base = &t->starts[0];
+		while (n > 1)
 		{
-			if (CheckAddrRange(AddrStart))
-				return false;
-
-			if (CheckAddrRange(AddrEnd))
-				return false;
+			size_t half = n / 2;
+			base = (base[half] <= Addr) ? base + half : base;
+			n -= half;
 		}
 
-		{
-			boost::mutex::scoped_lock lock(guard);
-			items.insert(std::make_pair(AddrStart, AddrEnd));
-		}
-
-		return true;
+		return base - &t->starts[0];
 	}
 
-	bool CheckAddrRange(const T& Addr)
+	static bool check_range(const flat_table* t, const T& Addr)
 	{
-		boost::mutex::scoped_lock lock(guard);
+		// The range with the nearest start is checked only, as the lookup in the map does.
+		// An empty range which starts at Addr gives way to the previous one.
+		size_t idx = find_nearest(t, Addr);
+		if (idx == t->starts.size())
+			return false;
+
+		if (t->ends[idx] >= Addr)
+			return true;
 
+		return (idx > 0) && !(t->starts[idx] < Addr) && (t->ends[idx - 1] >= Addr);
+	}
+
+	// Guard must be locked
+	bool check_addr_range_locked(const T& Addr) const
+	{
 		bool retval = false;
 		if (!items.empty())
 		{
@@ -170,37 +214,101 @@ public:
 		return retval;
 	}
 
-	bool CheckAddrSingle(const T& Addr)
+public:
+
+	const std::map<T,T>& itemsref() const
 	{
-		boost::mutex::scoped_lock lock(guard);
-		AddrTableConstIter found = items.find(Addr);
-		return (found != items.end());
+		return items;
 	}
 
-	bool DeleteAddr(size_t index)
+	size_t GetAddrCount()
+	{
+		flat_reader fr(*this);
+		return fr.table->starts.size();
+	}
+
+	bool GetAddrPair(size_t index, T& AddrStart, T& AddrEnd)
+	{
+		flat_reader fr(*this);
+
+		if (index >= fr.table->starts.size())
+			return false;
+
+		AddrStart = fr.table->starts[index];
+		AddrEnd = fr.table->ends[index];
+		return true;
+	}
+
+	bool AddAddrPair(const char* pAddrStart, const char* pAddrEnd, bool checkRange)
+	{
+		T AddrStart(pAddrStart);
+		T AddrEnd(pAddrEnd);
+		return AddAddrPair(AddrStart, AddrEnd, checkRange);
+	}
+
+	bool AddAddrPair(const T& AddrStart, const T& AddrEnd, bool checkRange)
 	{
 		boost::mutex::scoped_lock lock(guard);
 
-		bool retval = false;
-		AddrTableIter iter;
+		// Checked by the map, the flat table is not published yet in a bulk update
+		if (checkRange)
+		{
+			if (check_addr_range_locked(AddrStart))
+				return false;
 
-		if (index < items.size())
+			if (check_addr_range_locked(AddrEnd))
+				return false;
+		}
+
+		items.insert(std::make_pair(AddrStart, AddrEnd));
+		publish_flat();
+
+		return true;
+	}
+
+	bool CheckAddrRange(const T& Addr)
+	{
+		flat_reader fr(*this);
+		return check_range(fr.table, Addr);
+	}
+
+	// Checks a batch of addresses against one table snapshot
+	void CheckAddrRange(const T* Addrs, size_t count, bool* results)
+	{
+		flat_reader fr(*this);
+
+		for (size_t i = 0; i < count; i++)
 		{
-			iter = items.begin();
-			while (index > 0)
-			{
-				index--;
-				iter++;
-			}
+			results[i] = check_range(fr.table, Addrs[i]);
+		}
+	}
 
-			items.erase(iter);
-			retval = true;
-		};
+	bool CheckAddrSingle(const T& Addr)
+	{
+		flat_reader fr(*this);
 
-		return retval;
+		size_t idx = find_nearest(fr.table, Addr);
+		return (idx < fr.table->starts.size()) && !(fr.table->starts[idx] < Addr);
+	}
+
+	// The index is the one of GetAddrPair(), in a bulk update it stays the index of the
+	// published table until CommitUpdate()
+	bool DeleteAddr(size_t index)
+	{
+		boost::mutex::scoped_lock lock(guard);
+
+		// Only the writer holding the guard retires the published table
+		const flat_table* t = current.load();
+		if (index >= t->starts.size())
+			return false;
+
+		items.erase(t->starts[index]);
+		publish_flat();
+
+		return true;
 	}
 };
 
 }
 
-#endif // _UTM_ADDRTABLEBASE_H
\ No newline at end of file
+#endif // _UTM_ADDRTABLEBASE_H
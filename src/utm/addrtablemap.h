@@ -113,6 +113,10 @@ public:
 	};
 	
 	ubase* xml_catch_subnode(const char *name) { return NULL; };
+
+	// The addresses come one node at a time
+	void xml_parse_started() { addrtable.BeginUpdate(); };
+	void xml_parse_finished() { addrtable.CommitUpdate(); };
 };
 
 class addrtablemaprec_v4 : public addrtablemaprec<utm::addrtable_v4>
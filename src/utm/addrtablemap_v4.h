@@ -15,14 +15,27 @@ public:
 	addrtablemap_v4() { };
 	virtual ~addrtablemap_v4() { };
 
+	// Changes the table in place, many pairs are added between BeginUpdate() and CommitUpdate()
     void AddAddrPair(unsigned int key_id, const addrip_v4& start, const addrip_v4& end)
 	{
-		addrtablemaprec_v4 t;
-		if (this->find_by_id(key_id, t))
-		{
-			t.addrtable.AddAddrPair(start, end, false);
-			this->modify_element(t);
-		}
+		if (this->is_write_protected(key_id))
+			return;
+
+		addrtablemaprec<utm::addrtable_v4>* t = this->findptr_by_id(key_id);
+		if (t != NULL)
+			t->addrtable.AddAddrPair(start, end, false);
+	}
+
+	void BeginUpdate()
+	{
+		for (auto iter = this->items.begin(); iter != this->items.end(); ++iter)
+			iter->addrtable.BeginUpdate();
+	}
+
+	void CommitUpdate()
+	{
+		for (auto iter = this->items.begin(); iter != this->items.end(); ++iter)
+			iter->addrtable.CommitUpdate();
 	}
 };
 
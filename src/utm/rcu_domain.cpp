@@ -0,0 +1,93 @@
+#include "stdafx.h"
+
+#include "rcu_domain.h"
+
+#include <boost/test/unit_test.hpp>
+#include <boost/thread.hpp>
+
+namespace utm {
+
+namespace {
+
+struct rcu_test_table
+{
+	static std::atomic<int> alive;
+
+	rcu_test_table(unsigned int _value) : value(_value) { alive++; };
+	~rcu_test_table() { value = 0; alive--; };
+
+	unsigned int value;
+};
+
+std::atomic<int> rcu_test_table::alive(0);
+
+}
+
+BOOST_AUTO_TEST_CASE(rcu_domain_test_all)
+{
+	{
+		rcu_domain<rcu_test_table> domain;
+		std::atomic<const rcu_test_table*> current(new rcu_test_table(1));
+
+		// Without readers the tables are freed by the next retire
+		domain.retire(current.exchange(new rcu_test_table(2)));
+		domain.retire(current.exchange(new rcu_test_table(3)));
+		BOOST_REQUIRE_EQUAL(domain.retired_size() <= 1, true);
+
+		// The table of an open reader is kept
+		{
+			rcu_domain<rcu_test_table>::reader section(domain);
+			const rcu_test_table* t = current.load();
+
+			for (unsigned int i = 4; i < 10; i++)
+				domain.retire(current.exchange(new rcu_test_table(i)));
+
+			BOOST_REQUIRE_EQUAL(t->value, 3u);
+			BOOST_REQUIRE_EQUAL(domain.retired_size() >= 1, true);
+		}
+
+		domain.reclaim();
+		domain.reclaim();
+		BOOST_REQUIRE_EQUAL(domain.retired_size(), size_t(0));
+
+		// The readers never stop, the retired tables are freed anyway
+		const unsigned int threads = 4;
+		std::atomic<bool> is_stopped(false);
+		std::atomic<unsigned int> errors(0);
+
+		boost::thread_group tg;
+		for (unsigned int i = 0; i < threads; i++)
+		{
+			tg.create_thread([&domain, &current, &is_stopped, &errors]()
+			{
+				while (!is_stopped.load())
+				{
+					rcu_domain<rcu_test_table>::reader section(domain);
+					if (current.load()->value == 0)
+						errors++;
+				}
+			});
+		}
+
+		const unsigned int tables = 10000;
+		for (unsigned int i = 10; i < tables; i++)
+		{
+			domain.retire(current.exchange(new rcu_test_table(i)));
+			boost::this_thread::yield();
+		}
+
+		int alive = rcu_test_table::alive.load();
+
+		is_stopped.store(true);
+		tg.join_all();
+
+		BOOST_REQUIRE_EQUAL(errors.load(), 0u);
+		BOOST_REQUIRE_EQUAL(alive < int(tables / 10), true);
+
+		delete current.load();
+	}
+
+	BOOST_REQUIRE_EQUAL(rcu_test_table::alive.load(), 0);
+}
+
+}
@@ -0,0 +1,146 @@
+#ifndef _UTM_RCU_DOMAIN_H
+#define _UTM_RCU_DOMAIN_H
+
+#pragma once
+#include <utm.h>
+
+#include <atomic>
+#include <vector>
+
+#include "sharded_counter.h"
+
+namespace utm {
+
+//
+// Frees the tables which are read without locks. A reader counts itself in the slot of its
+// thread for the current epoch, so readers on different cores do not share a cache line.
+// A retired table is freed after the epoch is advanced and the readers of the previous epoch
+// have left, there is no need for a moment without any readers.
+//
+// Writers are serialized by the owner of the domain.
+//
+template<class T>
+class rcu_domain
+{
+	struct slot
+	{
+		std::atomic<unsigned int> count[2];
+		char pad[SHARDED_COUNTER_CACHELINE - 2 * sizeof(std::atomic<unsigned int>)];
+	};
+
+public:
+	// The tables published before the end of the section are not freed
+	class reader
+	{
+	public:
+		reader(const rcu_domain& _domain) : domain(_domain), slot_index(sharded_counter_slot())
+		{
+			epoch = domain.enter(slot_index);
+		}
+
+		~reader()
+		{
+			domain.leave(slot_index, epoch);
+		}
+
+	private:
+		reader(const reader&);
+		reader& operator=(const reader&);
+
+		const rcu_domain& domain;
+		unsigned int slot_index;
+		unsigned int epoch;
+	};
+
+	rcu_domain() : epoch(0)
+	{
+		for (unsigned int i = 0; i < SHARDED_COUNTER_SLOTS; i++)
+		{
+			slots[i].count[0].store(0);
+			slots[i].count[1].store(0);
+		}
+	}
+
+	~rcu_domain()
+	{
+		free_tables(waiting);
+		free_tables(fresh);
+	}
+
+	// The table is not published any more, it is freed when no reader can hold it
+	void retire(const T* t)
+	{
+		if (t != NULL)
+			fresh.push_back(t);
+
+		reclaim();
+	}
+
+	// Frees the tables retired before the current epoch if their readers have left.
+	// Called by retire(), and by the owner when nothing is retired for a long time.
+	void reclaim()
+	{
+		unsigned int e = epoch.load();
+		unsigned int previous = (e - 1) & 1;
+
+		for (unsigned int i = 0; i < SHARDED_COUNTER_SLOTS; i++)
+		{
+			if (slots[i].count[previous].load() != 0)
+				return;
+		}
+
+		free_tables(waiting);
+
+		if (fresh.empty())
+			return;
+
+		// The readers which could see the fresh tables are counted in the current epoch
+		waiting.swap(fresh);
+		epoch.store(e + 1);
+	}
+
+	size_t retired_size() const { return waiting.size() + fresh.size(); };
+
+private:
+	rcu_domain(const rcu_domain&);
+	rcu_domain& operator=(const rcu_domain&);
+
+	// A reader which counted itself in an epoch already advanced tries the new one
+	unsigned int enter(unsigned int slot_index) const
+	{
+		for (;;)
+		{
+			unsigned int e = epoch.load();
+			slots[slot_index].count[e & 1].fetch_add(1);
+
+			if (epoch.load() == e)
+				return e;
+
+			slots[slot_index].count[e & 1].fetch_sub(1);
+		}
+	}
+
+	void leave(unsigned int slot_index, unsigned int e) const
+	{
+		slots[slot_index].count[e & 1].fetch_sub(1);
+	}
+
+	static void free_tables(std::vector<const T*>& tables)
+	{
+		for (size_t i = 0; i < tables.size(); i++)
+			delete tables[i];
+
+		tables.clear();
+	}
+
+	std::atomic<unsigned int> epoch;
+	char pad[SHARDED_COUNTER_CACHELINE];
+	mutable slot slots[SHARDED_COUNTER_SLOTS];
+
+	std::vector<const T*> waiting;		// retired before the current epoch
+	std::vector<const T*> fresh;		// retired in the current epoch
+};
+
+}
+
+#endif // _UTM_RCU_DOMAIN_H
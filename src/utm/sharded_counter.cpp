@@ -0,0 +1,74 @@
+#include "stdafx.h"
+
+#include "sharded_counter.h"
+
+#include <boost/test/unit_test.hpp>
+#include <boost/thread.hpp>
+
+#ifdef UTM_WIN
+#define SHARDED_THREAD_LOCAL __declspec(thread)
+#else
+#define SHARDED_THREAD_LOCAL __thread
+#endif
+
+namespace utm {
+
+static std::atomic<unsigned int> sharded_counter_next(0);
+
+// Slot number plus one, zero until the first call of the thread
+static SHARDED_THREAD_LOCAL unsigned int sharded_counter_current = 0;
+
+unsigned int sharded_counter_slot()
+{
+	unsigned int current = sharded_counter_current;
+
+	if (current == 0)
+	{
+		current = (sharded_counter_next.fetch_add(1) & (SHARDED_COUNTER_SLOTS - 1)) + 1;
+		sharded_counter_current = current;
+	}
+
+	return current - 1;
+}
+
+BOOST_AUTO_TEST_CASE(sharded_counter_test_all)
+{
+	sharded_counter<__int64> c1;
+	BOOST_REQUIRE_EQUAL(c1.load(), __int64(0));
+
+	c1.fetch_add(10);
+	c1 += -3;
+	BOOST_REQUIRE_EQUAL(c1.load(), __int64(7));
+
+	const unsigned int threads = SHARDED_COUNTER_SLOTS + 4;
+	const unsigned int adds = 10000;
+
+	boost::thread_group tg;
+	for (unsigned int i = 0; i < threads; i++)
+	{
+		tg.create_thread([&c1, adds]()
+		{
+			for (unsigned int n = 0; n < adds; n++)
+				c1.fetch_add(2);
+		});
+	}
+	tg.join_all();
+
+	BOOST_REQUIRE_EQUAL(c1.load(), __int64(7 + threads * adds * 2));
+
+	// Copies keep the total, store() drops the other slots
+	sharded_counter<__int64> c2(c1);
+	BOOST_REQUIRE_EQUAL(c2.load(), c1.load());
+	BOOST_REQUIRE_EQUAL(c2 == c1, true);
+
+	c2 = 5;
+	BOOST_REQUIRE_EQUAL(c2.load(), __int64(5));
+
+	c2 = c1;
+	BOOST_REQUIRE_EQUAL(c2.load(), c1.load());
+
+	c1.store(0);
+	BOOST_REQUIRE_EQUAL(c1.load(), __int64(0));
+}
+
+}
@@ -0,0 +1,73 @@
+#ifndef _UTM_SHARDED_COUNTER_H
+#define _UTM_SHARDED_COUNTER_H
+
+#pragma once
+#include <utm.h>
+
+#include <atomic>
+
+#define SHARDED_COUNTER_SLOTS 16		// power of two, threads over it share the slots
+#define SHARDED_COUNTER_CACHELINE 64
+
+namespace utm {
+
+// The slot of the calling thread, given round-robin on the first call
+unsigned int sharded_counter_slot();
+
+//
+// Counter for the packet paths. Every thread adds to its own slot in a separate cache line,
+// load() sums the slots. The interface follows std::atomic, so the generated classes can
+// hold it instead of an atomic member.
+//
+template<typename T>
+class sharded_counter
+{
+	struct slot
+	{
+		std::atomic<T> value;
+		char pad[SHARDED_COUNTER_CACHELINE - sizeof(std::atomic<T>)];
+	};
+
+public:
+	sharded_counter() { store(0); };
+	sharded_counter(T value) { store(value); };
+	sharded_counter(const sharded_counter& rhs) { store(rhs.load()); };
+
+	sharded_counter& operator=(const sharded_counter& rhs) { store(rhs.load()); return *this; };
+	sharded_counter& operator=(T value) { store(value); return *this; };
+
+	bool operator==(const sharded_counter& rhs) const { return load() == rhs.load(); };
+	operator T() const { return load(); };
+
+	T load() const
+	{
+		T result = 0;
+		for (unsigned int i = 0; i < SHARDED_COUNTER_SLOTS; i++)
+			result += slots[i].value.load(std::memory_order_relaxed);
+
+		return result;
+	};
+
+	// The whole value goes to the first slot
+	void store(T value)
+	{
+		slots[0].value.store(value, std::memory_order_relaxed);
+		for (unsigned int i = 1; i < SHARDED_COUNTER_SLOTS; i++)
+			slots[i].value.store(0, std::memory_order_relaxed);
+	};
+
+	void fetch_add(T value)
+	{
+		slots[sharded_counter_slot()].value.fetch_add(value, std::memory_order_relaxed);
+	};
+
+	sharded_counter& operator+=(T value) { fetch_add(value); return *this; };
+
+private:
+	char pad[SHARDED_COUNTER_CACHELINE];
+	slot slots[SHARDED_COUNTER_SLOTS];
+};
+
+}
+
+#endif // _UTM_SHARDED_COUNTER_H
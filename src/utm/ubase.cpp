@@ -54,7 +54,7 @@ bool ubase::xml_parse(const char* xml, bool appendmode)
 			xml_catch_rootnode_attribute(xaiter->name(), xaiter->value());
 		}
 
-		xml_parse_allnodes(root.first_child().first_child());
+		xml_parse_bulk(root.first_child().first_child());
 	}
 
 	xdoc.reset();
@@ -66,7 +66,24 @@ void ubase::xml_parse(pugi::xml_node& node, bool appendmode)
 	if (!appendmode)
 		clear();
 
-	xml_parse_allnodes(node.first_child());
+	xml_parse_bulk(node.first_child());
+}
+
+void ubase::xml_parse_bulk(pugi::xml_node node)
+{
+	xml_parse_started();
+
+	try
+	{
+		xml_parse_allnodes(node);
+	}
+	catch (...)
+	{
+		xml_parse_finished();
+		throw;
+	}
+
+	xml_parse_finished();
 }
 
 void ubase::xml_parse_allnodes(pugi::xml_node& node)
@@ -443,6 +460,16 @@ bool ubase::xml_check_value(const char* current_keyname, const char* wanted_keyn
 	return true;
 }
 
+bool ubase::xml_check_value(const char* current_keyname, const char* wanted_keyname, const char* current_keyvalue, sharded_counter<uint64_t>& wanted_keyvalue)
+{
+	if (!xml_check_args(current_keyname, wanted_keyname))
+		return false;
+
+	wanted_keyvalue.store(fastformat::parse_uint64(current_keyvalue));
+
+	return true;
+}
+
 inline bool ubase::xml_check_args(const char* current_keyname, const char* wanted_keyname)
 {
 	if ((current_keyname == NULL) || (wanted_keyname == NULL))
@@ -21,6 +21,7 @@
 #include <gstring.h>
 #include <addrip_v4.h>
 #include <fastformat.h>
+#include <sharded_counter.h>
 
 typedef std::map<std::string, std::string> xmlattr_container;
 
@@ -45,6 +46,9 @@ public:
 	virtual void xml_catch_subnode_finished(const char *name);
 	virtual void xml_catch_subnode_attribute(const char *attrname, const char* attrvalue);
 	virtual void xml_catch_rootnode_attribute(const char *attrname, const char* attrvalue);
+	// Called around the nodes of xml_parse(), a table loaded node by node is published once
+	virtual void xml_parse_started() { };
+	virtual void xml_parse_finished() { };
 	virtual bool xml_has_root_attr() const { return false; };
 	virtual void xml_get_root_attr(xmlattr_container& attr) { };
 	virtual const char* xml_get_stylesheet() const { return NULL; };
@@ -94,6 +98,7 @@ private:
 	std::string rootname;
 
 	void xml_parse_allnodes(pugi::xml_node& node);
+	void xml_parse_bulk(pugi::xml_node node);
 	inline void check_xdoc() { if (xdoc.get() == NULL) xml_init(); };
 	inline void xml_append_data(const char* keyname, const char* value)
 	{
@@ -158,6 +163,7 @@ protected:
 	bool xml_check_value(const char* current_keyname, const char* wanted_keyname, const char* current_keyvalue, std::uint64_t& wanted_keyvalue);
 	bool xml_check_value(const char* current_keyname, const char* wanted_keyname, const char* current_keyvalue, std::atomic_uint_fast32_t& wanted_keyvalue);
 	bool xml_check_value(const char* current_keyname, const char* wanted_keyname, const char* current_keyvalue, std::atomic_uint_fast64_t& wanted_keyvalue);
+	bool xml_check_value(const char* current_keyname, const char* wanted_keyname, const char* current_keyvalue, sharded_counter<uint64_t>& wanted_keyvalue);
 
 	bool xml_check_value(const char* current_keyname, const char* wanted_keyname, const char* current_keyvalue, boost::function<void (const char *)> parser)
 	{
@@ -5,6 +5,10 @@
 #define UTM_WIN
 #endif
 
+#if defined(__linux__)
+#define UTM_LINUX
+#endif
+
 #ifndef UTM_VERSION
 #define UTM_VERSION "15.0.104"
 #endif